@@ -114,16 +114,23 @@ int common_util_mb_from_utf8(uint32_t cpid,
 	if (NULL == charset) {
 		return -1;
 	}
-	sprintf(temp_charset, "%s//IGNORE",
+	in_len = strlen(src) + 1;
+	memset(dst, 0, len);
+	if (in_len <= len && str_isascii(src, in_len) &&
+	    charset_ascii_compatible(charset)) {
+		memcpy(dst, src, in_len);
+		return in_len;
+	}
+	snprintf(temp_charset, arsizeof(temp_charset), "%s//IGNORE",
 		replace_iconv_charset(charset));
-	conv_id = iconv_open(temp_charset, "UTF-8");
+	conv_id = iconv_cached(temp_charset, "UTF-8");
+	if ((iconv_t)-1 == conv_id) {
+		return -1;
+	}
 	auto pin = deconst(src);
 	auto pout = dst;
-	in_len = strlen(src) + 1;
-	memset(dst, 0, len);
 	out_len = len;
 	iconv(conv_id, &pin, &in_len, &pout, &len);
-	iconv_close(conv_id);
 	return out_len - len;
 }
 
@@ -139,15 +146,22 @@ int common_util_mb_to_utf8(uint32_t cpid,
 	if (NULL == charset) {
 		return -1;
 	}
-	conv_id = iconv_open("UTF-8//IGNORE",
+	in_len = strlen(src) + 1;
+	memset(dst, 0, len);
+	if (in_len <= len && str_isascii(src, in_len) &&
+	    charset_ascii_compatible(charset)) {
+		memcpy(dst, src, in_len);
+		return in_len;
+	}
+	conv_id = iconv_cached("UTF-8//IGNORE",
 		replace_iconv_charset(charset));
+	if ((iconv_t)-1 == conv_id) {
+		return -1;
+	}
 	auto pin = deconst(src);
 	auto pout = dst;
-	in_len = strlen(src) + 1;
-	memset(dst, 0, len);
 	out_len = len;
-	iconv(conv_id, &pin, &in_len, &pout, &len);	
-	iconv_close(conv_id);
+	iconv(conv_id, &pin, &in_len, &pout, &len);
 	return out_len - len;
 }
 
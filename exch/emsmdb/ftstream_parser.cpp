@@ -864,7 +864,12 @@ std::unique_ptr<ftstream_parser> ftstream_parser::create(logon_object *plogon) t
 {
 	auto stream_id = common_util_get_ftstream_id();
 	auto rpc_info = get_rpc_info();
-	auto path = rpc_info.maildir + "/tmp/faststream"s;
+	auto path = rpc_info.maildir + "/tmp"s;
+	if (mkdir(path.c_str(), 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "E-1422: mkdir %s: %s\n", path.c_str(), strerror(errno));
+		return nullptr;
+	}
+	path += "/faststream";
 	if (mkdir(path.c_str(), 0777) < 0 && errno != EEXIST) {
 		fprintf(stderr, "E-1428: mkdir %s: %s\n", path.c_str(), strerror(errno));
 		return nullptr;
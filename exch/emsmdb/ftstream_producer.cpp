@@ -1,8 +1,11 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
 #include <cerrno>
 #include <cstdint>
 #include <memory>
+#include <new>
 #include <string>
+#include <libHX/string.h>
 #include <gromox/mapidefs.h>
 #include "ftstream_producer.h"
 #include "emsmdb_interface.h"
@@ -11,7 +14,7 @@
 #include <gromox/ext_buffer.hpp>
 #include <gromox/proc_common.h>
 #include <gromox/util.hpp>
-#include <sys/stat.h>
+#include <sys/mman.h>
 #include <cstring>
 #include <unistd.h>
 #include <cstdlib>
@@ -19,7 +22,16 @@
 #include <cstdio>
 #include "logon_object.h"
 
-using namespace std::string_literals;
+using namespace gromox;
+
+static char g_spill_path[256] = "/tmp";
+static uint32_t g_spill_threshold = 4 * 1024 * 1024;
+
+void ftstream_producer_init(const char *spill_path, uint32_t spill_threshold)
+{
+	gx_strlcpy(g_spill_path, spill_path, arsizeof(g_spill_path));
+	g_spill_threshold = spill_threshold;
+}
 
 static void ftstream_producer_try_recode_nbp(FTSTREAM_PRODUCER *pstream) try
 {
@@ -77,39 +89,107 @@ static void ftstream_producer_record_wsp(FTSTREAM_PRODUCER *pstream,
 	fprintf(stderr, "W-1604: ENOMEM\n");
 }
 
+static int ftstream_producer_open_spill()
+{
+	if (*g_spill_path == '\0')
+		return memfd_create("ftstream", MFD_CLOEXEC);
+	int fd = open(g_spill_path, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR))
+		return fd;
+	/* filesystem without O_TMPFILE support */
+	char tmpl[arsizeof(g_spill_path) + 16];
+	snprintf(tmpl, arsizeof(tmpl), "%s/ftstreamXXXXXX", g_spill_path);
+	fd = mkostemp(tmpl, O_CLOEXEC);
+	if (fd >= 0)
+		unlink(tmpl);
+	return fd;
+}
+
+static BOOL ftstream_producer_write_fd(int fd, const void *pbuff, size_t size)
+{
+	auto p = static_cast<const uint8_t *>(pbuff);
+	while (size > 0) {
+		auto ret = write(fd, p, size);
+		if (ret <= 0)
+			return FALSE;
+		p += ret;
+		size -= ret;
+	}
+	return TRUE;
+}
+
+/* move what has been produced so far from memory into the spill file */
+static BOOL ftstream_producer_spill(FTSTREAM_PRODUCER *pstream)
+{
+	pstream->fd = ftstream_producer_open_spill();
+	if (pstream->fd < 0) {
+		fprintf(stderr, "E-1338: spill to %s: %s\n",
+		        *g_spill_path == '\0' ? "memfd" : g_spill_path, strerror(errno));
+		return FALSE;
+	}
+	for (uint32_t pos = 0; pos < pstream->offset;
+	     pos += FTSTREAM_PRODUCER_CHUNK_SIZE) {
+		auto len = std::min(pstream->offset - pos,
+		           static_cast<uint32_t>(FTSTREAM_PRODUCER_CHUNK_SIZE));
+		if (!ftstream_producer_write_fd(pstream->fd,
+		    pstream->chunks[pos / FTSTREAM_PRODUCER_CHUNK_SIZE].get(), len))
+			return FALSE;
+	}
+	pstream->chunks.clear();
+	return TRUE;
+}
+
 static BOOL ftstream_producer_write_internal(
 	FTSTREAM_PRODUCER *pstream,
-	const void *pbuff, uint32_t size)
-{	
-	if (size >= FTSTREAM_PRODUCER_BUFFER_LENGTH
-		|| FTSTREAM_PRODUCER_BUFFER_LENGTH -
-		pstream->buffer_offset < size) {
-		if (-1 == pstream->fd) {
-			pstream->fd = open(pstream->path.c_str(),
-				O_CREAT|O_RDWR|O_TRUNC, 0666);
-			if (-1 == pstream->fd) {
-				fprintf(stderr, "E-1338: open %s: %s\n",
-				        pstream->path.c_str(), strerror(errno));
-				return FALSE;
-			}
-		}
-		if (0 != pstream->buffer_offset &&
-			pstream->buffer_offset != write(pstream->fd,
-			pstream->buffer, pstream->buffer_offset)) {
-			return FALSE;	
-		}
-		pstream->buffer_offset = 0;
-		pstream->read_offset = 0;
+	const void *pbuff, uint32_t size) try
+{
+	if (pstream->fd < 0 && pstream->offset + size > g_spill_threshold &&
+	    !ftstream_producer_spill(pstream))
+		return FALSE;
+	if (pstream->fd >= 0) {
+		if (!ftstream_producer_write_fd(pstream->fd, pbuff, size))
+			return FALSE;
+		pstream->offset += size;
+		return TRUE;
 	}
-	if (size >= FTSTREAM_PRODUCER_BUFFER_LENGTH) {
-		if (size != write(pstream->fd, pbuff, size)) {
+	auto src = static_cast<const uint8_t *>(pbuff);
+	while (size > 0) {
+		auto idx = pstream->offset / FTSTREAM_PRODUCER_CHUNK_SIZE;
+		auto ofs = pstream->offset % FTSTREAM_PRODUCER_CHUNK_SIZE;
+		if (idx == pstream->chunks.size())
+			pstream->chunks.emplace_back(new uint8_t[FTSTREAM_PRODUCER_CHUNK_SIZE]);
+		auto len = std::min(size, FTSTREAM_PRODUCER_CHUNK_SIZE - ofs);
+		memcpy(pstream->chunks[idx].get() + ofs, src, len);
+		src += len;
+		size -= len;
+		pstream->offset += len;
+	}
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	fprintf(stderr, "E-1621: ENOMEM\n");
+	return FALSE;
+}
+
+static BOOL ftstream_producer_read_internal(FTSTREAM_PRODUCER *pstream,
+    void *pbuff, uint16_t len)
+{
+	auto dst = static_cast<uint8_t *>(pbuff);
+	if (pstream->read_offset + len > pstream->offset)
+		return FALSE;
+	if (pstream->fd >= 0) {
+		if (pread(pstream->fd, dst, len, pstream->read_offset) != len)
 			return FALSE;
-		}
-	} else {
-		memcpy(pstream->buffer + pstream->buffer_offset, pbuff, size);
-		pstream->buffer_offset += size;
+		pstream->read_offset += len;
+		return TRUE;
+	}
+	for (uint32_t pos = pstream->read_offset, end = pos + len; pos < end; ) {
+		auto ofs = pos % FTSTREAM_PRODUCER_CHUNK_SIZE;
+		auto n = std::min(end - pos, FTSTREAM_PRODUCER_CHUNK_SIZE - ofs);
+		memcpy(dst, pstream->chunks[pos / FTSTREAM_PRODUCER_CHUNK_SIZE].get() + ofs, n);
+		dst += n;
+		pos += n;
 	}
-	pstream->offset += size;
+	pstream->read_offset += len;
 	return TRUE;
 }
 
@@ -887,22 +967,7 @@ BOOL ftstream_producer::write_hierarchysync(
 std::unique_ptr<ftstream_producer>
 ftstream_producer::create(logon_object *plogon, uint8_t string_option) try
 {
-	int stream_id;
-	
-	stream_id = common_util_get_ftstream_id();
-	auto rpc_info = get_rpc_info();
-	auto path = rpc_info.maildir + "/tmp"s;
-	if (mkdir(path.c_str(), 0777) < 0 && errno != EEXIST) {
-		fprintf(stderr, "E-1422: mkdir %s: %s\n", path.c_str(), strerror(errno));
-		return nullptr;
-	}
-	path = rpc_info.maildir + "/tmp/faststream"s;
-	if (mkdir(path.c_str(), 0777) < 0 && errno != EEXIST) {
-		fprintf(stderr, "E-1341: mkdir %s: %s\n", path.c_str(), strerror(errno));
-		return nullptr;
-	}
 	std::unique_ptr<ftstream_producer> pstream(new ftstream_producer);
-	pstream->path = path + "/"s + std::to_string(stream_id) + "." + get_host_ID();
 	pstream->plogon = plogon;
 	pstream->string_option = string_option;
 	return pstream;
@@ -914,11 +979,8 @@ ftstream_producer::create(logon_object *plogon, uint8_t string_option) try
 fxstream_producer::~fxstream_producer()
 {
 	auto pstream = this;
-	if (-1 != pstream->fd) {
+	if (-1 != pstream->fd)
 		close(pstream->fd);
-		if (remove(pstream->path.c_str()) < 0 && errno != ENOENT)
-			fprintf(stderr, "W-1371: remove %s: %s\n", pstream->path.c_str(), strerror(errno));
-	}
 }
 
 BOOL ftstream_producer::read_buffer(void *pbuff, uint16_t *plen, BOOL *pb_last)
@@ -932,18 +994,8 @@ BOOL ftstream_producer::read_buffer(void *pbuff, uint16_t *plen, BOOL *pb_last)
 		    pnode->offset != pstream->offset)
 			ftstream_producer_record_nbp(pstream, pstream->offset);
 		pstream->b_read = TRUE;
-		if (-1 != pstream->fd) {
-			if (0 != pstream->buffer_offset &&
-				pstream->buffer_offset != write(pstream->fd,
-				pstream->buffer, pstream->buffer_offset)) {
-				return FALSE;
-			}
-			lseek(pstream->fd, 0, SEEK_SET);
-		}
-		cur_offset = 0;
-	} else {
-		cur_offset = pstream->fd != -1 ? lseek(pstream->fd, 0, SEEK_CUR) : pstream->read_offset;
 	}
+	cur_offset = pstream->read_offset;
 	for (auto pnode = pstream->bp_list.begin();
 	     pnode != pstream->bp_list.end(); ++pnode) {
 		auto ppoint = &*pnode;
@@ -970,14 +1022,8 @@ BOOL ftstream_producer::read_buffer(void *pbuff, uint16_t *plen, BOOL *pb_last)
 			}
 		}
 		pstream->bp_list.erase(pstream->bp_list.begin(), pnode);
-		if (-1 != pstream->fd) {
-			if (*plen != read(pstream->fd, pbuff, *plen)) {
-				return FALSE;
-			}
-		} else {
-			memcpy(pbuff, pstream->buffer + pstream->read_offset, *plen);
-			pstream->read_offset += *plen;
-		}
+		if (!ftstream_producer_read_internal(pstream, pbuff, *plen))
+			return FALSE;
 		*pb_last = FALSE;
 		return TRUE;
 	}
@@ -989,24 +1035,17 @@ BOOL ftstream_producer::read_buffer(void *pbuff, uint16_t *plen, BOOL *pb_last)
 	}
 	*plen = ppoint->offset - cur_offset;
 	pstream->bp_list.clear();
-	if (-1 != pstream->fd) {
-		if (*plen != read(pstream->fd, pbuff, *plen)) {
-			return FALSE;
-		}
-	} else {
-		memcpy(pbuff, pstream->buffer + pstream->read_offset, *plen);
-		pstream->read_offset += *plen;
-	}
+	if (!ftstream_producer_read_internal(pstream, pbuff, *plen))
+		return FALSE;
 	*pb_last = TRUE;
 	if (-1 != pstream->fd) {
 		close(pstream->fd);
 		pstream->fd = -1;
-		if (remove(pstream->path.c_str()) < 0 && errno != ENOENT)
-			fprintf(stderr, "W-1340: remove: %s: %s\n",
-			        pstream->path.c_str(), strerror(errno));
 	}
+	/* keep one chunk around for the next round of the producer */
+	if (pstream->chunks.size() > 1)
+		pstream->chunks.resize(1);
 	pstream->offset = 0;
-	pstream->buffer_offset = 0;
 	pstream->read_offset = 0;
 	pstream->b_read = FALSE;
 	return TRUE;
@@ -3,11 +3,12 @@
 #include <list>
 #include <memory>
 #include <string>
+#include <vector>
 #include <gromox/mapi_types.hpp>
 #include <gromox/double_list.hpp>
 #include <sys/types.h>
 #define FTSTREAM_PRODUCER_POINT_LENGTH			1024
-#define FTSTREAM_PRODUCER_BUFFER_LENGTH			4*1024*1024
+#define FTSTREAM_PRODUCER_CHUNK_SIZE			(64*1024)
 #define STRING_OPTION_NONE						0x00
 #define STRING_OPTION_UNICODE					0x01
 #define STRING_OPTION_CPID						0x02
@@ -54,15 +55,16 @@ struct fxstream_producer {
 	BOOL write_state(const TPROPVAL_ARRAY *);
 	BOOL write_hierarchysync(const FOLDER_CHANGES *fldchgs, const TPROPVAL_ARRAY *del, const TPROPVAL_ARRAY *state);
 
-	int type = 0, fd = -1;
-	uint32_t offset = 0;
-	std::string path;
-	uint8_t buffer[FTSTREAM_PRODUCER_BUFFER_LENGTH]{};
-	uint32_t buffer_offset = 0, read_offset = 0;
+	int type = 0, fd = -1; /* fd: spill file, once past the threshold */
+	uint32_t offset = 0, read_offset = 0;
+	std::vector<std::unique_ptr<uint8_t[]>> chunks;
 	uint8_t string_option = 0;
 	logon_object *plogon = nullptr; /* plogon is a protected member */
 	std::list<point_node> bp_list;
 	BOOL b_read = false;
 };
 using FTSTREAM_PRODUCER = fxstream_producer;
+
+/* spill_path empty: spill to an anonymous memfd */
+extern void ftstream_producer_init(const char *spill_path, uint32_t spill_threshold);
 using ftstream_producer = fxstream_producer;
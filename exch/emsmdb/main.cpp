@@ -16,6 +16,7 @@
 #include "common_util.h"
 #include <gromox/config_file.hpp>
 #include "logon_object.h"
+#include "ftstream_producer.h"
 #include "exmdb_client.h"
 #include "rop_processor.h"
 #include "bounce_producer.h"
@@ -133,6 +134,8 @@ static BOOL proc_exchange_emsmdb(int reason, void **ppdata)
 			{"async_threads_num", "4", CFG_SIZE, "1", "20"},
 			{"average_handles", "1000", CFG_SIZE, "100"},
 			{"average_mem", "4K", CFG_SIZE, "4K"},
+			{"ftstream_spill_path", "/tmp"},
+			{"ftstream_spill_threshold", "4M", CFG_SIZE, "64K", "1G"},
 			{"mailbox_ping_interval", "5min", CFG_TIME, "60s", "1h"},
 			{"max_ext_rule_length", "510K", CFG_SIZE, "1"},
 			{"max_mail_length", "64M", CFG_SIZE, "1"},
@@ -174,6 +177,12 @@ static BOOL proc_exchange_emsmdb(int reason, void **ppdata)
 		smtp_port = pfile->get_ll("smtp_server_port");
 		printf("[exchange_emsmdb]: smtp server is [%s]:%hu\n", smtp_ip, smtp_port);
 		gx_strlcpy(submit_command, pfile->get_value("submit_command"), arsizeof(submit_command));
+		auto spill_path = pfile->get_value("ftstream_spill_path");
+		uint32_t spill_threshold = pfile->get_ll("ftstream_spill_threshold");
+		bytetoa(spill_threshold, size_buff);
+		printf("[exchange_emsmdb]: fast transfer streams over %s spill to %s\n",
+		       size_buff, *spill_path == '\0' ? "memfd" : spill_path);
+		ftstream_producer_init(spill_path, spill_threshold);
 		async_num = pfile->get_ll("async_threads_num");
 		printf("[exchange_emsmdb]: async threads number is %d\n", async_num);
 		if (!exch_emsmdb_reload(pfile))
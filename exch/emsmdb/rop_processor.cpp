@@ -4,7 +4,12 @@
 #include <cstring>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include <gromox/atomic.hpp>
 #include <gromox/defs.h>
 #include "subscription_object.h"
@@ -28,8 +33,6 @@
 #include <gromox/simple_tree.hpp>
 #include <gromox/lib_buffer.hpp>
 #include "aux_types.h"
-#include <gromox/str_hash.hpp>
-#include <gromox/int_hash.hpp>
 #include "rop_ext.h"
 #include "rop_ids.h"
 #include <gromox/util.hpp>
@@ -44,14 +47,21 @@
 
 #define HGROWING_SIZE					250
 
-
 /* maximum handle number per session */
 #define MAX_HANDLE_NUM					500
 
+#define LOGON_SHARD_NUM					16
+
 namespace {
 
+struct OBJECT_NODE;
+
+/*
+ * A LOGMAP belongs to one emsmdb handle, and emsmdb_interface hands a
+ * handle to one thread at a time, so the items need no lock of their own.
+ */
 struct LOGON_ITEM {
-	std::unique_ptr<INT_HASH_TABLE> phash;
+	std::unordered_map<uint32_t, OBJECT_NODE *> phash;
 	SIMPLE_TREE tree;
 };
 
@@ -64,6 +74,12 @@ struct OBJECT_NODE {
 
 }
 
+/* logon reference counts per mailbox dir, for the ping scan */
+struct LOGON_SHARD {
+	std::mutex lock;
+	std::unordered_map<std::string, uint32_t> refs;
+};
+
 struct LOGMAP {
 	LOGON_ITEM *p[256];
 };
@@ -72,8 +88,7 @@ static int g_scan_interval;
 static pthread_t g_scan_id;
 static int g_average_handles;
 static gromox::atomic_bool g_notify_stop{true};
-static std::mutex g_hash_lock;
-static std::unique_ptr<STR_HASH_TABLE> g_logon_hash;
+static LOGON_SHARD g_logon_shards[LOGON_SHARD_NUM];
 static LIB_BUFFER *g_logmap_allocator;
 static LIB_BUFFER *g_handle_allocator;
 static LIB_BUFFER *g_logitem_allocator;
@@ -87,6 +102,11 @@ LOGMAP *rop_processor_create_logmap()
 	return plogmap;
 }
 
+static LOGON_SHARD &rop_processor_logon_shard(const char *dir)
+{
+	return g_logon_shards[std::hash<std::string_view>{}(dir) % LOGON_SHARD_NUM];
+}
+
 static void rop_processor_enum_objnode(SIMPLE_TREE_NODE *pnode,
 	void *pparam)
 {
@@ -95,7 +115,7 @@ static void rop_processor_enum_objnode(SIMPLE_TREE_NODE *pnode,
 	
 	plogitem = (LOGON_ITEM*)pparam;
 	pobjnode = (OBJECT_NODE*)pnode->pdata;
-	plogitem->phash->remove(pobjnode->handle);
+	plogitem->phash.erase(pobjnode->handle);
 }
 
 static void rop_processor_free_object(void *pobject, int type)
@@ -148,7 +168,8 @@ static void rop_processor_free_objnode(SIMPLE_TREE_NODE *pnode)
 	lib_buffer_put(g_handle_allocator, pobjnode);
 }
 
-static void rop_processor_release_objnode(
+/* returns true if the logon item itself has been released */
+static bool rop_processor_release_objnode(
 	LOGON_ITEM *plogitem, OBJECT_NODE *pobjnode)
 {
 	BOOL b_root;
@@ -161,14 +182,12 @@ static void rop_processor_release_objnode(
 	if (simple_tree_get_root(&plogitem->tree) == &pobjnode->node) {
 		proot = simple_tree_get_root(&plogitem->tree);
 		pobject = ((OBJECT_NODE*)proot->pdata)->pobject;
-		std::lock_guard hl_hold(g_hash_lock);
-		auto pref = g_logon_hash->query<uint32_t>(static_cast<logon_object *>(pobject)->get_dir());
-		if (pref != nullptr) {
-			(*pref) --;
-			if (0 == *pref) {
-				g_logon_hash->remove(static_cast<logon_object *>(pobject)->get_dir());
-			}
-		}
+		auto dir = static_cast<logon_object *>(pobject)->get_dir();
+		auto &shard = rop_processor_logon_shard(dir);
+		std::lock_guard hl_hold(shard.lock);
+		auto it = shard.refs.find(dir);
+		if (it != shard.refs.end() && --it->second == 0)
+			shard.refs.erase(it);
 		b_root = TRUE;
 	} else {
 		b_root = FALSE;
@@ -179,9 +198,10 @@ static void rop_processor_release_objnode(
 		&pobjnode->node, rop_processor_free_objnode);
 	if (TRUE == b_root) {
 		simple_tree_free(&plogitem->tree);
-		plogitem->phash.reset();
 		lib_buffer_put_u<LOGON_ITEM>(g_logitem_allocator, plogitem);
+		return true;
 	}
+	return false;
 }
 
 static void rop_processor_release_logon_item(LOGON_ITEM *plogitem)
@@ -214,7 +234,6 @@ int rop_processor_create_logon_item(LOGMAP *plogmap,
     uint8_t logon_id, logon_object *plogon)
 {
 	int handle;
-	uint32_t tmp_ref;
 	auto plogitem = plogmap->p[logon_id];
 	/* MS-OXCROPS 3.1.4.2 */
 	if (NULL != plogitem) {
@@ -225,9 +244,10 @@ int rop_processor_create_logon_item(LOGMAP *plogmap,
 	if (NULL == plogitem) {
 		return -1;
 	}
-	new(plogitem) LOGON_ITEM;
-	plogitem->phash = INT_HASH_TABLE::create(HGROWING_SIZE, sizeof(OBJECT_NODE *));
-	if (NULL == plogitem->phash) {
+	try {
+		new(plogitem) LOGON_ITEM;
+		plogitem->phash.reserve(HGROWING_SIZE);
+	} catch (const std::bad_alloc &) {
 		lib_buffer_put_u(g_logitem_allocator, plogitem);
 		return -2;
 	}
@@ -236,16 +256,16 @@ int rop_processor_create_logon_item(LOGMAP *plogmap,
 	handle = rop_processor_add_object_handle(plogmap,
 				logon_id, -1, OBJECT_TYPE_LOGON, plogon);
 	if (handle < 0) {
+		plogmap->p[logon_id] = nullptr;
 		lib_buffer_put_u(g_logitem_allocator, plogitem);
 		return -3;
 	}
-	std::lock_guard hl_hold(g_hash_lock);
-	auto pref = g_logon_hash->query<uint32_t>(plogon->get_dir());
-	if (NULL == pref) {
-		tmp_ref = 1;
-		g_logon_hash->add(plogon->get_dir(), &tmp_ref);
-	} else {
-		(*pref) ++;
+	auto &shard = rop_processor_logon_shard(plogon->get_dir());
+	std::lock_guard hl_hold(shard.lock);
+	try {
+		++shard.refs[plogon->get_dir()];
+	} catch (const std::bad_alloc &) {
+		debug_info("[exchange_emsmdb]: E-1620: ENOMEM; logon will not be pinged\n");
 	}
 	return handle;
 }
@@ -253,9 +273,7 @@ int rop_processor_create_logon_item(LOGMAP *plogmap,
 int rop_processor_add_object_handle(LOGMAP *plogmap, uint8_t logon_id,
 	int parent_handle, int type, void *pobject)
 {
-	int tmp_handle;
-	OBJECT_NODE *ptmphanle;
-	OBJECT_NODE **ppparent;
+	OBJECT_NODE *pparent;
 	EMSMDB_INFO *pemsmdb_info;
 	
 	auto plogitem = plogmap->p[logon_id];
@@ -269,12 +287,12 @@ int rop_processor_add_object_handle(LOGMAP *plogmap, uint8_t logon_id,
 		if (NULL != simple_tree_get_root(&plogitem->tree)) {
 			return -4;
 		}
-		ppparent = NULL;
+		pparent = NULL;
 	} else if (parent_handle >= 0 && parent_handle < 0x7FFFFFFF) {
-		ppparent = plogitem->phash->query<OBJECT_NODE *>(parent_handle);
-		if (NULL == ppparent) {
+		auto it = plogitem->phash.find(parent_handle);
+		if (it == plogitem->phash.end())
 			return -5;
-		}
+		pparent = it->second;
 	} else {
 		return -6;
 	}
@@ -287,27 +305,19 @@ int rop_processor_add_object_handle(LOGMAP *plogmap, uint8_t logon_id,
 	pobjnode->node.pdata = pobjnode;
 	pobjnode->type = type;
 	pobjnode->pobject = pobject;
-	if (plogitem->phash->add(pobjnode->handle, &pobjnode) != 1) {
-		auto phash = INT_HASH_TABLE::create(plogitem->phash->capacity +
-		                        HGROWING_SIZE, sizeof(OBJECT_NODE *));
-		if (NULL == phash) {
+	try {
+		if (!plogitem->phash.emplace(pobjnode->handle, pobjnode).second) {
 			lib_buffer_put(g_handle_allocator, pobjnode);
-			return -8;
-		}
-		auto iter = plogitem->phash->make_iter();
-		for (int_hash_iter_begin(iter); !int_hash_iter_done(iter);
-			int_hash_iter_forward(iter)) {
-			ptmphanle = static_cast<OBJECT_NODE *>(int_hash_iter_get_value(iter, &tmp_handle));
-			phash->add(tmp_handle, ptmphanle);
+			return -9;
 		}
-		int_hash_iter_free(iter);
-		plogitem->phash = std::move(phash);
-		plogitem->phash->add(pobjnode->handle, &pobjnode);
+	} catch (const std::bad_alloc &) {
+		lib_buffer_put(g_handle_allocator, pobjnode);
+		return -8;
 	}
-	if (NULL == ppparent) {
+	if (NULL == pparent) {
 		simple_tree_set_root(&plogitem->tree, &pobjnode->node);
 	} else {
-		simple_tree_add_child(&plogitem->tree, &(*ppparent)->node,
+		simple_tree_add_child(&plogitem->tree, &pparent->node,
 			&pobjnode->node, SIMPLE_TREE_ADD_LAST);
 	}
 	if (OBJECT_TYPE_ICSUPCTX == type) {
@@ -327,12 +337,11 @@ void *rop_processor_get_object(LOGMAP *plogmap,
 	if (NULL == plogitem) {
 		return NULL;
 	}
-	auto ppobjnode = plogitem->phash->query<OBJECT_NODE *>(obj_handle);
-	if (NULL == ppobjnode) {
+	auto it = plogitem->phash.find(obj_handle);
+	if (it == plogitem->phash.end())
 		return NULL;
-	}
-	*ptype = (*ppobjnode)->type;
-	return (*ppobjnode)->pobject;
+	*ptype = it->second->type;
+	return it->second->pobject;
 }
 
 void rop_processor_release_object_handle(LOGMAP *plogmap,
@@ -347,18 +356,16 @@ void rop_processor_release_object_handle(LOGMAP *plogmap,
 	if (NULL == plogitem) {
 		return;
 	}
-	auto ppobjnode = plogitem->phash->query<OBJECT_NODE *>(obj_handle);
-	if (NULL == ppobjnode) {
+	auto it = plogitem->phash.find(obj_handle);
+	if (it == plogitem->phash.end())
 		return;
-	}
-	if (OBJECT_TYPE_ICSUPCTX == (*ppobjnode)->type) {
+	auto pobjnode = it->second;
+	if (OBJECT_TYPE_ICSUPCTX == pobjnode->type) {
 		pemsmdb_info = emsmdb_interface_get_emsmdb_info();
 		pemsmdb_info->upctx_ref --;
 	}
-	rop_processor_release_objnode(plogitem, *ppobjnode);
-	if (NULL == plogitem->phash) {
+	if (rop_processor_release_objnode(plogitem, pobjnode))
 		plogmap->p[logon_id] = nullptr;
-	}
 }
 
 logon_object *rop_processor_get_logon_object(LOGMAP *plogmap, uint8_t logon_id)
@@ -378,11 +385,8 @@ logon_object *rop_processor_get_logon_object(LOGMAP *plogmap, uint8_t logon_id)
 static void *emsrop_scanwork(void *param)
 {
 	int count;
-	char tmp_dir[256];
-	DOUBLE_LIST temp_list;
-	DOUBLE_LIST_NODE *pnode;
+	std::vector<std::string> dirs;
 	
-	double_list_init(&temp_list);
 	count = 0;
 	while (!g_notify_stop) {
 		sleep(1);
@@ -393,31 +397,20 @@ static void *emsrop_scanwork(void *param)
 		} else {
 			count = 0;
 		}
-		std::unique_lock hl_hold(g_hash_lock);
-		auto iter = g_logon_hash->make_iter();
-		for (str_hash_iter_begin(iter); FALSE == str_hash_iter_done(iter);
-			str_hash_iter_forward(iter)) {
-			str_hash_iter_get_value(iter, tmp_dir);
-			pnode = me_alloc<DOUBLE_LIST_NODE>();
-			if (NULL == pnode) {
-				continue;
-			}
-			pnode->pdata = strdup(tmp_dir);
-			if (NULL == pnode->pdata) {
-				free(pnode);
-				continue;
+		/* one shard at a time, so logons elsewhere are not held up */
+		for (auto &shard : g_logon_shards) {
+			std::unique_lock hl_hold(shard.lock);
+			try {
+				for (const auto &e : shard.refs)
+					dirs.push_back(e.first);
+			} catch (const std::bad_alloc &) {
 			}
-			double_list_append_as_tail(&temp_list, pnode);
-		}
-		str_hash_iter_free(iter);
-		hl_hold.unlock();
-		while ((pnode = double_list_pop_front(&temp_list)) != nullptr) {
-			exmdb_client_ping_store(static_cast<char *>(pnode->pdata));
-			free(pnode->pdata);
-			free(pnode);
+			hl_hold.unlock();
+			for (const auto &dir : dirs)
+				exmdb_client_ping_store(dir.c_str());
+			dirs.clear();
 		}
 	}
-	double_list_free(&temp_list);
 	return nullptr;
 }
 
@@ -450,10 +443,13 @@ int rop_processor_run()
 		printf("[exchange_emsmdb]: Failed to init object handle allocator\n");
 		return -3;
 	}
-	g_logon_hash = STR_HASH_TABLE::create(get_context_num() * 256, sizeof(uint32_t), nullptr);
-	if (NULL == g_logon_hash) {
-		printf("[exchange_emsmdb]: Failed to init logon hash\n");
-		return -4;
+	for (auto &shard : g_logon_shards) {
+		try {
+			shard.refs.reserve(context_num * 256 / LOGON_SHARD_NUM);
+		} catch (const std::bad_alloc &) {
+			printf("[exchange_emsmdb]: Failed to init logon hash\n");
+			return -4;
+		}
 	}
 	g_notify_stop = false;
 	auto ret = pthread_create(&g_scan_id, nullptr, emsrop_scanwork, nullptr);
@@ -486,7 +482,8 @@ void rop_processor_stop()
 		lib_buffer_free(g_handle_allocator);
 		g_handle_allocator = NULL;
 	}
-	g_logon_hash.reset();
+	for (auto &shard : g_logon_shards)
+		shard.refs.clear();
 }
 
 static int rop_processor_execute_and_push(uint8_t *pbuff,
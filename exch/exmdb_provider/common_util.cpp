@@ -300,23 +300,26 @@ char* common_util_convert_copy(BOOL to_utf8,
 	if (NULL == pstr_out) {
 		return NULL;
 	}
+	memset(pstr_out, 0, out_len);
+	if (str_isascii(pstring, in_len) && charset_ascii_compatible(charset)) {
+		memcpy(pstr_out, pstring, in_len);
+		return pstr_out;
+	}
 	if (TRUE == to_utf8) {
-		conv_id = iconv_open("UTF-8//IGNORE", charset);
+		conv_id = iconv_cached("UTF-8//IGNORE", charset);
 		if ((iconv_t)-1 == conv_id) {
-			conv_id = iconv_open("UTF-8//IGNORE", "windows-1252");
+			conv_id = iconv_cached("UTF-8//IGNORE", "windows-1252");
 		}
 	} else {
-		sprintf(temp_charset, "%s//IGNORE", charset);
-		conv_id = iconv_open(temp_charset, "UTF-8");
+		snprintf(temp_charset, arsizeof(temp_charset), "%s//IGNORE", charset);
+		conv_id = iconv_cached(temp_charset, "UTF-8");
 		if ((iconv_t)-1 == conv_id) {
-			conv_id = iconv_open("windows-1252//IGNORE", "UTF-8");
+			conv_id = iconv_cached("windows-1252//IGNORE", "UTF-8");
 		}
 	}
 	auto pin = deconst(pstring);
 	auto pout = pstr_out;
-	memset(pstr_out, 0, out_len);
 	iconv(conv_id, &pin, &in_len, &pout, &out_len);
-	iconv_close(conv_id);
 	return pstr_out;
 }
 
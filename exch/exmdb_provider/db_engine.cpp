@@ -1,14 +1,17 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
 #include <chrono>
 #include <csignal>
 #include <cstdint>
 #include <condition_variable>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 #include <gromox/atomic.hpp>
+#include <gromox/call_stats.hpp>
 #include <gromox/database.h>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/mapidefs.h>
@@ -36,6 +39,9 @@
 
 #define DB_LOCK_TIMEOUT					60
 #define MAX_DYNAMIC_NODES				100
+#define POPULATING_BATCH_SIZE			512
+
+static constexpr auto POPULATING_BATCH_TIME = std::chrono::milliseconds(50);
 
 using namespace gromox;
 
@@ -205,7 +211,10 @@ db_item_ptr db_engine_get_db(const char *path)
 	}
 	pdb->reference ++;
 	hhold.unlock();
-	if (!pdb->lock.try_lock_for(std::chrono::seconds(DB_LOCK_TIMEOUT))) {
+	auto t_wait = std::chrono::steady_clock::now();
+	auto locked = pdb->lock.try_lock_for(std::chrono::seconds(DB_LOCK_TIMEOUT));
+	gromox::call_stats::note_lock_wait(std::chrono::steady_clock::now() - t_wait);
+	if (!locked) {
 		hhold.lock();
 		pdb->reference --;
 		hhold.unlock();
@@ -227,6 +236,7 @@ db_item_ptr db_engine_get_db(const char *path)
 		pdb->psqlite = NULL;
 		return db_item_ptr(pdb);
 	}
+	gx_sql_count_ops(pdb->psqlite);
 	gx_sql_exec(pdb->psqlite, "PRAGMA foreign_keys=ON");
 	gx_sql_exec(pdb->psqlite, g_async ? "PRAGMA synchronous=ON" : "PRAGMA synchronous=OFF");
 	gx_sql_exec(pdb->psqlite, g_wal ? "PRAGMA journal_mode=WAL" : "PRAGMA journal_mode=DELETE");
@@ -377,12 +387,234 @@ static void *mdpeng_scanwork(void *param)
 	return nullptr;
 }
 
+/*
+ * Message properties synthesized by cu_get_properties (gp_msgprop) rather
+ * than read from the message_properties table; these cannot be matched by
+ * a plain SQL subquery.
+ */
+static bool db_engine_is_computed_msgprop(uint32_t tag)
+{
+	switch (tag) {
+	case PidTagFolderId:
+	case PidTagParentFolderId:
+	case PR_MESSAGE_SIZE:
+	case PR_ASSOCIATED:
+	case PidTagChangeNumber:
+	case PR_READ:
+	case PROP_TAG_HASNAMEDPROPERTIES:
+	case PR_HASATTACH:
+	case PidTagMid:
+	case PR_MESSAGE_FLAGS:
+		return true;
+	}
+	return false;
+}
+
+static bool db_engine_sql_fixed_value(uint16_t proptype,
+    const void *pvalue, uint64_t *pnum)
+{
+	switch (proptype) {
+	case PT_SHORT:
+		*pnum = *static_cast<const uint16_t *>(pvalue);
+		return true;
+	case PT_LONG:
+	case PT_ERROR:
+		*pnum = *static_cast<const uint32_t *>(pvalue);
+		return true;
+	case PT_BOOLEAN:
+		*pnum = *static_cast<const uint8_t *>(pvalue);
+		return true;
+	case PT_I8:
+	case PT_SYSTIME:
+	case PT_CURRENCY:
+		*pnum = *static_cast<const uint64_t *>(pvalue);
+		return true;
+	}
+	return false;
+}
+
+static bool db_engine_sql_is_fixed(uint16_t proptype)
+{
+	uint64_t dummy = 0;
+	return db_engine_sql_fixed_value(proptype, &dummy, &dummy);
+}
+
+/*
+ * propval_compare_relop compares 64-bit types as unsigned, but SQLite
+ * stores them as signed integers; split the range at the sign bit.
+ */
+static void db_engine_sql_relop(std::string &w, uint16_t proptype,
+    enum relop relop, uint64_t num)
+{
+	static constexpr const char *ops[] = {"<", "<=", ">", ">=", "=", "<>"};
+	auto s = std::to_string(static_cast<int64_t>(num));
+	if (relop == RELOP_EQ || relop == RELOP_NE ||
+	    (proptype != PT_I8 && proptype != PT_SYSTIME &&
+	    proptype != PT_CURRENCY)) {
+		w += "propval";
+		w += ops[relop];
+		w += s;
+		return;
+	}
+	bool big = num > INT64_MAX;
+	if (relop == RELOP_LT || relop == RELOP_LE)
+		w += big ? "(propval>=0 OR propval" : "(propval>=0 AND propval";
+	else
+		w += big ? "(propval<0 AND propval" : "(propval<0 OR propval";
+	w += ops[relop];
+	w += s;
+	w += ")";
+}
+
+static bool db_engine_res_has_count(const RESTRICTION *pres)
+{
+	switch (pres->rt) {
+	case RES_AND:
+	case RES_OR:
+		for (size_t i = 0; i < pres->andor->count; ++i)
+			if (db_engine_res_has_count(&pres->andor->pres[i]))
+				return true;
+		return false;
+	case RES_NOT:
+		return db_engine_res_has_count(&pres->xnot->res);
+	case RES_SUBRESTRICTION:
+		return db_engine_res_has_count(&pres->sub->res);
+	case RES_COMMENT:
+		return pres->comment->pres != nullptr &&
+		       db_engine_res_has_count(pres->comment->pres);
+	case RES_COUNT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Translate @pres into an SQL expression over "m.message_id" that selects
+ * exactly the messages for which common_util_evaluate_message_restriction
+ * would return TRUE. Only shapes with an exact SQL equivalent are handled:
+ * fixed-size property comparisons, bitmasks and existence tests on stored
+ * properties, and boolean combinations thereof. Content restrictions are
+ * left to the evaluator (codepage conversion, computed string props).
+ */
+static bool db_engine_res_to_sql(const RESTRICTION *pres, std::string &w)
+{
+	char buff[160];
+	uint64_t num;
+
+	switch (pres->rt) {
+	case RES_AND:
+	case RES_OR:
+		if (pres->andor->count == 0) {
+			w += pres->rt == RES_AND ? "1" : "0";
+			return true;
+		}
+		w += "(";
+		for (size_t i = 0; i < pres->andor->count; ++i) {
+			if (i > 0)
+				w += pres->rt == RES_AND ? " AND " : " OR ";
+			if (!db_engine_res_to_sql(&pres->andor->pres[i], w))
+				return false;
+		}
+		w += ")";
+		return true;
+	case RES_NOT:
+		w += "NOT (";
+		if (!db_engine_res_to_sql(&pres->xnot->res, w))
+			return false;
+		w += ")";
+		return true;
+	case RES_PROPERTY: {
+		auto rprop = pres->prop;
+		auto proptype = PROP_TYPE(rprop->proptag);
+		if (rprop->relop > RELOP_NE ||
+		    db_engine_is_computed_msgprop(rprop->proptag) ||
+		    rprop->propval.pvalue == nullptr ||
+		    PROP_TYPE(rprop->propval.proptag) != proptype ||
+		    !db_engine_sql_fixed_value(proptype, rprop->propval.pvalue, &num))
+			return false;
+		snprintf(buff, arsizeof(buff), "m.message_id IN (SELECT message_id "
+		         "FROM message_properties WHERE proptag=%u AND ",
+		         rprop->proptag);
+		w += buff;
+		db_engine_sql_relop(w, proptype, rprop->relop, num);
+		w += ")";
+		return true;
+	}
+	case RES_BITMASK: {
+		auto rbm = pres->bm;
+		if (PROP_TYPE(rbm->proptag) != PT_LONG ||
+		    db_engine_is_computed_msgprop(rbm->proptag) ||
+		    (rbm->bitmask_relop != BMR_EQZ && rbm->bitmask_relop != BMR_NEZ))
+			return false;
+		snprintf(buff, arsizeof(buff), "m.message_id IN (SELECT message_id "
+		         "FROM message_properties WHERE proptag=%u AND "
+		         "(propval&%u)%s0)", rbm->proptag, rbm->mask,
+		         rbm->bitmask_relop == BMR_EQZ ? "=" : "<>");
+		w += buff;
+		return true;
+	}
+	case RES_EXIST:
+		if (!db_engine_sql_is_fixed(PROP_TYPE(pres->exist->proptag)) ||
+		    db_engine_is_computed_msgprop(pres->exist->proptag))
+			return false;
+		snprintf(buff, arsizeof(buff), "m.message_id IN (SELECT message_id "
+		         "FROM message_properties WHERE proptag=%u)",
+		         pres->exist->proptag);
+		w += buff;
+		return true;
+	case RES_COMMENT:
+		if (pres->comment->pres == nullptr) {
+			w += "1";
+			return true;
+		}
+		return db_engine_res_to_sql(pres->comment->pres, w);
+	case RES_NULL:
+		w += "1";
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Build a WHERE fragment for the scope query. Returns true in @b_exact if
+ * the fragment is equivalent to the full restriction; otherwise the
+ * fragment (possibly empty) only narrows the candidate set, which must
+ * still be evaluated.
+ */
+static void db_engine_search_prefilter(const RESTRICTION *pres,
+    std::string &w, bool &b_exact)
+{
+	b_exact = false;
+	if (db_engine_res_has_count(pres))
+		/* RES_COUNT is stateful; per-message evaluation order matters */
+		return;
+	if (db_engine_res_to_sql(pres, w)) {
+		b_exact = true;
+		return;
+	}
+	w.clear();
+	if (pres->rt != RES_AND)
+		return;
+	for (size_t i = 0; i < pres->andor->count; ++i) {
+		std::string sub;
+		if (!db_engine_res_to_sql(&pres->andor->pres[i], sub))
+			continue;
+		if (!w.empty())
+			w += " AND ";
+		w += sub;
+	}
+}
+
 static BOOL db_engine_search_folder(const char *dir,
 	uint32_t cpid, uint64_t search_fid, uint64_t scope_fid,
-	const RESTRICTION *prestriction)
+	const RESTRICTION *prestriction) try
 {
 	char sql_string[128];
-	EID_ARRAY *pmessage_ids;
+	std::string query, where;
+	bool b_exact;
+	std::vector<uint64_t> message_ids, matches;
 	
 	auto pdb = db_engine_get_db(dir);
 	if (pdb == nullptr || pdb->psqlite == nullptr)
@@ -397,62 +629,107 @@ static BOOL db_engine_search_folder(const char *dir,
 		return TRUE;
 	}
 	if (0 == sqlite3_column_int64(pstmt, 0)) {
-		snprintf(sql_string, arsizeof(sql_string), "SELECT message_id FROM"
-		          " messages WHERE parent_fid=%llu",
-		          static_cast<unsigned long long>(scope_fid));
+		snprintf(sql_string, arsizeof(sql_string), "SELECT m.message_id"
+		          " FROM messages AS m WHERE m.parent_fid=%llu",
+		          LLU(scope_fid));
 	} else {
-		snprintf(sql_string, arsizeof(sql_string), "SELECT message_id FROM"
-		          " search_result WHERE folder_id=%llu",
-		          static_cast<unsigned long long>(scope_fid));
+		snprintf(sql_string, arsizeof(sql_string), "SELECT m.message_id"
+		          " FROM search_result AS s JOIN messages AS m ON"
+		          " m.message_id=s.message_id WHERE s.folder_id=%llu",
+		          LLU(scope_fid));
 	}
 	pstmt.finalize();
-	pstmt = gx_sql_prep(pdb->psqlite, sql_string);
-	if (pstmt == nullptr) {
-		return FALSE;
+	query = sql_string;
+	db_engine_search_prefilter(prestriction, where, b_exact);
+	if (!where.empty()) {
+		query += " AND (";
+		query += where;
+		query += ")";
 	}
-	pmessage_ids = eid_array_init();
-	if (NULL == pmessage_ids) {
+	pstmt = gx_sql_prep(pdb->psqlite, query.c_str());
+	if (pstmt == nullptr) {
 		return FALSE;
 	}
-	while (SQLITE_ROW == sqlite3_step(pstmt)) {
-		if (!eid_array_append(pmessage_ids,
-		    sqlite3_column_int64(pstmt, 0))) {
-			eid_array_free(pmessage_ids);
-			return FALSE;
-		}
-	}
+	while (SQLITE_ROW == sqlite3_step(pstmt))
+		message_ids.push_back(sqlite3_column_int64(pstmt, 0));
 	pstmt.finalize();
-	exmdb_server_build_environment(FALSE, TRUE, dir);
-	for (size_t i = 0, count = 0; i < pmessage_ids->count; ++i, ++count) {
+	auto parent_fid = common_util_get_folder_parent_fid(pdb->psqlite, search_fid);
+	/*
+	 * Work in batches bounded by message count and wall time, dropping
+	 * the store lock in between so that clients are not starved while a
+	 * large scope is being populated.
+	 */
+	for (size_t i = 0; i < message_ids.size(); ) {
 		if (g_notify_stop)
 			break;
-		if (200 == count) {
-			pdb.reset();
-			exmdb_server_free_environment();
-			sleep(1);
+		if (pdb == nullptr) {
+			std::this_thread::yield();
 			pdb = db_engine_get_db(dir);
-			if (pdb == nullptr || pdb->psqlite == nullptr) {
-				eid_array_free(pmessage_ids);
+			if (pdb == nullptr || pdb->psqlite == nullptr)
 				return FALSE;
+		}
+		exmdb_server_build_environment(FALSE, TRUE, dir);
+		auto t_start = std::chrono::steady_clock::now();
+		size_t end = std::min(i + POPULATING_BATCH_SIZE, message_ids.size());
+		matches.clear();
+		if (b_exact) {
+			matches.assign(message_ids.begin() + i,
+			               message_ids.begin() + end);
+		} else {
+			/* share prepared property statements across the batch */
+			if (!common_util_begin_message_optimize(pdb->psqlite)) {
+				fprintf(stderr, "E-1631: populating search folder %llxh: "
+				        "skipping %zu messages, cannot prepare statements\n",
+				        LLU(search_fid), end - i);
+				pdb.reset();
+				exmdb_server_free_environment();
+				i = end;
+				continue;
 			}
-			exmdb_server_build_environment(FALSE, TRUE, dir);
-			count = 0;
+			size_t j = i;
+			for (; j < end; ++j) {
+				if (common_util_evaluate_message_restriction(pdb->psqlite,
+				    cpid, message_ids[j], prestriction))
+					matches.push_back(message_ids[j]);
+				if ((j - i) % 32 == 31 && std::chrono::steady_clock::now() -
+				    t_start > POPULATING_BATCH_TIME) {
+					++j;
+					break;
+				}
+			}
+			common_util_end_message_optimize();
+			end = j;
 		}
-		if (TRUE == common_util_evaluate_message_restriction(
-			pdb->psqlite, cpid, pmessage_ids->pids[i], prestriction)) {
-			snprintf(sql_string, arsizeof(sql_string), "REPLACE INTO search_result "
-				"(folder_id, message_id) VALUES (%llu, %llu)",
-				LLU(search_fid), LLU(pmessage_ids->pids[i]));
-			if (gx_sql_exec(pdb->psqlite, sql_string) == SQLITE_OK)
-				db_engine_proc_dynamic_event(pdb, cpid,
-					DYNAMIC_EVENT_NEW_MESSAGE, search_fid,
-					pmessage_ids->pids[i], 0);
+		if (matches.size() > 0) {
+			auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
+			pstmt = gx_sql_prep(pdb->psqlite, "REPLACE INTO search_result "
+			        "(folder_id, message_id) VALUES (?, ?)");
+			if (pstmt == nullptr) {
+				exmdb_server_free_environment();
+				return FALSE;
+			}
+			for (auto mid : matches) {
+				sqlite3_bind_int64(pstmt, 1, search_fid);
+				sqlite3_bind_int64(pstmt, 2, mid);
+				auto ret = sqlite3_step(pstmt);
+				sqlite3_reset(pstmt);
+				if (ret == SQLITE_DONE)
+					db_engine_proc_dynamic_event(pdb, cpid,
+						DYNAMIC_EVENT_NEW_MESSAGE, search_fid, mid, 0);
+			}
+			pstmt.finalize();
+			sql_transact.commit();
+			/* let clients watch the folder's counts grow */
+			db_engine_notify_folder_modification(pdb, parent_fid, search_fid);
 		}
+		pdb.reset();
+		exmdb_server_free_environment();
+		i = end;
 	}
-	pdb.reset();
-	exmdb_server_free_environment();
-	eid_array_free(pmessage_ids);
 	return TRUE;
+} catch (const std::bad_alloc &) {
+	fprintf(stderr, "E-1617: ENOMEM\n");
+	return FALSE;
 }
 
 static BOOL db_engine_load_folder_descendant(const char *dir,
@@ -6,10 +6,12 @@
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 #include <libHX/string.h>
+#include <gromox/call_stats.hpp>
 #include <gromox/defs.h>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/socket.h>
@@ -34,10 +36,13 @@
 
 static size_t g_max_threads, g_max_routers;
 static std::vector<EXMDB_ITEM> g_local_list;
-static std::unordered_set<std::shared_ptr<ROUTER_CONNECTION>> g_router_list;
+/* keyed by remote_id; a reconnecting client may briefly have two routers */
+static std::unordered_multimap<std::string, std::shared_ptr<ROUTER_CONNECTION>> g_router_list;
 static std::unordered_set<std::shared_ptr<EXMDB_CONNECTION>> g_connection_list;
 static std::mutex g_router_lock, g_connection_lock;
 unsigned int g_exrpc_debug, g_enable_dam;
+gromox::call_stats g_exrpc_stats("exmdb_provider",
+	exmdb_callid::SET_MESSAGES_READ_STATE + 1, exmdb_rpc_idtoname);
 
 EXMDB_CONNECTION::~EXMDB_CONNECTION()
 {
@@ -732,6 +737,17 @@ static BOOL exmdb_parser_dispatch2(const EXMDB_REQUEST *prequest,
 				&presponse->payload.get_public_folder_unread_count.count);
 	case exmdb_callid::UNLOAD_STORE:
 		return exmdb_server_unload_store(prequest->dir);
+	case exmdb_callid::WRITE_MESSAGES: {
+		const auto &q = prequest->payload.write_messages;
+		return exmdb_server_write_messages(prequest->dir,
+		       q.account, q.cpid, q.folder_id, q.count, q.pmsgctnt,
+			&presponse->payload.write_messages.e_result);
+	}
+	case exmdb_callid::SET_MESSAGES_READ_STATE: {
+		const auto &q = prequest->payload.set_messages_read_state;
+		return exmdb_server_set_messages_read_state(prequest->dir,
+		       q.username, q.pmessage_ids, q.mark_as_read);
+	}
 	default:
 		return FALSE;
 	}
@@ -745,6 +761,8 @@ static BOOL exmdb_parser_dispatch(const EXMDB_REQUEST *prequest,
 		printf("exmdb rpc %s accessing %s: %s\n", exmdb_rpc_idtoname(prequest->call_id),
 		       prequest->dir, strerror(errno));
 	exmdb_server_set_dir(prequest->dir);
+	gromox::call_stats::begin();
+	gromox::call_stats::note_dir(prequest->dir);
 	auto ret = exmdb_parser_dispatch2(prequest, presponse);
 	if (g_exrpc_debug == 0)
 		return ret;
@@ -880,18 +898,29 @@ static void *mdpps_thrwork(void *pparam)
 					tmp_byte = exmdb_response::MAX_REACHED;
 				} else {
 					prouter->remote_id = request.payload.listen_notification.remote_id;
-					exmdb_server_free_environment();
-					if (5 != write(pconnection->sockd, resp_buff, 5)) {
-						break;
+					prouter->thr_id = pconnection->thr_id;
+					time(&prouter->last_time);
+					/* register before replying, so that ENOMEM can still be reported */
+					bool b_added = false;
+					std::unique_lock r_hold(g_router_lock);
+					try {
+						g_router_list.emplace(prouter->remote_id, prouter);
+						b_added = true;
+					} catch (const std::bad_alloc &) {
+						fprintf(stderr, "E-1626: ENOMEM\n");
+					}
+					r_hold.unlock();
+					if (!b_added) {
+						tmp_byte = exmdb_response::LACK_MEMORY;
 					} else {
-						prouter->thr_id = pconnection->thr_id;
+						exmdb_server_free_environment();
+						if (5 != write(pconnection->sockd, resp_buff, 5)) {
+							exmdb_parser_remove_router(prouter);
+							break;
+						}
 						prouter->sockd = pconnection->sockd;
 						pconnection->thr_id = {};
 						pconnection->sockd = -1;
-						time(&prouter->last_time);
-						std::unique_lock r_hold(g_router_lock);
-						g_router_list.insert(prouter);
-						r_hold.unlock();
 						std::unique_lock chold(g_connection_lock);
 						g_connection_list.erase(pconnection);
 						chold.unlock();
@@ -902,10 +931,13 @@ static void *mdpps_thrwork(void *pparam)
 				tmp_byte = exmdb_response::CONNECT_INCOMPLETE;
 			}
 		} else if (!exmdb_parser_dispatch(&request, &response)) {
+			g_exrpc_stats.end(request.call_id, buff_len);
 			tmp_byte = exmdb_response::DISPATCH_ERROR;
 		} else if (EXT_ERR_SUCCESS != exmdb_ext_push_response(&response, &tmp_bin)) {
+			g_exrpc_stats.end(request.call_id, buff_len);
 			tmp_byte = exmdb_response::PUSH_ERROR;
 		} else {
+			g_exrpc_stats.end(request.call_id, buff_len + tmp_bin.cb);
 			exmdb_server_free_environment();
 			offset = 0;
 			pbuff = tmp_bin.pb;
@@ -941,34 +973,22 @@ void exmdb_parser_put_connection(std::shared_ptr<EXMDB_CONNECTION> &&pconnection
 std::shared_ptr<ROUTER_CONNECTION> exmdb_parser_get_router(const char *remote_id)
 {
 	std::lock_guard rhold(g_router_lock);
-	auto it = std::find_if(g_router_list.begin(), g_router_list.end(),
-	          [&](const auto &r) { return r->remote_id == remote_id; });
-	if (it == g_router_list.end())
-		return nullptr;
-	auto rt = *it;
-	g_router_list.erase(it);
-	return rt;
+	auto it = g_router_list.find(remote_id);
+	return it != g_router_list.end() ? it->second : nullptr;
 }
 
-void exmdb_parser_put_router(std::shared_ptr<ROUTER_CONNECTION> &&pconnection)
+void exmdb_parser_remove_router(const std::shared_ptr<ROUTER_CONNECTION> &pconnection)
 {
 	std::lock_guard rhold(g_router_lock);
-	try {
-		g_router_list.insert(std::move(pconnection));
-	} catch (const std::bad_alloc &) {
+	auto range = g_router_list.equal_range(pconnection->remote_id);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == pconnection) {
+			g_router_list.erase(it);
+			return;
+		}
 	}
 }
 
-BOOL exmdb_parser_remove_router(const std::shared_ptr<ROUTER_CONNECTION> &pconnection)
-{
-	std::lock_guard rhold(g_router_lock);
-	auto it = g_router_list.find(pconnection);
-	if (it == g_router_list.cend())
-		return false;
-	g_router_list.erase(it);
-	return TRUE;
-}
-
 int exmdb_parser_run(const char *config_path)
 {
 	auto ret = list_file_read_exmdb("exmdb_list.txt", config_path, g_local_list);
@@ -1018,7 +1038,7 @@ void exmdb_parser_stop()
 			return;
 		}
 	i = 0;
-	for (auto &rt : g_router_list) {
+	for (auto &[remote_id, rt] : g_router_list) {
 		pthr_ids[i++] = rt->thr_id;
 		rt->b_stop = true;
 		rt->waken_cond.notify_one();
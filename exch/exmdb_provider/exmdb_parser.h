@@ -5,6 +5,7 @@
 #include <mutex>
 #include <string>
 #include <gromox/atomic.hpp>
+#include <gromox/call_stats.hpp>
 #include <gromox/common_types.hpp>
 #include <gromox/double_list.hpp>
 #include <pthread.h>
@@ -47,8 +48,8 @@ extern void exmdb_parser_stop();
 extern std::shared_ptr<EXMDB_CONNECTION> exmdb_parser_get_connection();
 void exmdb_parser_put_connection(std::shared_ptr<EXMDB_CONNECTION> &&);
 extern std::shared_ptr<ROUTER_CONNECTION> exmdb_parser_get_router(const char *remote_id);
-extern void exmdb_parser_put_router(std::shared_ptr<ROUTER_CONNECTION> &&);
-extern BOOL exmdb_parser_remove_router(const std::shared_ptr<ROUTER_CONNECTION> &);
+extern void exmdb_parser_remove_router(const std::shared_ptr<ROUTER_CONNECTION> &);
 
 extern unsigned int g_exrpc_debug, g_enable_dam;
+extern gromox::call_stats g_exrpc_stats;
 extern unsigned int g_mbox_contention_warning, g_mbox_contention_reject;
@@ -262,6 +262,7 @@ BOOL exmdb_server_set_message_properties(const char *dir,
 BOOL exmdb_server_set_message_read_state(const char *dir,
 	const char *username, uint64_t message_id,
 	uint8_t mark_as_read, uint64_t *pread_cn);
+extern BOOL exmdb_server_set_messages_read_state(const char *dir, const char *username, const EID_ARRAY *, uint8_t mark_as_read);
 BOOL exmdb_server_remove_message_properties(
 	const char *dir, uint32_t cpid, uint64_t message_id,
 	const PROPTAG_ARRAY *pproptags);
@@ -309,6 +310,7 @@ BOOL exmdb_server_delivery_message(const char *dir,
 	uint32_t cpid, const MESSAGE_CONTENT *pmsg,
 	const char *pdigest, uint32_t *presult);
 extern BOOL exmdb_server_write_message(const char *dir, const char *account, uint32_t cpid, uint64_t folder_id, const MESSAGE_CONTENT *, gxerr_t *);
+extern BOOL exmdb_server_write_messages(const char *dir, const char *account, uint32_t cpid, uint64_t folder_id, uint32_t count, const MESSAGE_CONTENT *, gxerr_t *);
 BOOL exmdb_server_read_message(const char *dir, const char *username,
 	uint32_t cpid, uint64_t message_id, MESSAGE_CONTENT **ppmsgctnt);
 BOOL exmdb_server_get_content_sync(const char *dir,
@@ -1,24 +1,27 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2020–2021 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <cstring>
+#include <new>
+#include <vector>
 #include <gromox/database.h>
 #include "exmdb_server.h"
 #include "common_util.h"
 #include "db_engine.h"
+#include "idset_cache.h"
 #include <gromox/eid_array.hpp>
 #include <gromox/rop_util.hpp>
 #include <gromox/idset.hpp>
-#include <gromox/scope.hpp>
 #include <cstdio>
-#define IDSET_CACHE_MIN_RANGE				10
 
 using namespace gromox;
 
 namespace {
 
 struct ENUM_PARAM {
-	xstmt stm_exist, stm_msg;
+	const std::vector<uint64_t> *pexist; /* sorted */
+	xstmt stm_msg;
 	EID_ARRAY *pdeleted_eids;
 	EID_ARRAY *pnolonger_mids;
 	BOOL b_result;
@@ -41,123 +44,40 @@ struct REPLID_NODE {
 	DOUBLE_LIST range_list;
 };
 
-struct IDSET_CACHE {
-	IDSET_CACHE();
-	~IDSET_CACHE();
-	NOMOVE(IDSET_CACHE);
-	BOOL init(const IDSET *);
-	BOOL hint(uint64_t);
-
-	sqlite3 *psqlite = nullptr;
-	xstmt pstmt;
-	DOUBLE_LIST range_list;
+struct ics_change {
+	uint64_t mid, dtime, mtime;
 };
 
 }
 
-IDSET_CACHE::IDSET_CACHE()
+bool IDSET_CACHE::init(const IDSET *pset) try
 {
-	double_list_init(&range_list);
-}
-
-IDSET_CACHE::~IDSET_CACHE()
-{
-	pstmt.finalize();
-	if (psqlite != nullptr)
-		sqlite3_close(psqlite);
-	double_list_free(&range_list);
-}
-
-BOOL IDSET_CACHE::init(const IDSET *pset)
-{
-	auto pcache = this;
-	uint64_t ival;
 	DOUBLE_LIST_NODE *pnode;
-	REPLID_NODE *prepl_node;
-	RANGE_NODE *prange_node;
-	RANGE_NODE *prange_node1;
-	DOUBLE_LIST *prange_list;
+	DOUBLE_LIST *prange_list = nullptr;
 	
-	if (SQLITE_OK != sqlite3_open_v2(":memory:", &pcache->psqlite,
-		SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL)) {
-		return FALSE;
-	}
-	if (gx_sql_exec(pcache->psqlite, "CREATE TABLE id_vals "
-	    "(id_val INTEGER PRIMARY KEY)") != SQLITE_OK)
-		return FALSE;
-	pcache->pstmt = NULL;
-	prange_list = NULL;
 	for (pnode=double_list_get_head(
 		(DOUBLE_LIST*)&pset->repl_list);
 		NULL!=pnode; pnode=double_list_get_after(
 		(DOUBLE_LIST*)&pset->repl_list, pnode)) {
-		prepl_node = (REPLID_NODE*)pnode->pdata;
+		auto prepl_node = static_cast<REPLID_NODE *>(pnode->pdata);
 		if (1 == prepl_node->replid) {
 			prange_list = &prepl_node->range_list;
 			break;
 		}
 	}
 	if (NULL == prange_list) {
-		return TRUE;
-	}
-	auto pstmt = gx_sql_prep(pcache->psqlite, "INSERT INTO id_vals VALUES (?)");
-	if (pstmt == nullptr) {
-		return FALSE;
+		return true;
 	}
 	for (pnode=double_list_get_head(prange_list); NULL!=pnode;
 		pnode=double_list_get_after(prange_list, pnode)) {
-		prange_node = (RANGE_NODE*)pnode->pdata;
-		if (prange_node->high_value -
-			prange_node->low_value >=
-			IDSET_CACHE_MIN_RANGE) {
-			prange_node1 = cu_alloc<RANGE_NODE>();
-			if (NULL == prange_node1) {
-				return FALSE;
-			}
-			prange_node1->node.pdata = prange_node1;
-			prange_node1->low_value = prange_node->low_value;
-			prange_node1->high_value = prange_node->high_value;
-			double_list_append_as_tail(
-				&pcache->range_list, &prange_node1->node);
-			continue;
-		}
-		for (ival = prange_node->low_value;
-		     ival <= prange_node->high_value; ival++) {
-			sqlite3_reset(pstmt);
-			sqlite3_bind_int64(pstmt, 1, ival);
-			if (SQLITE_DONE != sqlite3_step(pstmt)) {
-				return FALSE;
-			}
-		}
-	}
-	return TRUE;
-}
-
-BOOL IDSET_CACHE::hint(uint64_t id_val)
-{
-	auto pcache = this;
-	RANGE_NODE *prange_node;
-	DOUBLE_LIST_NODE *pnode;
-	
-	if (NULL == pcache->pstmt) {
-		pcache->pstmt = gx_sql_prep(pcache->psqlite, "SELECT id_val FROM id_vals WHERE id_val=?");
-		if (pcache->pstmt == nullptr)
-			return FALSE;
-	}
-	sqlite3_reset(pcache->pstmt);
-	sqlite3_bind_int64(pcache->pstmt, 1, id_val);
-	if (SQLITE_ROW == sqlite3_step(pcache->pstmt)) {
-		return TRUE;
-	}
-	for (pnode=double_list_get_head(&pcache->range_list); NULL!=pnode;
-		pnode=double_list_get_after(&pcache->range_list, pnode)) {
-		prange_node = (RANGE_NODE*)pnode->pdata;
-		if (id_val >= prange_node->low_value &&
-			id_val <= prange_node->high_value) {
-			return TRUE;	
-		}
-	}
-	return FALSE;
+		auto prange_node = static_cast<RANGE_NODE *>(pnode->pdata);
+		add(prange_node->low_value, prange_node->high_value);
+	}
+	finalize();
+	return true;
+} catch (const std::bad_alloc &) {
+	fprintf(stderr, "E-1622: ENOMEM\n");
+	return false;
 }
 
 static void ics_enum_content_idset(void *vparam, uint64_t message_id)
@@ -169,9 +89,7 @@ static void ics_enum_content_idset(void *vparam, uint64_t message_id)
 		return;
 	}
 	mid_val = rop_util_get_gc_value(message_id);
-	sqlite3_reset(pparam->stm_exist);
-	sqlite3_bind_int64(pparam->stm_exist, 1, mid_val);
-	if (sqlite3_step(pparam->stm_exist) == SQLITE_ROW)
+	if (std::binary_search(pparam->pexist->cbegin(), pparam->pexist->cend(), mid_val))
 		return;
 	sqlite3_reset(pparam->stm_msg);
 	sqlite3_bind_int64(pparam->stm_msg, 1, mid_val);
@@ -194,44 +112,22 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 	uint64_t *pnormal_total, EID_ARRAY *pupdated_mids, EID_ARRAY *pchg_mids,
 	uint64_t *plast_cn, EID_ARRAY *pgiven_mids, EID_ARRAY *pdeleted_mids,
 	EID_ARRAY *pnolonger_mids, EID_ARRAY *pread_mids,
-	EID_ARRAY *punread_mids, uint64_t *plast_readcn)
+	EID_ARRAY *punread_mids, uint64_t *plast_readcn) try
 {
-	sqlite3 *psqlite;
-	
 	*pfai_count = 0;
 	*pfai_total = 0;
 	*pnormal_count = 0;
 	*pnormal_total = 0;
 	auto b_private = exmdb_server_check_private();
 
-	/* Setup of scratch space db */
-	if (SQLITE_OK != sqlite3_open_v2(":memory:", &psqlite,
-		SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL)) {
-		return FALSE;
-	}
-	auto cl_0 = make_scope_exit([&]() { sqlite3_close(psqlite); });
-	if (gx_sql_exec(psqlite, "CREATE TABLE existence "
-	    "(message_id INTEGER PRIMARY KEY)") != SQLITE_OK)
-		return FALSE;
-	if (NULL != pread) {
-		if (gx_sql_exec(psqlite, "CREATE TABLE reads "
-		    "(message_id INTEGER PRIMARY KEY, read_state INTEGER)") != SQLITE_OK)
-			return FALSE;
-	}
-	if (TRUE == b_ordered) {
-		if (gx_sql_exec(psqlite, "CREATE TABLE changes"
-		    " (message_id INTEGER PRIMARY KEY, "
-		    "delivery_time INTEGER, mod_time INTEGER)") != SQLITE_OK)
-			return FALSE;
-		if (gx_sql_exec(psqlite, "CREATE INDEX idx_dtime ON changes (delivery_time)") != SQLITE_OK)
-			return FALSE;
-		if (gx_sql_exec(psqlite, "CREATE INDEX idx_mtime ON changes (mod_time)") != SQLITE_OK)
-			return FALSE;
-	} else {
-		if (gx_sql_exec(psqlite, "CREATE TABLE changes "
-		    "(message_id INTEGER PRIMARY KEY)") != SQLITE_OK)
-			return FALSE;
-	}
+	/*
+	 * Scratch space: messages are scanned in message_id order, so
+	 * existence and reads come out sorted and the lookups into the
+	 * given set advance along with the scan.
+	 */
+	std::vector<uint64_t> existence;
+	std::vector<ics_change> changes;
+	std::vector<std::pair<uint64_t, bool>> reads;
 	IDSET_CACHE cache;
 	if (!cache.init(pgiven))
 		return FALSE;
@@ -242,7 +138,6 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 
 	/* Query section 1 */
 	{
-	auto transact1 = gx_sql_begin_trans(psqlite);
 	xtransaction transact2;
 	if (NULL != prestriction) {
 		transact2 = gx_sql_begin_trans(pdb->psqlite);
@@ -252,25 +147,19 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 		snprintf(sql_string, arsizeof(sql_string), "SELECT message_id,"
 			" change_number, is_associated, message_size,"
 			" read_state, read_cn FROM messages WHERE "
-			"parent_fid=%llu", static_cast<unsigned long long>(fid_val));
+			"parent_fid=%llu ORDER BY message_id",
+			static_cast<unsigned long long>(fid_val));
 	} else {
 		snprintf(sql_string, arsizeof(sql_string), "SELECT message_id,"
 			" change_number, is_associated, message_size "
 			"FROM messages WHERE parent_fid=%llu AND "
-			"is_deleted=0", static_cast<unsigned long long>(fid_val));
+			"is_deleted=0 ORDER BY message_id",
+			static_cast<unsigned long long>(fid_val));
 	}
 	auto stm_select_msg = gx_sql_prep(pdb->psqlite, sql_string);
 	if (stm_select_msg == nullptr)
 		return false;
-	auto stm_insert_chg = gx_sql_prep(psqlite, b_ordered ?
-	                      "INSERT INTO changes VALUES (?, ?, ?)" :
-	                      "INSERT INTO changes VALUES (?)");
-	if (stm_insert_chg == nullptr)
-		return false;
-	auto stm_insert_exist = gx_sql_prep(psqlite, "INSERT INTO existence VALUES (?)");
-	if (stm_insert_exist == nullptr)
-		return false;
-	xstmt stm_insert_reads, stm_select_rcn, stm_select_rst;
+	xstmt stm_select_rcn, stm_select_rst;
 	if (NULL != pread) {
 		if (FALSE == b_private) {
 			stm_select_rcn = gx_sql_prep(pdb->psqlite, "SELECT read_cn FROM "
@@ -282,9 +171,6 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 			if (stm_select_rst == nullptr)
 				return false;
 		}
-		stm_insert_reads = gx_sql_prep(psqlite, "INSERT INTO reads VALUES (?, ?)");
-		if (stm_insert_reads == nullptr)
-			return false;
 	}
 	xstmt stm_select_mp;
 	if (TRUE == b_ordered) {
@@ -316,10 +202,7 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 			pdb->psqlite, cpid, mid_val, prestriction)) {
 			continue;	
 		}
-		sqlite3_reset(stm_insert_exist);
-		sqlite3_bind_int64(stm_insert_exist, 1, mid_val);
-		if (sqlite3_step(stm_insert_exist) != SQLITE_DONE)
-			return false;
+		existence.push_back(mid_val);
 		if (change_num > *plast_cn) {
 			*plast_cn = change_num;
 		}
@@ -352,9 +235,9 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 				    const_cast<IDSET *>(pread)->hint(rop_util_make_eid_ex(1, read_cn))) {
 					continue;	
 				}
-				int read_state;
+				bool read_state;
 				if (TRUE == b_private) {
-					read_state = sqlite3_column_int64(stm_select_msg, 4);
+					read_state = sqlite3_column_int64(stm_select_msg, 4) != 0;
 				} else {
 					sqlite3_reset(stm_select_rst);
 					sqlite3_bind_int64(stm_select_rst, 1, mid_val);
@@ -362,11 +245,7 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 						username, -1 , SQLITE_STATIC);
 					read_state = sqlite3_step(stm_select_rst) == SQLITE_ROW;
 				}
-				sqlite3_reset(stm_insert_reads);
-				sqlite3_bind_int64(stm_insert_reads, 1, mid_val);
-				sqlite3_bind_int64(stm_insert_reads, 2, read_state);
-				if (sqlite3_step(stm_insert_reads) != SQLITE_DONE)
-					return false;
+				reads.emplace_back(mid_val, read_state);
 				continue;
 			}
 		}
@@ -390,19 +269,9 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 			(*pnormal_count) ++;
 			*pnormal_total += message_size;
 		}
-		sqlite3_reset(stm_insert_chg);
-		sqlite3_bind_int64(stm_insert_chg, 1, mid_val);
-		if (TRUE == b_ordered) {
-			sqlite3_bind_int64(stm_insert_chg, 2, dtime);
-			sqlite3_bind_int64(stm_insert_chg, 3, mtime);
-		}
-		if (sqlite3_step(stm_insert_chg) != SQLITE_DONE)
-			return false;
+		changes.push_back({mid_val, dtime, mtime});
 	}
 	stm_select_msg.finalize();
-	stm_insert_chg.finalize();
-	stm_insert_exist.finalize();
-	stm_insert_reads.finalize();
 	stm_select_rcn.finalize();
 	stm_select_rst.finalize();
 	stm_select_mp.finalize();
@@ -412,24 +281,21 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 	if (0 != *plast_readcn) {
 		*plast_readcn = rop_util_make_eid_ex(1, *plast_readcn);
 	}
-	transact1.commit();
 	transact2.commit();
 	} /* section 1 */
 
-	/* Query section 2a */
-	{
-	ssize_t count;
+	/* Query section 2 */
 	{
-	auto stm_select_chg = gx_sql_prep(psqlite, "SELECT count(*) FROM changes");
-	if (stm_select_chg == nullptr || sqlite3_step(stm_select_chg) != SQLITE_ROW)
-		return FALSE;
-	count = sqlite3_column_int64(stm_select_chg, 0);
-	stm_select_chg.finalize();
+	if (TRUE == b_ordered)
+		std::stable_sort(changes.begin(), changes.end(),
+			[](const ics_change &a, const ics_change &b) {
+				return a.dtime != b.dtime ? a.dtime > b.dtime : a.mtime > b.mtime;
+			});
 	pchg_mids->count = 0;
 	pupdated_mids->count = 0;
-	if (count > 0) {
-		pupdated_mids->pids = cu_alloc<uint64_t>(count);
-		pchg_mids->pids = cu_alloc<uint64_t>(count);
+	if (changes.size() > 0) {
+		pupdated_mids->pids = cu_alloc<uint64_t>(changes.size());
+		pchg_mids->pids = cu_alloc<uint64_t>(changes.size());
 		if (NULL == pupdated_mids->pids || NULL == pchg_mids->pids) {
 			return FALSE;
 		}
@@ -437,33 +303,17 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 		pupdated_mids->pids = NULL;
 		pchg_mids->pids = NULL;
 	}
-	} /* section 2a */
-
-	/* Query section 2b */
-	{
-	auto stm_select_chg = gx_sql_prep(psqlite, b_ordered ?
-	                      "SELECT message_id FROM changes ORDER BY delivery_time DESC, mod_time DESC" :
-	                      "SELECT message_id FROM changes");
-	if (stm_select_chg == nullptr)
-		return FALSE;
-	for (ssize_t i = 0; i < count; ++i) {
-		if (sqlite3_step(stm_select_chg) != SQLITE_ROW)
-			return FALSE;
-		uint64_t mid_val = sqlite3_column_int64(stm_select_chg, 0);
-		pchg_mids->pids[pchg_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-		if (cache.hint(mid_val))
-			pupdated_mids->pids[pupdated_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-	}
-	} /* section 2b */
+	for (const auto &chg : changes) {
+		pchg_mids->pids[pchg_mids->count++] = rop_util_make_eid_ex(1, chg.mid);
+		if (cache.hint(chg.mid))
+			pupdated_mids->pids[pupdated_mids->count++] = rop_util_make_eid_ex(1, chg.mid);
 	}
+	} /* section 2 */
 
 	/* Query section 3 */
 	{
 	ENUM_PARAM enum_param;
-	enum_param.stm_exist = gx_sql_prep(psqlite,
-	                       "SELECT message_id FROM existence WHERE message_id=?");
-	if (enum_param.stm_exist == nullptr)
-		return FALSE;
+	enum_param.pexist = &existence;
 	enum_param.stm_msg = gx_sql_prep(pdb->psqlite,
 	                     "SELECT message_id FROM messages WHERE message_id=?");
 	if (enum_param.stm_msg == nullptr)
@@ -484,7 +334,6 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 		eid_array_free(enum_param.pnolonger_mids);
 		return FALSE;	
 	}
-	enum_param.stm_exist.finalize();
 	enum_param.stm_msg.finalize();
 	pdeleted_mids->count = enum_param.pdeleted_eids->count;
 	if (0 != enum_param.pdeleted_eids->count) {
@@ -523,74 +372,47 @@ BOOL exmdb_server_get_content_sync(const char *dir,
 
 	/* Query section 4 */
 	{
-	auto stm_select_exist = gx_sql_prep(psqlite, "SELECT count(*) FROM existence");
-	if (stm_select_exist == nullptr ||
-	    sqlite3_step(stm_select_exist) != SQLITE_ROW)
-		return FALSE;
-	int64_t count = sqlite3_column_int64(stm_select_exist, 0);
-	stm_select_exist.finalize();
 	pgiven_mids->count = 0;
-	if (count <= 0) {
+	if (existence.size() == 0) {
 		pgiven_mids->pids = NULL;
 	} else {
-		pgiven_mids->pids = cu_alloc<uint64_t>(count);
+		pgiven_mids->pids = cu_alloc<uint64_t>(existence.size());
 		if (NULL == pgiven_mids->pids) {
 			return FALSE;
 		}
-		auto stm_select_ex = gx_sql_prep(psqlite, "SELECT message_id"
-		                     " FROM existence ORDER BY message_id DESC");
-		if (stm_select_ex == nullptr)
-			return FALSE;
-		while (sqlite3_step(stm_select_ex) == SQLITE_ROW) {
-			uint64_t mid_val = sqlite3_column_int64(stm_select_ex, 0);
-			pgiven_mids->pids[pgiven_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-		}
+		for (auto it = existence.crbegin(); it != existence.crend(); ++it)
+			pgiven_mids->pids[pgiven_mids->count++] = rop_util_make_eid_ex(1, *it);
 	}
 	} /* section 4 */
 
 	/* Query section 5 */
 	{
-	if (NULL != pread) {
-		auto stm_select_rd = gx_sql_prep(psqlite, "SELECT count(*) FROM reads");
-		if (stm_select_rd == nullptr ||
-		    sqlite3_step(stm_select_rd) != SQLITE_ROW)
+	pread_mids->count = 0;
+	punread_mids->count = 0;
+	if (reads.size() == 0) {
+		pread_mids->pids = NULL;
+		punread_mids->pids = NULL;
+	} else {
+		pread_mids->pids = cu_alloc<uint64_t>(reads.size());
+		if (NULL == pread_mids->pids) {
 			return FALSE;
-		ssize_t count = sqlite3_column_int64(stm_select_rd, 0);
-		stm_select_rd.finalize();
-		pread_mids->count = 0;
-		punread_mids->count = 0;
-		if (count <= 0) {
-			pread_mids->pids = NULL;
-			punread_mids->pids = NULL;
-		} else {
-			pread_mids->pids = cu_alloc<uint64_t>(count);
-			if (NULL == pread_mids->pids) {
-				return FALSE;
-			}
-			punread_mids->pids = cu_alloc<uint64_t>(count);
-			if (NULL == punread_mids->pids) {
-				return FALSE;
-			}
 		}
-		stm_select_rd = gx_sql_prep(psqlite,
-		                "SELECT message_id, read_state FROM reads");
-		if (stm_select_rd == nullptr)
+		punread_mids->pids = cu_alloc<uint64_t>(reads.size());
+		if (NULL == punread_mids->pids) {
 			return FALSE;
-		while (sqlite3_step(stm_select_rd) == SQLITE_ROW) {
-			uint64_t mid_val = sqlite3_column_int64(stm_select_rd, 0);
-			if (sqlite3_column_int64(stm_select_rd, 1) == 0)
-				punread_mids->pids[punread_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-			else
-				pread_mids->pids[pread_mids->count++] = rop_util_make_eid_ex(1, mid_val);
 		}
-	} else {
-		pread_mids->count = 0;
-		pread_mids->pids = NULL;
-		punread_mids->count = 0;
-		punread_mids->pids = NULL;
+	}
+	for (const auto &[mid_val, read_state] : reads) {
+		if (!read_state)
+			punread_mids->pids[punread_mids->count++] = rop_util_make_eid_ex(1, mid_val);
+		else
+			pread_mids->pids[pread_mids->count++] = rop_util_make_eid_ex(1, mid_val);
 	}
 	} /* section 5 */
 	return TRUE;
+} catch (const std::bad_alloc &) {
+	fprintf(stderr, "E-1623: ENOMEM\n");
+	return false;
 }
 
 static void ics_enum_hierarchy_idset(void *vparam, uint64_t folder_id)
@@ -607,9 +429,7 @@ static void ics_enum_hierarchy_idset(void *vparam, uint64_t folder_id)
 	if (1 != replid) {
 		fid_val |= ((uint64_t)replid) << 48;
 	}
-	sqlite3_reset(pparam->stm_exist);
-	sqlite3_bind_int64(pparam->stm_exist, 1, fid_val);
-	if (sqlite3_step(pparam->stm_exist) == SQLITE_ROW)
+	if (std::binary_search(pparam->pexist->cbegin(), pparam->pexist->cend(), fid_val))
 		return;
 	if (!eid_array_append(pparam->pdeleted_eids, folder_id))
 		pparam->b_result = FALSE;
@@ -623,19 +443,18 @@ static void ics_enum_hierarchy_replist(void *vpar, uint16_t replid)
 	}
 }
 
+/* may throw std::bad_alloc */
 static BOOL ics_load_folder_changes(sqlite3 *psqlite,
 	uint64_t folder_id, const char *username,
-	const IDSET *pgiven, const IDSET *pseen,
-	sqlite3_stmt *pstmt, sqlite3_stmt *stm_insert_chg,
-	sqlite3_stmt *stm_insert_exist, uint64_t *plast_cn)
+	const IDSET *pgiven, const IDSET *pseen, sqlite3_stmt *pstmt,
+	std::vector<uint64_t> &changes, std::vector<uint64_t> &existence,
+	uint64_t *plast_cn)
 {
 	uint64_t fid_val;
 	uint64_t change_num;
 	uint32_t permission;
-	DOUBLE_LIST tmp_list;
-	DOUBLE_LIST_NODE *pnode;
+	std::vector<uint64_t> tmp_list;
 	
-	double_list_init(&tmp_list);
 	sqlite3_reset(pstmt);
 	sqlite3_bind_int64(pstmt, 1, folder_id);
 	while (SQLITE_ROW == sqlite3_step(pstmt)) {
@@ -649,60 +468,30 @@ static BOOL ics_load_folder_changes(sqlite3 *psqlite,
 			if (!(permission & (frightsReadAny | frightsVisible | frightsOwner)))
 				continue;
 		}
-		pnode = cu_alloc<DOUBLE_LIST_NODE>();
-		if (NULL == pnode) {
-			return FALSE;
-		}
-		pnode->pdata = cu_alloc<uint64_t>();
-		if (NULL == pnode->pdata) {
-			return FALSE;
-		}
-		*(uint64_t*)pnode->pdata = fid_val;
-		double_list_append_as_tail(&tmp_list, pnode);
-		sqlite3_reset(stm_insert_exist);
-		sqlite3_bind_int64(stm_insert_exist, 1, fid_val);
-		if (sqlite3_step(stm_insert_exist) != SQLITE_DONE)
-			return FALSE;
+		tmp_list.push_back(fid_val);
+		existence.push_back(fid_val);
 		if (change_num > *plast_cn) {
 			*plast_cn = change_num;
 		}
 		if (const_cast<IDSET *>(pgiven)->hint(rop_util_make_eid_ex(1, fid_val)) &&
 		    const_cast<IDSET *>(pseen)->hint(rop_util_make_eid_ex(1, change_num)))
 			continue;
-		sqlite3_reset(stm_insert_chg);
-		sqlite3_bind_int64(stm_insert_chg, 1, fid_val);
-		if (sqlite3_step(stm_insert_chg) != SQLITE_DONE)
-			return FALSE;
+		changes.push_back(fid_val);
 	}
-	while ((pnode = double_list_pop_front(&tmp_list)) != nullptr) {
-		if (!ics_load_folder_changes(psqlite,
-		    *static_cast<uint64_t *>(pnode->pdata), username, pgiven,
-		    pseen, pstmt, stm_insert_chg, stm_insert_exist, plast_cn))
+	for (auto subfid : tmp_list)
+		if (!ics_load_folder_changes(psqlite, subfid, username, pgiven,
+		    pseen, pstmt, changes, existence, plast_cn))
 			return FALSE;	
-	}
 	return TRUE;
 }
 
 BOOL exmdb_server_get_hierarchy_sync(const char *dir,
 	uint64_t folder_id, const char *username, const IDSET *pgiven,
 	const IDSET *pseen, FOLDER_CHANGES *pfldchgs, uint64_t *plast_cn,
-	EID_ARRAY *pgiven_fids, EID_ARRAY *pdeleted_fids)
+	EID_ARRAY *pgiven_fids, EID_ARRAY *pdeleted_fids) try
 {
-	sqlite3 *psqlite;
-	
-	/* Setup of scratch space db */
-	if (SQLITE_OK != sqlite3_open_v2(":memory:", &psqlite,
-		SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, NULL)) {
-		return FALSE;
-	}
-	auto cl_0 = make_scope_exit([&]() { sqlite3_close(psqlite); });
-	if (gx_sql_exec(psqlite, "CREATE TABLE existence "
-	    "(folder_id INTEGER PRIMARY KEY)") != SQLITE_OK)
-		return FALSE;
-	if (gx_sql_exec(psqlite, "CREATE TABLE changes "
-	    "(idx INTEGER PRIMARY KEY AUTOINCREMENT,"
-	    " folder_id INTEGER UNIQUE NOT NULL)") != SQLITE_OK)
-		return FALSE;
+	/* Scratch space */
+	std::vector<uint64_t> existence, changes;
 	auto fid_val = rop_util_get_gc_value(folder_id);
 	auto pdb = db_engine_get_db(dir);
 	if (pdb == nullptr || pdb->psqlite == nullptr)
@@ -715,34 +504,20 @@ BOOL exmdb_server_get_hierarchy_sync(const char *dir,
 	                      "SELECT folder_id, change_number FROM folders WHERE parent_id=? AND is_deleted=0");
 	if (stm_select_fld == nullptr)
 		return FALSE;
-	auto sql_transact = gx_sql_begin_trans(psqlite);
-	auto stm_insert_chg = gx_sql_prep(psqlite,
-	                      "INSERT INTO changes (folder_id) VALUES (?)");
-	if (stm_insert_chg == nullptr)
-		return FALSE;
-	auto stm_insert_exist = gx_sql_prep(psqlite, "INSERT INTO existence VALUES (?)");
-	if (stm_insert_exist == nullptr)
-		return FALSE;
 	*plast_cn = 0;
 	if (!ics_load_folder_changes(pdb->psqlite, fid_val, username, pgiven,
-	    pseen, stm_select_fld, stm_insert_chg, stm_insert_exist, plast_cn))
+	    pseen, stm_select_fld, changes, existence, plast_cn))
 		return FALSE;
 	stm_select_fld.finalize();
-	stm_insert_chg.finalize();
-	stm_insert_exist.finalize();
 	if (0 != *plast_cn) {
 		*plast_cn = rop_util_make_eid_ex(1, *plast_cn);
 	}
-	sql_transact.commit();
+	std::sort(existence.begin(), existence.end());
 	} /* section 1 */
 
 	/* Query section 2 */
 	{
-	auto stm_select_chg = gx_sql_prep(psqlite, "SELECT count(*) FROM changes");
-	if (stm_select_chg == nullptr || sqlite3_step(stm_select_chg) != SQLITE_ROW)
-		return FALSE;
-	pfldchgs->count = sqlite3_column_int64(stm_select_chg, 0);
-	stm_select_chg.finalize();
+	pfldchgs->count = changes.size();
 	if (0 != pfldchgs->count) {
 		pfldchgs->pfldchgs = cu_alloc<TPROPVAL_ARRAY>(pfldchgs->count);
 		if (NULL == pfldchgs->pfldchgs) {
@@ -757,14 +532,8 @@ BOOL exmdb_server_get_hierarchy_sync(const char *dir,
 	/* Query section 3 */
 	{
 	auto sql_transact2 = gx_sql_begin_trans(pdb->psqlite);
-	auto stm_select_chg = gx_sql_prep(psqlite,
-	                      "SELECT folder_id FROM changes ORDER BY idx ASC");
-	if (stm_select_chg == nullptr)
-		return FALSE;
 	for (size_t i = 0; i < pfldchgs->count; ++i) {
-		if (sqlite3_step(stm_select_chg) != SQLITE_ROW)
-			return FALSE;
-		auto fid_val1 = sqlite3_column_int64(stm_select_chg, 0);
+		auto fid_val1 = changes[i];
 		PROPTAG_ARRAY proptags;
 		if (!cu_get_proptags(db_table::folder_props, fid_val1,
 			pdb->psqlite, &proptags)) {
@@ -792,7 +561,6 @@ BOOL exmdb_server_get_hierarchy_sync(const char *dir,
 			return FALSE;
 		}
 	}
-	stm_select_chg.finalize();
 	sql_transact2.commit();
 	} /* section 3 */
 
@@ -800,26 +568,16 @@ BOOL exmdb_server_get_hierarchy_sync(const char *dir,
 
 	/* Query section 4 */
 	{
-	auto stm_select_exist = gx_sql_prep(psqlite, "SELECT count(*) FROM existence");
-	if (stm_select_exist == nullptr ||
-	    sqlite3_step(stm_select_exist) != SQLITE_ROW)
-		return FALSE;
-	ssize_t count = sqlite3_column_int64(stm_select_exist, 0);
-	stm_select_exist.finalize();
 	pgiven_fids->count = 0;
-	if (count <= 0) {
+	if (existence.size() == 0) {
 		pgiven_fids->pids = NULL;
 	} else {
-		pgiven_fids->pids = cu_alloc<uint64_t>(count);
+		pgiven_fids->pids = cu_alloc<uint64_t>(existence.size());
 		if (NULL == pgiven_fids->pids) {
 			return FALSE;
 		}
-		auto stm_select_ex = gx_sql_prep(psqlite, "SELECT folder_id"
-		                     " FROM existence ORDER BY folder_id DESC");
-		if (stm_select_ex == nullptr)
-			return FALSE;
-		while (sqlite3_step(stm_select_ex) == SQLITE_ROW) {
-			uint64_t fid_val = sqlite3_column_int64(stm_select_ex, 0);
+		for (auto it = existence.crbegin(); it != existence.crend(); ++it) {
+			uint64_t fid_val = *it;
 			if (0 == (fid_val & 0xFF00000000000000ULL)) {
 				pgiven_fids->pids[pgiven_fids->count++] =
 						rop_util_make_eid_ex(1, fid_val);
@@ -838,10 +596,7 @@ BOOL exmdb_server_get_hierarchy_sync(const char *dir,
 	replids.count = 0;
 	const_cast<IDSET *>(pgiven)->enum_replist(&replids, ics_enum_hierarchy_replist);
 	ENUM_PARAM enum_param;
-	enum_param.stm_exist = gx_sql_prep(psqlite, "SELECT folder_id"
-	                       " FROM existence WHERE folder_id=?");
-	if (enum_param.stm_exist == nullptr)
-		return FALSE;
+	enum_param.pexist = &existence;
 	enum_param.b_result = TRUE;
 	enum_param.pdeleted_eids = eid_array_init();
 	if (NULL == enum_param.pdeleted_eids) {
@@ -868,4 +623,7 @@ BOOL exmdb_server_get_hierarchy_sync(const char *dir,
 	eid_array_free(enum_param.pdeleted_eids);
 	} /* section 5 */
 	return TRUE;
+} catch (const std::bad_alloc &) {
+	fprintf(stderr, "E-1624: ENOMEM\n");
+	return false;
 }
@@ -0,0 +1,61 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+struct IDSET;
+
+/*
+ * Membership test over the GC values of replica 1 of an IDSET, held as
+ * a sorted vector of disjoint closed ranges. hint() resumes from where
+ * the previous lookup ended when the values come in ascending order, as
+ * they do during a scan of messages ordered by message_id, so that such
+ * a scan amounts to a merge join; other lookups use a binary search.
+ */
+struct IDSET_CACHE {
+	using range = std::pair<uint64_t, uint64_t>;
+
+	bool init(const IDSET *);
+	/* may throw std::bad_alloc */
+	void add(uint64_t low, uint64_t high) { ranges.emplace_back(low, high); }
+	void finalize();
+	bool hint(uint64_t);
+
+	std::vector<range> ranges;
+	size_t pos = 0;
+};
+
+/* sort the ranges and coalesce overlapping or adjacent ones */
+inline void IDSET_CACHE::finalize()
+{
+	std::sort(ranges.begin(), ranges.end());
+	size_t j = 0;
+	for (size_t i = 0; i < ranges.size(); ++i) {
+		if (j > 0 && (ranges[j-1].second == UINT64_MAX ||
+		    ranges[i].first <= ranges[j-1].second + 1)) {
+			ranges[j-1].second = std::max(ranges[j-1].second, ranges[i].second);
+			continue;
+		}
+		ranges[j++] = ranges[i];
+	}
+	ranges.resize(j);
+	pos = 0;
+}
+
+inline bool IDSET_CACHE::hint(uint64_t id_val)
+{
+	size_t lo = pos > 0 && id_val <= ranges[pos-1].second ? 0 : pos;
+	size_t hi = lo, step = 1;
+	/* gallop: everything before lo ends below id_val */
+	while (hi < ranges.size() && ranges[hi].second < id_val) {
+		lo = hi + 1;
+		hi += step;
+		step *= 2;
+	}
+	hi = std::min(hi, ranges.size());
+	auto it = std::lower_bound(ranges.begin() + lo, ranges.begin() + hi, id_val,
+	          [](const range &r, uint64_t v) { return r.second < v; });
+	pos = it - ranges.begin();
+	return it != ranges.end() && it->first <= id_val;
+}
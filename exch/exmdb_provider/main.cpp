@@ -32,6 +32,9 @@ static constexpr cfg_directive cfg_default_values[] = {
 	{"cache_interval", "2h", CFG_TIME, "1s"},
 	{"dbg_synthesize_content", "0"},
 	{"exrpc_debug", "0"},
+	{"exrpc_slow_threshold", "0"},
+	{"exrpc_stats_file", ""},
+	{"exrpc_stats_interval", "1min", CFG_TIME, "1s"},
 	{"enable_dam", "1", CFG_BOOL},
 	{"listen_ip", "::1"},
 	{"listen_port", "5000"},
@@ -71,14 +74,16 @@ static void console_talk(int argc, char **argv, char *result, int length)
 						 "\t%s unload <maildir>\r\n"
 						 "\t    --unload the store\r\n"
 						 "\t%s info\r\n"
-						 "\t    --print the module information";
+						 "\t    --print the module information\r\n"
+						 "\t%s stats [reset]\r\n"
+						 "\t    --print (or clear) the per-RPC latency statistics";
 
 	if (1 == argc) {
 		gx_strlcpy(result, "550 too few arguments", length);
 		return;
 	}
 	if (2 == argc && 0 == strcmp("--help", argv[1])) {
-		snprintf(result, length, help_string, argv[0], argv[0]);
+		snprintf(result, length, help_string, argv[0], argv[0], argv[0]);
 		result[length - 1] = '\0';
 		return;
 	}
@@ -93,6 +98,17 @@ static void console_talk(int argc, char **argv, char *result, int length)
 			exmdb_parser_get_param(ALIVE_ROUTER_CONNECTIONS));
 		return;
 	}
+	if (2 == argc && 0 == strcmp("stats", argv[1])) {
+		auto text = g_exrpc_stats.dump(50);
+		snprintf(result, length, "250 exmdb provider RPC statistics:\r\n%s", text.c_str());
+		return;
+	}
+	if (3 == argc && 0 == strcmp("stats", argv[1]) &&
+	    0 == strcmp("reset", argv[2])) {
+		g_exrpc_stats.reset();
+		gx_strlcpy(result, "250 statistics cleared", length);
+		return;
+	}
 	if (3 == argc && 0 == strcmp("unload", argv[1])) {
 		if (TRUE == exmdb_server_unload_store(argv[2])) {
 			gx_strlcpy(result, "250 unload store OK", length);
@@ -119,6 +135,9 @@ static bool exmdb_provider_reload(std::shared_ptr<CONFIG_FILE> pconfig)
 	}
 	try {
 		g_exrpc_debug = pconfig->get_ll("exrpc_debug");
+		g_exrpc_stats.set_slow_threshold(pconfig->get_ll("exrpc_slow_threshold"));
+		g_exrpc_stats.set_snapshot(pconfig->get_value("exrpc_stats_file"),
+			pconfig->get_ll("exrpc_stats_interval"));
 		g_dbg_synth_content = pconfig->get_ll("dbg_synthesize_content");
 		g_enable_dam = parse_bool(pconfig->get_value("enable_dam"));
 		g_mbox_contention_warning = pconfig->get_ll("mbox_contention_warning");
@@ -7,6 +7,7 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 #include <libHX/string.h>
 #include <openssl/evp.h>
 #include <openssl/md5.h>
@@ -1089,6 +1090,96 @@ BOOL exmdb_server_set_message_read_state(const char *dir,
 	return TRUE;
 }
 
+/*
+ * Bulk form of set_message_read_state: all messages are marked in a single
+ * transaction, and the commit time of each affected folder is bumped once.
+ * Messages that no longer exist are skipped.
+ */
+BOOL exmdb_server_set_messages_read_state(const char *dir,
+	const char *username, const EID_ARRAY *pmessage_ids,
+	uint8_t mark_as_read)
+{
+	BOOL b_result;
+	uint64_t nt_time;
+	uint64_t read_cn;
+	TAGGED_PROPVAL tmp_propval;
+	std::vector<std::pair<uint64_t, uint64_t>> done;
+	std::vector<uint64_t> folders;
+	
+	if (0 == pmessage_ids->count) {
+		return TRUE;
+	}
+	auto pdb = db_engine_get_db(dir);
+	if (pdb == nullptr || pdb->psqlite == nullptr)
+		return FALSE;
+	BOOL b_private = exmdb_server_check_private();
+	if (!b_private)
+		exmdb_server_set_public_username(username);
+	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
+	auto pstmt = gx_sql_prep(pdb->psqlite, b_private ?
+	             "UPDATE messages SET read_cn=? WHERE message_id=?" :
+	             "REPLACE INTO read_cns VALUES (?, ?, ?)");
+	auto pstmt1 = gx_sql_prep(pdb->psqlite, "SELECT parent_fid "
+	              "FROM messages WHERE message_id=?");
+	if (pstmt == nullptr || pstmt1 == nullptr) {
+		return FALSE;
+	}
+	try {
+		done.reserve(pmessage_ids->count);
+		for (size_t i = 0; i < pmessage_ids->count; ++i) {
+			auto mid_val = rop_util_get_gc_value(pmessage_ids->pids[i]);
+			sqlite3_bind_int64(pstmt1, 1, mid_val);
+			if (SQLITE_ROW != sqlite3_step(pstmt1)) {
+				sqlite3_reset(pstmt1);
+				continue;
+			}
+			uint64_t fid_val = sqlite3_column_int64(pstmt1, 0);
+			sqlite3_reset(pstmt1);
+			if (FALSE == common_util_allocate_cn(pdb->psqlite, &read_cn)) {
+				return FALSE;
+			}
+			common_util_set_message_read(pdb->psqlite,
+				mid_val, mark_as_read);
+			if (b_private) {
+				sqlite3_bind_int64(pstmt, 1, read_cn);
+				sqlite3_bind_int64(pstmt, 2, mid_val);
+			} else {
+				sqlite3_bind_int64(pstmt, 1, mid_val);
+				sqlite3_bind_text(pstmt, 2, username, -1, SQLITE_STATIC);
+				sqlite3_bind_int64(pstmt, 3, read_cn);
+			}
+			if (SQLITE_DONE != sqlite3_step(pstmt)) {
+				return FALSE;
+			}
+			sqlite3_reset(pstmt);
+			done.emplace_back(fid_val, mid_val);
+			if (std::find(folders.cbegin(), folders.cend(),
+			    fid_val) == folders.cend())
+				folders.push_back(fid_val);
+		}
+	} catch (const std::bad_alloc &) {
+		fprintf(stderr, "E-1618: ENOMEM\n");
+		return FALSE;
+	}
+	pstmt.finalize();
+	pstmt1.finalize();
+	nt_time = rop_util_current_nttime();
+	tmp_propval.proptag = PR_LOCAL_COMMIT_TIME_MAX;
+	tmp_propval.pvalue = &nt_time;
+	for (auto fid_val : folders)
+		cu_set_property(db_table::folder_props,
+			fid_val, 0, pdb->psqlite, &tmp_propval, &b_result);
+	sql_transact.commit();
+	for (const auto &e : done) {
+		db_engine_proc_dynamic_event(pdb,
+			0, DYNAMIC_EVENT_MODIFY_MESSAGE,
+			e.first, e.second, 0);
+		db_engine_notify_message_modification(
+			pdb, e.first, e.second);
+	}
+	return TRUE;
+}
+
 /* if folder_id is 0, it means embedded message */
 BOOL exmdb_server_allocate_message_id(const char *dir,
 	uint64_t folder_id, uint64_t *pmessage_id)
@@ -3045,7 +3136,6 @@ static BOOL message_forward_message(const char *from_address,
 	char tmp_path[256];
 	struct tm time_buff;
 	char mid_string[128];
-	struct stat node_stat;
 	DOUBLE_LIST rcpt_list;
 	char tmp_buff[64*1024];
 	DOUBLE_LIST_NODE *pnode;
@@ -3066,23 +3156,17 @@ static BOOL message_forward_message(const char *from_address,
 		    static_cast<EXT_RECIPIENT_BLOCK *>(pblock), &rcpt_list))
 			return FALSE;
 	}
-	std::unique_ptr<char[], stdlib_delete> pbuff;
+	mapped_file pbuff;
 	MAIL imail;
 	if (NULL != pdigest) {
 		get_digest(pdigest, "file", mid_string, arsizeof(mid_string));
 		snprintf(tmp_path, arsizeof(tmp_path), "%s/eml/%s",
 			exmdb_server_get_dir(), mid_string);
 		wrapfd fd = open(tmp_path, O_RDONLY);
-		if (fd.get() < 0 || fstat(fd.get(), &node_stat) != 0)
+		if (fd.get() < 0 || pbuff.map(fd.get()) != 0)
 			return false;
-		pbuff.reset(me_alloc<char>(node_stat.st_size));
-		if (NULL == pbuff) {
-			return FALSE;
-		}
-		if (read(fd.get(), pbuff.get(), node_stat.st_size) != node_stat.st_size)
-			return FALSE;
 		imail = MAIL(common_util_get_mime_pool());
-		if (!imail.retrieve(pbuff.get(), node_stat.st_size))
+		if (!imail.retrieve(pbuff.data(), pbuff.size()))
 			return FALSE;
 		auto pmime = imail.get_head();
 		if (NULL == pmime) {
@@ -4587,6 +4671,96 @@ BOOL exmdb_server_write_message(const char *dir, const char *account,
 	return TRUE;
 }
 
+/*
+ * Bulk variant of exmdb_server_write_message for importers: all messages go
+ * into @folder_id and are committed in a single transaction. PidTagMid and
+ * PidTagChangeNumber may be absent, in which case they (and the change key
+ * and PCL) are allocated here. If any message cannot be written, nothing is.
+ */
+BOOL exmdb_server_write_messages(const char *dir, const char *account,
+    uint32_t cpid, uint64_t folder_id, uint32_t count,
+    const MESSAGE_CONTENT *pmsgctnt, gxerr_t *pe_result)
+{
+	auto pdb = db_engine_get_db(dir);
+	if (pdb == nullptr || pdb->psqlite == nullptr)
+		return FALSE;
+	if (cu_check_msgsize_overflow(pdb->psqlite, PR_STORAGE_QUOTA_LIMIT) ||
+	    common_util_check_msgcnt_overflow(pdb->psqlite)) {
+		*pe_result = GXERR_OVER_QUOTA;
+		return TRUE;
+	}
+	auto fid_val = rop_util_get_gc_value(folder_id);
+	auto nt_time = rop_util_current_nttime();
+	std::vector<std::pair<uint64_t, bool>> written;
+	try {
+		written.reserve(count);
+	} catch (const std::bad_alloc &) {
+		fprintf(stderr, "E-1615: ENOMEM\n");
+		return FALSE;
+	}
+	{
+	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
+	for (size_t i = 0; i < count; ++i) {
+		auto &ctnt = pmsgctnt[i];
+		/*
+		 * Like write_message, which requires the caller to supply them,
+		 * change number, change key and PCL come either all from the
+		 * client or all from message_write_message. A lone change key
+		 * or PCL would be stored next to the generated ones.
+		 */
+		auto n_chg = ctnt.proplist.has(PidTagChangeNumber) +
+		             ctnt.proplist.has(PR_CHANGE_KEY) +
+		             ctnt.proplist.has(PR_PREDECESSOR_CHANGE_LIST);
+		if (n_chg != 0 && n_chg != 3) {
+			*pe_result = GXERR_CALL_FAILED;
+			return TRUE;
+		}
+		bool b_exist = false;
+		auto pmid = ctnt.proplist.get<uint64_t>(PidTagMid);
+		if (pmid != nullptr) {
+			uint64_t fid_val1 = 0;
+			if (!common_util_get_message_parent_folder(pdb->psqlite,
+			    rop_util_get_gc_value(*pmid), &fid_val1))
+				return FALSE;
+			if (fid_val1 != 0) {
+				if (fid_val1 != fid_val) {
+					*pe_result = GXERR_CALL_FAILED;
+					return TRUE;
+				}
+				b_exist = true;
+			}
+		}
+		auto pvalue = ctnt.proplist.get<uint64_t>(PR_LAST_MODIFICATION_TIME);
+		if (pvalue != nullptr)
+			*pvalue = nt_time;
+		uint64_t mid_val = 0;
+		if (!message_write_message(FALSE, pdb->psqlite, account, cpid,
+		    FALSE, fid_val, &ctnt, &mid_val))
+			return FALSE;
+		if (mid_val == 0) {
+			/* auto rollback at end of scope */
+			*pe_result = GXERR_CALL_FAILED;
+			return TRUE;
+		}
+		written.emplace_back(mid_val, b_exist);
+	}
+	sql_transact.commit();
+	}
+	*pe_result = GXERR_SUCCESS;
+	for (const auto &[mid_val, b_exist] : written) {
+		if (b_exist) {
+			db_engine_proc_dynamic_event(pdb, cpid,
+				DYNAMIC_EVENT_MODIFY_MESSAGE, fid_val, mid_val, 0);
+			db_engine_notify_message_modification(pdb, fid_val, mid_val);
+		} else {
+			db_engine_proc_dynamic_event(pdb, cpid,
+				DYNAMIC_EVENT_NEW_MESSAGE, fid_val, mid_val, 0);
+			db_engine_notify_message_creation(pdb, fid_val, mid_val);
+		}
+	}
+	return TRUE;
+}
+
 BOOL exmdb_server_read_message(const char *dir, const char *username,
 	uint32_t cpid, uint64_t message_id, MESSAGE_CONTENT **ppmsgctnt)
 {
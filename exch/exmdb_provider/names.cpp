@@ -139,13 +139,15 @@ static constexpr const char *exmdb_rpc_names[] = {
 	nullptr,
 	nullptr,
 	E(UNLOAD_STORE),
+	E(WRITE_MESSAGES),
+	E(SET_MESSAGES_READ_STATE),
 };
 #undef E
 #undef EXP
 
 const char *exmdb_rpc_idtoname(unsigned int i)
 {
-	static_assert(GX_ARRAY_SIZE(exmdb_rpc_names) == exmdb_callid::UNLOAD_STORE + 1);
+	static_assert(GX_ARRAY_SIZE(exmdb_rpc_names) == exmdb_callid::SET_MESSAGES_READ_STATE + 1);
 	const char *s = i < GX_ARRAY_SIZE(exmdb_rpc_names) ? exmdb_rpc_names[i] : nullptr;
 	return znul(s);
 }
@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <mutex>
 #include <utility>
@@ -13,6 +15,59 @@
 #include <unistd.h>
 #include <ctime>
 #include <poll.h>
+#include <sys/uio.h>
+
+/*
+ * Datagrams are written back-to-back, up to NOTIFY_WINDOW of them (and
+ * at most NOTIFY_BATCH_BYTES) per writev, and the per-datagram acks are
+ * then collected in one go. The frames themselves are unchanged, so
+ * existing listeners (midb, zcore, exmdb_client) need no adjustment.
+ */
+#define NOTIFY_WINDOW 64
+#define NOTIFY_BATCH_BYTES 0x10000
+/* how far back in the queue to look for an equivalent pending datagram */
+#define NOTIFY_COALESCE_SPAN 32
+
+static bool notification_agent_same(const BINARY &a, const BINARY &b)
+{
+	return a.cb == b.cb && memcmp(a.pb, b.pb, a.cb) == 0;
+}
+
+/*
+ * Drop events made redundant by the one being queued. Only datagrams
+ * that have not been picked up by the sender yet are considered.
+ *
+ * - A *_TABLE_CHANGED makes the listener reload the table, so an identical
+ *   pending one is removed and the new one goes to the tail, after any row
+ *   events it supersedes.
+ * - A *_ROW_MODIFIED identical to the queue tail carries no new info.
+ */
+static bool notification_agent_coalesce(std::list<BINARY> &list,
+    uint8_t type, const BINARY &bin)
+{
+	switch (type) {
+	case DB_NOTIFY_TYPE_HIERARCHY_TABLE_CHANGED:
+	case DB_NOTIFY_TYPE_CONTENT_TABLE_CHANGED:
+	case DB_NOTIFY_TYPE_SEARCH_TABLE_CHANGED: {
+		size_t span = 0;
+		for (auto it = list.rbegin(); it != list.rend() &&
+		     span < NOTIFY_COALESCE_SPAN; ++it, ++span) {
+			if (!notification_agent_same(*it, bin))
+				continue;
+			free(it->pb);
+			list.erase(std::next(it).base());
+			break;
+		}
+		return false;
+	}
+	case DB_NOTIFY_TYPE_HIERARCHY_TABLE_ROW_MODIFIED:
+	case DB_NOTIFY_TYPE_CONTENT_TABLE_ROW_MODIFIED:
+	case DB_NOTIFY_TYPE_SEARCH_TABLE_ROW_MODIFIED:
+		return list.size() > 0 && notification_agent_same(list.back(), bin);
+	default:
+		return false;
+	}
+}
 
 void notification_agent_backward_notify(const char *remote_id,
     const DB_NOTIFY_DATAGRAM *pnotify)
@@ -24,94 +79,112 @@ void notification_agent_backward_notify(const char *remote_id,
 		return;
 	}
 	auto prouter = exmdb_parser_get_router(remote_id);
-	if (NULL == prouter) {
+	if (prouter == nullptr || prouter->b_stop)
 		return;
-	}
 	BINARY bin{};
-	if (exmdb_ext_push_db_notify(pnotify, &bin) != EXT_ERR_SUCCESS) {
-		exmdb_parser_put_router(std::move(prouter));
-		return;	
-	}
+	if (exmdb_ext_push_db_notify(pnotify, &bin) != EXT_ERR_SUCCESS)
+		return;
 	try {
 		std::unique_lock rt_hold(prouter->lock);
+		if (notification_agent_coalesce(prouter->datagram_list,
+		    pnotify->db_notify.type, bin)) {
+			free(bin.pb);
+			return;
+		}
 		prouter->datagram_list.push_back(bin);
 	} catch (...) {
 		free(bin.pb);
 		return;
 	}
 	prouter->waken_cond.notify_one();
-	exmdb_parser_put_router(std::move(prouter));
 }
 
-static BOOL notification_agent_read_response(std::shared_ptr<ROUTER_CONNECTION> prouter)
+static BOOL notification_agent_read_response(ROUTER_CONNECTION &rt,
+    size_t count)
 {
-	int tv_msec;
-	uint8_t resp_code;
+	uint8_t resp_code[NOTIFY_WINDOW];
 	struct pollfd pfd_read;
 	
-	tv_msec = SOCKET_TIMEOUT * 1000;
-	pfd_read.fd = prouter->sockd;
+	pfd_read.fd = rt.sockd;
 	pfd_read.events = POLLIN|POLLPRI;
-	if (1 != poll(&pfd_read, 1, tv_msec) ||
-		1 != read(prouter->sockd, &resp_code, 1) ||
-	    resp_code != exmdb_response::SUCCESS)
-		return FALSE;
+	while (count > 0) {
+		if (poll(&pfd_read, 1, SOCKET_TIMEOUT * 1000) != 1)
+			return FALSE;
+		auto ret = read(rt.sockd, resp_code, std::min(count, sizeof(resp_code)));
+		if (ret <= 0)
+			return FALSE;
+		if (std::any_of(resp_code, resp_code + ret,
+		    [](uint8_t c) { return c != exmdb_response::SUCCESS; }))
+			return FALSE;
+		count -= ret;
+	}
 	return TRUE;
 }
 
+/* Send one window's worth of queued datagrams; false on connection error. */
+static bool notification_agent_send_batch(ROUTER_CONNECTION &rt,
+    std::list<BINARY> &batch)
+{
+	struct iovec iov[NOTIFY_WINDOW];
+	size_t count = 0, total = 0;
+	for (const auto &bin : batch) {
+		iov[count].iov_base = bin.pb;
+		iov[count++].iov_len = bin.cb;
+		total += bin.cb;
+	}
+	auto ret = writev(rt.sockd, iov, count);
+	for (auto &&bin : batch)
+		free(bin.pb);
+	batch.clear();
+	return ret >= 0 && static_cast<size_t>(ret) == total &&
+	       notification_agent_read_response(rt, count);
+}
+
 void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&prouter)
 {
 	uint32_t ping_buff;
+	std::list<BINARY> batch;
 	
 	while (!prouter->b_stop) {
-		BINARY dg;
 		std::unique_lock cn_hold(prouter->cond_mutex);
 		static_assert(SOCKET_TIMEOUT >= 3, "integer underflow");
 		prouter->waken_cond.wait_for(cn_hold, std::chrono::seconds(SOCKET_TIMEOUT - 3));
 		cn_hold.unlock();
 
-		std::unique_lock rt_hold(prouter->lock);
-		if (prouter->datagram_list.size() > 0) {
-			dg = prouter->datagram_list.front();
-			prouter->datagram_list.pop_front();
-		} else {
-			dg.cb = 0;
-			dg.pb = nullptr;
-		}
-		rt_hold.unlock();
-		if (dg.pb == nullptr) {
-			ping_buff = 0;
-			if (sizeof(uint32_t) != write(prouter->sockd,
-				&ping_buff, sizeof(uint32_t)) || FALSE ==
-				notification_agent_read_response(prouter)) {
-				goto EXIT_THREAD;
-			}
-			continue;
-		}
-		while (dg.pb != nullptr) {
-			auto bytes_written = write(prouter->sockd, dg.pb, dg.cb);
-			free(dg.pb);
-			if (bytes_written != dg.cb ||
-			    !notification_agent_read_response(prouter))
+		bool sent = false;
+		while (true) {
+			std::unique_lock rt_hold(prouter->lock);
+			size_t bytes = 0;
+			auto &dl = prouter->datagram_list;
+			auto end = dl.begin();
+			for (size_t n = 0; end != dl.end() && n < NOTIFY_WINDOW &&
+			     (n == 0 || bytes + end->cb <= NOTIFY_BATCH_BYTES); ++n, ++end)
+				bytes += end->cb;
+			batch.splice(batch.end(), dl, dl.begin(), end);
+			rt_hold.unlock();
+			if (batch.empty())
+				break;
+			if (!notification_agent_send_batch(*prouter, batch))
 				goto EXIT_THREAD;
-			std::lock_guard rt_lock(prouter->lock);
-			if (prouter->datagram_list.size() > 0) {
-				dg = prouter->datagram_list.front();
-				prouter->datagram_list.pop_front();
-			} else {
-				dg.cb = 0;
-				dg.pb = nullptr;
-			}
+			sent = true;
 		}
+		if (sent)
+			continue;
+		ping_buff = 0;
+		if (sizeof(uint32_t) != write(prouter->sockd,
+		    &ping_buff, sizeof(uint32_t)) ||
+		    !notification_agent_read_response(*prouter, 1))
+			goto EXIT_THREAD;
 	}
  EXIT_THREAD:
-	while (FALSE == exmdb_parser_remove_router(prouter)) {
-		sleep(1);
-	}
+	prouter->b_stop = true;
+	exmdb_parser_remove_router(prouter);
+	std::unique_lock rt_hold(prouter->lock);
 	close(prouter->sockd);
 	prouter->sockd = -1;
 	for (auto &&bin : prouter->datagram_list)
 		free(bin.pb);
 	prouter->datagram_list.clear();
+	rt_hold.unlock();
 	pthread_exit(nullptr);
 }
@@ -1899,9 +1899,11 @@ static void table_truncate_string(uint32_t cpid, char *pstring)
 	pout = tmp_buff;
 	memset(tmp_buff, 0, sizeof(tmp_buff));
 	snprintf(tmp_charset, arsizeof(tmp_charset), "%s//IGNORE", charset);
-	conv_id = iconv_open(tmp_charset, charset);
+	conv_id = iconv_cached(tmp_charset, charset);
+	if ((iconv_t)-1 == conv_id) {
+		return;
+	}
 	iconv(conv_id, &pin, &in_len, &pout, &out_len);
-	iconv_close(conv_id);
 	if (out_len < sizeof(tmp_buff)) {
 		strcpy(pstring, tmp_buff);
 	}
@@ -11,6 +11,7 @@
 #include <gromox/contexts_pool.hpp>
 #include <gromox/threads_pool.hpp>
 #include "http_parser.h"
+#include "mod_fastcgi.h"
 #include <gromox/lib_buffer.hpp>
 #include "resource.h"
 #include "service.h"
@@ -89,16 +90,32 @@ BOOL cmd_handler_http_control(int argc, char** argv)
 		support_ssl             = http_parser_get_param(HTTP_SUPPORT_SSL);
 		itvltoa(time_out, str_timeout);
 		itvltoa(block_interval_auths, str_authblock);
+		FASTCGI_STATS fcgi;
+		mod_fastcgi_get_stats(&fcgi);
+		char str_fcgi_idle[64];
+		itvltoa(fcgi.pool_idle_timeout, str_fcgi_idle);
 		console_server_reply_to_client("250 http information of %s:\r\n"
 			"\tsession time-out                     %s\r\n"
 			"\tauthentication times                 %d\r\n"
 			"\tauth failure block interval          %s\r\n"
-			"\tsupport SSL?                         %s",
+			"\tsupport SSL?                         %s\r\n"
+			"\tfastcgi pool size                    %u\r\n"
+			"\tfastcgi pool idle time-out           %s\r\n"
+			"\tfastcgi idle connections             %u\r\n"
+			"\tfastcgi requests                     %llu\r\n"
+			"\tfastcgi connects                     %llu\r\n"
+			"\tfastcgi connection reuses            %llu\r\n"
+			"\tfastcgi connections discarded        %llu",
 			resource_get_string("HOST_ID"),
 			str_timeout,
 			auth_times,
 			str_authblock,
-			support_ssl == FALSE ? "FALSE" : "TRUE");
+			support_ssl == FALSE ? "FALSE" : "TRUE",
+			fcgi.pool_size, str_fcgi_idle, fcgi.idle,
+			static_cast<unsigned long long>(fcgi.requests),
+			static_cast<unsigned long long>(fcgi.connects),
+			static_cast<unsigned long long>(fcgi.reuses),
+			static_cast<unsigned long long>(fcgi.discards));
 		return TRUE;
 	}
 	if (argc < 4) {
@@ -880,7 +880,7 @@ static int htp_delegate_fcgi(HTTP_CONTEXT *pcontext)
 	pcontext->total_length = 0;
 
 	if (FALSE == mod_fastcgi_write_request(pcontext)) {
-		http_5xx(pcontext);
+		http_5xx(pcontext, "Bad FastCGI Gateway", 502);
 		return X_LOOP;
 	}
 	if (!mod_fastcgi_check_end_of_read(pcontext)) {
@@ -1121,13 +1121,17 @@ static int htparse_wrrep_nobuf(HTTP_CONTEXT *pcontext)
 			http_5xx(pcontext, "Bad FastCGI Gateway", 502);
 			return X_LOOP;
 		}
-	} else if (mod_cache_check_caching(pcontext) &&
-	    !mod_cache_read_response(pcontext)) {
-		if (FALSE == mod_cache_check_responded(pcontext)) {
+	} else if (mod_cache_check_caching(pcontext)) {
+		if (mod_cache_read_response(pcontext)) {
+			/* mod_cache may hand out file content to send as-is */
+			if (pcontext->write_buff != nullptr) {
+				pcontext->write_offset = 0;
+				return X_RUNOFF;
+			}
+		} else if (FALSE == mod_cache_check_responded(pcontext)) {
 			http_5xx(pcontext);
 			return X_LOOP;
-		}
-		if (pcontext->stream_out.get_total_length() == 0) {
+		} else if (pcontext->stream_out.get_total_length() == 0) {
 			if (TRUE == pcontext->b_close) {
 				return X_RUNOFF;
 			}
@@ -1362,7 +1366,7 @@ static int htparse_rdbody_nochan2(HTTP_CONTEXT *pcontext)
 			return PROCESS_CONTINUE;
 		} else if (NULL != pcontext->pfast_context) {
 			if (FALSE == mod_fastcgi_write_request(pcontext)) {
-				http_5xx(pcontext);
+				http_5xx(pcontext, "Bad FastCGI Gateway", 502);
 				return X_LOOP;
 			}
 			if (!mod_fastcgi_check_end_of_read(pcontext)) {
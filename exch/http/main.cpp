@@ -116,15 +116,17 @@ int main(int argc, const char **argv) try
 
 	static constexpr cfg_directive cfg_default_values[] = {
 		{"block_interval_auths", "1min", CFG_TIME, "1s"},
+		{"cache_size", "64M", CFG_SIZE},
 		{"config_file_path", PKGSYSCONFDIR "/http:" PKGSYSCONFDIR},
 		{"console_server_ip", "::1"},
 		{"console_server_port", "8899"},
 		{"context_average_mem", "256K", CFG_SIZE, "192K"},
 		{"context_num", "400", CFG_SIZE},
 		{"data_file_path", PKGDATADIR "/http:" PKGDATADIR},
-		{"fastcgi_cache_size", "256K", CFG_SIZE, "64K"},
 		{"fastcgi_exec_timeout", "10min", CFG_TIME, "1min"},
 		{"fastcgi_max_size", "4M", CFG_SIZE, "64K"},
+		{"fastcgi_pool_idle_timeout", "30s", CFG_TIME, "1s"},
+		{"fastcgi_pool_size", "4", CFG_SIZE},
 		{"hpm_cache_size", "512K", CFG_SIZE, "64K"},
 		{"hpm_max_size", "4M", CFG_SIZE, "64K"},
 		{"hpm_plugin_ignore_errors", "false", CFG_BOOL},
@@ -297,10 +299,6 @@ int main(int argc, const char **argv) try
 	printf("[console_server]: console server address is [%s]:%hu\n",
 	       *console_server_ip == '\0' ? "*" : console_server_ip, console_server_port);
 	
-	uint64_t fastcgi_cache_size = g_config_file->get_ll("fastcgi_cache_size");
-	bytetoa(fastcgi_cache_size, temp_buff);
-	printf("[mod_fastcgi]: fastcgi cache size is %s\n", temp_buff);
-	
 	uint64_t fastcgi_max_size = g_config_file->get_ll("fastcgi_max_size");
 	bytetoa(fastcgi_max_size, temp_buff);
 	printf("[mod_fastcgi]: fastcgi maximum size is %s\n", temp_buff);
@@ -308,6 +306,11 @@ int main(int argc, const char **argv) try
 	int fastcgi_exec_timeout = g_config_file->get_ll("fastcgi_exec_timeout");
 	itvltoa(fastcgi_exec_timeout, temp_buff);
 	printf("[http]: fastcgi excution time out is %s\n", temp_buff);
+	unsigned int fastcgi_pool_size = g_config_file->get_ll("fastcgi_pool_size");
+	int fastcgi_pool_idle_timeout = g_config_file->get_ll("fastcgi_pool_idle_timeout");
+	itvltoa(fastcgi_pool_idle_timeout, temp_buff);
+	printf("[mod_fastcgi]: keeping up to %u idle connections per socket for %s\n",
+	       fastcgi_pool_size, temp_buff);
 	uint16_t listen_port = g_config_file->get_ll("listen_port");
 	unsigned int mss_size = g_config_file->get_ll("tcp_max_segment");
 	listener_init(listen_port, listen_ssl_port, mss_size);
@@ -422,8 +425,8 @@ int main(int argc, const char **argv) try
 		printf("[system]: failed to run mod rewrite\n");
 		return EXIT_FAILURE;
 	}
-	mod_fastcgi_init(context_num, fastcgi_cache_size,
-		fastcgi_max_size, fastcgi_exec_timeout); 
+	mod_fastcgi_init(context_num, fastcgi_max_size, fastcgi_exec_timeout,
+		fastcgi_pool_size, fastcgi_pool_idle_timeout);
  
 	if (0 != mod_fastcgi_run()) { 
 		printf("[system]: failed to run mod fastcgi\n");
@@ -431,12 +434,11 @@ int main(int argc, const char **argv) try
 	}
 	auto cleanup_18 = make_scope_exit(mod_fastcgi_stop);
 
-	mod_cache_init(context_num);
+	mod_cache_init(context_num, g_config_file->get_ll("cache_size"));
 	if (0 != mod_cache_run()) {
 		printf("[system]: failed to run mod cache\n");
 		return EXIT_FAILURE;
 	}
-	auto cleanup_19 = make_scope_exit(mod_cache_free);
 	auto cleanup_20 = make_scope_exit(mod_cache_stop);
 
 	http_parser_init(context_num, http_conn_timeout,
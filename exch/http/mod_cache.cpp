@@ -2,13 +2,18 @@
 // SPDX-FileCopyrightText: 2021 grommunio GmbH
 // This file is part of Gromox.
 #include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <libHX/string.h>
@@ -17,35 +22,61 @@
 #include <gromox/fileio.h>
 #include <gromox/util.hpp>
 #include <gromox/paths.h>
-#include <gromox/str_hash.hpp>
 #include "resource.h"
 #include "mod_cache.h"
 #include <gromox/list_file.hpp>
 #include <gromox/mail_func.hpp>
-#include <gromox/double_list.hpp>
 #include "http_parser.h"
 #include "system_services.h"
+#include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctime>
-#define HASH_GROWING_NUM			1000
+#define CACHE_SHARDS				16
+
+/* largest piece of a file handed to one write()/SSL_write() */
+#define SEGMENT_SIZE				0x40000
 
 #define BOUNDARY_STRING				"00000000000000000001"
 
 using namespace gromox;
 
 namespace {
+
+/*
+ * One file plus the response header fields that only depend on it. Files
+ * that fit the cache are read into @data; in-flight responses hold a
+ * reference, so eviction or invalidation never frees the buffer under a
+ * writer. Larger files are not retained and keep @fd open instead, to be
+ * read piecewise while sending; if such a file shrinks meanwhile, the
+ * response is cut short and the connection closed.
+ */
 struct CACHE_ITEM {
-	DOUBLE_LIST_NODE node;
-	char extention[16];
-	DATA_BLOB blob;
-	ino_t ino;
-	time_t mtime;
-	BOOL b_expired;
-	int reference;
+	CACHE_ITEM() = default;
+	NOMOVE(CACHE_ITEM);
+
+	std::string path;
+	std::string content_type;
+	std::unique_ptr<uint8_t[]> data;
+	wrapfd fd{-1};
+	uint32_t length = 0;
+	ino_t ino = 0;
+	time_t mtime = 0;
+	bool b_watched = false;
+	char etag[64]{}, last_modified[64]{};
+};
+using cache_item_ptr = std::shared_ptr<CACHE_ITEM>;
+
+struct CACHE_SHARD {
+	std::mutex lock;
+	/* most recently used at the front */
+	std::list<cache_item_ptr> lru;
+	std::unordered_map<std::string, std::list<cache_item_ptr>::iterator> index;
+	uint64_t bytes = 0;
 };
 
 struct RANGE {
@@ -54,13 +85,14 @@ struct RANGE {
 };
 
 struct CACHE_CONTEXT {
-	CACHE_ITEM *pitem;
-	BOOL b_header;
-	uint32_t offset;
-	uint32_t until;
-	int range_pos;
-	int range_num;
-	RANGE *prange;
+	cache_item_ptr pitem;
+	BOOL b_header = false;
+	uint32_t offset = 0;
+	uint32_t until = 0;
+	size_t range_pos = 0;
+	std::vector<RANGE> ranges;
+	/* staging buffer for items served by pread */
+	std::unique_ptr<uint8_t[]> chunk;
 };
 
 struct DIRECTORY_NODE {
@@ -70,84 +102,154 @@ struct DIRECTORY_NODE {
 }
 
 static int g_context_num;
+static uint64_t g_shard_limit;
+static int g_inotify_fd = -1;
 static gromox::atomic_bool g_notify_stop;
 static pthread_t g_scan_tid;
-static DOUBLE_LIST g_item_list;
-static std::mutex g_hash_lock;
+static std::mutex g_watch_lock;
+static std::unordered_map<int, std::string> g_watch_list;
 static std::vector<DIRECTORY_NODE> g_directory_list;
-static std::unique_ptr<STR_HASH_TABLE> g_cache_hash;
+static CACHE_SHARD g_cache_shards[CACHE_SHARDS];
+/* bumped by every invalidation, so that a load racing one is not kept */
+static std::atomic<uint64_t> g_inval_gen;
 static CACHE_CONTEXT *g_context_list;
 
+static CACHE_SHARD &mod_cache_shard(const std::string &path)
+{
+	return g_cache_shards[std::hash<std::string>{}(path) % CACHE_SHARDS];
+}
 
-static void *mod_cache_scanwork(void *pparam)
+static cache_item_ptr mod_cache_lookup(const std::string &path)
 {
-	int count;
-	char tmp_key[1024];
-	CACHE_ITEM *pitem;
-	CACHE_ITEM **ppitem;
-	struct stat node_stat;
-	
-	count = 0;
-	while (!g_notify_stop) {
-		count ++;
-		if (count < 600) {
-			sleep(1);
-			continue;
-		}
-		std::lock_guard hhold(g_hash_lock);
-		auto iter = g_cache_hash->make_iter();
-		for (str_hash_iter_begin(iter); !str_hash_iter_done(iter);
-			str_hash_iter_forward(iter)) {
-			ppitem = static_cast<CACHE_ITEM **>(str_hash_iter_get_value(iter, tmp_key));
-			pitem = *ppitem;
-			if (0 != pitem->reference) {
-				continue;
-			}
-			if (0 == stat(tmp_key, &node_stat) &&
-				0 != S_ISREG(node_stat.st_mode) &&
-				node_stat.st_ino == pitem->ino &&
-				node_stat.st_size == pitem->blob.length &&
-				node_stat.st_mtime == pitem->mtime) {
-				continue;
-			}
-			str_hash_iter_remove(iter);
-			free(pitem->blob.data);
-			free(pitem);
+	auto &shard = mod_cache_shard(path);
+	std::lock_guard hold(shard.lock);
+	auto it = shard.index.find(path);
+	if (it == shard.index.end())
+		return nullptr;
+	shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+	return *it->second;
+}
+
+static void mod_cache_drop(CACHE_SHARD &shard,
+    std::list<cache_item_ptr>::iterator it)
+{
+	shard.bytes -= (*it)->length;
+	shard.index.erase((*it)->path);
+	shard.lru.erase(it);
+}
+
+static void mod_cache_invalidate(const std::string &path)
+{
+	++g_inval_gen;
+	auto &shard = mod_cache_shard(path);
+	std::lock_guard hold(shard.lock);
+	auto it = shard.index.find(path);
+	if (it != shard.index.end())
+		mod_cache_drop(shard, it->second);
+}
+
+/* Drop everything below @dir, or everything at all if @dir is empty. */
+static void mod_cache_invalidate_dir(const std::string &dir)
+{
+	++g_inval_gen;
+	for (auto &shard : g_cache_shards) {
+		std::lock_guard hold(shard.lock);
+		for (auto it = shard.lru.begin(); it != shard.lru.end(); ) {
+			auto next = std::next(it);
+			if (dir.empty() || (strncmp((*it)->path.c_str(),
+			    dir.c_str(), dir.size()) == 0 &&
+			    (*it)->path[dir.size()] == '/'))
+				mod_cache_drop(shard, it);
+			it = next;
 		}
-		str_hash_iter_free(iter);
-		count = 0;
 	}
-	return nullptr;
 }
 
-static BOOL mod_cache_enlarge_hash()
+static void mod_cache_insert(const cache_item_ptr &pitem)
 {
-	void *ptmp_value;
-	char tmp_key[1024];
-	
-	auto phash = STR_HASH_TABLE::create(g_cache_hash->capacity +
-		HASH_GROWING_NUM, sizeof(CACHE_ITEM*), NULL);
-	if (NULL == phash) {
-		return FALSE;
+	auto &shard = mod_cache_shard(pitem->path);
+	std::lock_guard hold(shard.lock);
+	auto it = shard.index.find(pitem->path);
+	if (it != shard.index.end())
+		mod_cache_drop(shard, it->second);
+	while (shard.lru.size() > 0 && shard.bytes + pitem->length > g_shard_limit)
+		mod_cache_drop(shard, std::prev(shard.lru.end()));
+	shard.lru.push_front(pitem);
+	shard.index.emplace(pitem->path, shard.lru.begin());
+	shard.bytes += pitem->length;
+}
+
+/*
+ * Watch the directory containing @path, so that changes to the file
+ * evict its entry. Without a watch, hits fall back to a stat comparison.
+ */
+static bool mod_cache_watch(const std::string &path)
+{
+	if (g_inotify_fd < 0)
+		return false;
+	auto pos = path.rfind('/');
+	if (pos == path.npos)
+		return false;
+	auto dir = path.substr(0, pos);
+	auto wd = inotify_add_watch(g_inotify_fd, dir.c_str(),
+	          IN_ATTRIB | IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE |
+	          IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+	          IN_DELETE_SELF | IN_MOVE_SELF);
+	if (wd < 0)
+		return false;
+	std::lock_guard hold(g_watch_lock);
+	g_watch_list.emplace(wd, std::move(dir));
+	return true;
+}
+
+static void mod_cache_handle_event(const struct inotify_event *ev)
+{
+	if (ev->mask & IN_Q_OVERFLOW) {
+		mod_cache_invalidate_dir({});
+		return;
 	}
-	auto iter = g_cache_hash->make_iter();
-	for (str_hash_iter_begin(iter); !str_hash_iter_done(iter);
-		str_hash_iter_forward(iter)) {
-		ptmp_value = str_hash_iter_get_value(iter, tmp_key);
-		phash->add(tmp_key, ptmp_value);
+	std::string dir;
+	{
+		std::lock_guard hold(g_watch_lock);
+		auto it = g_watch_list.find(ev->wd);
+		if (it == g_watch_list.end())
+			return;
+		dir = it->second;
+		if (ev->mask & IN_IGNORED)
+			g_watch_list.erase(it);
+	}
+	if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+		mod_cache_invalidate_dir(dir);
+	else if (ev->len > 0)
+		mod_cache_invalidate(dir + "/" + ev->name);
+}
+
+static void *mod_cache_scanwork(void *pparam)
+{
+	alignas(struct inotify_event) char buf[16384];
+	
+	while (!g_notify_stop) {
+		struct pollfd pfd = {g_inotify_fd, POLLIN, 0};
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		auto len = read(g_inotify_fd, buf, sizeof(buf));
+		if (len <= 0)
+			continue;
+		for (ssize_t ofs = 0; ofs < len; ) {
+			auto ev = reinterpret_cast<const struct inotify_event *>(buf + ofs);
+			mod_cache_handle_event(ev);
+			ofs += sizeof(*ev) + ev->len;
+		}
 	}
-	str_hash_iter_free(iter);
-	g_cache_hash = std::move(phash);
-	return TRUE;
+	return nullptr;
 }
 
-void mod_cache_init(int context_num)
+void mod_cache_init(int context_num, uint64_t cache_size)
 {
 	g_notify_stop = true;
 	g_context_num = context_num;
-	double_list_init(&g_item_list);
+	g_shard_limit = cache_size / CACHE_SHARDS;
 }
-
 static int mod_cache_defaults()
 {
 	printf("[mod_cache]: defaulting to built-in list of handled paths\n");
@@ -195,16 +297,16 @@ int mod_cache_run()
 	auto ret = mod_cache_read_txt();
 	if (ret < 0)
 		return ret;
-	g_context_list = static_cast<CACHE_CONTEXT *>(malloc(sizeof(CACHE_CONTEXT) * g_context_num));
+	g_context_list = new(std::nothrow) CACHE_CONTEXT[g_context_num];
 	if (NULL == g_context_list) {
 		printf("[mod_cache]: Failed to allocate context list\n");
 		return -2;
 	}
-	memset(g_context_list, 0, sizeof(CACHE_CONTEXT)*g_context_num);
-	g_cache_hash = STR_HASH_TABLE::create(HASH_GROWING_NUM, sizeof(CACHE_ITEM *), nullptr);
-	if (NULL == g_cache_hash) {
-		printf("[mod_cache]: Failed to init cache hash table\n");
-		return -3;
+	g_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (g_inotify_fd < 0) {
+		printf("[mod_cache]: inotify_init: %s; cached files will be "
+		       "revalidated with stat\n", strerror(errno));
+		return 0;
 	}
 	g_notify_stop = false;
 	ret = pthread_create(&g_scan_tid, nullptr, mod_cache_scanwork, nullptr);
@@ -219,10 +321,6 @@ int mod_cache_run()
 
 void mod_cache_stop()
 {
-	CACHE_ITEM *pitem;
-	CACHE_ITEM **ppitem;
-	DOUBLE_LIST_NODE *pnode;
-	
 	if (!g_notify_stop) {
 		g_notify_stop = true;
 		pthread_kill(g_scan_tid, SIGALRM);
@@ -230,30 +328,15 @@ void mod_cache_stop()
 	}
 	g_directory_list.clear();
 	if (NULL != g_context_list) {
-		free(g_context_list);
+		delete[] g_context_list;
 		g_context_list = NULL;
 	}
-	if (NULL != g_cache_hash) {
-		auto iter = g_cache_hash->make_iter();
-		for (str_hash_iter_begin(iter); !str_hash_iter_done(iter);
-			str_hash_iter_forward(iter)) {
-			ppitem = static_cast<CACHE_ITEM **>(str_hash_iter_get_value(iter, nullptr));
-			free((*ppitem)->blob.data);
-			free(*ppitem);
-		}
-		str_hash_iter_free(iter);
-		g_cache_hash.reset();
-	}
-	while ((pnode = double_list_pop_front(&g_item_list)) != nullptr) {
-		pitem = (CACHE_ITEM*)pnode->pdata;
-		free(pitem->blob.data);
-		free(pitem);
+	mod_cache_invalidate_dir({});
+	if (g_inotify_fd >= 0) {
+		close(g_inotify_fd);
+		g_inotify_fd = -1;
 	}
-}
-
-void mod_cache_free()
-{
-	double_list_free(&g_item_list);
+	g_watch_list.clear();
 }
 
 static CACHE_CONTEXT* mod_cache_get_cache_context(HTTP_CONTEXT *phttp)
@@ -392,30 +475,18 @@ static BOOL mod_cache_response_unmodified(HTTP_CONTEXT *phttp)
 
 static BOOL mod_cache_response_single_header(HTTP_CONTEXT *phttp)
 {
-	char etag[128];
 	time_t cur_time;
 	struct tm tmp_tm;
 	int response_len;
 	char date_string[128];
-	CACHE_CONTEXT *pcontext;
 	char response_buff[1024];
-	char modified_string[128];
-	const char *pcontent_type;
 	
-	pcontext = mod_cache_get_cache_context(phttp);
+	auto pcontext = mod_cache_get_cache_context(phttp);
+	auto pitem = pcontext->pitem.get();
 	time(&cur_time);
 	gmtime_r(&cur_time, &tmp_tm);
 	strftime(date_string, 128, "%a, %d %b %Y %T GMT", &tmp_tm);
-	gmtime_r(&pcontext->pitem->mtime, &tmp_tm);
-	strftime(modified_string, 128, "%a, %d %b %Y %T GMT", &tmp_tm);
-	mod_cache_serialize_etag(pcontext->pitem->ino,
-		pcontext->pitem->blob.length, pcontext->pitem->mtime, etag);
-	pcontent_type = system_services_extension_to_mime(
-							pcontext->pitem->extention);
-	if (NULL == pcontent_type) {
-		pcontent_type = "application/octet-stream";
-	}
-	strcpy(response_buff, pcontext->until != pcontext->pitem->blob.length ?
+	strcpy(response_buff, pcontext->until != pitem->length ?
 	       "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n");
 	response_len = strlen(response_buff);
 	response_len += gx_snprintf(response_buff + response_len,
@@ -428,15 +499,15 @@ static BOOL mod_cache_response_single_header(HTTP_CONTEXT *phttp)
 					"Last-Modified: %s\r\n"
 					"ETag: \"%s\"\r\n",
 					resource_get_string("HOST_ID"),
-					date_string, pcontent_type,
+					date_string, pitem->content_type.c_str(),
 					pcontext->until - pcontext->offset,
-					modified_string, etag);
-	if (pcontext->until != pcontext->pitem->blob.length) {
+					pitem->last_modified, pitem->etag);
+	if (pcontext->until != pitem->length) {
 		response_len += gx_snprintf(response_buff + response_len,
 		                GX_ARRAY_SIZE(response_buff) - response_len,
 					"Content-Range: bytes %u-%u/%u\r\n\r\n",
 					pcontext->offset, pcontext->until - 1,
-					pcontext->pitem->blob.length);
+					pitem->length);
 	} else {
 		memcpy(response_buff + response_len, "\r\n", 2);
 		response_len += 2;
@@ -446,32 +517,22 @@ static BOOL mod_cache_response_single_header(HTTP_CONTEXT *phttp)
 
 static uint32_t mod_cache_calculate_content_length(CACHE_CONTEXT *pcontext)
 {
-	int i;
-	int ctype_len;
 	char num_buff[64];
 	uint32_t content_length;
-	const char *pcontent_type;
+	auto ctype_len = pcontext->pitem->content_type.size();
 	
-	pcontent_type = system_services_extension_to_mime(
-							pcontext->pitem->extention);
-	if (NULL == pcontent_type) {
-		pcontent_type = "application/octet-stream";
-	}
-	ctype_len = strlen(pcontent_type);
 	content_length = 0;
-	for (i=0; i<pcontext->range_num; i++) {
+	for (const auto &range : pcontext->ranges) {
 		/* --boundary_string\r\n */
 		content_length += 2 + sizeof(BOUNDARY_STRING) - 1 + 2;
 		/* Content-Type: xxx\r\n */
 		content_length += 16 + ctype_len;
 		/* Content-Range: bytes x-x/xxx\r\n */
 		content_length += 25 + sprintf(num_buff, "%u%u%u",
-								pcontext->prange[i].begin,
-								pcontext->prange[i].end,
-								pcontext->pitem->blob.length);
+								range.begin, range.end,
+								pcontext->pitem->length);
 		content_length += 2; /* \r\n */
-		content_length += pcontext->prange[i].end -
-						pcontext->prange[i].begin + 1;
+		content_length += range.end - range.begin + 1;
 		content_length += 2; /* \r\n */
 	}
 	/* --boundary_string--\r\n */
@@ -481,24 +542,17 @@ static uint32_t mod_cache_calculate_content_length(CACHE_CONTEXT *pcontext)
 
 static BOOL mod_cache_response_multiple_header(HTTP_CONTEXT *phttp)
 {
-	char etag[128];
 	time_t cur_time;
 	struct tm tmp_tm;
 	int response_len;
 	char date_string[128];
 	uint32_t content_length;
-	CACHE_CONTEXT *pcontext;
 	char response_buff[1024];
-	char modified_string[128];
 	
-	pcontext = mod_cache_get_cache_context(phttp);
+	auto pcontext = mod_cache_get_cache_context(phttp);
 	time(&cur_time);
 	gmtime_r(&cur_time, &tmp_tm);
 	strftime(date_string, 128, "%a, %d %b %Y %T GMT", &tmp_tm);
-	gmtime_r(&pcontext->pitem->mtime, &tmp_tm);
-	strftime(modified_string, 128, "%a, %d %b %Y %T GMT", &tmp_tm);
-	mod_cache_serialize_etag(pcontext->pitem->ino,
-		pcontext->pitem->blob.length, pcontext->pitem->mtime, etag);
 	content_length =  mod_cache_calculate_content_length(pcontext);	
 	response_len = gx_snprintf(response_buff, GX_ARRAY_SIZE(response_buff),
 					"HTTP/1.1 206 Partial Content\r\n"
@@ -510,8 +564,8 @@ static BOOL mod_cache_response_multiple_header(HTTP_CONTEXT *phttp)
 					"Last-Modified: %s\r\n"
 					"ETag: \"%s\"\r\n",
 					resource_get_string("HOST_ID"),
-					date_string, BOUNDARY_STRING,
-					content_length, modified_string, etag);
+					date_string, BOUNDARY_STRING, content_length,
+					pcontext->pitem->last_modified, pcontext->pitem->etag);
 	return phttp->stream_out.write(response_buff, response_len) == STREAM_WRITE_OK ? TRUE : false;
 }
 
@@ -599,26 +653,78 @@ static BOOL mod_cache_parse_range_value(char *value,
 	}
 	pcontext->offset = 0;
 	pcontext->until = 0;
-	pcontext->range_pos = -1;
-	pcontext->range_num = range_num;
-	pcontext->prange = static_cast<RANGE *>(malloc(sizeof(RANGE) * range_num));
-	if (NULL == pcontext->prange) {
+	pcontext->range_pos = 0;
+	try {
+		pcontext->ranges.assign(ranges, ranges + range_num);
+	} catch (const std::bad_alloc &) {
 		return FALSE;
 	}
-	memcpy(pcontext->prange, ranges, sizeof(RANGE)*range_num);
 	return TRUE;
 }
 
+/*
+ * Read @path into memory (or just open it, if it is too large to be kept)
+ * and fill in the per-file response header fields.
+ */
+static cache_item_ptr mod_cache_load(const std::string &path,
+    const char *suffix)
+{
+	cache_item_ptr pitem;
+	struct stat node_stat;
+	
+	try {
+		pitem = std::make_shared<CACHE_ITEM>();
+		pitem->path = path;
+	} catch (const std::bad_alloc &) {
+		return nullptr;
+	}
+	/* watch before stat, so that no change can slip in between */
+	pitem->b_watched = mod_cache_watch(path);
+	wrapfd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	if (fd.get() < 0 || fstat(fd.get(), &node_stat) != 0 ||
+	    !S_ISREG(node_stat.st_mode) || node_stat.st_size >= 0xFFFFFFFF)
+		return nullptr;
+	pitem->ino = node_stat.st_ino;
+	pitem->length = node_stat.st_size;
+	pitem->mtime = node_stat.st_mtime;
+	if (pitem->length > g_shard_limit) {
+		pitem->fd = std::move(fd);
+	} else if (pitem->length > 0) {
+		pitem->data.reset(new(std::nothrow) uint8_t[pitem->length]);
+		if (pitem->data == nullptr)
+			return nullptr;
+		/* a file shrinking under us fails the load, it is not padded */
+		for (uint32_t ofs = 0; ofs < pitem->length; ) {
+			auto ret = read(fd.get(), &pitem->data[ofs], pitem->length - ofs);
+			if (ret <= 0)
+				return nullptr;
+			ofs += ret;
+		}
+	}
+	auto pcontent_type = system_services_extension_to_mime(suffix);
+	try {
+		pitem->content_type = pcontent_type != nullptr ?
+		                      pcontent_type : "application/octet-stream";
+	} catch (const std::bad_alloc &) {
+		return nullptr;
+	}
+	mod_cache_serialize_etag(pitem->ino, pitem->length,
+		pitem->mtime, pitem->etag);
+	struct tm tmp_tm;
+	gmtime_r(&pitem->mtime, &tmp_tm);
+	strftime(pitem->last_modified, arsizeof(pitem->last_modified),
+		"%a, %d %b %Y %T GMT", &tmp_tm);
+	return pitem;
+}
+
 BOOL mod_cache_get_context(HTTP_CONTEXT *phttp)
 {
-	int fd;
 	ino_t ino;
 	char *ptoken;
 	time_t mtime;
 	uint32_t size;
 	char suffix[16];
 	char domain[256];
-	CACHE_ITEM *pitem;
 	char tmp_path[512];
 	char tmp_buff[8192];
 	struct stat node_stat;
@@ -699,20 +805,35 @@ BOOL mod_cache_get_context(HTTP_CONTEXT *phttp)
 		return FALSE;
 	snprintf(tmp_path, GX_ARRAY_SIZE(tmp_path), "%s%s", it->dir.c_str(),
 	         request_uri + it->path.size());
-	if (0 != stat(tmp_path, &node_stat) ||
-		0 == S_ISREG(node_stat.st_mode)) {
+	cache_item_ptr pitem;
+	try {
+		pitem = mod_cache_lookup(tmp_path);
+	} catch (const std::bad_alloc &) {
 		return FALSE;
 	}
-	if (node_stat.st_size >= 0xFFFFFFFF) {
-		return FALSE;
+	if (pitem != nullptr && !pitem->b_watched &&
+	    (stat(tmp_path, &node_stat) != 0 ||
+	    node_stat.st_ino != pitem->ino ||
+	    node_stat.st_size != pitem->length ||
+	    node_stat.st_mtime != pitem->mtime)) {
+		mod_cache_invalidate(tmp_path);
+		pitem.reset();
+	}
+	if (pitem == nullptr) {
+		uint64_t gen = g_inval_gen;
+		pitem = mod_cache_load(tmp_path, suffix);
+		if (pitem == nullptr)
+			return FALSE;
+		/* too large or possibly stale already: serve, but do not keep */
+		if (pitem->fd.get() < 0 && gen == g_inval_gen)
+			mod_cache_insert(pitem);
 	}
 	if (mod_cache_get_others_field(&phttp->request.f_others,
 	    "If-None-Match", tmp_buff, GX_ARRAY_SIZE(tmp_buff)) &&
 		TRUE == mod_cache_retrieve_etag(
 		tmp_buff, &ino, &size, &mtime)) {
-		if (ino == node_stat.st_ino &&
-			size == node_stat.st_size &&
-			mtime == node_stat.st_mtime) {
+		if (ino == pitem->ino && size == pitem->length &&
+		    mtime == pitem->mtime) {
 			return mod_cache_response_unmodified(phttp);
 		}
 	} else {
@@ -720,17 +841,18 @@ BOOL mod_cache_get_context(HTTP_CONTEXT *phttp)
 		    "If-Modified-Since", tmp_buff, GX_ARRAY_SIZE(tmp_buff)) &&
 			TRUE == mod_cache_parse_rfc1123_dstring(
 			tmp_buff, &mtime)) {
-			if (mtime == node_stat.st_mtime) {
+			if (mtime == pitem->mtime) {
 				return mod_cache_response_unmodified(phttp);
 			}
 		}
 	}
 	pcontext = mod_cache_get_cache_context(phttp);
-	memset(pcontext, 0, sizeof(CACHE_CONTEXT));
+	pcontext->b_header = FALSE;
+	pcontext->ranges.clear();
 	if (mod_cache_get_others_field(&phttp->request.f_others, "Range",
 	    tmp_buff, GX_ARRAY_SIZE(tmp_buff))) {
 		if (FALSE == mod_cache_parse_range_value(
-			tmp_buff, node_stat.st_size, pcontext)) {
+			tmp_buff, pitem->length, pcontext)) {
 			http_parser_log_info(phttp, LV_DEBUG, "\"range\""
 				" value in http request header format"
 				" error for mod_cache");
@@ -738,121 +860,18 @@ BOOL mod_cache_get_context(HTTP_CONTEXT *phttp)
 		}
 	} else {
 		pcontext->offset = 0;
-		pcontext->until = node_stat.st_size;
-	}
-	std::unique_lock hhold(g_hash_lock);
-	auto ppitem = g_cache_hash->query<CACHE_ITEM *>(tmp_path);
-	if (NULL != ppitem) {
-		pitem = *ppitem;
-		if (pitem->ino != node_stat.st_ino ||
-			pitem->blob.length != node_stat.st_size ||
-			pitem->mtime != node_stat.st_mtime) {
-			g_cache_hash->remove(tmp_path);
-			if (pitem->reference > 0) {
-				pitem->b_expired = TRUE;
-				pitem->node.pdata = pitem;
-				double_list_append_as_tail(
-					&g_item_list, &pitem->node);
-			} else {
-				free(pitem->blob.data);
-				free(pitem);
-			}
-		} else {
-			pitem->reference ++;
-			pcontext->pitem = pitem;
-			return TRUE;
-		}
-	}
-	hhold.unlock();
-	pitem = static_cast<CACHE_ITEM *>(malloc(sizeof(*pitem)));
-	if (NULL == pitem) {
-		if (NULL != pcontext->prange) {
-			free(pcontext->prange);
-			pcontext->prange = NULL;
-		}
-		return FALSE;
-	}
-	strcpy(pitem->extention, suffix);
-	pitem->reference = 1;
-	pitem->ino = node_stat.st_ino;
-	pitem->blob.length = node_stat.st_size;
-	pitem->mtime = node_stat.st_mtime;
-	pitem->blob.data = static_cast<uint8_t *>(malloc(node_stat.st_size));
-	if (NULL == pitem->blob.data) {
-		free(pitem);
-		if (NULL != pcontext->prange) {
-			free(pcontext->prange);
-			pcontext->prange = NULL;
-		}
-		return FALSE;
-	}
-	fd = open(tmp_path, O_RDONLY);
-	if (-1 == fd) {
-		free(pitem->blob.data);
-		free(pitem);
-		if (NULL != pcontext->prange) {
-			free(pcontext->prange);
-			pcontext->prange = NULL;
-		}
-		return FALSE;
-	}
-	if (node_stat.st_size != read(fd,
-		pitem->blob.data, node_stat.st_size)) {
-		close(fd);
-		free(pitem->blob.data);
-		free(pitem);
-		if (NULL != pcontext->prange) {
-			free(pcontext->prange);
-			pcontext->prange = NULL;
-		}
-		return FALSE;
-	}
-	close(fd);
-	hhold.lock();
-	ppitem = g_cache_hash->query<CACHE_ITEM *>(tmp_path);
-	if (NULL == ppitem) {
-		if (g_cache_hash->add(tmp_path, &pitem) != 1) {
-			if (FALSE == mod_cache_enlarge_hash()) {
-				goto INVALIDATE_ITEM;
-			}
-			g_cache_hash->add(tmp_path, &pitem);
-		}
-		pitem->b_expired = FALSE;
-		pcontext->pitem = pitem;
-		return TRUE;
+		pcontext->until = pitem->length;
 	}
- INVALIDATE_ITEM:
-	pitem->b_expired = TRUE;
-	pitem->node.pdata = pitem;
-	double_list_append_as_tail(&g_item_list, &pitem->node);
-	pcontext->pitem = pitem;
+	pcontext->pitem = std::move(pitem);
 	return TRUE;
 }
 
 void mod_cache_put_context(HTTP_CONTEXT *phttp)
 {
-	CACHE_ITEM *pitem;
-	CACHE_CONTEXT *pcontext;
-	
-	pcontext = mod_cache_get_cache_context(phttp);
-	if (NULL == pcontext->pitem) {
-		return;
-	}
-	pitem = pcontext->pitem;
-	pcontext->pitem = NULL;
-	std::unique_lock hhold(g_hash_lock);
-	pitem->reference --;
-	if (0 != pitem->reference || FALSE == pitem->b_expired) {
-		return;
-	}
-	double_list_remove(&g_item_list, &pitem->node);
-	hhold.unlock();
-	free(pitem->blob.data);
-	free(pitem);
-	if (NULL != pcontext->prange) {
-		free(pcontext->prange);
-		pcontext->prange = NULL;
-	}
+	auto pcontext = mod_cache_get_cache_context(phttp);
+	pcontext->pitem.reset();
+	pcontext->ranges.clear();
+	pcontext->chunk.reset();
 }
 
 BOOL mod_cache_check_responded(HTTP_CONTEXT *phttp)
@@ -863,19 +882,23 @@ BOOL mod_cache_check_responded(HTTP_CONTEXT *phttp)
 	return pcontext->b_header;
 }
 
+/*
+ * Headers and multipart boundaries go through stream_out; file content is
+ * handed to the writer as a pointer into the cached buffer, without a
+ * copy, or read into the context's staging buffer for uncached files.
+ */
 BOOL mod_cache_read_response(HTTP_CONTEXT *phttp)
 {
 	int tmp_len;
 	char tmp_buff[1024];
-	CACHE_CONTEXT *pcontext;
-	const char *pcontent_type;
 	
-	pcontext = mod_cache_get_cache_context(phttp);
-	if (NULL == pcontext->pitem) {
+	auto pcontext = mod_cache_get_cache_context(phttp);
+	auto pitem = pcontext->pitem.get();
+	if (NULL == pitem) {
 		return FALSE;
 	}
 	if (FALSE == pcontext->b_header) {
-		if (NULL == pcontext->prange) {
+		if (pcontext->ranges.empty()) {
 			if (FALSE == mod_cache_response_single_header(phttp)) {
 				mod_cache_put_context(phttp);
 				return FALSE;
@@ -891,55 +914,63 @@ BOOL mod_cache_read_response(HTTP_CONTEXT *phttp)
 			mod_cache_put_context(phttp);
 			return FALSE;
 		}
+		return TRUE;
 	}
-	if (pcontext->until - pcontext->offset >=
-		STREAM_BLOCK_SIZE - 1) {
-		tmp_len = STREAM_BLOCK_SIZE - 1;
-	} else {
-		tmp_len = pcontext->until - pcontext->offset;
-	}
-	if (phttp->stream_out.write(pcontext->pitem->blob.data +
-	    pcontext->offset, tmp_len) != STREAM_WRITE_OK) {
-		mod_cache_put_context(phttp);
-		return FALSE;
-	}
-	pcontext->offset += tmp_len;
-	if (pcontext->offset == pcontext->until) {
-		if (NULL != pcontext->prange) {
-			pcontext->range_pos ++;
-			if (pcontext->range_pos < pcontext->range_num) {
-				pcontext->offset = pcontext->prange[
-						pcontext->range_pos].begin;
-				pcontext->until = pcontext->prange[
-						pcontext->range_pos].end + 1;
-				pcontent_type = system_services_extension_to_mime(
-							pcontext->pitem->extention);
-				if (NULL == pcontent_type) {
-					pcontent_type = "application/octet-stream";
+	if (pcontext->offset < pcontext->until) {
+		tmp_len = std::min(pcontext->until - pcontext->offset,
+		          static_cast<uint32_t>(SEGMENT_SIZE));
+		if (pitem->data != nullptr) {
+			phttp->write_buff = &pitem->data[pcontext->offset];
+		} else {
+			if (pcontext->chunk == nullptr) {
+				pcontext->chunk.reset(new(std::nothrow) uint8_t[SEGMENT_SIZE]);
+				if (pcontext->chunk == nullptr) {
+					phttp->b_close = TRUE;
+					mod_cache_put_context(phttp);
+					return FALSE;
 				}
-				tmp_len = sprintf(tmp_buff,
-					"\r\n--%s\r\n"
-					"Content-Type: %s\r\n"
-					"Content-Range: bytes %u-%u/%u\r\n\r\n",
-					BOUNDARY_STRING, pcontent_type,
-					pcontext->prange[pcontext->range_pos].begin,
-					pcontext->prange[pcontext->range_pos].end,
-					pcontext->pitem->blob.length);
-			} else {
-				tmp_len = sprintf(tmp_buff,
-					"\r\n--%s--\r\n",
-					BOUNDARY_STRING);
-				free(pcontext->prange);
-				pcontext->prange = NULL;
 			}
-			if (phttp->stream_out.write(tmp_buff, tmp_len) != STREAM_WRITE_OK) {
-				mod_cache_put_context(phttp);
-				return FALSE;
+			for (int ofs = 0; ofs < tmp_len; ) {
+				auto ret = pread(pitem->fd.get(), &pcontext->chunk[ofs],
+				           tmp_len - ofs, pcontext->offset + ofs);
+				if (ret <= 0) {
+					/* Content-Length can no longer be honored */
+					http_parser_log_info(phttp, LV_DEBUG, "mod_cache: "
+						"%s changed while being sent", pitem->path.c_str());
+					phttp->b_close = TRUE;
+					mod_cache_put_context(phttp);
+					return FALSE;
+				}
+				ofs += ret;
 			}
-			return TRUE;
+			phttp->write_buff = pcontext->chunk.get();
 		}
+		phttp->write_length = tmp_len;
+		pcontext->offset += tmp_len;
+		return TRUE;
+	}
+	if (pcontext->range_pos > pcontext->ranges.size() ||
+	    pcontext->ranges.empty()) {
+		mod_cache_put_context(phttp);
+		return FALSE;
+	}
+	if (pcontext->range_pos < pcontext->ranges.size()) {
+		const auto &range = pcontext->ranges[pcontext->range_pos];
+		pcontext->offset = range.begin;
+		pcontext->until = range.end + 1;
+		tmp_len = sprintf(tmp_buff,
+			"\r\n--%s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Range: bytes %u-%u/%u\r\n\r\n",
+			BOUNDARY_STRING, pitem->content_type.c_str(),
+			range.begin, range.end, pitem->length);
+	} else {
+		tmp_len = sprintf(tmp_buff,
+			"\r\n--%s--\r\n",
+			BOUNDARY_STRING);
 	}
-	if (pcontext->offset == pcontext->until) {
+	++pcontext->range_pos;
+	if (phttp->stream_out.write(tmp_buff, tmp_len) != STREAM_WRITE_OK) {
 		mod_cache_put_context(phttp);
 		return FALSE;
 	}
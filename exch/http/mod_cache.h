@@ -1,11 +1,11 @@
 #pragma once
+#include <cstdint>
 #include <gromox/common_types.hpp>
 
 struct HTTP_CONTEXT;
-extern void mod_cache_init(int context_num);
+extern void mod_cache_init(int context_num, uint64_t cache_size);
 extern int mod_cache_run();
 extern void mod_cache_stop();
-extern void mod_cache_free();
 BOOL mod_cache_check_caching(HTTP_CONTEXT *phttp);
 BOOL mod_cache_get_context(HTTP_CONTEXT *phttp);
 void mod_cache_put_context(HTTP_CONTEXT *phttp);
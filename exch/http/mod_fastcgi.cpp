@@ -1,8 +1,13 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <new>
 #include <string>
 #include <vector>
 #include <utility>
@@ -24,6 +29,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <cstring>
 #include <cstdlib>
@@ -44,6 +50,10 @@
 
 #define FCGI_REQUEST_ID							1
 
+#define FCGI_KEEP_CONN							1
+
+/* largest multiple of 8 below 64K, so that STDIN records need no padding */
+#define STDIN_RECORD_MAX						0xFFF8
 
 #define RECORD_TYPE_BEGIN_REQUEST				1
 #define RECORD_TYPE_ABORT_REQUEST				2
@@ -70,10 +80,21 @@
 
 using namespace gromox;
 
+/*
+ * Idle keep-alive connections to one FastCGI socket, most recently
+ * returned at the back. Nodes that name the same socket share a pool,
+ * since every pooled connection holds on to one php-fpm worker.
+ */
+struct FCGI_POOL {
+	std::mutex lock;
+	std::deque<std::pair<int, time_t>> idle;
+};
+
 struct FASTCGI_NODE {
 	std::string domain, path, dir, suffix, index;
 	std::vector<std::string> header_list;
 	std::string sock_path;
+	FCGI_POOL *pool = nullptr;
 };
 
 namespace {
@@ -103,10 +124,14 @@ struct RECORD_HEADER {
 static int g_context_num;
 static int g_exec_timeout;
 static uint64_t g_max_size;
-static uint64_t g_cache_size;
+static unsigned int g_pool_size;
+static int g_pool_idle_timeout;
 static std::vector<FASTCGI_NODE> g_fastcgi_list;
+static std::map<std::string, FCGI_POOL> g_pool_list;
 static FASTCGI_CONTEXT *g_context_list;
 static std::atomic<int> g_unavailable_times;
+static std::atomic<uint64_t> g_stat_requests, g_stat_connects;
+static std::atomic<uint64_t> g_stat_reuses, g_stat_discards;
 
 static const FASTCGI_NODE *mod_fastcgi_find_backend(const char *domain,
     const char *uri_path, const char *file_name, const char *suffix,
@@ -132,14 +157,15 @@ static const FASTCGI_NODE *mod_fastcgi_find_backend(const char *domain,
 	return NULL;
 }
 
-void mod_fastcgi_init(int context_num, uint64_t cache_size, uint64_t max_size,
-    int exec_timeout)
+void mod_fastcgi_init(int context_num, uint64_t max_size, int exec_timeout,
+    unsigned int pool_size, int pool_idle_timeout)
 {
 	g_context_num = context_num;
 	g_unavailable_times = 0;
-	g_cache_size = cache_size;
 	g_max_size = max_size;
 	g_exec_timeout = exec_timeout;
+	g_pool_size = pool_size;
+	g_pool_idle_timeout = pool_idle_timeout;
 }
 
 static int mod_fastcgi_defaults()
@@ -208,7 +234,14 @@ int mod_fastcgi_run()
 	auto ret = mod_fastcgi_read_txt();
 	if (ret < 0)
 		return ret;
-	g_context_list = static_cast<FASTCGI_CONTEXT *>(malloc(sizeof(FASTCGI_CONTEXT) * g_context_num));
+	try {
+		for (auto &node : g_fastcgi_list)
+			node.pool = &g_pool_list[node.sock_path];
+	} catch (const std::bad_alloc &) {
+		printf("[mod_fastcgi]: bad_alloc\n");
+		return -ENOMEM;
+	}
+	g_context_list = new(std::nothrow) FASTCGI_CONTEXT[g_context_num];
 	if (NULL == g_context_list) {
 		printf("[mod_fastcgi]: Failed to allocate context list\n");
 		return -ENOMEM;
@@ -218,10 +251,30 @@ int mod_fastcgi_run()
 
 void mod_fastcgi_stop()
 {
-	free(g_context_list);
+	for (auto &[path, pool] : g_pool_list)
+		for (const auto &conn : pool.idle)
+			close(conn.first);
+	g_pool_list.clear();
+	g_fastcgi_list.clear();
+	delete[] g_context_list;
 	g_context_list = NULL;
 }
 
+void mod_fastcgi_get_stats(FASTCGI_STATS *pstats)
+{
+	pstats->pool_size = g_pool_size;
+	pstats->pool_idle_timeout = g_pool_idle_timeout;
+	pstats->requests = g_stat_requests;
+	pstats->connects = g_stat_connects;
+	pstats->reuses = g_stat_reuses;
+	pstats->discards = g_stat_discards;
+	pstats->idle = 0;
+	for (auto &[path, pool] : g_pool_list) {
+		std::lock_guard<std::mutex> hold(pool.lock);
+		pstats->idle += pool.idle.size();
+	}
+}
+
 static int mod_fastcgi_push_name_value(NDR_PUSH *pndr,
     const char *pname, const char *pvalue)
 {
@@ -247,7 +300,7 @@ static int mod_fastcgi_push_name_value(NDR_PUSH *pndr,
 	return ndr_push_array_uint8(pndr, reinterpret_cast<const uint8_t *>(pvalue), val_len);
 }
 
-static int mod_fastcgi_push_begin_request(NDR_PUSH *pndr)
+static int mod_fastcgi_push_begin_request(NDR_PUSH *pndr, uint8_t flags)
 {
 	TRY(ndr_push_uint8(pndr, FCGI_VERSION));
 	TRY(ndr_push_uint8(pndr, RECORD_TYPE_BEGIN_REQUEST));
@@ -261,7 +314,7 @@ static int mod_fastcgi_push_begin_request(NDR_PUSH *pndr)
 	/* begin request role */
 	TRY(ndr_push_uint16(pndr, ROLE_RESPONDER));
 	/* begin request flags */
-	TRY(ndr_push_uint8(pndr, 0));
+	TRY(ndr_push_uint8(pndr, flags));
 	/* begin request reserved bytes */
 	return ndr_push_zero(pndr, 5);
 }
@@ -305,19 +358,16 @@ static int mod_fastcgi_push_params_end(NDR_PUSH *pndr)
 	return mod_fastcgi_push_align_record(pndr);
 }
 
-static int mod_fastcgi_push_stdin(NDR_PUSH *pndr,
-    const void *pbuff, uint16_t length)
+static int mod_fastcgi_push_stdin_header(NDR_PUSH *pndr,
+    uint16_t length, uint8_t padding_len)
 {
 	TRY(ndr_push_uint8(pndr, FCGI_VERSION));
 	TRY(ndr_push_uint8(pndr, RECORD_TYPE_STDIN));
 	TRY(ndr_push_uint16(pndr, FCGI_REQUEST_ID));
 	TRY(ndr_push_uint16(pndr, length));
-	/* push padding length */
-	TRY(ndr_push_uint8(pndr, 0));
+	TRY(ndr_push_uint8(pndr, padding_len));
 	/* reserved */
-	TRY(ndr_push_uint8(pndr, 0));
-	TRY(ndr_push_array_uint8(pndr, static_cast<const uint8_t *>(pbuff), length));
-	return mod_fastcgi_push_align_record(pndr);
+	return ndr_push_uint8(pndr, 0);
 }
 
 static int mod_fastcgi_pull_end_request(NDR_PULL *pndr,
@@ -392,6 +442,78 @@ static int mod_fastcgi_connect_backend(const char *path)
 	return sockd;
 }
 
+static bool mod_fastcgi_conn_alive(int sockd)
+{
+	struct pollfd pfd = {sockd, POLLIN, 0};
+	/* an idle connection has nothing to say; data or EOF means it is dead */
+	return poll(&pfd, 1, 0) == 0;
+}
+
+static int mod_fastcgi_pool_get(FCGI_POOL *pool, const char *path, bool *preused)
+{
+	auto now = time(nullptr);
+	while (g_pool_size > 0) {
+		std::pair<int, time_t> conn;
+		{
+			std::lock_guard<std::mutex> hold(pool->lock);
+			if (pool->idle.empty())
+				break;
+			conn = pool->idle.back();
+			pool->idle.pop_back();
+		}
+		if (now - conn.second < g_pool_idle_timeout &&
+		    mod_fastcgi_conn_alive(conn.first)) {
+			++g_stat_reuses;
+			*preused = true;
+			return conn.first;
+		}
+		close(conn.first);
+		++g_stat_discards;
+	}
+	*preused = false;
+	++g_stat_connects;
+	return mod_fastcgi_connect_backend(path);
+}
+
+static void mod_fastcgi_pool_put(FCGI_POOL *pool, int sockd)
+{
+	auto now = time(nullptr);
+	std::lock_guard<std::mutex> hold(pool->lock);
+	while (pool->idle.size() > 0 &&
+	    now - pool->idle.front().second >= g_pool_idle_timeout) {
+		close(pool->idle.front().first);
+		pool->idle.pop_front();
+		++g_stat_discards;
+	}
+	if (pool->idle.size() >= g_pool_size) {
+		close(sockd);
+		return;
+	}
+	pool->idle.emplace_back(sockd, now);
+}
+
+static BOOL mod_fastcgi_safe_write(int sockd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		auto ret = writev(sockd, iov, iovcnt);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return FALSE;
+		size_t done = ret;
+		while (iovcnt > 0 && done >= iov->iov_len) {
+			done -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = static_cast<char *>(iov->iov_base) + done;
+			iov->iov_len -= done;
+		}
+	}
+	return TRUE;
+}
+
 BOOL mod_fastcgi_get_context(HTTP_CONTEXT *phttp)
 {
 	BOOL b_index;
@@ -505,16 +627,7 @@ BOOL mod_fastcgi_get_context(HTTP_CONTEXT *phttp)
 	auto pcontext = &g_context_list[phttp->context_id];
 	time(&pcontext->last_time);
 	pcontext->pfnode = pfnode;
-	if (TRUE == b_chunked || content_length > g_cache_size) {
-		snprintf(tmp_buff, GX_ARRAY_SIZE(tmp_buff), "/tmp/http-%u", phttp->context_id);
-		pcontext->cache_fd = open(tmp_buff,
-			O_CREAT|O_TRUNC|O_RDWR, 0666);
-		if (pcontext->cache_fd == -1)
-			return FALSE;
-		pcontext->cache_size = 0;
-	} else {
-		pcontext->cache_fd = -1;
-	}
+	pcontext->body_size = 0;
 	pcontext->b_index = b_index;
 	pcontext->b_chunked = b_chunked;
 	if (TRUE == b_chunked) {
@@ -524,6 +637,7 @@ BOOL mod_fastcgi_get_context(HTTP_CONTEXT *phttp)
 	pcontext->b_end = FALSE;
 	pcontext->content_length = content_length;
 	pcontext->cli_sockd = -1;
+	pcontext->b_reuse = false;
 	pcontext->b_header = FALSE;
 	phttp->pfast_context = pcontext;
 	return TRUE;
@@ -549,7 +663,6 @@ static BOOL mod_fastcgi_build_params(HTTP_CONTEXT *phttp,
 	NDR_PUSH ndr_push;
 	char uri_path[8192];
 	char tmp_buff[8192];
-	struct stat node_stat;
 	
 	ndr_push_init(&ndr_push, pbuff, *plength,
 		NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
@@ -750,10 +863,8 @@ static BOOL mod_fastcgi_build_params(HTTP_CONTEXT *phttp,
 		         static_cast<unsigned long long>(phttp->pfast_context->content_length));
 		QRF(mod_fastcgi_push_name_value(&ndr_push, "CONTENT_LENGTH", tmp_buff));
 	} else {
-		if (fstat(phttp->pfast_context->cache_fd, &node_stat) != 0)
-			return FALSE;
-		snprintf(tmp_buff, sizeof(tmp_buff), "%llu",
-		         static_cast<unsigned long long>(node_stat.st_size));
+		snprintf(tmp_buff, sizeof(tmp_buff), "%zu",
+		         phttp->pfast_context->chunk_body.size());
 		QRF(mod_fastcgi_push_name_value(&ndr_push, "CONTENT_LENGTH", tmp_buff));
 	}
 	QRF(mod_fastcgi_push_params_end(&ndr_push));
@@ -761,155 +872,137 @@ static BOOL mod_fastcgi_build_params(HTTP_CONTEXT *phttp,
 	return TRUE;
 }
 
-BOOL mod_fastcgi_relay_content(HTTP_CONTEXT *phttp)
+/*
+ * Send BEGIN_REQUEST and PARAMS on a pooled or new connection. A pooled
+ * connection may have been dropped by the back-end (e.g. pm.max_requests)
+ * after the liveness check; nothing of the body is consumed yet, so the
+ * request is simply retried on the next connection.
+ */
+static BOOL mod_fastcgi_begin_request(HTTP_CONTEXT *phttp)
 {
-	void *pbuff;
-	int cli_sockd;
 	int ndr_length;
 	NDR_PUSH ndr_push;
-	char tmp_path[256];
-	char tmp_buff[65535];
+	uint8_t begin_buff[16], end_buff[8];
 	uint8_t ndr_buff[65800];
+	auto pfast_context = phttp->pfast_context;
+	auto pfnode = pfast_context->pfnode;
 	
-	ndr_push_init(&ndr_push, tmp_buff, 16,
+	ndr_push_init(&ndr_push, begin_buff, sizeof(begin_buff),
 		NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
-	if (mod_fastcgi_push_begin_request(&ndr_push) != NDR_ERR_SUCCESS ||
-	    ndr_push.offset != 16)
+	if (mod_fastcgi_push_begin_request(&ndr_push, g_pool_size > 0 ?
+	    FCGI_KEEP_CONN : 0) != NDR_ERR_SUCCESS || ndr_push.offset != 16)
 		return FALSE;
 	ndr_length = sizeof(ndr_buff);
 	if (!mod_fastcgi_build_params(phttp, ndr_buff, &ndr_length))
-		return FALSE;	
-	cli_sockd = mod_fastcgi_connect_backend(phttp->pfast_context->pfnode->sock_path.c_str());
-	if (cli_sockd < 0) {
-		http_parser_log_info(phttp, LV_DEBUG, "fail to "
-				"connect to fastcgi back-end %s",
-				phttp->pfast_context->pfnode->sock_path.c_str());
 		return FALSE;
-	}
-	if (16 != write(cli_sockd, tmp_buff, 16) ||
-		ndr_length != write(cli_sockd, ndr_buff,
-		ndr_length)) {
-		close(cli_sockd);
-		http_parser_log_info(phttp, LV_DEBUG, "fail to "
-			"write record to fastcgi back-end %s",
-			phttp->pfast_context->pfnode->sock_path.c_str());
-		return FALSE;
-	}
-	ndr_push_init(&ndr_push, tmp_buff, 8,
+	ndr_push_init(&ndr_push, end_buff, sizeof(end_buff),
 		NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
 	if (NDR_ERR_SUCCESS != mod_fastcgi_push_params_begin(&ndr_push) ||
-		NDR_ERR_SUCCESS != mod_fastcgi_push_params_end(&ndr_push) ||
-		8 != ndr_push.offset || 8 != write(cli_sockd, tmp_buff, 8)) {
-		close(cli_sockd);
-		http_parser_log_info(phttp, LV_DEBUG, "fail to "
-			"write record to fastcgi back-end %s",
-			phttp->pfast_context->pfnode->sock_path.c_str());
+	    NDR_ERR_SUCCESS != mod_fastcgi_push_params_end(&ndr_push) ||
+	    8 != ndr_push.offset)
 		return FALSE;
-	}
-	if (-1 == phttp->pfast_context->cache_fd) {
-		if (phttp->pfast_context->content_length == 0)
-			goto END_OF_STDIN;
-		unsigned int tmp_len = sizeof(tmp_buff);
-		while ((pbuff = phttp->stream_in.get_read_buf(&tmp_len)) != nullptr) {
-			if (tmp_len > phttp->pfast_context->content_length) {
-				phttp->stream_in.rewind_read_ptr(tmp_len - phttp->pfast_context->content_length);
-				tmp_len = phttp->pfast_context->content_length;
-				phttp->pfast_context->content_length = 0;
-			} else{
-				phttp->pfast_context->content_length -= tmp_len;
-			}
-			ndr_push_init(&ndr_push, ndr_buff, sizeof(ndr_buff),
-						NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
-			if (NDR_ERR_SUCCESS != mod_fastcgi_push_stdin(
-				&ndr_push, pbuff, tmp_len)) {
-				close(cli_sockd);
-				http_parser_log_info(phttp, LV_DEBUG, "fail to "
-					"push stdin record for mod_fastcgi");
-				return FALSE;
-			}
-			if (ndr_push.offset != write(cli_sockd,
-				ndr_buff, ndr_push.offset)) {
-				close(cli_sockd);
-				http_parser_log_info(phttp, LV_DEBUG, "fail to "
-					"write record to fastcgi back-end %s",
-					phttp->pfast_context->pfnode->sock_path.c_str());
-				return FALSE;
-			}
-			if (phttp->pfast_context->content_length == 0)
-				break;
-			tmp_len = sizeof(tmp_buff);
+	++g_stat_requests;
+	while (true) {
+		bool b_reused = false;
+		auto cli_sockd = mod_fastcgi_pool_get(pfnode->pool,
+		                 pfnode->sock_path.c_str(), &b_reused);
+		if (cli_sockd < 0) {
+			http_parser_log_info(phttp, LV_DEBUG, "fail to "
+				"connect to fastcgi back-end %s",
+				pfnode->sock_path.c_str());
+			return FALSE;
 		}
-	} else {
-		lseek(phttp->pfast_context->cache_fd, 0, SEEK_SET);
-		while (true) {
-			auto tmp_len = read(phttp->pfast_context->cache_fd,
-				tmp_buff, sizeof(tmp_buff));
-			if (tmp_len < 0) {
-				close(cli_sockd);
-				http_parser_log_info(phttp, LV_DEBUG, "fail to"
-					" read cache file for mod_fastcgi");
-				return FALSE;
-			} else if (0 == tmp_len) {
-				close(phttp->pfast_context->cache_fd);
-				phttp->pfast_context->cache_fd = -1;
-				snprintf(tmp_path, GX_ARRAY_SIZE(tmp_path), "/tmp/http-%u", phttp->context_id);
-				if (remove(tmp_path) < 0 && errno != ENOENT)
-					fprintf(stderr, "W-1362: remove %s: %s\n", tmp_path, strerror(errno));
-				break;
-			}
-			ndr_push_init(&ndr_push, ndr_buff, sizeof(ndr_buff),
-						NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
-			if (NDR_ERR_SUCCESS != mod_fastcgi_push_stdin(
-				&ndr_push, tmp_buff, tmp_len)) {
-				close(cli_sockd);
-				http_parser_log_info(phttp, LV_DEBUG, "fail to "
-					"push stdin record for mod_fastcgi");
-				return FALSE;
-			}
-			if (ndr_push.offset != write(cli_sockd,
-				ndr_buff, ndr_push.offset)) {
-				close(cli_sockd);
-				http_parser_log_info(phttp, LV_DEBUG, "fail to "
-					"write record to fastcgi back-end %s",
-					phttp->pfast_context->pfnode->sock_path.c_str());
-				return FALSE;
-			}
+		struct iovec iov[] = {
+			{begin_buff, sizeof(begin_buff)},
+			{ndr_buff, static_cast<size_t>(ndr_length)},
+			{end_buff, sizeof(end_buff)},
+		};
+		if (mod_fastcgi_safe_write(cli_sockd, iov, arsizeof(iov))) {
+			pfast_context->cli_sockd = cli_sockd;
+			return TRUE;
 		}
-	}
- END_OF_STDIN:
-	ndr_push_init(&ndr_push, ndr_buff, sizeof(ndr_buff),
-				NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
-	if (NDR_ERR_SUCCESS != mod_fastcgi_push_stdin(
-		&ndr_push, NULL, 0)) {
 		close(cli_sockd);
-		http_parser_log_info(phttp, LV_DEBUG, "fail to push "
-			"last empty stdin record for mod_fastcgi");
-		return FALSE;
+		if (!b_reused) {
+			http_parser_log_info(phttp, LV_DEBUG, "fail to "
+				"write record to fastcgi back-end %s",
+				pfnode->sock_path.c_str());
+			return FALSE;
+		}
+		++g_stat_discards;
 	}
-	if (ndr_push.offset != write(cli_sockd,
-		ndr_buff, ndr_push.offset)) {
-		close(cli_sockd);
+}
+
+/* Wrap request body bytes into STDIN records, straight from the buffer. */
+static BOOL mod_fastcgi_write_stdin(HTTP_CONTEXT *phttp,
+    const void *pbuff, size_t length)
+{
+	NDR_PUSH ndr_push;
+	uint8_t header_buff[8];
+	static const uint8_t padding[8]{};
+	auto pfast_context = phttp->pfast_context;
+	
+	do {
+		uint16_t rec_len = std::min(length, static_cast<size_t>(STDIN_RECORD_MAX));
+		uint8_t padding_len = (8 - (rec_len & 7)) & 7;
+		ndr_push_init(&ndr_push, header_buff, sizeof(header_buff),
+			NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
+		if (mod_fastcgi_push_stdin_header(&ndr_push, rec_len,
+		    padding_len) != NDR_ERR_SUCCESS) {
+			http_parser_log_info(phttp, LV_DEBUG, "fail to "
+				"push stdin record for mod_fastcgi");
+			return FALSE;
+		}
+		struct iovec iov[] = {
+			{header_buff, sizeof(header_buff)},
+			{const_cast<void *>(pbuff), rec_len},
+			{const_cast<uint8_t *>(padding), padding_len},
+		};
+		if (!mod_fastcgi_safe_write(pfast_context->cli_sockd, iov, arsizeof(iov))) {
+			http_parser_log_info(phttp, LV_DEBUG, "fail to "
+				"write record to fastcgi back-end %s",
+				pfast_context->pfnode->sock_path.c_str());
+			return FALSE;
+		}
+		pbuff = static_cast<const char *>(pbuff) + rec_len;
+		length -= rec_len;
+	} while (length > 0);
+	time(&pfast_context->last_time);
+	return TRUE;
+}
+
+BOOL mod_fastcgi_relay_content(HTTP_CONTEXT *phttp)
+{
+	auto pfast_context = phttp->pfast_context;
+	
+	if (pfast_context->cli_sockd < 0 && !mod_fastcgi_begin_request(phttp))
+		return FALSE;
+	if (pfast_context->chunk_body.size() > 0 &&
+	    !mod_fastcgi_write_stdin(phttp, pfast_context->chunk_body.data(),
+	    pfast_context->chunk_body.size()))
+		return FALSE;
+	/* the empty STDIN record marks the end of the request body */
+	if (!mod_fastcgi_write_stdin(phttp, nullptr, 0)) {
 		http_parser_log_info(phttp, LV_DEBUG, "fail to write"
 			" last empty stdin to fastcgi back-end %s",
-			phttp->pfast_context->pfnode->sock_path.c_str());
+			pfast_context->pfnode->sock_path.c_str());
 		return FALSE;
 	}
-	phttp->pfast_context->cli_sockd = cli_sockd;
 	return TRUE;
 }
 
 void mod_fastcgi_put_context(HTTP_CONTEXT *phttp)
 {
-	char tmp_path[256];
+	auto pfast_context = phttp->pfast_context;
 	
-	if (-1 != phttp->pfast_context->cache_fd) {
-		close(phttp->pfast_context->cache_fd);
-		snprintf(tmp_path, GX_ARRAY_SIZE(tmp_path), "/tmp/http-%u", phttp->context_id);
-		if (remove(tmp_path) < 0 && errno != ENOENT)
-			fprintf(stderr, "W-1361: remove %s: %s\n", tmp_path, strerror(errno));
+	if (pfast_context->cli_sockd != -1) {
+		if (pfast_context->b_reuse)
+			mod_fastcgi_pool_put(pfast_context->pfnode->pool,
+				pfast_context->cli_sockd);
+		else
+			close(pfast_context->cli_sockd);
+		pfast_context->cli_sockd = -1;
 	}
-	if (phttp->pfast_context->cli_sockd != -1)
-		close(phttp->pfast_context->cli_sockd);
+	std::string().swap(pfast_context->chunk_body);
 	phttp->pfast_context = NULL;
 }
 
@@ -920,54 +1013,63 @@ BOOL mod_fastcgi_write_request(HTTP_CONTEXT *phttp)
 	void *pbuff;
 	char *ptoken;
 	char tmp_buff[1024];
+	auto pfast_context = phttp->pfast_context;
 	
-	if (phttp->pfast_context->b_end)
-		return TRUE;
-	if (-1 == phttp->pfast_context->cache_fd) {
-		if (phttp->pfast_context->content_length <= phttp->stream_in.get_total_length())
-			phttp->pfast_context->b_end = TRUE;	
+	if (pfast_context->b_end)
 		return TRUE;
-	}
-	if (FALSE == phttp->pfast_context->b_chunked) {
-		if (phttp->pfast_context->cache_size + phttp->stream_in.get_total_length() < phttp->pfast_context->content_length &&
-		    phttp->stream_in.get_total_length() < g_cache_size)
-			return TRUE;	
-		size = STREAM_BLOCK_SIZE;
+	if (FALSE == pfast_context->b_chunked) {
+		if (pfast_context->cli_sockd < 0 &&
+		    !mod_fastcgi_begin_request(phttp))
+			return FALSE;
+		if (pfast_context->content_length == 0) {
+			pfast_context->b_end = TRUE;
+			return TRUE;
+		}
+		size = STDIN_RECORD_MAX;
 		while ((pbuff = phttp->stream_in.get_read_buf(reinterpret_cast<unsigned int *>(&size))) != nullptr) {
-			if (phttp->pfast_context->cache_size + size >
-				phttp->pfast_context->content_length) {
-				tmp_len = phttp->pfast_context->content_length
-							- phttp->pfast_context->cache_size;
+			if (pfast_context->body_size + size >
+			    pfast_context->content_length) {
+				/* anything beyond is the next pipelined request */
+				tmp_len = pfast_context->content_length
+				          - pfast_context->body_size;
 				phttp->stream_in.rewind_read_ptr(size - tmp_len);
-				phttp->pfast_context->cache_size =
-					phttp->pfast_context->content_length;
 			} else {
-				phttp->pfast_context->cache_size += size;
 				tmp_len = size;
 			}
-			if (tmp_len != write(phttp->pfast_context->cache_fd,
-				pbuff, tmp_len)) {
-				http_parser_log_info(phttp, LV_DEBUG, "fail to"
-					" write cache file for mod_fastcgi");
+			if (!mod_fastcgi_write_stdin(phttp, pbuff, tmp_len))
 				return FALSE;
-			}
-			if (phttp->pfast_context->cache_size ==
-				phttp->pfast_context->content_length) {
-				phttp->pfast_context->b_end = TRUE;
+			pfast_context->body_size += tmp_len;
+			if (pfast_context->body_size ==
+			    pfast_context->content_length) {
+				pfast_context->b_end = TRUE;
 				return TRUE;
 			}
-			size = STREAM_BLOCK_SIZE;
+			size = STDIN_RECORD_MAX;
 		}
 	} else {
  CHUNK_BEGIN:
-		if (phttp->pfast_context->chunk_size ==
-			phttp->pfast_context->chunk_offset) {
+		if (pfast_context->chunk_size ==
+			pfast_context->chunk_offset) {
 			size = phttp->stream_in.peek_buffer(tmp_buff, 1024);
+			if (pfast_context->chunk_size > 0) {
+				/* chunk data is terminated by CRLF */
+				if (size < 2)
+					return TRUE;
+				if (strncmp(tmp_buff, "\r\n", 2) != 0) {
+					http_parser_log_info(phttp, LV_DEBUG, "fail to "
+						"parse chunked block for mod_fastcgi");
+					return FALSE;
+				}
+				phttp->stream_in.fwd_read_ptr(2);
+				pfast_context->chunk_size = 0;
+				pfast_context->chunk_offset = 0;
+				size = phttp->stream_in.peek_buffer(tmp_buff, 1024);
+			}
 			if (size < 5)
 				return TRUE;
 			if (0 == strncmp("0\r\n\r\n", tmp_buff, 5)) {
 				phttp->stream_in.fwd_read_ptr(5);
-				phttp->pfast_context->b_end = TRUE;
+				pfast_context->b_end = TRUE;
 				return TRUE;
 			}
 			ptoken = static_cast<char *>(memmem(tmp_buff, size, "\r\n", 2));
@@ -980,53 +1082,47 @@ BOOL mod_fastcgi_write_request(HTTP_CONTEXT *phttp)
 				return TRUE;
 			}
 			*ptoken = '\0';
-			phttp->pfast_context->chunk_size =
+			pfast_context->chunk_size =
 					strtol(tmp_buff, NULL, 16);
-			if (0 == phttp->pfast_context->chunk_size) {
+			if (0 == pfast_context->chunk_size) {
 				http_parser_log_info(phttp, LV_DEBUG, "fail to "
 					"parse chunked block for mod_fastcgi");
 				return FALSE;
 			}
-			phttp->pfast_context->chunk_offset = 0;
+			pfast_context->chunk_offset = 0;
 			tmp_len = ptoken + 2 - tmp_buff;
 			phttp->stream_in.fwd_read_ptr(tmp_len);
 		}
-		size = STREAM_BLOCK_SIZE;
+		size = STDIN_RECORD_MAX;
 		while ((pbuff = phttp->stream_in.get_read_buf(reinterpret_cast<unsigned int *>(&size))) != nullptr) {
-			if (phttp->pfast_context->chunk_size >=
-				size + phttp->pfast_context->chunk_offset) {
-				if (size != write(phttp->pfast_context->cache_fd,
-					pbuff, size)) {
-					http_parser_log_info(phttp, LV_DEBUG, "fail to"
-						" write cache file for mod_fastcgi");
-					return FALSE;
-				}
-				phttp->pfast_context->chunk_offset += size;
-				phttp->pfast_context->cache_size += size;
+			if (pfast_context->chunk_size >=
+			    size + pfast_context->chunk_offset) {
+				tmp_len = size;
 			} else {
-				tmp_len = phttp->pfast_context->chunk_size
-					- phttp->pfast_context->chunk_offset;
-				if (tmp_len != write(phttp->pfast_context->cache_fd,
-					pbuff, tmp_len)) {
-					http_parser_log_info(phttp, LV_DEBUG, "fail to"
-						" write cache file for mod_fastcgi");
-					return FALSE;
-				}
+				tmp_len = pfast_context->chunk_size
+				          - pfast_context->chunk_offset;
 				phttp->stream_in.rewind_read_ptr(size - tmp_len);
-				phttp->pfast_context->cache_size += tmp_len;
-				phttp->pfast_context->chunk_offset =
-					phttp->pfast_context->chunk_size;
 			}
-			if (phttp->pfast_context->cache_size > g_max_size) {
+			pfast_context->chunk_offset += tmp_len;
+			pfast_context->body_size += tmp_len;
+			if (pfast_context->body_size > g_max_size) {
 				http_parser_log_info(phttp, LV_DEBUG, "chunked content"
 						" length is too long for mod_fastcgi");
 				return FALSE;
 			}
-			if (phttp->pfast_context->chunk_offset ==
-			    phttp->pfast_context->chunk_size)
-				goto CHUNK_BEGIN;	
+			try {
+				pfast_context->chunk_body.append(static_cast<char *>(pbuff), tmp_len);
+			} catch (const std::bad_alloc &) {
+				http_parser_log_info(phttp, LV_DEBUG, "out of memory");
+				return FALSE;
+			}
+			if (pfast_context->chunk_offset ==
+			    pfast_context->chunk_size)
+				goto CHUNK_BEGIN;
+			size = STDIN_RECORD_MAX;
 		}
 	}
+	/* everything buffered so far has been forwarded */
 	phttp->stream_in.clear();
 	return TRUE;
 }
@@ -1143,15 +1239,19 @@ BOOL mod_fastcgi_read_response(HTTP_CONTEXT *phttp)
 			ndr_pull_init(&ndr_pull, tmp_buff, tmp_len,
 				NDR_FLAG_NOALIGN|NDR_FLAG_BIGENDIAN);
 			if (mod_fastcgi_pull_end_request(&ndr_pull,
-			    header.padding_len, &end_request) != NDR_ERR_SUCCESS)
+			    header.padding_len, &end_request) != NDR_ERR_SUCCESS) {
 				http_parser_log_info(phttp, LV_DEBUG, "fail to"
 					" pull record body in mod_fastcgi");
-			else
+			} else {
 				http_parser_log_info(phttp, LV_DEBUG, "app_status %u, "
 						"protocol_status %d from fastcgi back-end"
 						" %s", end_request.app_status,
 						(int)end_request.protocol_status,
 						phttp->pfast_context->pfnode->sock_path.c_str());
+				/* all records of this request are consumed; reusable */
+				phttp->pfast_context->b_reuse = g_pool_size > 0 &&
+					end_request.protocol_status == PROTOCOL_STATUS_REQUEST_COMPLETE;
+			}
 			if (phttp->pfast_context->b_header &&
 			    phttp->pfast_context->b_chunked)
 				phttp->stream_out.write("0\r\n\r\n", 5);
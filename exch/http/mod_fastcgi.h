@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdint>
 #include <ctime>
+#include <string>
 #include <gromox/common_types.hpp>
 #define RESPONSE_TIMEOUT				-1
 #define RESPONSE_WAITING				0
@@ -16,18 +17,30 @@ struct FASTCGI_CONTEXT {
 	BOOL b_end;
 	uint64_t content_length;
 	const FASTCGI_NODE *pfnode;
-	int cache_fd;
-	uint64_t cache_size;
+	uint64_t body_size; /* bytes of request body forwarded so far */
+	/*
+	 * PARAMS must carry CONTENT_LENGTH before any STDIN, so a chunked
+	 * body is decoded here (at most fastcgi_max_size) and sent at the end.
+	 */
+	std::string chunk_body;
 	int cli_sockd;
+	bool b_reuse; /* END_REQUEST seen, connection may go back to the pool */
 	BOOL b_header; /* is response header met */
 	time_t last_time;
 };
 
+struct FASTCGI_STATS {
+	unsigned int pool_size, idle;
+	int pool_idle_timeout;
+	uint64_t requests, connects, reuses, discards;
+};
+
 struct HTTP_CONTEXT;
 
-extern void mod_fastcgi_init(int context_num, uint64_t cache_size, uint64_t max_size, int exec_timeout);
+extern void mod_fastcgi_init(int context_num, uint64_t max_size, int exec_timeout, unsigned int pool_size, int pool_idle_timeout);
 extern int mod_fastcgi_run();
 extern void mod_fastcgi_stop();
+extern void mod_fastcgi_get_stats(FASTCGI_STATS *);
 BOOL mod_fastcgi_get_context(HTTP_CONTEXT *phttp);
 BOOL mod_fastcgi_check_end_of_read(HTTP_CONTEXT *phttp);
 BOOL mod_fastcgi_check_responded(HTTP_CONTEXT *phttp);
@@ -393,7 +393,6 @@ pdu_processor_create(const char *host, uint16_t tcp_port)
 	{
 			double_list_init(&pprocessor->context_list);
 			double_list_init(&pprocessor->auth_list);
-			double_list_init(&pprocessor->fragmented_list);
 			pprocessor->pendpoint = &*ei;
 			std::lock_guard li_hold(g_list_lock);
 			g_processor_list.push_back(pprocessor.get());
@@ -406,7 +405,6 @@ PDU_PROCESSOR::~PDU_PROCESSOR()
 {
 	auto pprocessor = this;
 	uint64_t handle;
-	DCERPC_CALL *pcall;
 	DCERPC_CALL fake_call;
 	DOUBLE_LIST_NODE *pnode;
 	DCERPC_CONTEXT *pcontext;
@@ -439,11 +437,9 @@ PDU_PROCESSOR::~PDU_PROCESSOR()
 	}
 	double_list_free(&pprocessor->auth_list);
 	
-	while ((pnode = double_list_pop_front(&pprocessor->fragmented_list)) != nullptr) {
-		pcall = (DCERPC_CALL*)pnode->pdata;
-		pdu_processor_free_call(pcall);
-	}
-	double_list_free(&pprocessor->fragmented_list);
+	for (const auto &e : pprocessor->fragmented_calls)
+		pdu_processor_free_call(e.second);
+	pprocessor->fragmented_calls.clear();
 	
 	pprocessor->cli_max_recv_frag = 0;
 	std::unique_lock li_hold(g_list_lock);
@@ -513,18 +509,12 @@ void pdu_processor_free_blob(BLOB_NODE *pbnode)
 static DCERPC_CALL* pdu_processor_get_fragmented_call(
 	PDU_PROCESSOR *pprocessor, uint32_t call_id)
 {
-	DCERPC_CALL *pcall;
-	DOUBLE_LIST_NODE *pnode;
-	
-	for (pnode=double_list_get_head(&pprocessor->fragmented_list); NULL!=pnode;
-		pnode=double_list_get_after(&pprocessor->fragmented_list, pnode)) {
-		pcall = (DCERPC_CALL*)pnode->pdata;
-		if (pcall->pkt.call_id == call_id) {
-			double_list_remove(&pprocessor->fragmented_list, pnode);
-			return pcall;
-		}
-	}
-	return NULL;
+	auto it = pprocessor->fragmented_calls.find(call_id);
+	if (it == pprocessor->fragmented_calls.end())
+		return NULL;
+	auto pcall = it->second;
+	pprocessor->fragmented_calls.erase(it);
+	return pcall;
 }
 
 static uint32_t pdu_processor_allocate_group_id(DCERPC_ENDPOINT *pendpoint)
@@ -3175,50 +3165,19 @@ int pdu_processor_input(PDU_PROCESSOR *pprocessor, const char *pbuff,
 			}
 			
 			prequestx = &pcallx->pkt.payload.request;
-
-			alloc_size = prequestx->stub_and_verifier.length +
-							prequest->stub_and_verifier.length;
-			if (prequestx->alloc_hint > alloc_size) {
-				alloc_size = prequestx->alloc_hint;
-			}
-			
-			if (pcallx->alloc_size < alloc_size) {
-				if (alloc_size > g_max_request_mem) {
-					pdu_processor_free_call(pcallx);
-					if (FALSE == pdu_processor_fault(pcall,
-						DCERPC_FAULT_OTHER)) {
-						pdu_processor_free_call(pcall);
-						return PDU_PROCESSOR_ERROR;
-					}
-					*ppcall = pcall;
-					return PDU_PROCESSOR_OUTPUT;
-				}	
-				alloc_size = strange_roundup(alloc_size - 1, 16 * 1024);
-				pdata = malloc(alloc_size);
-				if (NULL == pdata) {
-					pdu_processor_free_call(pcallx);
-					if (FALSE == pdu_processor_fault(pcall,
-						DCERPC_FAULT_OTHER)) {
-						pdu_processor_free_call(pcall);
-						return PDU_PROCESSOR_ERROR;
-					}
-					*ppcall = pcall;
-					return PDU_PROCESSOR_OUTPUT;
+			if (!pdu_processor_append_stub(&prequestx->stub_and_verifier,
+			    &pcallx->alloc_size, prequest->stub_and_verifier.data,
+			    prequest->stub_and_verifier.length,
+			    prequestx->alloc_hint, g_max_request_mem)) {
+				pdu_processor_free_call(pcallx);
+				if (FALSE == pdu_processor_fault(pcall,
+					DCERPC_FAULT_OTHER)) {
+					pdu_processor_free_call(pcall);
+					return PDU_PROCESSOR_ERROR;
 				}
-				memcpy(pdata, prequestx->stub_and_verifier.data,
-					prequestx->stub_and_verifier.length);
-				free(prequestx->stub_and_verifier.data);
-				prequestx->stub_and_verifier.vdata = pdata;
-				pcallx->alloc_size = alloc_size;
+				*ppcall = pcall;
+				return PDU_PROCESSOR_OUTPUT;
 			}
-				
-			memcpy(prequestx->stub_and_verifier.data +
-				prequestx->stub_and_verifier.length,
-				prequest->stub_and_verifier.data,
-				prequest->stub_and_verifier.length);
-			
-			prequestx->stub_and_verifier.length +=
-				prequest->stub_and_verifier.length;
 
 			pcallx->pkt.pfc_flags |= pcall->pkt.pfc_flags&DCERPC_PFC_FLAG_LAST;
 			pdu_processor_free_call(pcall);
@@ -3227,18 +3186,24 @@ int pdu_processor_input(PDU_PROCESSOR *pprocessor, const char *pbuff,
 		
 
 		/* this may not be the last pdu in the chain - if its isn't then
-		just put it on the fragmented_list and wait for the rest */
+		just put it into fragmented_calls and wait for the rest */
 		if (0 == (pcall->pkt.pfc_flags & DCERPC_PFC_FLAG_LAST)) {
-			if (double_list_get_nodes_num(&pprocessor->fragmented_list) >
-				MAX_FRAGMENTED_CALLS) {
+			if (pprocessor->fragmented_calls.size() > MAX_FRAGMENTED_CALLS) {
 				debug_info("[pdu_processor]: maximum fragments"
 					" number of call reached\n");
 				pdu_processor_free_call(pcall);
 				return PDU_PROCESSOR_ERROR;
 			}
-			
-			double_list_append_as_tail(&pprocessor->fragmented_list,
-				&pcall->node);
+			try {
+				auto &slot = pprocessor->fragmented_calls[pcall->pkt.call_id];
+				/* a new FIRST fragment supersedes an unfinished one */
+				if (slot != nullptr && slot != pcall)
+					pdu_processor_free_call(slot);
+				slot = pcall;
+			} catch (const std::bad_alloc &) {
+				pdu_processor_free_call(pcall);
+				return PDU_PROCESSOR_ERROR;
+			}
 			*ppcall = pcall;
 			return PDU_PROCESSOR_INPUT;
 		}
@@ -1,7 +1,11 @@
 #pragma once
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <list>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <gromox/dcerpc.hpp>
 #include <gromox/ndr.hpp>
 #include <gromox/plugin.hpp>
@@ -43,6 +47,8 @@ struct PROC_PLUGIN {
 	bool completed_init = false;
 };
 
+struct DCERPC_CALL;
+
 /* virtual connection to DCE RPC server, actually only data structure of context */
 struct PDU_PROCESSOR {
 	~PDU_PROCESSOR();
@@ -51,7 +57,9 @@ struct PDU_PROCESSOR {
 	uint32_t assoc_group_id = 0; /* we do not support association mechanism */
 	uint32_t cli_max_recv_frag = 0; /* the maximum size the client wants to receive */
 	DCERPC_ENDPOINT *pendpoint = nullptr;
-	DOUBLE_LIST context_list{}, auth_list{}, fragmented_list{};
+	DOUBLE_LIST context_list{}, auth_list{};
+	/* requests still waiting for their LAST fragment, by call_id */
+	std::unordered_map<uint32_t, DCERPC_CALL *> fragmented_calls;
 };
 
 struct DCERPC_AUTH_CONTEXT {
@@ -95,6 +103,34 @@ struct BLOB_NODE {
 	DATA_BLOB blob;
 };
 
+/*
+ * Append one request fragment's stub data to the reassembly buffer @dst
+ * (malloc'd, *@palloc_size bytes). The buffer grows at least twofold, and
+ * right to @hint (the client's alloc_hint) when that is larger, so that
+ * a request of n fragments costs O(n) copying in total instead of O(n^2).
+ */
+static inline bool pdu_processor_append_stub(DATA_BLOB *dst,
+    uint32_t *palloc_size, const void *src, uint32_t len, size_t hint,
+    size_t limit)
+{
+	size_t need = static_cast<size_t>(dst->length) + len;
+	if (need > limit)
+		return false;
+	if (need > *palloc_size) {
+		size_t size = std::max({need, std::min(hint, limit),
+		              std::min(2 * static_cast<size_t>(*palloc_size), limit)});
+		auto pdata = realloc(dst->vdata, size);
+		if (pdata == nullptr)
+			return false;
+		dst->vdata = pdata;
+		*palloc_size = size;
+	}
+	if (len > 0)
+		memcpy(dst->data + dst->length, src, len);
+	dst->length = need;
+	return true;
+}
+
 extern void pdu_processor_init(int connection_num, int connection_ratio,
 	const char *netbios_name, const char *dns_name, const char *dns_domain,
 	BOOL header_signing, size_t max_request_mem, const char *plugins_path,
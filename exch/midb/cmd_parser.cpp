@@ -5,8 +5,10 @@
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 #include <libHX/string.h>
 #include <gromox/atomic.hpp>
+#include <gromox/call_stats.hpp>
 #include <gromox/defs.h>
 #include <gromox/common_types.hpp>
 #include <gromox/double_list.hpp>
@@ -26,6 +28,7 @@
 #define MAX_ARGS			(32*1024)
 
 #define CONN_BUFFLEN        (257*1024)
+#define MAX_COMMANDS		64
 
 using namespace gromox;
 
@@ -37,9 +40,24 @@ static std::mutex g_connection_lock, g_cond_mutex;
 static std::condition_variable g_waken_cond;
 static DOUBLE_LIST g_connection_list;
 static DOUBLE_LIST g_connection_list1;
-static std::unordered_map<std::string, MIDB_CMD_HANDLER> g_cmd_entry;
+namespace {
+struct CMD_ENTRY {
+	MIDB_CMD_HANDLER handler;
+	unsigned int id;
+};
+}
+
+static std::unordered_map<std::string, CMD_ENTRY> g_cmd_entry;
+static std::vector<std::string> g_cmd_names;
 unsigned int g_cmd_debug;
 
+static const char *cmd_parser_idtoname(unsigned int id)
+{
+	return id < g_cmd_names.size() ? g_cmd_names[id].c_str() : "";
+}
+
+call_stats g_cmd_stats("midb", MAX_COMMANDS, cmd_parser_idtoname);
+
 static void *midcp_thrwork(void *);
 static int cmd_parser_generate_args(char* cmd_line, int cmd_len, char** argv);
 
@@ -161,7 +179,10 @@ void cmd_parser_stop()
 
 void cmd_parser_register_command(const char *command, MIDB_CMD_HANDLER handler)
 {
-	g_cmd_entry.emplace(command, handler);
+	/* ids beyond MAX_COMMANDS still work, they just go unrecorded */
+	if (g_cmd_entry.emplace(command, CMD_ENTRY{handler,
+	    static_cast<unsigned int>(g_cmd_names.size())}).second)
+		g_cmd_names.emplace_back(command);
 }
 
 static thread_local int dbg_current_argc;
@@ -199,7 +220,8 @@ void cmd_write(int fd, const void *vbuf, size_t z)
 	cmd_write_x(2, fd, static_cast<const char *>(vbuf), z);
 }
 
-static std::pair<bool, int> midcp_exec1(int argc, char **argv, MIDB_CONNECTION *conn)
+static std::pair<bool, int> midcp_exec1(int argc, char **argv,
+    MIDB_CONNECTION *conn, size_t line_len)
 {
 	if (g_notify_stop)
 		return {false, 0};
@@ -208,18 +230,22 @@ static std::pair<bool, int> midcp_exec1(int argc, char **argv, MIDB_CONNECTION *
 		return {false, 0};
 	if (!common_util_build_environment(argv[1]))
 		return {false, 0};
-	auto err = cmd_iter->second(argc, argv, conn->sockd);
+	call_stats::begin();
+	call_stats::note_dir(argv[1]);
+	auto err = cmd_iter->second.handler(argc, argv, conn->sockd);
+	g_cmd_stats.end(cmd_iter->second.id, line_len);
 	common_util_free_environment();
 	if (err == 0)
 		return {true, 0};
 	return {false, err};
 }
 
-static void midcp_exec(int argc, char **argv, MIDB_CONNECTION *conn)
+static void midcp_exec(int argc, char **argv, MIDB_CONNECTION *conn,
+    size_t line_len)
 {
 	dbg_current_argc = argc;
 	dbg_current_argv = argv;
-	auto [replied, result] = midcp_exec1(argc, argv, conn);
+	auto [replied, result] = midcp_exec1(argc, argv, conn, line_len);
 	if (replied)
 		return;
 	char rsp[20];
@@ -306,7 +332,7 @@ static void *midcp_thrwork(void *param)
 			}
 
 			HX_strupper(argv[0]);
-			midcp_exec(argc, argv, pconnection);
+			midcp_exec(argc, argv, pconnection, i);
 			offset -= i + 2;
 			memmove(buffer, buffer + i + 2, offset);
 			break;
@@ -1,4 +1,5 @@
 #pragma once
+#include <gromox/call_stats.hpp>
 #include <gromox/double_list.hpp>
 #include <pthread.h>
 
@@ -21,3 +22,4 @@ extern void cmd_parser_register_command(const char *command, MIDB_CMD_HANDLER);
 extern void cmd_write(int fd, const void *buf, size_t size);
 
 extern unsigned int g_cmd_debug;
+extern gromox::call_stats g_cmd_stats;
@@ -3,6 +3,7 @@
 #	include "config.h"
 #endif
 #include "console_cmd_handler.h"
+#include "cmd_parser.h"
 #include <gromox/console_server.hpp>
 #include "exmdb_client.h"
 #include "mail_engine.h"
@@ -25,7 +26,9 @@ static char g_server_help[] =
 static char g_midb_help[] =
 	"250 MIDB DAEMON midb control help information:\r\n"
 	"\tmidb info\r\n"
-	"\t    --print the http parser info";
+	"\t    --print the http parser info\r\n"
+	"\tmidb stats [reset]\r\n"
+	"\t    --print (or clear) the per-command latency statistics";
 
 static char g_system_help[] =
 	"250 MIDB DAEMON system help information:\r\n"
@@ -68,6 +71,17 @@ BOOL cmd_handler_midb_control(int argc, char** argv)
 			exmdb_client_get_param(LOST_PROXY_CONNECTIONS));
 		return TRUE;
 	}
+	if (2 == argc && 0 == strcmp(argv[1], "stats")) {
+		auto text = g_cmd_stats.dump(50);
+		console_server_reply_to_client("250 midb command statistics:\r\n%s", text.c_str());
+		return TRUE;
+	}
+	if (3 == argc && 0 == strcmp(argv[1], "stats") &&
+	    0 == strcmp(argv[2], "reset")) {
+		g_cmd_stats.reset();
+		console_server_reply_to_client("250 statistics cleared");
+		return TRUE;
+	}
 	console_server_reply_to_client("550 invalid argument %s", argv[1]);
 	return TRUE;
 }
@@ -15,6 +15,7 @@
 #include <libHX/ctype_helper.h>
 #include <libHX/string.h>
 #include <gromox/atomic.hpp>
+#include <gromox/call_stats.hpp>
 #include <gromox/database.h>
 #include <gromox/defs.h>
 #include <gromox/fileio.h>
@@ -231,11 +232,13 @@ static char* mail_engine_ct_to_utf8(const char *charset, const char *string)
 		return strdup(string);
 	}	
 	length = strlen(string) + 1;
+	if (charset_ascii_compatible(charset) && str_isascii(string, length))
+		return strdup(string);
 	auto ret_string = me_alloc<char>(2 * length);
 	if (NULL == ret_string) {
 		return NULL;
 	}
-	conv_id = iconv_open("UTF-8", charset);
+	conv_id = iconv_cached("UTF-8", charset);
 	if ((iconv_t)-1 == conv_id) {
 		free(ret_string);
 		return NULL;
@@ -245,11 +248,9 @@ static char* mail_engine_ct_to_utf8(const char *charset, const char *string)
 	in_len = length;
 	out_len = 2*length;
 	if (iconv(conv_id, &pin, &in_len, &pout, &out_len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
 		free(ret_string);
 		return NULL;
 	}
-	iconv_close(conv_id);
 	return ret_string;
 }
 
@@ -273,21 +274,19 @@ static uint64_t mail_engine_get_digest(sqlite3 *psqlite,
 		snprintf(temp_path, 256, "%s/eml/%s",
 			common_util_get_maildir(), mid_string);
 		fd = open(temp_path, O_RDONLY);
-		if (fd.get() < 0 || fstat(fd.get(), &node_stat) < 0) {
+		if (fd.get() < 0) {
 			fprintf(stderr, "%s: %s: %s\n", __func__, temp_path, strerror(errno));
 			return 0;
 		}
-		if (!S_ISREG(node_stat.st_mode))
-			return 0;
-		std::unique_ptr<char[], stdlib_delete> pbuff(me_alloc<char>(node_stat.st_size));
-		if (NULL == pbuff) {
+		mapped_file pbuff;
+		auto ret = pbuff.map(fd.get());
+		if (ret != 0) {
+			fprintf(stderr, "%s: %s: %s\n", __func__, temp_path, strerror(ret));
 			return 0;
 		}
-		if (read(fd.get(), pbuff.get(), node_stat.st_size) != node_stat.st_size)
-			return 0;
 		fd.close();
 		MAIL imail(g_mime_pool);
-		if (!imail.retrieve(pbuff.get(), node_stat.st_size))
+		if (!imail.retrieve(pbuff.data(), pbuff.size()))
 			return 0;
 		tmp_len = sprintf(digest_buff, "{\"file\":\"\",");
 		if (imail.get_digest(&size, digest_buff + tmp_len,
@@ -2538,7 +2537,9 @@ static IDB_REF mail_engine_peek_idb(const char *path)
 	auto pidb = &it->second;
 	pidb->reference ++;
 	hhold.unlock();
+	auto t_wait = std::chrono::steady_clock::now();
 	pidb->lock.lock();
+	call_stats::note_lock_wait(std::chrono::steady_clock::now() - t_wait);
 	if (NULL == pidb->psqlite) {
 		pidb->last_time = 0;
 		pidb->lock.unlock();
@@ -2581,6 +2582,7 @@ static IDB_REF mail_engine_get_idb(const char *path)
 			fprintf(stderr, "E-1438: sqlite3_open %s: %s\n", temp_path, sqlite3_errstr(ret));
 			return {};
 		}
+		gx_sql_count_ops(pidb->psqlite);
 		gx_sql_exec(pidb->psqlite, "PRAGMA foreign_keys=ON");
 		gx_sql_exec(pidb->psqlite, g_async ? "PRAGMA synchronous=ON" : "PRAGMA synchronous=OFF");
 		gx_sql_exec(pidb->psqlite, g_wal ? "PRAGMA journal_mode=WAL" : "PRAGMA journal_mode=DELETE");
@@ -2618,7 +2620,10 @@ static IDB_REF mail_engine_get_idb(const char *path)
 	}
 	pidb->reference ++;
 	hhold.unlock();
-	if (!pidb->lock.try_lock_for(DB_LOCK_TIMEOUT)) {
+	auto t_wait = std::chrono::steady_clock::now();
+	auto locked = pidb->lock.try_lock_for(DB_LOCK_TIMEOUT);
+	call_stats::note_lock_wait(std::chrono::steady_clock::now() - t_wait);
+	if (!locked) {
 		hhold.lock();
 		pidb->reference --;
 		hhold.unlock();
@@ -3023,7 +3028,6 @@ static int mail_engine_minst(int argc, char **argv, int sockd)
 	uint64_t change_num;
 	uint64_t message_id;
 	char sql_string[1024];
-	struct stat node_stat;
 	char temp_buff[MAX_DIGLEN];
 	
 	if (6 != argc || strlen(argv[1]) >= 256
@@ -3039,18 +3043,16 @@ static int mail_engine_minst(int argc, char **argv, int sockd)
 	wrapfd fd = open(temp_path, O_RDONLY);
 	if (fd.get() < 0)
 		return MIDB_E_NO_MEMORY;
-	if (fstat(fd.get(), &node_stat) != 0 || !S_ISREG(node_stat.st_mode))
+	mapped_file pbuff;
+	auto ret = pbuff.map(fd.get());
+	if (ret == EINVAL)
 		return MIDB_E_PARAMETER_ERROR;
-	std::unique_ptr<char[], stdlib_delete> pbuff(me_alloc<char>(node_stat.st_size));
-	if (NULL == pbuff) {
-		return MIDB_E_NO_MEMORY;
-	}
-	if (read(fd.get(), pbuff.get(), node_stat.st_size) != node_stat.st_size)
+	else if (ret != 0)
 		return MIDB_E_NO_MEMORY;
 	fd.close();
 
 	MAIL imail(g_mime_pool);
-	if (!imail.retrieve(pbuff.get(), node_stat.st_size))
+	if (!imail.retrieve(pbuff.data(), pbuff.size()))
 		return MIDB_E_NO_MEMORY;
 	tmp_len = sprintf(temp_buff, "{\"file\":\"\",");
 	if (imail.get_digest(&mess_len, temp_buff + tmp_len, MAX_DIGLEN - tmp_len - 1) <= 0)
@@ -3227,7 +3229,6 @@ static int mail_engine_mcopy(int argc, char **argv, int sockd)
 	uint64_t change_num;
 	uint64_t message_id;
 	char sql_string[1024];
-	struct stat node_stat;
 
 	if (5 != argc || strlen(argv[1]) >= 256 ||
 		strlen(argv[2]) >= 1024 || strlen(argv[4]) >= 1024) {
@@ -3243,18 +3244,16 @@ static int mail_engine_mcopy(int argc, char **argv, int sockd)
 	wrapfd fd = open(eml_path.c_str(), O_RDONLY);
 	if (fd.get() < 0)
 		return MIDB_E_NO_MEMORY;
-	if (fstat(fd.get(), &node_stat) != 0 || !S_ISREG(node_stat.st_mode))
+	mapped_file pbuff;
+	auto ret = pbuff.map(fd.get());
+	if (ret == EINVAL)
 		return MIDB_E_PARAMETER_ERROR;
-	std::unique_ptr<char[], stdlib_delete> pbuff(me_alloc<char>(node_stat.st_size));
-	if (NULL == pbuff) {
-		return MIDB_E_NO_MEMORY;
-	}
-	if (read(fd.get(), pbuff.get(), node_stat.st_size) != node_stat.st_size)
+	else if (ret != 0)
 		return MIDB_E_NO_MEMORY;
 	fd.close();
 
 	MAIL imail(g_mime_pool);
-	if (!imail.retrieve(pbuff.get(), node_stat.st_size))
+	if (!imail.retrieve(pbuff.data(), pbuff.size()))
 		return MIDB_E_NO_MEMORY;
 	auto pidb = mail_engine_get_idb(argv[1]);
 	if (pidb == nullptr) {
@@ -4762,6 +4761,137 @@ static int mail_engine_prflg(int argc, char **argv, int sockd)
 	return 0;
 }
 
+/*
+ * P-BFLG <dir> <folder> <set> <unset> <mid>...
+ *
+ * Applies a flag delta to many messages at once: letters in <unset> are
+ * cleared first, then those in <set> are raised (so a STORE FLAGS
+ * replacement is one command). Local flags are updated in a single
+ * transaction, read state changes go to exmdb as one bulk call per
+ * direction. The reply lists the resulting flags of each message in
+ * argument order, "-" for messages that are not in the folder.
+ */
+static int mail_engine_pbflg(int argc, char **argv, int sockd)
+{
+	/* same order as the flag columns selected below */
+	static constexpr char letters[] = "AUFWDSR";
+	static constexpr unsigned int COL_UNSENT = 1, COL_READ = 5;
+	uint32_t tmp_proptag;
+	uint32_t message_flags;
+	EID_ARRAY message_ids;
+	PROPTAG_ARRAY proptags;
+	PROBLEM_ARRAY problems;
+	TPROPVAL_ARRAY propvals;
+
+	if (argc < 6 || strlen(argv[1]) >= 256 || strlen(argv[2]) >= 1024) {
+		return MIDB_E_PARAMETER_ERROR;
+	}
+	std::string reply;
+	std::vector<uint64_t> to_read, to_unread;
+	std::vector<std::pair<uint64_t, bool>> to_unsent;
+	auto pidb = mail_engine_get_idb(argv[1]);
+	if (pidb == nullptr)
+		return MIDB_E_HASHTABLE_FULL;
+	auto folder_id = mail_engine_get_folder_id(pidb.get(), argv[2]);
+	if (0 == folder_id) {
+		return MIDB_E_NO_FOLDER;
+	}
+	auto sql_transact = gx_sql_begin_trans(pidb->psqlite);
+	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT message_id, folder_id,"
+	             " replied, unsent, flagged, forwarded, deleted, read, recent"
+	             " FROM messages WHERE mid_string=?");
+	auto pstmt1 = gx_sql_prep(pidb->psqlite, "UPDATE messages SET replied=?,"
+	              " unsent=?, flagged=?, forwarded=?, deleted=?, read=?,"
+	              " recent=? WHERE message_id=?");
+	if (pstmt == nullptr || pstmt1 == nullptr) {
+		return MIDB_E_NO_MEMORY;
+	}
+	try {
+		reply = "TRUE";
+		for (int i = 5; i < argc; ++i) {
+			sqlite3_bind_text(pstmt, 1, argv[i], -1, SQLITE_STATIC);
+			if (SQLITE_ROW != sqlite3_step(pstmt) ||
+			    gx_sql_col_uint64(pstmt, 1) != folder_id) {
+				sqlite3_reset(pstmt);
+				reply += " -";
+				continue;
+			}
+			uint64_t message_id = sqlite3_column_int64(pstmt, 0);
+			bool old_val[7], new_val[7];
+			for (unsigned int k = 0; k < 7; ++k) {
+				old_val[k] = sqlite3_column_int64(pstmt, 2 + k) != 0;
+				new_val[k] = old_val[k];
+				if (strchr(argv[4], letters[k]) != nullptr)
+					new_val[k] = false;
+				if (strchr(argv[3], letters[k]) != nullptr)
+					new_val[k] = true;
+			}
+			sqlite3_reset(pstmt);
+			for (unsigned int k = 0; k < 7; ++k)
+				sqlite3_bind_int64(pstmt1, 1 + k, new_val[k]);
+			sqlite3_bind_int64(pstmt1, 8, message_id);
+			if (SQLITE_DONE != sqlite3_step(pstmt1)) {
+				return MIDB_E_NO_MEMORY;
+			}
+			sqlite3_reset(pstmt1);
+			if (new_val[COL_UNSENT] != old_val[COL_UNSENT])
+				to_unsent.emplace_back(message_id, new_val[COL_UNSENT]);
+			if (new_val[COL_READ] != old_val[COL_READ])
+				(new_val[COL_READ] ? to_read : to_unread).push_back(
+					rop_util_make_eid_ex(1, message_id));
+			reply += " (";
+			for (unsigned int k = 0; k < 7; ++k)
+				if (new_val[k])
+					reply += letters[k];
+			reply += ')';
+		}
+		reply += "\r\n";
+	} catch (const std::bad_alloc &) {
+		fprintf(stderr, "E-1619: ENOMEM\n");
+		return MIDB_E_NO_MEMORY;
+	}
+	pstmt.finalize();
+	pstmt1.finalize();
+	sql_transact.commit();
+	pidb.reset();
+	for (auto ids : {&to_read, &to_unread}) {
+		if (ids->empty())
+			continue;
+		message_ids.count = ids->size();
+		message_ids.pids = ids->data();
+		if (!exmdb_client::set_messages_read_state(argv[1], nullptr,
+		    &message_ids, ids == &to_read)) {
+			return MIDB_E_NO_MEMORY;
+		}
+	}
+	/* PR_MESSAGE_FLAGS is a whole-value property; no bulk form for it */
+	for (const auto &e : to_unsent) {
+		proptags.count = 1;
+		proptags.pproptag = &tmp_proptag;
+		tmp_proptag = PR_MESSAGE_FLAGS;
+		if (!exmdb_client::get_message_properties(argv[1], NULL,
+		    0, rop_util_make_eid_ex(1, e.first), &proptags, &propvals) ||
+		    0 == propvals.count) {
+			return MIDB_E_NO_MEMORY;
+		}
+		message_flags = *static_cast<uint32_t *>(propvals.ppropval[0].pvalue);
+		if (!!(message_flags & MSGFLAG_UNSENT) == e.second)
+			continue;
+		if (e.second)
+			message_flags |= MSGFLAG_UNSENT;
+		else
+			message_flags &= ~MSGFLAG_UNSENT;
+		propvals.ppropval[0].pvalue = &message_flags;
+		if (!exmdb_client::set_message_properties(argv[1],
+		    NULL, 0, rop_util_make_eid_ex(1, e.first), &propvals,
+		    &problems)) {
+			return MIDB_E_NO_MEMORY;
+		}
+	}
+	cmd_write(sockd, reply.c_str(), reply.size());
+	return 0;
+}
+
 static int mail_engine_pgflg(int argc, char **argv, int sockd)
 {
 	int temp_len;
@@ -5668,6 +5798,7 @@ int mail_engine_run()
 	cmd_parser_register_command("P-SFLG", mail_engine_psflg);
 	cmd_parser_register_command("P-RFLG", mail_engine_prflg);
 	cmd_parser_register_command("P-GFLG", mail_engine_pgflg);
+	cmd_parser_register_command("P-BFLG", mail_engine_pbflg);
 	cmd_parser_register_command("P-SRHL", mail_engine_psrhl);
 	cmd_parser_register_command("P-SRHU", mail_engine_psrhu);
 	exmdb_client_register_proc(reinterpret_cast<void *>(mail_engine_notification_proc));
@@ -61,15 +61,48 @@ static void term_handler(int signo)
 	g_notify_stop = true;
 }
 
+static constexpr cfg_directive cfg_default_values[] = {
+	{"config_file_path", PKGSYSCONFDIR "/midb:" PKGSYSCONFDIR},
+	{"console_server_ip", "::1"},
+	{"console_server_port", "9900"},
+	{"data_path", PKGDATADIR "/midb:" PKGDATADIR},
+	{"default_charset", "windows-1252"},
+	{"default_timezone", "Asia/Shanghai"},
+	{"midb_cache_interval", "30min", CFG_TIME, "1min", "30min"},
+	{"midb_cmd_debug", "0"},
+	{"midb_cmd_slow_threshold", "0"},
+	{"midb_cmd_stats_file", ""},
+	{"midb_cmd_stats_interval", "1min", CFG_TIME, "1s"},
+	{"midb_listen_ip", "::1"},
+	{"midb_listen_port", "5555"},
+	{"midb_mime_number", "4096", CFG_SIZE, "1024"},
+	{"midb_table_size", "5000", CFG_SIZE, "100", "50000"},
+	{"midb_threads_num", "100", CFG_SIZE, "20", "1000"},
+	{"notify_stub_threads_num", "10", CFG_SIZE, "1", "200"},
+	{"rpc_proxy_connection_num", "10", CFG_SIZE, "1", "200"},
+	{"service_plugin_path", PKGLIBDIR},
+	{"sqlite_mmap_size", "0", CFG_SIZE},
+	{"sqlite_synchronous", "off", CFG_BOOL},
+	{"sqlite_wal_mode", "true", CFG_BOOL},
+	{"state_path", PKGSTATEDIR},
+	{"x500_org_name", "Gromox default"},
+	{},
+};
+
 static bool midb_reload_config(std::shared_ptr<CONFIG_FILE> pconfig)
 {
 	if (pconfig == nullptr)
 		pconfig = config_file_prg(opt_config_file, "midb.cfg");
+	if (pconfig != nullptr)
+		config_file_apply(*pconfig, cfg_default_values);
 	if (opt_config_file != nullptr && pconfig == nullptr) {
 		printf("config_file_init %s: %s\n", opt_config_file, strerror(errno));
 		return false;
 	}
 	g_cmd_debug = pconfig->get_ll("midb_cmd_debug");
+	g_cmd_stats.set_slow_threshold(pconfig->get_ll("midb_cmd_slow_threshold"));
+	g_cmd_stats.set_snapshot(pconfig->get_value("midb_cmd_stats_file"),
+		pconfig->get_ll("midb_cmd_stats_interval"));
 	return true;
 }
 
@@ -104,30 +137,6 @@ int main(int argc, const char **argv) try
 	if (pconfig == nullptr)
 		return 2;
 
-	static constexpr cfg_directive cfg_default_values[] = {
-		{"config_file_path", PKGSYSCONFDIR "/midb:" PKGSYSCONFDIR},
-		{"console_server_ip", "::1"},
-		{"console_server_port", "9900"},
-		{"data_path", PKGDATADIR "/midb:" PKGDATADIR},
-		{"default_charset", "windows-1252"},
-		{"default_timezone", "Asia/Shanghai"},
-		{"midb_cache_interval", "30min", CFG_TIME, "1min", "30min"},
-		{"midb_cmd_debug", "0"},
-		{"midb_listen_ip", "::1"},
-		{"midb_listen_port", "5555"},
-		{"midb_mime_number", "4096", CFG_SIZE, "1024"},
-		{"midb_table_size", "5000", CFG_SIZE, "100", "50000"},
-		{"midb_threads_num", "100", CFG_SIZE, "20", "1000"},
-		{"notify_stub_threads_num", "10", CFG_SIZE, "1", "200"},
-		{"rpc_proxy_connection_num", "10", CFG_SIZE, "1", "200"},
-		{"service_plugin_path", PKGLIBDIR},
-		{"sqlite_mmap_size", "0", CFG_SIZE},
-		{"sqlite_synchronous", "off", CFG_BOOL},
-		{"sqlite_wal_mode", "true", CFG_BOOL},
-		{"state_path", PKGSTATEDIR},
-		{"x500_org_name", "Gromox default"},
-		{},
-	};
 	config_file_apply(*g_config_file, cfg_default_values);
 	auto str_value = pconfig->get_value("SERVICE_PLUGIN_LIST");
 	char **service_plugin_list = nullptr;
@@ -13,6 +13,8 @@ static BOOL svc_mysql_adaptor(int reason, void** ppdata)
 		mysql_adaptor_stop();
 		return TRUE;
 	} else if (reason == PLUGIN_RELOAD) {
+		mysql_adaptor_print_login_stats();
+		mysql_adaptor_cache_clear();
 		mysql_adaptor_reload_config(get_config_path(),
 			get_host_ID(), get_prog_id());
 	}
@@ -20,6 +22,8 @@ static BOOL svc_mysql_adaptor(int reason, void** ppdata)
 		return TRUE;
 
 	LINK_SVC_API(ppdata);
+	if (!register_talk(mysql_adaptor_console_talk))
+		printf("[mysql_adaptor]: failed to register console talk\n");
 	if (!mysql_adaptor_reload_config(get_config_path(),
 	    get_host_ID(), get_prog_id()))
 		return false;
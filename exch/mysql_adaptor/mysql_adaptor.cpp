@@ -2,23 +2,32 @@
 // SPDX-FileCopyrightText: 2020–2021 grommunio GmbH
 // This file is part of Gromox.
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
+#include <crypt.h>
 #include <libHX/string.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 #include <gromox/database_mysql.hpp>
 #include <gromox/defs.h>
+#include <gromox/scope.hpp>
 #include "mysql_adaptor.h"
 #include <gromox/util.hpp>
 #include <cstdio>
 #include <unistd.h>
 #include <mysql.h>
 #include "sql2.hpp"
+#include "ttl_cache.hpp"
 #define MLIST_PRIVILEGE_ALL				0
 #define MLIST_PRIVILEGE_INTERNAL		1
 #define MLIST_PRIVILEGE_DOMAIN			2
@@ -35,20 +44,429 @@
 using namespace std::string_literals;
 using namespace gromox;
 
-static std::mutex g_crypt_lock;
+namespace {
+
+/**
+ * @digest:	HMAC over username, password and stored hash
+ * @expire:	end of validity
+ */
+struct authcache_entry {
+	std::string digest;
+	std::chrono::steady_clock::time_point expire;
+};
+
+/* Count, total and maximum duration of one stage of the login path */
+struct latency_counter {
+	void add(std::chrono::steady_clock::time_point start);
+	int print(char *buf, size_t bufsize, const char *name) const;
+
+	std::atomic<uint64_t> count{0}, total_us{0}, max_us{0};
+};
+
+}
+
+/**
+ * Per-user metadata, as fetched in one go by user_meta_get. Most lookups
+ * from delivery and the store servers are satisfied from this.
+ */
+struct user_meta {
+	int id = 0, domain_id = 0;
+	enum display_type dtypx = DT_MAILUSER;
+	unsigned int address_status = 0;
+	std::string maildir, lang, timezone;
+};
+
+struct domain_meta {
+	int id = 0, org_id = 0;
+	std::string homedir;
+};
+
+static constexpr size_t AUTHCACHE_MAX = 65536;
+static ttl_cache<user_meta> g_user_cache;
+static ttl_cache<domain_meta> g_domain_cache;
+static std::mutex g_authcache_lock;
+static std::unordered_map<std::string, authcache_entry> g_authcache;
+static unsigned char g_authcache_key[32];
+static std::once_flag g_authcache_keyinit;
+static std::atomic<uint64_t> g_login_ok, g_login_fail, g_login_cached;
+/*
+ * meta: user lookup (mysql_adaptor_meta); verify: mysql_adaptor_login2,
+ * cache hits included; hash: crypt_r alone; login: from the start of the
+ * lookup to the end of the verification, as authmgr calls the two back to
+ * back on one thread.
+ */
+static latency_counter g_lat_meta, g_lat_verify, g_lat_hash, g_lat_login;
+static thread_local std::chrono::steady_clock::time_point t_login_start;
 
 static void mysql_adaptor_encode_squote(const char *in, char *out);
 
+static std::string meta_key(const char *name)
+{
+	std::string key = name;
+	HX_strlower(key.data());
+	return key;
+}
+
+#define USER_META_COLUMNS "u.id, u.domain_id, dt.propval_str AS dtypx, " \
+	"u.maildir, u.lang, u.timezone, u.address_status"
+
+static void user_meta_fill(user_meta &u, char **myrow)
+{
+	u.id = strtol(myrow[0], nullptr, 0);
+	u.domain_id = strtol(myrow[1], nullptr, 0);
+	u.dtypx = DT_MAILUSER;
+	if (myrow[2] != nullptr)
+		u.dtypx = static_cast<enum display_type>(strtoul(myrow[2], nullptr, 0));
+	u.maildir = znul(myrow[3]);
+	u.lang = znul(myrow[4]);
+	u.timezone = znul(myrow[5]);
+	u.address_status = strtoul(znul(myrow[6]), nullptr, 0);
+}
+
+/**
+ * Returns 1 if the user was found, 0 if it does not exist, and -1 on
+ * database errors (which are never cached).
+ */
+static int user_meta_get(const char *username, user_meta &u)
+{
+	auto key = meta_key(username);
+	auto c = g_user_cache.get(key, u);
+	if (c != g_user_cache.MISS)
+		return c == g_user_cache.FOUND ? 1 : 0;
+	char temp_name[UADDR_SIZE*2];
+	mysql_adaptor_encode_squote(username, temp_name);
+	auto qstr = "SELECT " USER_META_COLUMNS " FROM users AS u "
+	            JOIN_WITH_DISPLAYTYPE " WHERE u.username='"s +
+	            temp_name + "' LIMIT 2";
+	auto conn = g_sqlconn_pool.get_wait();
+	if (conn.res == nullptr || !conn.res.query(qstr.c_str()))
+		return -1;
+	DB_RESULT pmyres = mysql_store_result(conn.res.get());
+	if (pmyres == nullptr)
+		return -1;
+	conn.finish();
+	if (pmyres.num_rows() != 1) {
+		g_user_cache.put(std::move(key), nullptr);
+		return 0;
+	}
+	user_meta_fill(u, pmyres.fetch_row());
+	g_user_cache.put(std::move(key), &u);
+	return 1;
+}
+
+static void domain_meta_fill(domain_meta &d, char **myrow)
+{
+	d.id = strtol(myrow[0], nullptr, 0);
+	d.org_id = strtol(myrow[1], nullptr, 0);
+	d.homedir = znul(myrow[2]);
+}
+
+static int domain_meta_get(const char *domainname, domain_meta &d)
+{
+	auto key = meta_key(domainname);
+	auto c = g_domain_cache.get(key, d);
+	if (c != g_domain_cache.MISS)
+		return c == g_domain_cache.FOUND ? 1 : 0;
+	char temp_name[UDOM_SIZE*2];
+	mysql_adaptor_encode_squote(domainname, temp_name);
+	auto qstr = "SELECT id, org_id, homedir FROM domains WHERE domainname='"s +
+	            temp_name + "'";
+	auto conn = g_sqlconn_pool.get_wait();
+	if (conn.res == nullptr || !conn.res.query(qstr.c_str()))
+		return -1;
+	DB_RESULT pmyres = mysql_store_result(conn.res.get());
+	if (pmyres == nullptr)
+		return -1;
+	conn.finish();
+	if (pmyres.num_rows() != 1) {
+		g_domain_cache.put(std::move(key), nullptr);
+		return 0;
+	}
+	domain_meta_fill(d, pmyres.fetch_row());
+	g_domain_cache.put(std::move(key), &d);
+	return 1;
+}
+
+static bool mysql_adaptor_cache_preload() try
+{
+	auto conn = g_sqlconn_pool.get_wait();
+	if (conn.res == nullptr ||
+	    !conn.res.query("SELECT u.username, " USER_META_COLUMNS
+	    " FROM users AS u " JOIN_WITH_DISPLAYTYPE))
+		return false;
+	DB_RESULT pmyres = mysql_store_result(conn.res.get());
+	if (pmyres == nullptr)
+		return false;
+	size_t users = pmyres.num_rows();
+	for (size_t i = 0; i < users; ++i) {
+		auto myrow = pmyres.fetch_row();
+		user_meta u;
+		user_meta_fill(u, &myrow[1]);
+		g_user_cache.put(meta_key(myrow[0]), &u);
+	}
+	if (!conn.res.query("SELECT domainname, id, org_id, homedir FROM domains"))
+		return false;
+	pmyres = mysql_store_result(conn.res.get());
+	if (pmyres == nullptr)
+		return false;
+	conn.finish();
+	size_t domains = pmyres.num_rows();
+	for (size_t i = 0; i < domains; ++i) {
+		auto myrow = pmyres.fetch_row();
+		domain_meta d;
+		domain_meta_fill(d, &myrow[1]);
+		g_domain_cache.put(meta_key(myrow[0]), &d);
+	}
+	printf("[mysql_adaptor]: preloaded %zu users and %zu domains into cache\n",
+	       users, domains);
+	return true;
+} catch (const std::exception &e) {
+	printf("E-%u: %s\n", 1735, e.what());
+	return false;
+}
+
+void mysql_adaptor_cache_setup()
+{
+	size_t max = g_parm.cache_max_entries > 0 ? g_parm.cache_max_entries : 1;
+	g_user_cache.configure(std::chrono::seconds(g_parm.cache_ttl),
+		std::chrono::seconds(g_parm.cache_neg_ttl), max);
+	g_domain_cache.configure(std::chrono::seconds(g_parm.cache_ttl),
+		std::chrono::seconds(g_parm.cache_neg_ttl), max);
+}
+
+void mysql_adaptor_cache_forget(const char *name) try
+{
+	auto key = meta_key(name);
+	g_user_cache.erase(key);
+	g_domain_cache.erase(key);
+} catch (const std::bad_alloc &) {
+	g_user_cache.clear();
+	g_domain_cache.clear();
+}
+
+void mysql_adaptor_cache_clear()
+{
+	g_user_cache.clear();
+	g_domain_cache.clear();
+}
+
 int mysql_adaptor_run()
 {
 	if (!db_upgrade_check())
 		return -1;
+	if (g_parm.cache_preload && g_user_cache.enabled() &&
+	    !mysql_adaptor_cache_preload())
+		printf("[mysql_adaptor]: cache preload failed; continuing with lazy fill\n");
 	return 0;
 }
 
 void mysql_adaptor_stop()
 {
+	mysql_adaptor_print_login_stats();
 	g_sqlconn_pool.clear();
+	std::lock_guard hold(g_authcache_lock);
+	g_authcache.clear();
+}
+
+void latency_counter::add(std::chrono::steady_clock::time_point start)
+{
+	uint64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(
+	                std::chrono::steady_clock::now() - start).count();
+	total_us += usec;
+	++count;
+	auto prev = max_us.load();
+	while (usec > prev && !max_us.compare_exchange_weak(prev, usec))
+		/* retry */;
+}
+
+int latency_counter::print(char *buf, size_t bufsize, const char *name) const
+{
+	uint64_t n = count;
+	return snprintf(buf, bufsize, "\t%-8s %llu calls, avg %llu us, max %llu us\r\n",
+	       name, static_cast<unsigned long long>(n),
+	       static_cast<unsigned long long>(n != 0 ? total_us / n : 0),
+	       static_cast<unsigned long long>(max_us.load()));
+}
+
+static void login_stats(char *buf, size_t bufsize)
+{
+	int off = snprintf(buf, bufsize, "\tlogins: %llu ok, %llu failed, %llu from cache\r\n",
+	          static_cast<unsigned long long>(g_login_ok),
+	          static_cast<unsigned long long>(g_login_fail),
+	          static_cast<unsigned long long>(g_login_cached));
+	for (auto [name, c] : {std::make_pair("login", &g_lat_login),
+	     std::make_pair("lookup", &g_lat_meta),
+	     std::make_pair("verify", &g_lat_verify),
+	     std::make_pair("hash", &g_lat_hash)}) {
+		if (off <= 0 || static_cast<size_t>(off) >= bufsize)
+			break;
+		off += c->print(&buf[off], bufsize - off, name);
+	}
+}
+
+void mysql_adaptor_print_login_stats()
+{
+	char buf[512];
+	login_stats(buf, arsizeof(buf));
+	/* one line per counter, without the console's tab/CRLF framing */
+	char *save = nullptr;
+	for (auto line = strtok_r(buf, "\r\n", &save); line != nullptr;
+	     line = strtok_r(nullptr, "\r\n", &save))
+		printf("[mysql_adaptor]: %s\n", line + strspn(line, "\t"));
+}
+
+template<typename T> static int cache_stats(char *buf, size_t bufsize,
+    const char *name, const ttl_cache<T> &c)
+{
+	auto st = c.get_stats();
+	auto total = st.hits + st.neg_hits + st.misses;
+	return snprintf(buf, bufsize, "\t%-8s %zu entries, %llu hits, %llu "
+	       "negative hits, %llu misses (%.1f%% hit rate), %llu evicted\r\n",
+	       name, st.entries, static_cast<unsigned long long>(st.hits),
+	       static_cast<unsigned long long>(st.neg_hits),
+	       static_cast<unsigned long long>(st.misses),
+	       total > 0 ? 100.0 * (st.hits + st.neg_hits) / total : 0.0,
+	       static_cast<unsigned long long>(st.evictions));
+}
+
+void mysql_adaptor_console_talk(int argc, char **argv, char *result, int length)
+{
+	char help_string[] = "250 mysql adaptor help information:\r\n"
+	                     "\t%s info\r\n"
+	                     "\t    --print cache and login statistics\r\n"
+	                     "\t%s cache flush\r\n"
+	                     "\t    --drop all cached user and domain records\r\n"
+	                     "\t%s cache forget <user|domain>\r\n"
+	                     "\t    --drop the cached record for one name";
+
+	if (1 == argc) {
+		gx_strlcpy(result, "550 too few arguments", length);
+		return;
+	}
+	if (2 == argc && 0 == strcmp("--help", argv[1])) {
+		snprintf(result, length, help_string, argv[0], argv[0], argv[0]);
+		return;
+	}
+	if (2 == argc && 0 == strcmp("info", argv[1])) {
+		char logins[512];
+		int off = snprintf(result, length, "250 mysql adaptor information:\r\n"
+		          "\tcache ttl %us, negative ttl %us\r\n",
+		          g_parm.cache_ttl, g_parm.cache_neg_ttl);
+		if (off > 0 && off < length)
+			off += cache_stats(&result[off], length - off, "users", g_user_cache);
+		if (off > 0 && off < length)
+			off += cache_stats(&result[off], length - off, "domains", g_domain_cache);
+		login_stats(logins, arsizeof(logins));
+		if (off > 0 && off < length)
+			snprintf(&result[off], length - off, "%s", logins);
+		return;
+	}
+	if (3 == argc && 0 == strcmp("cache", argv[1]) &&
+	    0 == strcmp("flush", argv[2])) {
+		mysql_adaptor_cache_clear();
+		gx_strlcpy(result, "250 cache flushed", length);
+		return;
+	}
+	if (4 == argc && 0 == strcmp("cache", argv[1]) &&
+	    0 == strcmp("forget", argv[2])) {
+		mysql_adaptor_cache_forget(argv[3]);
+		snprintf(result, length, "250 %s dropped from cache", argv[3]);
+		return;
+	}
+	snprintf(result, length, "550 invalid argument %s", argv[1]);
+}
+
+/**
+ * crypt(3) uses static storage; the reentrant variant lets any number of
+ * logins hash concurrently.
+ */
+static bool crypt_verify(const char *password, const char *encrypt_passwd)
+{
+	auto start = std::chrono::steady_clock::now();
+	auto cd = std::make_unique<struct crypt_data>();
+	auto out = crypt_r(password, encrypt_passwd, cd.get());
+	bool ok = out != nullptr && strcmp(out, encrypt_passwd) == 0;
+	g_lat_hash.add(start);
+	return ok;
+}
+
+static std::string authcache_digest(const char *username,
+    const char *password, const char *encrypt_passwd)
+{
+	std::call_once(g_authcache_keyinit, []() {
+		if (RAND_bytes(g_authcache_key, sizeof(g_authcache_key)) != 1)
+			randstring_k(reinterpret_cast<char *>(g_authcache_key),
+				sizeof(g_authcache_key) - 1,
+				"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789./");
+	});
+	std::string msg = username;
+	msg += '\0';
+	msg += password;
+	msg += '\0';
+	msg += encrypt_passwd;
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = 0;
+	if (HMAC(EVP_sha256(), g_authcache_key, sizeof(g_authcache_key),
+	    reinterpret_cast<const unsigned char *>(msg.data()), msg.size(),
+	    md, &mdlen) == nullptr)
+		mdlen = 0;
+	OPENSSL_cleanse(msg.data(), msg.size());
+	return std::string(reinterpret_cast<char *>(md), mdlen);
+}
+
+static std::string authcache_user(const char *username)
+{
+	std::string key = username;
+	HX_strlower(key.data());
+	return key;
+}
+
+static bool authcache_check(const std::string &user, const std::string &digest)
+{
+	if (digest.empty())
+		return false;
+	std::lock_guard hold(g_authcache_lock);
+	auto it = g_authcache.find(user);
+	if (it == g_authcache.end())
+		return false;
+	if (it->second.expire < std::chrono::steady_clock::now()) {
+		g_authcache.erase(it);
+		return false;
+	}
+	return it->second.digest.size() == digest.size() &&
+	       CRYPTO_memcmp(it->second.digest.data(), digest.data(),
+	       digest.size()) == 0;
+}
+
+static void authcache_add(std::string &&user, std::string &&digest)
+{
+	if (digest.empty())
+		return;
+	auto now = std::chrono::steady_clock::now();
+	std::lock_guard hold(g_authcache_lock);
+	if (g_authcache.size() >= AUTHCACHE_MAX) {
+		for (auto it = g_authcache.begin(); it != g_authcache.end(); ) {
+			if (it->second.expire < now)
+				it = g_authcache.erase(it);
+			else
+				++it;
+		}
+		if (g_authcache.size() >= AUTHCACHE_MAX)
+			g_authcache.clear();
+	}
+	auto &e = g_authcache[std::move(user)];
+	e.digest = std::move(digest);
+	e.expire = now + std::chrono::seconds(g_parm.auth_cache_ttl);
+}
+
+static void authcache_forget(const char *username) try
+{
+	auto user = authcache_user(username);
+	std::lock_guard hold(g_authcache_lock);
+	g_authcache.erase(user);
+} catch (const std::bad_alloc &) {
+	std::lock_guard hold(g_authcache_lock);
+	g_authcache.clear();
 }
 
 BOOL mysql_adaptor_meta(const char *username, const char *password,
@@ -56,6 +474,8 @@ BOOL mysql_adaptor_meta(const char *username, const char *password,
     char *encrypt_passwd, size_t encrypt_size, uint8_t *externid_present) try
 {
 	char temp_name[UADDR_SIZE*2];
+	auto start = t_login_start = std::chrono::steady_clock::now();
+	auto cl_0 = make_scope_exit([&]() { g_lat_meta.add(start); });
 
 	mysql_adaptor_encode_squote(username, temp_name);
 	auto qstr =
@@ -120,9 +540,7 @@ BOOL mysql_adaptor_meta(const char *username, const char *password,
 static BOOL firsttime_password(const char *username, const char *password,
     char *encrypt_passwd, size_t encrypt_size, char *reason, int length) try
 {
-	std::unique_lock cr_hold(g_crypt_lock);
 	gx_strlcpy(encrypt_passwd, crypt_wrapper(password), encrypt_size);
-	cr_hold.unlock();
 
 	char temp_name[UADDR_SIZE*2];
 	mysql_adaptor_encode_squote(username, temp_name);
@@ -138,16 +556,29 @@ static BOOL firsttime_password(const char *username, const char *password,
 }
 
 static BOOL verify_password(const char *username, const char *password,
-    const char *encrypt_passwd, char *reason, int length)
+    const char *encrypt_passwd, char *reason, int length) try
 {
-	std::unique_lock cr_hold(g_crypt_lock);
-	if (0 == strcmp(crypt(password, encrypt_passwd), encrypt_passwd)) {
+	std::string user, digest;
+	if (g_parm.auth_cache_ttl > 0) {
+		user = authcache_user(username);
+		digest = authcache_digest(username, password, encrypt_passwd);
+		if (authcache_check(user, digest)) {
+			++g_login_cached;
+			return TRUE;
+		}
+	}
+	if (crypt_verify(password, encrypt_passwd)) {
+		if (g_parm.auth_cache_ttl > 0)
+			authcache_add(std::move(user), std::move(digest));
 		return TRUE;
 	}
-	cr_hold.unlock();
 	snprintf(reason, length, "password error, please check it "
 	         "and retry");
 	return FALSE;
+} catch (const std::bad_alloc &) {
+	printf("E-%u: ENOMEM\n", 1734);
+	snprintf(reason, length, "out of memory");
+	return false;
 }
 
 BOOL mysql_adaptor_login2(const char *username, const char *password,
@@ -155,12 +586,22 @@ BOOL mysql_adaptor_login2(const char *username, const char *password,
     int length)
 {
 	BOOL ret;
+	auto start = std::chrono::steady_clock::now();
 	if (g_parm.enable_firsttimepw && *encrypt_passwd == '\0')
 		ret = firsttime_password(username, password, encrypt_passwd,
 		      encrypt_size, reason, length);
 	else
 		ret = verify_password(username, password, encrypt_passwd, reason,
 		      length);
+	if (ret)
+		++g_login_ok;
+	else
+		++g_login_fail;
+	g_lat_verify.add(start);
+	if (t_login_start != std::chrono::steady_clock::time_point{}) {
+		g_lat_login.add(t_login_start);
+		t_login_start = {};
+	}
 	return ret;
 }
 
@@ -199,13 +640,10 @@ BOOL mysql_adaptor_setpasswd(const char *username,
 	strncpy(encrypt_passwd, myrow[0], sizeof(encrypt_passwd));
 	encrypt_passwd[sizeof(encrypt_passwd) - 1] = '\0';
 	
-	std::unique_lock cr_hold(g_crypt_lock);
-	if ('\0' != encrypt_passwd[0] && 0 != strcmp(crypt(
-		password, encrypt_passwd), encrypt_passwd)) {
+	if ('\0' != encrypt_passwd[0] && !crypt_verify(password, encrypt_passwd))
 		return FALSE;
-	}
 	gx_strlcpy(encrypt_passwd, crypt_wrapper(new_password), arsizeof(encrypt_passwd));
-	cr_hold.unlock();
+	authcache_forget(username);
 	qstr = "UPDATE users SET password='"s + encrypt_passwd +
 	       "' WHERE username='" + temp_name + "'";
 	if (!conn.res.query(qstr.c_str()))
@@ -239,21 +677,10 @@ BOOL mysql_adaptor_get_username_from_id(int user_id,
 
 BOOL mysql_adaptor_get_id_from_username(const char *username, int *puser_id) try
 {
-	char temp_name[UADDR_SIZE*2];
-	
-	mysql_adaptor_encode_squote(username, temp_name);
-	auto qstr = "SELECT id FROM users WHERE username='"s + temp_name + "'";
-	auto conn = g_sqlconn_pool.get_wait();
-	if (!conn.res.query(qstr.c_str()))
-		return false;
-	DB_RESULT pmyres = mysql_store_result(conn.res.get());
-	if (pmyres == nullptr)
-		return false;
-	conn.finish();
-	if (pmyres.num_rows() != 1)
+	user_meta u;
+	if (user_meta_get(username, u) != 1)
 		return FALSE;
-	auto myrow = pmyres.fetch_row();
-	*puser_id = strtol(myrow[0], nullptr, 0);
+	*puser_id = u.id;
 	return TRUE;
 } catch (const std::exception &e) {
 	printf("E-%u: %s\n", 1705, e.what());
@@ -348,23 +775,14 @@ BOOL mysql_adaptor_get_user_privilege_bits(const char *username,
 
 bool mysql_adaptor_get_user_lang(const char *username, char *lang, size_t lang_size) try
 {
-	char temp_name[UADDR_SIZE*2];
-	
-	mysql_adaptor_encode_squote(username, temp_name);
-	auto qstr = "SELECT lang FROM users WHERE username='"s + temp_name + "'";
-	auto conn = g_sqlconn_pool.get_wait();
-	if (!conn.res.query(qstr.c_str()))
-		return false;
-	DB_RESULT pmyres = mysql_store_result(conn.res.get());
-	if (pmyres == nullptr)
+	user_meta u;
+	auto ret = user_meta_get(username, u);
+	if (ret < 0)
 		return false;
-	conn.finish();
-	if (pmyres.num_rows() != 1) {
-		lang[0] = '\0';	
-	} else {
-		auto myrow = pmyres.fetch_row();
-		gx_strlcpy(lang, myrow[0], lang_size);
-	}
+	if (ret == 0)
+		lang[0] = '\0';
+	else
+		gx_strlcpy(lang, u.lang.c_str(), lang_size);
 	return true;
 } catch (const std::exception &e) {
 	printf("E-%u: %s\n", 1709, e.what());
@@ -382,6 +800,7 @@ BOOL mysql_adaptor_set_user_lang(const char *username, const char *lang) try
 	auto conn = g_sqlconn_pool.get_wait();
 	if (!conn.res.query(qstr.c_str()))
 		return false;
+	mysql_adaptor_cache_forget(username);
 	return TRUE;
 } catch (const std::exception &e) {
 	printf("E-%u: %s\n", 1710, e.what());
@@ -418,23 +837,14 @@ static BOOL mysql_adaptor_expand_hierarchy(MYSQL *pmysql,
 
 bool mysql_adaptor_get_timezone(const char *username, char *zone, size_t zone_size) try
 {
-	char temp_name[UADDR_SIZE*2];
-	
-	mysql_adaptor_encode_squote(username, temp_name);
-	auto qstr = "SELECT timezone FROM users WHERE username='"s + temp_name + "'";
-	auto conn = g_sqlconn_pool.get_wait();
-	if (!conn.res.query(qstr.c_str()))
-		return false;
-	DB_RESULT pmyres = mysql_store_result(conn.res.get());
-	if (pmyres == nullptr)
+	user_meta u;
+	auto ret = user_meta_get(username, u);
+	if (ret < 0)
 		return false;
-	conn.finish();
-	if (pmyres.num_rows() != 1) {
+	if (ret == 0)
 		zone[0] = '\0';
-	} else {
-		auto myrow = pmyres.fetch_row();
-		gx_strlcpy(zone, myrow[0], zone_size);
-	}
+	else
+		gx_strlcpy(zone, u.timezone.c_str(), zone_size);
 	return true;
 } catch (const std::exception &e) {
 	printf("E-%u: %s\n", 1712, e.what());
@@ -453,6 +863,7 @@ BOOL mysql_adaptor_set_timezone(const char *username, const char *zone) try
 	auto conn = g_sqlconn_pool.get_wait();
 	if (!conn.res.query(qstr.c_str()))
 		return false;
+	mysql_adaptor_cache_forget(username);
 	return TRUE;
 } catch (const std::exception &e) {
 	printf("E-%u: %s\n", 1713, e.what());
@@ -461,21 +872,10 @@ BOOL mysql_adaptor_set_timezone(const char *username, const char *zone) try
 
 bool mysql_adaptor_get_maildir(const char *username, char *maildir, size_t md_size) try
 {
-	char temp_name[UADDR_SIZE*2];
-	
-	mysql_adaptor_encode_squote(username, temp_name);
-	auto qstr = "SELECT maildir FROM users WHERE username='"s + temp_name + "'";
-	auto conn = g_sqlconn_pool.get_wait();
-	if (!conn.res.query(qstr.c_str()))
-		return false;
-	DB_RESULT pmyres = mysql_store_result(conn.res.get());
-	if (pmyres == nullptr)
-		return false;
-	conn.finish();
-	if (pmyres.num_rows() != 1)
+	user_meta u;
+	if (user_meta_get(username, u) != 1)
 		return FALSE;
-	auto myrow = pmyres.fetch_row();
-	gx_strlcpy(maildir, myrow[0], md_size);
+	gx_strlcpy(maildir, u.maildir.c_str(), md_size);
 	return true;
 } catch (const std::exception &e) {
 	printf("E-%u: %s\n", 1714, e.what());
@@ -484,21 +884,10 @@ bool mysql_adaptor_get_maildir(const char *username, char *maildir, size_t md_si
 
 bool mysql_adaptor_get_homedir(const char *domainname, char *homedir, size_t dsize) try
 {
-	char temp_name[UDOM_SIZE*2];
-	
-	mysql_adaptor_encode_squote(domainname, temp_name);
-	auto qstr = "SELECT homedir, domain_status FROM domains WHERE domainname='"s + temp_name + "'";
-	auto conn = g_sqlconn_pool.get_wait();
-	if (!conn.res.query(qstr.c_str()))
-		return false;
-	DB_RESULT pmyres = mysql_store_result(conn.res.get());
-	if (pmyres == nullptr)
+	domain_meta d;
+	if (domain_meta_get(domainname, d) != 1)
 		return false;
-	conn.finish();
-	if (pmyres.num_rows() != 1)
-		return false;
-	auto myrow = pmyres.fetch_row();
-	gx_strlcpy(homedir, myrow[0], dsize);
+	gx_strlcpy(homedir, d.homedir.c_str(), dsize);
 	return true;
 } catch (const std::exception &e) {
 	printf("E-%u: %s\n", 1716, e.what());
@@ -551,30 +940,13 @@ BOOL mysql_adaptor_get_id_from_homedir(const char *homedir, int *pdomain_id) try
 BOOL mysql_adaptor_get_user_ids(const char *username, int *puser_id,
     int *pdomain_id, enum display_type *dtypx) try
 {
-	char temp_name[UADDR_SIZE*2];
-	
-	mysql_adaptor_encode_squote(username, temp_name);
-	auto qstr =
-		"SELECT u.id, u.domain_id, dt.propval_str AS dtypx"
-		" FROM users AS u " JOIN_WITH_DISPLAYTYPE
-		" WHERE u.username='"s + temp_name + "' LIMIT 2";
-	auto conn = g_sqlconn_pool.get_wait();
-	if (!conn.res.query(qstr.c_str()))
-		return false;
-	DB_RESULT pmyres = mysql_store_result(conn.res.get());
-	if (pmyres == nullptr)
-		return false;
-	conn.finish();
-	if (pmyres.num_rows() != 1)
-		return FALSE;	
-	auto myrow = pmyres.fetch_row();
-	*puser_id = strtol(myrow[0], nullptr, 0);
-	*pdomain_id = strtol(myrow[1], nullptr, 0);
-	if (dtypx != nullptr) {
-		*dtypx = DT_MAILUSER;
-		if (myrow[2] != nullptr)
-			*dtypx = static_cast<enum display_type>(strtoul(myrow[2], nullptr, 0));
-	}
+	user_meta u;
+	if (user_meta_get(username, u) != 1)
+		return FALSE;
+	*puser_id = u.id;
+	*pdomain_id = u.domain_id;
+	if (dtypx != nullptr)
+		*dtypx = u.dtypx;
 	return TRUE;
 } catch (const std::exception &e) {
 	printf("E-%u: %s\n", 1719, e.what());
@@ -584,22 +956,11 @@ BOOL mysql_adaptor_get_user_ids(const char *username, int *puser_id,
 BOOL mysql_adaptor_get_domain_ids(const char *domainname, int *pdomain_id,
     int *porg_id) try
 {
-	char temp_name[UDOM_SIZE*2];
-	
-	mysql_adaptor_encode_squote(domainname, temp_name);
-	auto qstr = "SELECT id, org_id FROM domains WHERE domainname='"s + temp_name + "'";
-	auto conn = g_sqlconn_pool.get_wait();
-	if (!conn.res.query(qstr.c_str()))
-		return false;
-	DB_RESULT pmyres = mysql_store_result(conn.res.get());
-	if (pmyres == nullptr)
-		return false;
-	conn.finish();
-	if (pmyres.num_rows() != 1)
+	domain_meta d;
+	if (domain_meta_get(domainname, d) != 1)
 		return FALSE;
-	auto myrow = pmyres.fetch_row();
-	*pdomain_id = strtol(myrow[0], nullptr, 0);
-	*porg_id = strtol(myrow[1], nullptr, 0);
+	*pdomain_id = d.id;
+	*porg_id = d.org_id;
 	return TRUE;
 } catch (const std::exception &e) {
 	printf("E-%u: %s\n", 1720, e.what());
@@ -942,26 +1303,13 @@ static void mysql_adaptor_encode_squote(const char *in, char *out)
 BOOL mysql_adaptor_check_same_org2(const char *domainname1,
     const char *domainname2) try
 {
-	char temp_name1[UDOM_SIZE*2], temp_name2[UDOM_SIZE*2];
-
-	mysql_adaptor_encode_squote(domainname1, temp_name1);
-	mysql_adaptor_encode_squote(domainname2, temp_name2);
-	auto qstr = "SELECT org_id FROM domains WHERE domainname='"s + temp_name1 +
-	            "' OR domainname='" + temp_name2 + "'";
-	auto conn = g_sqlconn_pool.get_wait();
-	if (!conn.res.query(qstr.c_str()))
-		return false;
-	DB_RESULT pmyres = mysql_store_result(conn.res.get());
-	if (pmyres == nullptr)
-		return false;
-	conn.finish();
-	if (pmyres.num_rows() != 2)
+	domain_meta d1, d2;
+	/* the former "domainname=a OR domainname=b" query wanted 2 rows */
+	if (strcasecmp(domainname1, domainname2) == 0 ||
+	    domain_meta_get(domainname1, d1) != 1 ||
+	    domain_meta_get(domainname2, d2) != 1)
 		return FALSE;
-	auto myrow = pmyres.fetch_row();
-	int org_id1 = strtol(myrow[0], nullptr, 0);
-	myrow = pmyres.fetch_row();
-	int org_id2 = strtol(myrow[0], nullptr, 0);
-	if (0 == org_id1 || 0 == org_id2 || org_id1 != org_id2) {
+	if (0 == d1.org_id || 0 == d2.org_id || d1.org_id != d2.org_id) {
 		return FALSE;
 	}
 	return TRUE;
@@ -1398,31 +1746,19 @@ BOOL mysql_adaptor_get_mlist(const char *username,  const char *from,
 bool mysql_adaptor_get_user_info(const char *username, char *maildir,
     size_t msize, char *lang, size_t lsize, char *zone, size_t tsize) try
 {
-	char temp_name[UADDR_SIZE*2];
-
-	mysql_adaptor_encode_squote(username, temp_name);
-	auto qstr = "SELECT maildir, address_status, lang, timezone "
-	            "FROM users WHERE username='"s + temp_name + "'";
-	auto conn = g_sqlconn_pool.get_wait();
-	if (conn.res == nullptr)
-		return false;
-	if (!conn.res.query(qstr.c_str()))
+	user_meta u;
+	auto ret = user_meta_get(username, u);
+	if (ret < 0)
 		return false;
-	DB_RESULT pmyres = mysql_store_result(conn.res.get());
-	if (pmyres == nullptr)
-		return false;
-	conn.finish();
-
-	if (pmyres.num_rows() != 1) {
+	if (ret == 0) {
 		maildir[0] = '\0';
 		return true;
 	}
-	auto myrow = pmyres.fetch_row();
-	auto status = strtol(myrow[1], nullptr, 0);
-	if (status == AF_USER_NORMAL || status == AF_USER_SHAREDMBOX) {
-		gx_strlcpy(maildir, myrow[0], msize);
-		gx_strlcpy(lang, myrow[2], lsize);
-		gx_strlcpy(zone, myrow[3], tsize);
+	if (u.address_status == AF_USER_NORMAL ||
+	    u.address_status == AF_USER_SHAREDMBOX) {
+		gx_strlcpy(maildir, u.maildir.c_str(), msize);
+		gx_strlcpy(lang, u.lang.c_str(), lsize);
+		gx_strlcpy(zone, u.timezone.c_str(), tsize);
 	} else {
 		maildir[0] = '\0';
 		lang[0] = '\0';
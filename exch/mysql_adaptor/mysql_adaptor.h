@@ -39,6 +39,9 @@ enum sql_schema_upgrade {
 struct mysql_adaptor_init_param {
 	std::string host, user, pass, dbname;
 	int port = 0, conn_num = 0, timeout = 0;
+	unsigned int auth_cache_ttl = 0;
+	unsigned int cache_ttl = 0, cache_neg_ttl = 0, cache_max_entries = 0;
+	bool cache_preload = false;
 	enum sql_schema_upgrade schema_upgrade = S_ABORT;
 	bool enable_firsttimepw = false;
 };
@@ -75,6 +78,11 @@ struct sql_class {
 extern void mysql_adaptor_init(mysql_adaptor_init_param &&);
 extern int mysql_adaptor_run();
 extern void mysql_adaptor_stop();
+extern void mysql_adaptor_print_login_stats();
+extern void mysql_adaptor_console_talk(int argc, char **argv, char *result, int length);
+extern void mysql_adaptor_cache_setup();
+extern void mysql_adaptor_cache_forget(const char *name);
+extern void mysql_adaptor_cache_clear();
 extern BOOL mysql_adaptor_meta(const char *username, const char *password, char *maildir, char *lang, char *reason, int length, unsigned int mode, char *encrypted_passwd, size_t enc_size, uint8_t *externid_present);
 extern BOOL mysql_adaptor_login2(const char *username, const char *password, char *encrypt_passwd, size_t enc_size, char *reason, int length);
 BOOL mysql_adaptor_setpasswd(const char *username,
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later, OR GPL-2.0-or-later WITH linking exception
 // SPDX-FileCopyrightText: 2021 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -14,6 +15,7 @@
 #include <gromox/dbop.h>
 #include <gromox/defs.h>
 #include <gromox/mapidefs.h>
+#include <gromox/util.hpp>
 #include <mysql.h>
 #include <errmsg.h>
 #include "mysql_adaptor.h"
@@ -395,6 +397,26 @@ bool mysql_adaptor_reload_config(const char *path,
 
 	v = pfile->get_value("enable_firsttime_password");
 	par.enable_firsttimepw = v != nullptr && strcmp(v, "yes") == 0;
+	v = pfile->get_value("auth_cache_ttl");
+	if (v != nullptr) {
+		auto t = atoitvl(v);
+		par.auth_cache_ttl = t > 0 ? t : 0;
+	}
+	if (par.auth_cache_ttl > 0)
+		printf("[mysql_adaptor]: caching successful logins for %us\n",
+		       par.auth_cache_ttl);
+	v = pfile->get_value("cache_ttl");
+	par.cache_ttl = v != nullptr ? std::max(atoitvl(v), 0L) : 0;
+	v = pfile->get_value("cache_negative_ttl");
+	par.cache_neg_ttl = v != nullptr ? std::max(atoitvl(v), 0L) : 0;
+	v = pfile->get_value("cache_max_entries");
+	par.cache_max_entries = v != nullptr ? strtoul(v, nullptr, 0) : 100000;
+	v = pfile->get_value("cache_preload");
+	par.cache_preload = v != nullptr && strcmp(v, "yes") == 0;
+	if (par.cache_ttl > 0)
+		printf("[mysql_adaptor]: metadata cache ttl %us, negative ttl %us, "
+		       "max %u entries%s\n", par.cache_ttl, par.cache_neg_ttl,
+		       par.cache_max_entries, par.cache_preload ? ", preload" : "");
 	mysql_adaptor_init(std::move(par));
 	return true;
 } catch (const std::bad_alloc &) {
@@ -406,4 +428,5 @@ void mysql_adaptor_init(mysql_adaptor_init_param &&parm)
 	g_parm = std::move(parm);
 	g_sqlconn_pool.resize(g_parm.conn_num);
 	g_sqlconn_pool.bump();
+	mysql_adaptor_cache_setup();
 }
@@ -0,0 +1,128 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * Lookup cache for mysql_adaptor metadata. Keys are normalized by the
+ * caller. Absent records are remembered too (for @neg_ttl), so that
+ * repeated queries for unknown addresses do not reach the database either.
+ * A zero @ttl disables the cache altogether.
+ */
+template<typename T> class ttl_cache {
+	public:
+	using clock = std::chrono::steady_clock;
+
+	enum lookup { MISS = 0, FOUND, ABSENT };
+
+	struct stats {
+		uint64_t hits = 0, neg_hits = 0, misses = 0, evictions = 0;
+		size_t entries = 0;
+	};
+
+	void configure(std::chrono::seconds ttl, std::chrono::seconds neg_ttl,
+	    size_t max_entries)
+	{
+		std::lock_guard hold(m_lock);
+		m_ttl = ttl;
+		m_neg_ttl = neg_ttl;
+		m_max = max_entries;
+		m_on = ttl.count() > 0;
+		if (ttl.count() == 0)
+			m_map.clear();
+	}
+
+	bool enabled() const { return m_on; }
+
+	lookup get(const std::string &key, T &out)
+	{
+		if (!enabled())
+			return MISS;
+		std::lock_guard hold(m_lock);
+		auto it = m_map.find(key);
+		if (it == m_map.end() || it->second.expire < clock::now()) {
+			if (it != m_map.end())
+				m_map.erase(it);
+			++m_stats.misses;
+			return MISS;
+		}
+		if (!it->second.value.has_value()) {
+			++m_stats.neg_hits;
+			return ABSENT;
+		}
+		++m_stats.hits;
+		out = *it->second.value;
+		return FOUND;
+	}
+
+	/* @v == nullptr records a negative entry */
+	void put(std::string &&key, const T *v)
+	{
+		if (!enabled())
+			return;
+		auto now = clock::now();
+		std::lock_guard hold(m_lock);
+		if (v == nullptr && m_neg_ttl.count() == 0)
+			return;
+		if (m_map.size() >= m_max && m_map.find(key) == m_map.end())
+			prune(now);
+		auto &e = m_map[std::move(key)];
+		if (v != nullptr)
+			e.value.emplace(*v);
+		else
+			e.value.reset();
+		e.expire = now + (v != nullptr ? m_ttl : m_neg_ttl);
+	}
+
+	void erase(const std::string &key)
+	{
+		std::lock_guard hold(m_lock);
+		m_map.erase(key);
+	}
+
+	void clear()
+	{
+		std::lock_guard hold(m_lock);
+		m_map.clear();
+	}
+
+	stats get_stats() const
+	{
+		std::lock_guard hold(m_lock);
+		auto s = m_stats;
+		s.entries = m_map.size();
+		return s;
+	}
+
+	private:
+	struct entry {
+		std::optional<T> value;
+		clock::time_point expire;
+	};
+
+	void prune(clock::time_point now)
+	{
+		auto before = m_map.size();
+		for (auto it = m_map.begin(); it != m_map.end(); ) {
+			if (it->second.expire < now)
+				it = m_map.erase(it);
+			else
+				++it;
+		}
+		if (m_map.size() >= m_max)
+			m_map.clear();
+		m_stats.evictions += before - m_map.size();
+	}
+
+	mutable std::mutex m_lock;
+	std::unordered_map<std::string, entry> m_map;
+	std::chrono::seconds m_ttl{0}, m_neg_ttl{0};
+	size_t m_max = 0;
+	std::atomic<bool> m_on{false};
+	stats m_stats;
+};
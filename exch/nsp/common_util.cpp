@@ -7,6 +7,7 @@
 #include <gromox/ndr_stack.hpp>
 #include <gromox/guid.hpp>
 #include <gromox/rop_util.hpp>
+#include <gromox/util.hpp>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -54,19 +55,24 @@ int common_util_from_utf8(uint32_t codepage,
 	if (NULL == charset) {
 		return -1;
 	}
-	conv_id = iconv_open(charset, "UTF-8");
-	auto pin = deconst(src);
-	auto pout = dst;
 	in_len = strlen(src) + 1;
 	memset(dst, 0, len);
+	if (in_len <= len && str_isascii(src, in_len) &&
+	    charset_ascii_compatible(charset)) {
+		memcpy(dst, src, in_len);
+		return in_len;
+	}
+	conv_id = iconv_cached(charset, "UTF-8");
+	if ((iconv_t)-1 == conv_id) {
+		return -1;
+	}
+	auto pin = deconst(src);
+	auto pout = dst;
 	out_len = len;
 	if (iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
 		return -1;
-	} else {
-		iconv_close(conv_id);
-		return out_len - len;
 	}
+	return out_len - len;
 }
 
 int common_util_to_utf8(uint32_t codepage,
@@ -81,19 +87,24 @@ int common_util_to_utf8(uint32_t codepage,
 	if (NULL == charset) {
 		return -1;
 	}
-	conv_id = iconv_open("UTF-8", charset);
-	auto pin = deconst(src);
-	auto pout = dst;
 	in_len = strlen(src) + 1;
 	memset(dst, 0, len);
+	if (in_len <= len && str_isascii(src, in_len) &&
+	    charset_ascii_compatible(charset)) {
+		memcpy(dst, src, in_len);
+		return in_len;
+	}
+	conv_id = iconv_cached("UTF-8", charset);
+	if ((iconv_t)-1 == conv_id) {
+		return -1;
+	}
+	auto pin = deconst(src);
+	auto pout = dst;
 	out_len = len;
 	if (iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
 		return -1;
-	} else {
-		iconv_close(conv_id);
-		return out_len - len;
 	}
+	return out_len - len;
 }
 
 void common_util_guid_to_binary(GUID *pguid, BINARY *pbin)
@@ -4,6 +4,7 @@
 #include <gromox/mapidefs.h>
 #include <gromox/proc_common.h>
 #include <gromox/ndr_stack.hpp>
+#include <gromox/util.hpp>
 #include "nsp_ndr.h"
 #include <iconv.h>
 #include <cstring>
@@ -12,6 +13,8 @@
 #define FLAG_CONTENT		0x2
 #define TRY(expr) do { int v = (expr); if (v != NDR_ERR_SUCCESS) return v; } while (false)
 
+using namespace gromox;
+
 static int nsp_ndr_pull_restriction(NDR_PULL *pndr, int flag, NSPRES *r);
 
 static int nsp_ndr_push_restriction(NDR_PUSH *pndr, int flag, const NSPRES *r);
@@ -20,39 +23,37 @@ static int nsp_ndr_to_utf16(int ndr_flag, const char *src, char *dst, size_t len
 {
 	size_t in_len;
 	size_t out_len;
-	iconv_t conv_id = (ndr_flag & NDR_FLAG_BIGENDIAN) ?
-	                  iconv_open("UTF-16", "UTF-8") :
-	                  iconv_open("UTF-16LE", "UTF-8");
+	if (!(ndr_flag & NDR_FLAG_BIGENDIAN))
+		return utf8_to_utf16le(src, dst, len);
+	auto conv_id = iconv_cached("UTF-16", "UTF-8");
+	if ((iconv_t)-1 == conv_id) {
+		return -1;
+	}
 	auto pin = deconst(src);
 	auto pout = dst;
 	in_len = strlen(src) + 1;
 	memset(dst, 0, len);
 	out_len = len;
 	if (iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
 		return -1;
-	} else {
-		iconv_close(conv_id);
-		return out_len - len;
 	}
+	return out_len - len;
 }
 
 static BOOL nsp_ndr_to_utf8(int ndr_flag, const char *src,
 	size_t src_len, char *dst, size_t len)
 {
-	iconv_t conv_id = (ndr_flag & NDR_FLAG_BIGENDIAN) ?
-	                  iconv_open("UTF-8", "UTF-16") :
-	                  iconv_open("UTF-8", "UTF-16LE");
+	if (!(ndr_flag & NDR_FLAG_BIGENDIAN))
+		return utf16le_to_utf8(src, src_len, dst, len);
+	auto conv_id = iconv_cached("UTF-8", "UTF-16");
+	if ((iconv_t)-1 == conv_id) {
+		return FALSE;
+	}
 	auto pin = deconst(src);
 	auto pout = dst;
 	memset(dst, 0, len);
-	if (iconv(conv_id, &pin, &src_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
-		return FALSE;
-	} else {
-		iconv_close(conv_id);
-		return TRUE;
-	}
+	return iconv(conv_id, &pin, &src_len, &pout, &len) ==
+	       static_cast<size_t>(-1) ? FALSE : TRUE;
 }
 
 static int nsp_ndr_pull_stat(NDR_PULL *pndr, STAT *r)
@@ -8,6 +8,7 @@
 #include "zarafa_server.h"
 #include "exmdb_client.h"
 #include "common_util.h"
+#include "rpc_parser.h"
 #include "service.h"
 #include <gromox/util.hpp>
 #include <gromox/guid.hpp>
@@ -26,7 +27,9 @@ static char g_server_help[] =
 static char g_zcore_help[] =
 	"250 ZCORE DAEMON zcore control help information:\r\n"
 	"\tzcore info\r\n"
-	"\t    --print the http parser info";
+	"\t    --print the http parser info\r\n"
+	"\tzcore stats [reset]\r\n"
+	"\t    --print (or clear) the per-RPC latency statistics";
 
 static char g_system_help[] =
 	"250 ZCORE DAEMON system help information:\r\n"
@@ -69,6 +72,17 @@ BOOL cmd_handler_zcore_control(int argc, char** argv)
 			exmdb_client_get_param(LOST_PROXY_CONNECTIONS));
 		return TRUE;
 	}
+	if (2 == argc && 0 == strcmp(argv[1], "stats")) {
+		auto text = g_zrpc_stats.dump(50);
+		console_server_reply_to_client("250 zcore RPC statistics:\r\n%s", text.c_str());
+		return TRUE;
+	}
+	if (3 == argc && 0 == strcmp(argv[1], "stats") &&
+	    0 == strcmp(argv[2], "reset")) {
+		g_zrpc_stats.reset();
+		console_server_reply_to_client("250 statistics cleared");
+		return TRUE;
+	}
 	console_server_reply_to_client("550 invalid argument %s", argv[1]);
 	return TRUE;
 }
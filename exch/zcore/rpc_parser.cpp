@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <mutex>
 #include <gromox/atomic.hpp>
+#include <gromox/call_stats.hpp>
 #include <gromox/defs.h>
 #include <gromox/zcore_rpc.hpp>
 #include <gromox/idset.hpp>
@@ -43,6 +44,8 @@ static DOUBLE_LIST g_conn_list;
 static std::condition_variable g_waken_cond;
 static std::mutex g_conn_lock, g_cond_mutex;
 unsigned int g_zrpc_debug;
+gromox::call_stats g_zrpc_stats("zcore", zcore_callid::LINKMESSAGE + 1,
+	zcore_rpc_idtoname);
 
 void rpc_parser_init(int thread_num)
 {
@@ -738,8 +741,10 @@ static void *zcrp_thrwork(void *param)
 	if (zcore_callid::NOTIFDEQUEUE == request.call_id) {
 		common_util_set_clifd(clifd);
 	}
+	gromox::call_stats::begin();
 	switch (rpc_parser_dispatch(&request, &response)) {
 	case DISPATCH_FALSE:
+		g_zrpc_stats.end(request.call_id, buff_len);
 		common_util_free_environment();
 		tmp_byte = zcore_response::DISPATCH_ERROR;
 		fdpoll.events = POLLOUT|POLLWRBAND;
@@ -749,12 +754,14 @@ static void *zcrp_thrwork(void *param)
 		close(clifd);
 		goto NEXT_CLIFD;
 	case DISPATCH_CONTINUE:
+		g_zrpc_stats.end(request.call_id, buff_len);
 		common_util_free_environment();
 		/* clifd will be maintained by zarafa_server */
 		goto NEXT_CLIFD;
 	}
 	if (FALSE == rpc_ext_push_response(
 		&response, &tmp_bin)) {
+		g_zrpc_stats.end(request.call_id, buff_len);
 		common_util_free_environment();
 		tmp_byte = zcore_response::PUSH_ERROR;
 		fdpoll.events = POLLOUT|POLLWRBAND;
@@ -764,6 +771,7 @@ static void *zcrp_thrwork(void *param)
 		close(clifd);
 		goto NEXT_CLIFD;
 	}
+	g_zrpc_stats.end(request.call_id, buff_len + tmp_bin.cb);
 	common_util_free_environment();
 	fdpoll.events = POLLOUT|POLLWRBAND;
 	if (1 == poll(&fdpoll, 1, tv_msec)) {
@@ -1,4 +1,5 @@
 #pragma once
+#include <gromox/call_stats.hpp>
 #include <gromox/common_types.hpp>
 
 void rpc_parser_init(int thread_num);
@@ -7,3 +8,4 @@ extern void rpc_parser_stop();
 BOOL rpc_parser_activate_connection(int clifd);
 
 extern unsigned int g_zrpc_debug;
+extern gromox::call_stats g_zrpc_stats;
@@ -1,18 +1,24 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2020–2021 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
+#include <chrono>
 #include <csignal>
 #include <cstdint>
 #include <cstring>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <queue>
 #include <string>
 #include <unistd.h>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 #include <sys/wait.h>
 #include <libHX/string.h>
 #include <gromox/atomic.hpp>
+#include <gromox/call_stats.hpp>
 #include <gromox/defs.h>
 #include <gromox/fileio.h>
 #include <gromox/mapidefs.h>
@@ -73,8 +79,38 @@ struct user_info_del {
 	void operator()(USER_INFO *x);
 };
 
+/*
+ * Sessions live in shards picked by user_id, the name->user_id map in
+ * shards picked by name hash. A user shard lock may be taken while
+ * holding a session shard lock, never the other way round.
+ */
+struct SESSION_SHARD {
+	std::mutex lock;
+	std::unordered_map<int, std::shared_ptr<USER_INFO>> sessions;
+};
+
+struct USER_SHARD {
+	std::mutex lock;
+	std::unordered_map<std::string, int> users;
+};
+
+/*
+ * Point in time at which a session wants to be looked at by the scanner.
+ * Every session has exactly one entry with rearm=true (expiry and tree
+ * reload), which the scanner replaces each time it pops it. Entries with
+ * rearm=false are one-shot wakeups for notification sink timeouts.
+ */
+struct SCHED_ENTRY {
+	time_t due;
+	GUID hsession;
+	bool rearm;
+	bool operator>(const SCHED_ENTRY &o) const { return due > o.due; }
+};
+
 }
 
+#define SESSION_SHARD_NUM 16
+
 using USER_INFO_REF = std::unique_ptr<USER_INFO, user_info_del>;
 
 static size_t g_table_size;
@@ -83,10 +119,13 @@ static int g_ping_interval;
 static pthread_t g_scan_id;
 static int g_cache_interval;
 static pthread_key_t g_info_key;
-static std::mutex g_table_lock, g_notify_lock;
-static std::unordered_map<std::string, int> g_user_table;
+static std::mutex g_notify_lock, g_sched_lock;
+static SESSION_SHARD g_session_shards[SESSION_SHARD_NUM];
+static USER_SHARD g_user_shards[SESSION_SHARD_NUM];
+static std::atomic<size_t> g_session_count{0};
 static std::unordered_map<std::string, NOTIFY_ITEM> g_notify_table;
-static std::unordered_map<int, USER_INFO> g_session_table;
+static std::priority_queue<SCHED_ENTRY, std::vector<SCHED_ENTRY>,
+       std::greater<SCHED_ENTRY>> g_sched_queue;
 
 USER_INFO::USER_INFO()
 {
@@ -130,22 +169,51 @@ static int zarafa_server_get_user_id(GUID hsession)
 	return user_id;
 }
 
+static SESSION_SHARD &zarafa_server_session_shard(int user_id)
+{
+	return g_session_shards[static_cast<unsigned int>(user_id) % SESSION_SHARD_NUM];
+}
+
+static USER_SHARD &zarafa_server_user_shard(const std::string &name)
+{
+	return g_user_shards[std::hash<std::string>{}(name) % SESSION_SHARD_NUM];
+}
+
+static void zarafa_server_schedule(time_t due, const GUID &hsession, bool rearm)
+{
+	std::lock_guard sc_hold(g_sched_lock);
+	try {
+		g_sched_queue.push({due, hsession, rearm});
+	} catch (const std::bad_alloc &) {
+		fprintf(stderr, "E-1625: ENOMEM; session %d will not be rescanned\n",
+		        zarafa_server_get_user_id(hsession));
+	}
+}
+
 static USER_INFO_REF zarafa_server_query_session(GUID hsession)
 {
 	int user_id;
 	
 	user_id = zarafa_server_get_user_id(hsession);
-	std::unique_lock tl_hold(g_table_lock);
-	auto iter = g_session_table.find(user_id);
-	if (iter == g_session_table.end())
+	auto &shard = zarafa_server_session_shard(user_id);
+	std::unique_lock tl_hold(shard.lock);
+	auto iter = shard.sessions.find(user_id);
+	if (iter == shard.sessions.end())
 		return nullptr;
-	auto pinfo = &iter->second;
+	auto pinfo = iter->second.get();
 	if (hsession != pinfo->hsession)
 		return nullptr;
+	/*
+	 * Taken under the shard lock, so the scanner, which only touches
+	 * sessions with reference==0 (also under the shard lock), stays off.
+	 */
 	pinfo->reference ++;
 	time(&pinfo->last_time);
 	tl_hold.unlock();
+	auto t_wait = std::chrono::steady_clock::now();
 	pinfo->lock.lock();
+	gromox::call_stats::note_lock_wait(std::chrono::steady_clock::now() - t_wait);
+	gromox::call_stats::note_dir(pinfo->get_maildir());
 	pthread_setspecific(g_info_key, pinfo);
 	return USER_INFO_REF(pinfo);
 }
@@ -158,9 +226,7 @@ USER_INFO *zarafa_server_get_info()
 void user_info_del::operator()(USER_INFO *pinfo)
 {
 	pinfo->lock.unlock();
-	std::unique_lock tl_hold(g_table_lock);
 	pinfo->reference --;
-	tl_hold.unlock();
 	pthread_setspecific(g_info_key, NULL);
 }
 
@@ -181,6 +247,99 @@ NOTIFY_ITEM::~NOTIFY_ITEM()
 	double_list_free(&notify_list);
 }
 
+static time_t zcorezs_next_scan(const USER_INFO &info, time_t cur_time,
+    time_t sink_due)
+{
+	auto due = std::min(info.last_time, info.reload_time) + g_cache_interval;
+	if (due > cur_time)
+		return due;
+	/* idle, but held back by pending sinks (or a failed reload) */
+	return sink_due > cur_time ? sink_due : cur_time + 1;
+}
+
+/*
+ * Look at one session whose scheduled time has come: expired sinks go to
+ * @expired_sinks, an idle session is unlinked, and a due object tree
+ * reload is built outside of the shard lock.
+ */
+static void zcorezs_scan_session(const SCHED_ENTRY &ent, time_t cur_time,
+    DOUBLE_LIST *expired_sinks)
+{
+	auto user_id = zarafa_server_get_user_id(ent.hsession);
+	auto &shard = zarafa_server_session_shard(user_id);
+	std::unique_lock sh_hold(shard.lock);
+	auto iter = shard.sessions.find(user_id);
+	if (iter == shard.sessions.end() || iter->second->hsession != ent.hsession)
+		return;
+	auto pinfo = iter->second.get();
+	if (pinfo->reference != 0) {
+		sh_hold.unlock();
+		zarafa_server_schedule(cur_time + 1, ent.hsession, ent.rearm);
+		return;
+	}
+	time_t sink_due = 0;
+	auto ptail = double_list_get_tail(&pinfo->sink_list);
+	DOUBLE_LIST_NODE *pnode;
+	while ((pnode = double_list_pop_front(&pinfo->sink_list)) != nullptr) {
+		auto psink_node = static_cast<SINK_NODE *>(pnode->pdata);
+		if (cur_time >= psink_node->until_time) {
+			double_list_append_as_tail(expired_sinks, pnode);
+		} else {
+			double_list_append_as_tail(&pinfo->sink_list, pnode);
+			if (sink_due == 0 || psink_node->until_time < sink_due)
+				sink_due = psink_node->until_time;
+		}
+		if (pnode == ptail)
+			break;
+	}
+	if (!ent.rearm)
+		return;
+	if (cur_time - pinfo->last_time >= g_cache_interval &&
+	    double_list_get_nodes_num(&pinfo->sink_list) == 0) {
+		auto victim = std::move(iter->second);
+		shard.sessions.erase(iter);
+		--g_session_count;
+		auto &ushard = zarafa_server_user_shard(victim->username);
+		std::unique_lock uh_hold(ushard.lock);
+		ushard.users.erase(victim->username);
+		uh_hold.unlock();
+		sh_hold.unlock();
+		/*
+		 * Object tree teardown happens here, outside of any lock. Open
+		 * messages and tables unload their instances via exmdb, which
+		 * allocates from the environment.
+		 */
+		common_util_build_environment();
+		victim->ptree.reset();
+		common_util_free_environment();
+		victim.reset();
+		return;
+	}
+	if (cur_time - pinfo->last_time >= g_cache_interval ||
+	    cur_time - pinfo->reload_time < g_cache_interval) {
+		auto due = zcorezs_next_scan(*pinfo, cur_time, sink_due);
+		sh_hold.unlock();
+		zarafa_server_schedule(due, ent.hsession, true);
+		return;
+	}
+	auto holder = iter->second;
+	sh_hold.unlock();
+	common_util_build_environment();
+	auto ptree = object_tree_create(holder->get_maildir());
+	sh_hold.lock();
+	/* only swap if nobody picked the session up in the meantime */
+	if (ptree != nullptr && holder->reference == 0) {
+		std::swap(holder->ptree, ptree);
+		holder->reload_time = cur_time;
+	}
+	auto due = zcorezs_next_scan(*holder, cur_time, sink_due);
+	sh_hold.unlock();
+	/* old tree, or the new one if it could not be installed */
+	ptree.reset();
+	common_util_free_environment();
+	zarafa_server_schedule(due, ent.hsession, true);
+}
+
 static void *zcorezs_scanwork(void *param)
 {
 	int count;
@@ -194,7 +353,6 @@ static void *zcorezs_scanwork(void *param)
 	DOUBLE_LIST temp_list;
 	DOUBLE_LIST temp_list1;
 	DOUBLE_LIST_NODE *pnode;
-	DOUBLE_LIST_NODE *ptail;
 	
 	count = 0;
 	double_list_init(&temp_list);
@@ -209,70 +367,35 @@ static void *zcorezs_scanwork(void *param)
 		if (count >= g_ping_interval) {
 			count = 0;
 		}
-		std::unique_lock tl_hold(g_table_lock);
 		time(&cur_time);
-		for (auto iter = g_session_table.begin(); iter != g_session_table.end(); ) {
-			auto pinfo = &iter->second;
-			if (0 != pinfo->reference) {
-				++iter;
-				continue;
-			}
-			ptail = double_list_get_tail(&pinfo->sink_list);
-			while ((pnode = double_list_pop_front(&pinfo->sink_list)) != nullptr) {
-				psink_node = (SINK_NODE*)pnode->pdata;
-				if (cur_time >= psink_node->until_time) {
-					double_list_append_as_tail(&temp_list1, pnode);
-				} else {
-					double_list_append_as_tail(
-						&pinfo->sink_list, pnode);
-				}
-				if (pnode == ptail) {
-					break;
-				}
-			}
-			if (cur_time - pinfo->reload_time >= g_cache_interval) {
-				common_util_build_environment();
-				auto ptree = object_tree_create(pinfo->get_maildir());
-				if (NULL != ptree) {
-					pinfo->ptree = std::move(ptree);
-					pinfo->reload_time = cur_time;
-				}
-				common_util_free_environment();
-				++iter;
-				continue;
-			}
-			if (cur_time - pinfo->last_time < g_cache_interval) {
-				if (0 != count) {
-					++iter;
+		while (true) {
+			std::unique_lock sc_hold(g_sched_lock);
+			if (g_sched_queue.empty() || g_sched_queue.top().due > cur_time)
+				break;
+			auto ent = g_sched_queue.top();
+			g_sched_queue.pop();
+			sc_hold.unlock();
+			zcorezs_scan_session(ent, cur_time, &temp_list1);
+		}
+		for (size_t i = 0; count == 0 && i < SESSION_SHARD_NUM; ++i) {
+			auto &shard = g_session_shards[i];
+			std::lock_guard sh_hold(shard.lock);
+			for (const auto &pair : shard.sessions) {
+				auto pinfo = pair.second.get();
+				if (pinfo->reference != 0 ||
+				    cur_time - pinfo->last_time >= g_cache_interval)
 					continue;
-				}
 				pnode = me_alloc<DOUBLE_LIST_NODE>();
-				if (pnode == nullptr) {
-					++iter;
+				if (pnode == nullptr)
 					continue;
-				}
 				pnode->pdata = strdup(pinfo->get_maildir());
 				if (NULL == pnode->pdata) {
 					free(pnode);
-					++iter;
 					continue;
 				}
 				double_list_append_as_tail(&temp_list, pnode);
-				++iter;
-			} else {
-				if (0 != double_list_get_nodes_num(&pinfo->sink_list)) {
-					++iter;
-					continue;
-				}
-				common_util_build_environment();
-				pinfo->ptree.reset();
-				common_util_free_environment();
-				double_list_free(&pinfo->sink_list);
-				g_user_table.erase(pinfo->username);
-				iter = g_session_table.erase(iter);
 			}
 		}
-		tl_hold.unlock();
 		while ((pnode = double_list_pop_front(&temp_list)) != nullptr) {
 			common_util_build_environment();
 			exmdb_client::ping_store(static_cast<char *>(pnode->pdata));
@@ -699,8 +822,12 @@ void zarafa_server_stop()
 	g_notify_stop = true;
 	pthread_kill(g_scan_id, SIGALRM);
 	pthread_join(g_scan_id, NULL);
-	g_session_table.clear();
-	g_user_table.clear();
+	for (auto &shard : g_session_shards)
+		shard.sessions.clear();
+	for (auto &shard : g_user_shards)
+		shard.users.clear();
+	g_session_count = 0;
+	g_sched_queue = {};
 	g_notify_table.clear();
 }
 
@@ -714,8 +841,14 @@ int zarafa_server_get_param(int param)
 	switch (param) {
 	case USER_TABLE_SIZE:
 		return g_table_size;
-	case USER_TABLE_USED:
-		return g_user_table.size();
+	case USER_TABLE_USED: {
+		size_t used = 0;
+		for (auto &shard : g_user_shards) {
+			std::lock_guard uh_hold(shard.lock);
+			used += shard.users.size();
+		}
+		return used;
+	}
 	default:
 		return -1;
 	}
@@ -746,20 +879,24 @@ uint32_t zarafa_server_logon(const char *username,
 	}
 	gx_strlcpy(tmp_name, username, GX_ARRAY_SIZE(tmp_name));
 	HX_strlower(tmp_name);
-	std::unique_lock tl_hold(g_table_lock);
-	auto iter = g_user_table.find(tmp_name);
-	if (iter != g_user_table.end()) {
+	auto &ushard = zarafa_server_user_shard(tmp_name);
+	std::unique_lock uh_hold(ushard.lock);
+	auto iter = ushard.users.find(tmp_name);
+	if (iter != ushard.users.end()) {
 		user_id = iter->second;
-		auto st_iter = g_session_table.find(user_id);
-		if (st_iter != g_session_table.end()) {
-			auto pinfo = &st_iter->second;
+		uh_hold.unlock();
+		auto &shard = zarafa_server_session_shard(user_id);
+		std::lock_guard sh_hold(shard.lock);
+		auto st_iter = shard.sessions.find(user_id);
+		if (st_iter != shard.sessions.end()) {
+			auto pinfo = st_iter->second.get();
 			time(&pinfo->last_time);
 			*phsession = pinfo->hsession;
 			return ecSuccess;
 		}
-		g_user_table.erase(iter);
+	} else {
+		uh_hold.unlock();
 	}
-	tl_hold.unlock();
 	if (FALSE == system_services_get_id_from_username(
 		username, &user_id) ||
 	    !system_services_get_homedir(pdomain, homedir, arsizeof(homedir)) ||
@@ -772,54 +909,59 @@ uint32_t zarafa_server_logon(const char *username,
 	    !system_services_get_user_lang(username, lang, arsizeof(lang))))
 		return ecError;
 
-	USER_INFO tmp_info;
-	tmp_info.hsession = guid_random_new();
-	memcpy(tmp_info.hsession.node, &user_id, sizeof(int32_t));
-	tmp_info.user_id = user_id;
-	tmp_info.domain_id = domain_id;
-	tmp_info.org_id = org_id;
+	std::shared_ptr<USER_INFO> tmp_info;
 	try {
-		tmp_info.username = username;
-		HX_strlower(tmp_info.username.data());
-		tmp_info.lang = lang;
-		tmp_info.maildir = maildir;
-		tmp_info.homedir = homedir;
+		tmp_info = std::make_shared<USER_INFO>();
+		tmp_info->username = username;
+		HX_strlower(tmp_info->username.data());
+		tmp_info->lang = lang;
+		tmp_info->maildir = maildir;
+		tmp_info->homedir = homedir;
 	} catch (const std::bad_alloc &) {
 		return ecMAPIOOM;
 	}
-	tmp_info.cpid = !system_services_lang_to_charset(lang, charset) ? 1252 :
-	                system_services_charset_to_cpid(charset);
-	tmp_info.flags = flags;
-	time(&tmp_info.last_time);
-	tmp_info.reload_time = tmp_info.last_time;
-	tmp_info.ptree = object_tree_create(maildir);
-	if (tmp_info.ptree == nullptr)
-		return ecError;
-	tl_hold.lock();
-	auto st_iter = g_session_table.find(user_id);
-	if (st_iter != g_session_table.end()) {
-		auto pinfo = &st_iter->second;
-		*phsession = pinfo->hsession;
+	tmp_info->hsession = guid_random_new();
+	memcpy(tmp_info->hsession.node, &user_id, sizeof(int32_t));
+	tmp_info->user_id = user_id;
+	tmp_info->domain_id = domain_id;
+	tmp_info->org_id = org_id;
+	tmp_info->cpid = !system_services_lang_to_charset(lang, charset) ? 1252 :
+	                 system_services_charset_to_cpid(charset);
+	tmp_info->flags = flags;
+	time(&tmp_info->last_time);
+	tmp_info->reload_time = tmp_info->last_time;
+	tmp_info->ptree = object_tree_create(maildir);
+	if (tmp_info->ptree == nullptr)
+		return ecError;
+	auto &shard = zarafa_server_session_shard(user_id);
+	std::unique_lock sh_hold(shard.lock);
+	auto st_iter = shard.sessions.find(user_id);
+	if (st_iter != shard.sessions.end()) {
+		*phsession = st_iter->second->hsession;
 		return ecSuccess;
 	}
-	if (g_session_table.size() >= g_table_size)
+	if (++g_session_count > g_table_size) {
+		--g_session_count;
 		return ecError;
+	}
 	try {
-		st_iter = g_session_table.try_emplace(user_id, std::move(tmp_info)).first;
+		shard.sessions.emplace(user_id, tmp_info);
 	} catch (const std::bad_alloc &) {
-		return ecError;
-	}
-	if (g_user_table.size() >= g_table_size) {
-		g_session_table.erase(user_id);
+		--g_session_count;
 		return ecError;
 	}
 	try {
-		g_user_table.try_emplace(tmp_name, user_id);
+		std::lock_guard uh_hold(ushard.lock);
+		ushard.users.insert_or_assign(tmp_name, user_id);
 	} catch (const std::bad_alloc &) {
-		g_session_table.erase(user_id);
+		shard.sessions.erase(user_id);
+		--g_session_count;
 		return ecError;
 	}
-	*phsession = st_iter->second.hsession;
+	sh_hold.unlock();
+	*phsession = tmp_info->hsession;
+	zarafa_server_schedule(tmp_info->last_time + g_cache_interval,
+		tmp_info->hsession, true);
 	return ecSuccess;
 }
 
@@ -2729,6 +2871,7 @@ uint32_t zarafa_server_notifdequeue(const NOTIF_SINK *psink,
 				psink->count*sizeof(ADVISE_INFO));
 	double_list_append_as_tail(
 		&pinfo->sink_list, &psink_node->node);
+	zarafa_server_schedule(psink_node->until_time, pinfo->hsession, false);
 	return ecNotFound;
 }
 
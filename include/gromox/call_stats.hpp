@@ -0,0 +1,71 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <gromox/defs.h>
+
+namespace gromox {
+
+/*
+ * Per-call-ID latency histograms for RPC dispatchers.
+ *
+ * Every thread records into its own set of counters, so the hot path is a
+ * handful of relaxed stores and no locks; readers sum up all threads. The
+ * counters of a thread are folded into a common pool when it exits.
+ *
+ * A call is bracketed by begin() and end(). In between, the lower layers
+ * may attribute lock wait time, SQLite work and the mailbox directory to
+ * the call running on the current thread via the static note_* functions.
+ */
+class GX_EXPORT call_stats {
+	public:
+	static constexpr unsigned int BUCKETS = 28; /* log2(usec) up to ~67s */
+	using name_fn = const char *(*)(unsigned int);
+
+	struct counter {
+		std::atomic<uint64_t> count{0}, total_us{0}, max_us{0}, lock_us{0};
+		std::atomic<uint64_t> sql_ops{0}, bytes{0}, bucket[BUCKETS]{};
+	};
+
+	call_stats(const char *tag, unsigned int ncalls, name_fn);
+	~call_stats();
+	NOMOVE(call_stats);
+
+	void set_slow_threshold(unsigned int msec) { m_slow_ms = msec; }
+	void set_snapshot(const char *path, unsigned int interval);
+	static void begin();
+	void end(unsigned int call_id, size_t payload_bytes);
+	std::string dump(size_t limit = SIZE_MAX) const;
+	bool write_snapshot() const;
+	void reset();
+
+	static void note_lock_wait(std::chrono::steady_clock::duration);
+	static void note_sql_ops(unsigned int);
+	static void note_dir(const char *);
+
+	private:
+	struct slab;
+	slab *get_slab();
+	void retire(slab *);
+	counter *get_counter(slab *, unsigned int call_id);
+	void maybe_snapshot();
+
+	const char *m_tag;
+	unsigned int m_ncalls, m_serial;
+	name_fn m_name;
+	std::atomic<unsigned int> m_slow_ms{0}, m_snap_interval{0};
+	std::atomic<int64_t> m_snap_next{0};
+	mutable std::mutex m_lock;
+	std::string m_snap_path;
+	std::vector<slab *> m_slabs;
+	std::unique_ptr<counter[]> m_retired;
+
+	friend struct call_stats_tls;
+};
+
+}
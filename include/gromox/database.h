@@ -41,6 +41,7 @@ struct xstmt {
 extern GX_EXPORT struct xstmt gx_sql_prep(sqlite3 *, const char *);
 extern GX_EXPORT xtransaction gx_sql_begin_trans(sqlite3 *);
 extern GX_EXPORT int gx_sql_exec(sqlite3 *, const char *query);
+extern GX_EXPORT void gx_sql_count_ops(sqlite3 *);
 
 static inline uint64_t gx_sql_col_uint64(sqlite3_stmt *s, int c)
 {
@@ -121,3 +121,5 @@ EXMIDL(transport_new_mail, (const char *dir, uint64_t folder_id, uint64_t messag
 EXMIDL(check_contact_address, (const char *dir, const char *paddress, IDLOUT BOOL *b_found))
 EXMIDL(get_public_folder_unread_count, (const char *dir, const char *username, uint64_t folder_id, IDLOUT uint32_t *count))
 EXMIDL(unload_store, (const char *dir))
+EXMIDL(write_messages, (const char *dir, const char *account, uint32_t cpid, uint64_t folder_id, uint32_t count, const MESSAGE_CONTENT *pmsgctnt, IDLOUT gxerr_t *e_result))
+EXMIDL(set_messages_read_state, (const char *dir, const char *username, const EID_ARRAY *pmessage_ids, uint8_t mark_as_read))
@@ -146,6 +146,8 @@ enum {
 	CHECK_CONTACT_ADDRESS = 0x79,
 	GET_PUBLIC_FOLDER_UNREAD_COUNT = 0x7a,
 	UNLOAD_STORE = 0x80,
+	WRITE_MESSAGES = 0x81,
+	SET_MESSAGES_READ_STATE = 0x82,
 };
 }
 
@@ -642,6 +644,12 @@ struct EXREQ_SET_MESSAGE_READ_STATE {
 	uint8_t mark_as_read;
 };
 
+struct EXREQ_SET_MESSAGES_READ_STATE {
+	char *username;
+	EID_ARRAY *pmessage_ids;
+	uint8_t mark_as_read;
+};
+
 struct EXREQ_REMOVE_MESSAGE_PROPERTIES {
 	uint32_t cpid;
 	uint64_t message_id;
@@ -751,6 +759,14 @@ struct EXREQ_WRITE_MESSAGE {
 	MESSAGE_CONTENT *pmsgctnt;
 };
 
+struct EXREQ_WRITE_MESSAGES {
+	char *account;
+	uint32_t cpid;
+	uint64_t folder_id;
+	uint32_t count;
+	MESSAGE_CONTENT *pmsgctnt;
+};
+
 struct EXREQ_READ_MESSAGE {
 	char *username;
 	uint32_t cpid;
@@ -897,6 +913,7 @@ union EXMDB_REQUEST_PAYLOAD {
 	EXREQ_GET_MESSAGE_PROPERTIES get_message_properties;
 	EXREQ_SET_MESSAGE_PROPERTIES set_message_properties;
 	EXREQ_SET_MESSAGE_READ_STATE set_message_read_state;
+	EXREQ_SET_MESSAGES_READ_STATE set_messages_read_state;
 	EXREQ_REMOVE_MESSAGE_PROPERTIES remove_message_properties;
 	EXREQ_ALLOCATE_MESSAGE_ID allocate_message_id;
 	EXREQ_GET_MESSAGE_GROUP_ID get_message_group_id;
@@ -917,6 +934,7 @@ union EXMDB_REQUEST_PAYLOAD {
 	EXREQ_UPDATE_FOLDER_RULE update_folder_rule;
 	EXREQ_DELIVERY_MESSAGE delivery_message;
 	EXREQ_WRITE_MESSAGE write_message;
+	EXREQ_WRITE_MESSAGES write_messages;
 	EXREQ_READ_MESSAGE read_message;
 	EXREQ_GET_CONTENT_SYNC get_content_sync;
 	EXREQ_GET_HIERARCHY_SYNC get_hierarchy_sync;
@@ -1312,6 +1330,10 @@ struct EXRESP_WRITE_MESSAGE {
 	gxerr_t e_result;
 };
 
+struct EXRESP_WRITE_MESSAGES {
+	gxerr_t e_result;
+};
+
 struct EXRESP_READ_MESSAGE {
 	MESSAGE_CONTENT *pmsgctnt;
 };
@@ -1445,6 +1467,7 @@ union EXMDB_RESPONSE_PAYLOAD {
 	EXRESP_UPDATE_FOLDER_RULE update_folder_rule;
 	EXRESP_DELIVERY_MESSAGE delivery_message;
 	EXRESP_WRITE_MESSAGE write_message;
+	EXRESP_WRITE_MESSAGES write_messages;
 	EXRESP_READ_MESSAGE read_message;
 	EXRESP_GET_CONTENT_SYNC get_content_sync;
 	EXRESP_GET_HIERARCHY_SYNC get_hierarchy_sync;
@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdarg>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <dirent.h>
@@ -48,6 +49,33 @@ class wrapfd {
 	int m_fd = -1;
 };
 
+/**
+ * A file, or a byte range of it, made addressable for parsing in place
+ * (MAIL::retrieve keeps pointers into its input). The mapping is private
+ * and writable, so a parser touching the buffer only copies that page;
+ * the file must not be truncated while mapped. Small ranges, or those
+ * for which mmap is refused, are read into the heap instead.
+ */
+class GX_EXPORT mapped_file {
+	public:
+	mapped_file() = default;
+	~mapped_file() { reset(); }
+	NOMOVE(mapped_file);
+
+	/* Returns 0 or an errno value. @length == SIZE_MAX: up to EOF. */
+	int map(int fd, size_t offset = 0, size_t length = SIZE_MAX);
+	void reset();
+	char *data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+	private:
+	void *m_base = nullptr;
+	size_t m_maplen = 0;
+	char *m_data = nullptr;
+	size_t m_size = 0;
+	bool m_heap = false;
+};
+
 extern GX_EXPORT std::string iconvtext(const char *, size_t, const char *from, const char *to);
 extern GX_EXPORT pid_t popenfd(const char *const *, int *, int *, int *, const char *const *);
 extern GX_EXPORT ssize_t feed_w3m(const void *in, size_t insize, std::string &out);
@@ -1,7 +1,23 @@
 #pragma once
 #include <sys/time.h>
+#include <sys/types.h>
 #include <openssl/ssl.h>
-struct GENERIC_CONNECTION {
+#include <gromox/defs.h>
+struct iovec;
+struct GX_EXPORT GENERIC_CONNECTION {
+	/*
+	 * Gathered write: writev(2) in IOV_MAX-sized chunks for plain sockets,
+	 * TLS-record-sized SSL_write calls otherwise. Returns the byte count
+	 * written before the first error, if any.
+	 */
+	ssize_t writev(const struct iovec *, unsigned int count);
+	/*
+	 * Send @len bytes from the current offset of @fd without a userspace
+	 * copy. Fails with EOPNOTSUPP when that is not possible (TLS without
+	 * kernel offload).
+	 */
+	ssize_t sendfile(int fd, size_t len);
+
 	char client_ip[40]{}; /* client ip address string */
 	int client_port = 0; /* value of client port */
 	char server_ip[40]{}; /* server ip address */
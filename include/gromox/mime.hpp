@@ -1,4 +1,8 @@
 #pragma once
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <gromox/stream.hpp>
 #include <gromox/mem_file.hpp>
 #include <gromox/simple_tree.hpp>
@@ -21,6 +25,46 @@ enum{
 
 using MIME_FIELD_ENUM = BOOL (*)(const char *, char *, void *);
 
+/**
+ * Header fields of a MIME part other than Content-Type, in original order.
+ * Names and values are kept NUL-terminated in one arena; @m_index maps the
+ * lowercased name to the slots holding it, so lookups do not walk the
+ * whole head. Removed slots are kept as tombstones; append() compacts the
+ * table once they outnumber the live fields.
+ */
+class GX_EXPORT mime_field_table {
+	public:
+	struct field {
+		uint32_t name_off, name_len, value_off, value_len;
+		bool live;
+	};
+
+	bool append(const char *name, size_t nlen, const char *value, size_t vlen);
+	const field *find(const char *name, unsigned int order = 0) const;
+	size_t count(const char *name) const;
+	bool remove_first(const char *name);
+	bool remove_all(const char *name);
+	void clear();
+	size_t size() const { return m_live; }
+	const char *name(const field &f) const { return &m_arena[f.name_off]; }
+	const char *value(const field &f) const { return &m_arena[f.value_off]; }
+	template<typename F> bool for_each(F &&func) const {
+		for (const auto &f : m_fields)
+			if (f.live && !func(f))
+				return false;
+		return true;
+	}
+
+	private:
+	static std::string make_key(const char *, size_t);
+	void compact();
+
+	std::string m_arena;
+	std::vector<field> m_fields;
+	std::unordered_map<std::string, std::vector<uint32_t>> m_index;
+	size_t m_live = 0;
+};
+
 struct MIME {
 	SIMPLE_TREE_NODE node;
 	int			mime_type;
@@ -28,7 +72,7 @@ struct MIME {
 	char		boundary_string[VALUE_LEN];
 	int			boundary_len;
 	MEM_FILE	f_type_params;
-	MEM_FILE	f_other_fields;
+	mime_field_table other_fields;
 	BOOL		head_touched;
 	BOOL		content_touched;
 	char		*head_begin;
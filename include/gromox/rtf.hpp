@@ -4,3 +4,5 @@
 
 extern GX_EXPORT bool rtf_init_library(CPID_TO_CHARSET);
 extern GX_EXPORT bool rtf_to_html(const char *in, size_t inlen, const char *charset, char **outp, size_t *outlen, ATTACHMENT_LIST *);
+/* Same as rtf_to_html, but always via the element tree (no \fromhtml1 fast path) */
+extern GX_EXPORT bool rtf_to_html_tree(const char *in, size_t inlen, const char *charset, char **outp, size_t *outlen, ATTACHMENT_LIST *);
@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <ctime>
 #include <string>
+#include <iconv.h>
 #include <gromox/common_types.hpp>
 #include <gromox/defs.h>
 
@@ -9,6 +10,11 @@ enum {
 	QP_MIME_HEADER = 1U << 0,
 };
 
+/* instruction set levels for the base64/QP codecs */
+enum {
+	CODEC_SCALAR, CODEC_SSE4, CODEC_AVX2,
+};
+
 BOOL utf8_check(const char *str);
 BOOL utf8_len(const char *str, int *plen);
 BOOL utf8_truncate(char *str, int length);
@@ -40,6 +46,8 @@ extern int decode64_ex(const char *in, size_t inlen, void *out, size_t outmax, s
 extern GX_EXPORT size_t qp_decode(void *output, const char *input, size_t length, unsigned int qp_flags = 0);
 extern GX_EXPORT ssize_t qp_decode_ex(void *output, size_t out_len, const char *input, size_t length);
 extern GX_EXPORT ssize_t qp_encode_ex(void *output, size_t outlen, const char *input, size_t length);
+/* Caps the codecs at @isa (or the CPU's best); returns the level in effect. */
+extern GX_EXPORT unsigned int codec_set_isa(unsigned int isa);
 void encode_hex_int(int id, char *out);
 int decode_hex_int(const char *in);
 extern BOOL encode_hex_binary(const void *src, int srclen, char *dst, int dstlen);
@@ -58,5 +66,13 @@ extern GX_EXPORT std::string bin2hex(const void *, size_t);
 template<typename T> std::string bin2hex(const T &x) { return bin2hex(&x, sizeof(x)); }
 extern GX_EXPORT std::string hex2bin(const char *);
 extern GX_EXPORT void rfc1123_dstring(char *, size_t, time_t = 0);
+/*
+ * Per-thread cached iconv descriptor, reset to the initial shift state.
+ * (iconv_t)-1 if the pair is unsupported. Do not iconv_close() it, nor
+ * keep it across calls that may convert between the same pair.
+ */
+extern GX_EXPORT iconv_t iconv_cached(const char *to, const char *from);
+extern GX_EXPORT bool str_isascii(const char *, size_t);
+extern GX_EXPORT bool charset_ascii_compatible(const char *);
 
 }
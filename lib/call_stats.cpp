@@ -0,0 +1,349 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later WITH linking exception
+// This file is part of Gromox.
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <libHX/string.h>
+#include <gromox/call_stats.hpp>
+#include <gromox/defs.h>
+
+#define LLU(x) static_cast<unsigned long long>(x)
+
+using namespace std::chrono;
+
+namespace gromox {
+
+struct call_stats::slab {
+	explicit slab(unsigned int n) : ctr(new std::atomic<counter *>[n]), num(n)
+	{
+		for (unsigned int i = 0; i < n; ++i)
+			ctr[i] = nullptr;
+	}
+	~slab()
+	{
+		for (unsigned int i = 0; i < num; ++i)
+			delete ctr[i].load();
+	}
+	NOMOVE(slab);
+
+	std::unique_ptr<std::atomic<counter *>[]> ctr;
+	unsigned int num;
+};
+
+/* Per-thread bookkeeping: the slabs of this thread and the running call */
+struct call_stats_tls {
+	struct entry {
+		unsigned int serial;
+		call_stats *owner;
+		call_stats::slab *slab;
+	};
+	~call_stats_tls();
+
+	std::vector<entry> slabs;
+	steady_clock::time_point start;
+	steady_clock::duration lock_wait{};
+	uint64_t sql_ops = 0;
+	char dir[256]{};
+};
+
+}
+
+using namespace gromox;
+
+static std::mutex g_live_lock; /* protects g_live, taken before m_lock */
+static std::unordered_set<unsigned int> g_live;
+static std::atomic<unsigned int> g_serial;
+static thread_local call_stats_tls tl_stats;
+
+call_stats_tls::~call_stats_tls()
+{
+	std::lock_guard lv_hold(g_live_lock);
+	for (const auto &e : slabs) {
+		if (g_live.find(e.serial) != g_live.end())
+			e.owner->retire(e.slab);
+	}
+}
+
+static inline void cs_add(std::atomic<uint64_t> &v, uint64_t x)
+{
+	v.fetch_add(x, std::memory_order_relaxed);
+}
+
+static inline void cs_max(std::atomic<uint64_t> &v, uint64_t x)
+{
+	auto cur = v.load(std::memory_order_relaxed);
+	while (cur < x && !v.compare_exchange_weak(cur, x, std::memory_order_relaxed))
+		/* retry */;
+}
+
+static inline void cs_merge(call_stats::counter &d, const call_stats::counter &s)
+{
+	cs_add(d.count, s.count.load(std::memory_order_relaxed));
+	cs_add(d.total_us, s.total_us.load(std::memory_order_relaxed));
+	cs_max(d.max_us, s.max_us.load(std::memory_order_relaxed));
+	cs_add(d.lock_us, s.lock_us.load(std::memory_order_relaxed));
+	cs_add(d.sql_ops, s.sql_ops.load(std::memory_order_relaxed));
+	cs_add(d.bytes, s.bytes.load(std::memory_order_relaxed));
+	for (unsigned int i = 0; i < call_stats::BUCKETS; ++i)
+		cs_add(d.bucket[i], s.bucket[i].load(std::memory_order_relaxed));
+}
+
+static inline void cs_zero(call_stats::counter &c)
+{
+	c.count = c.total_us = c.max_us = c.lock_us = c.sql_ops = c.bytes = 0;
+	for (auto &b : c.bucket)
+		b = 0;
+}
+
+call_stats::call_stats(const char *tag, unsigned int ncalls, name_fn fn) :
+	m_tag(tag), m_ncalls(ncalls), m_serial(++g_serial), m_name(fn),
+	m_retired(new counter[ncalls])
+{
+	std::lock_guard lv_hold(g_live_lock);
+	g_live.insert(m_serial);
+}
+
+call_stats::~call_stats()
+{
+	std::unique_lock lv_hold(g_live_lock);
+	g_live.erase(m_serial);
+	lv_hold.unlock();
+	std::lock_guard hold(m_lock);
+	for (auto s : m_slabs)
+		delete s;
+	m_slabs.clear();
+}
+
+void call_stats::set_snapshot(const char *path, unsigned int interval)
+{
+	std::lock_guard hold(m_lock);
+	m_snap_path = path != nullptr ? path : "";
+	m_snap_interval = m_snap_path.empty() ? 0 : interval;
+	m_snap_next = time(nullptr) + interval;
+}
+
+call_stats::slab *call_stats::get_slab()
+{
+	for (const auto &e : tl_stats.slabs)
+		if (e.serial == m_serial)
+			return e.slab;
+	std::unique_ptr<slab> s(new(std::nothrow) slab(m_ncalls));
+	if (s == nullptr)
+		return nullptr;
+	try {
+		tl_stats.slabs.push_back({m_serial, this, s.get()});
+	} catch (const std::bad_alloc &) {
+		return nullptr;
+	}
+	std::lock_guard hold(m_lock);
+	try {
+		m_slabs.push_back(s.get());
+	} catch (const std::bad_alloc &) {
+		tl_stats.slabs.pop_back();
+		return nullptr;
+	}
+	return s.release();
+}
+
+/* Fold the counters of an exiting thread into m_retired */
+void call_stats::retire(slab *s)
+{
+	std::lock_guard hold(m_lock);
+	for (unsigned int i = 0; i < s->num; ++i) {
+		auto c = s->ctr[i].load();
+		if (c != nullptr)
+			cs_merge(m_retired[i], *c);
+	}
+	m_slabs.erase(std::remove(m_slabs.begin(), m_slabs.end(), s), m_slabs.end());
+	delete s;
+}
+
+call_stats::counter *call_stats::get_counter(slab *s, unsigned int call_id)
+{
+	auto c = s->ctr[call_id].load(std::memory_order_acquire);
+	if (c != nullptr)
+		return c;
+	/* only the owning thread ever stores into its slab */
+	c = new(std::nothrow) counter;
+	if (c != nullptr)
+		s->ctr[call_id].store(c, std::memory_order_release);
+	return c;
+}
+
+void call_stats::begin()
+{
+	auto &t = tl_stats;
+	t.lock_wait = {};
+	t.sql_ops = 0;
+	*t.dir = '\0';
+	t.start = steady_clock::now();
+}
+
+void call_stats::note_lock_wait(steady_clock::duration d)
+{
+	tl_stats.lock_wait += d;
+}
+
+void call_stats::note_sql_ops(unsigned int n)
+{
+	tl_stats.sql_ops += n;
+}
+
+void call_stats::note_dir(const char *dir)
+{
+	if (dir != nullptr && *tl_stats.dir == '\0')
+		gx_strlcpy(tl_stats.dir, dir, GX_ARRAY_SIZE(tl_stats.dir));
+}
+
+void call_stats::end(unsigned int call_id, size_t payload_bytes)
+{
+	auto &t = tl_stats;
+	uint64_t us = duration_cast<microseconds>(steady_clock::now() - t.start).count();
+	uint64_t lock_us = duration_cast<microseconds>(t.lock_wait).count();
+	if (call_id < m_ncalls) {
+		auto s = get_slab();
+		auto c = s != nullptr ? get_counter(s, call_id) : nullptr;
+		if (c != nullptr) {
+			auto b = us == 0 ? 0 : std::min(BUCKETS - 1,
+			         static_cast<unsigned int>(64 - __builtin_clzll(us)));
+			cs_add(c->count, 1);
+			cs_add(c->total_us, us);
+			cs_max(c->max_us, us);
+			cs_add(c->lock_us, lock_us);
+			cs_add(c->sql_ops, t.sql_ops);
+			cs_add(c->bytes, payload_bytes);
+			cs_add(c->bucket[b], 1);
+		}
+	}
+	auto slow_ms = m_slow_ms.load(std::memory_order_relaxed);
+	if (slow_ms > 0 && us >= slow_ms * 1000ULL) {
+		auto name = call_id < m_ncalls ? m_name(call_id) : nullptr;
+		fprintf(stderr, "W-1627: [%s] slow call %s (%u) on %s: %llu ms, "
+		        "of which lock wait %llu ms, execution %llu ms; "
+		        "%llu sqlite ops, %zu bytes\n",
+		        m_tag, name != nullptr && *name != '\0' ? name : "?",
+		        call_id, *t.dir != '\0' ? t.dir : "-",
+		        LLU(us / 1000), LLU(lock_us / 1000),
+		        LLU((us - std::min(us, lock_us)) / 1000),
+		        LLU(t.sql_ops), payload_bytes);
+	}
+	if (m_snap_interval.load(std::memory_order_relaxed) != 0)
+		maybe_snapshot();
+}
+
+void call_stats::maybe_snapshot()
+{
+	int64_t now = time(nullptr);
+	auto next = m_snap_next.load(std::memory_order_relaxed);
+	if (now < next || !m_snap_next.compare_exchange_strong(next,
+	    now + m_snap_interval.load(std::memory_order_relaxed)))
+		return;
+	write_snapshot();
+}
+
+/* Upper bound of the bucket in which the q-th quantile falls */
+static uint64_t cs_quantile(const call_stats::counter &c, uint64_t count, double q)
+{
+	uint64_t want = count * q, seen = 0;
+	for (unsigned int i = 0; i < call_stats::BUCKETS; ++i) {
+		seen += c.bucket[i].load(std::memory_order_relaxed);
+		if (seen > want)
+			return 1ULL << i;
+	}
+	return 1ULL << (call_stats::BUCKETS - 1);
+}
+
+std::string call_stats::dump(size_t limit) const try
+{
+	std::unique_ptr<counter[]> sum(new counter[m_ncalls]);
+	std::unique_lock hold(m_lock);
+	for (unsigned int i = 0; i < m_ncalls; ++i)
+		cs_merge(sum[i], m_retired[i]);
+	for (auto s : m_slabs) {
+		for (unsigned int i = 0; i < m_ncalls; ++i) {
+			auto c = s->ctr[i].load(std::memory_order_acquire);
+			if (c != nullptr)
+				cs_merge(sum[i], *c);
+		}
+	}
+	hold.unlock();
+	std::vector<unsigned int> ids;
+	for (unsigned int i = 0; i < m_ncalls; ++i)
+		if (sum[i].count != 0)
+			ids.push_back(i);
+	std::sort(ids.begin(), ids.end(), [&](unsigned int a, unsigned int b) {
+		return sum[a].total_us > sum[b].total_us;
+	});
+	if (ids.size() > limit)
+		ids.resize(limit);
+	char line[256];
+	snprintf(line, arsizeof(line), "%-32s %10s %9s %9s %9s %9s %10s %10s %12s\n",
+	         "call", "count", "avg_us", "p50_us", "p99_us", "max_us",
+	         "lock_ms", "sql_kops", "bytes");
+	std::string out = line;
+	for (auto i : ids) {
+		const auto &c = sum[i];
+		auto name = m_name(i);
+		uint64_t n = c.count;
+		snprintf(line, arsizeof(line), "%-32s %10llu %9llu %9llu %9llu %9llu %10llu %10llu %12llu\n",
+		         name != nullptr && *name != '\0' ? name : std::to_string(i).c_str(),
+		         LLU(n), LLU(c.total_us / n), LLU(cs_quantile(c, n, 0.50)),
+		         LLU(cs_quantile(c, n, 0.99)), LLU(c.max_us.load()),
+		         LLU(c.lock_us / 1000), LLU(c.sql_ops / 1000), LLU(c.bytes.load()));
+		out += line;
+	}
+	return out;
+} catch (const std::bad_alloc &) {
+	return {};
+}
+
+bool call_stats::write_snapshot() const
+{
+	std::unique_lock hold(m_lock);
+	auto path = m_snap_path;
+	hold.unlock();
+	if (path.empty())
+		return false;
+	auto text = dump();
+	auto tmp = path + ".tmp";
+	auto fp = fopen(tmp.c_str(), "w");
+	if (fp == nullptr) {
+		fprintf(stderr, "E-1628: [%s] fopen %s: %s\n", m_tag, tmp.c_str(), strerror(errno));
+		return false;
+	}
+	fprintf(fp, "# %s call statistics at %lld\n", m_tag, static_cast<long long>(time(nullptr)));
+	fputs(text.c_str(), fp);
+	if (fclose(fp) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+		fprintf(stderr, "E-1629: [%s] writing %s: %s\n", m_tag, path.c_str(), strerror(errno));
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+void call_stats::reset()
+{
+	std::lock_guard hold(m_lock);
+	for (unsigned int i = 0; i < m_ncalls; ++i)
+		cs_zero(m_retired[i]);
+	for (auto s : m_slabs) {
+		for (unsigned int i = 0; i < m_ncalls; ++i) {
+			auto c = s->ctr[i].load(std::memory_order_acquire);
+			if (c != nullptr)
+				cs_zero(*c);
+		}
+	}
+}
@@ -3,8 +3,12 @@
 // This file is part of Gromox.
 #include <cstdio>
 #include <sqlite3.h>
+#include <gromox/call_stats.hpp>
 #include <gromox/database.h>
 
+/* granularity of the VM instruction count fed to call_stats */
+#define SQL_PROGRESS_OPS 1000
+
 xstmt gx_sql_prep(sqlite3 *db, const char *query)
 {
 	xstmt out;
@@ -57,3 +61,18 @@ int gx_sql_exec(sqlite3 *db, const char *query)
 	sqlite3_free(estr);
 	return ret;
 }
+
+static int gx_sql_progress(void *)
+{
+	gromox::call_stats::note_sql_ops(SQL_PROGRESS_OPS);
+	return 0;
+}
+
+/*
+ * Attribute the VM instructions executed on @db to the call_stats call
+ * running on the current thread.
+ */
+void gx_sql_count_ops(sqlite3 *db)
+{
+	sqlite3_progress_handler(db, SQL_PROGRESS_OPS, gx_sql_progress, nullptr);
+}
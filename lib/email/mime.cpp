@@ -13,10 +13,14 @@
 #include <gromox/mail.hpp>
 #include <gromox/mail_func.hpp>
 #include <gromox/scope.hpp>
+#include <algorithm>
+#include <memory>
+#include <new>
 #include <cstring>
 #include <cstdlib>
 #include <unistd.h>
 #include <cstdio>
+#include <sys/uio.h>
 
 using namespace gromox;
 
@@ -35,6 +39,124 @@ bool MAIL::set_header(const char *hdr, const char *val)
 	return mime_set_field(static_cast<MIME *>(node->pdata), hdr, val);
 }
 
+std::string mime_field_table::make_key(const char *name, size_t len)
+{
+	std::string key(name, len);
+	for (auto &c : key)
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+	return key;
+}
+
+/* Drop tombstones once they outnumber the live fields (repeated set_field). */
+void mime_field_table::compact() try
+{
+	mime_field_table t;
+	t.m_arena.reserve(m_arena.size());
+	t.m_fields.reserve(m_live);
+	for (const auto &f : m_fields)
+		if (f.live && !t.append(name(f), f.name_len, value(f), f.value_len))
+			return;
+	*this = std::move(t);
+} catch (const std::bad_alloc &) {
+}
+
+bool mime_field_table::append(const char *name, size_t nlen,
+    const char *value, size_t vlen) try
+{
+	if (m_fields.size() - m_live > std::max(m_live, static_cast<size_t>(16)))
+		compact();
+	auto arena_len = m_arena.size();
+	field f{};
+	f.name_off = arena_len;
+	f.name_len = nlen;
+	f.value_off = arena_len + nlen + 1;
+	f.value_len = vlen;
+	f.live = true;
+	m_arena.append(name, nlen);
+	m_arena += '\0';
+	m_arena.append(value, vlen);
+	m_arena += '\0';
+	try {
+		m_fields.push_back(f);
+		try {
+			m_index[make_key(name, nlen)].push_back(m_fields.size() - 1);
+		} catch (const std::bad_alloc &) {
+			m_fields.pop_back();
+			throw;
+		}
+	} catch (const std::bad_alloc &) {
+		m_arena.resize(arena_len);
+		throw;
+	}
+	++m_live;
+	return true;
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
+const mime_field_table::field *mime_field_table::find(const char *name,
+    unsigned int order) const try
+{
+	auto it = m_index.find(make_key(name, strlen(name)));
+	if (it == m_index.end() || order >= it->second.size())
+		return nullptr;
+	return &m_fields[it->second[order]];
+} catch (const std::bad_alloc &) {
+	return nullptr;
+}
+
+size_t mime_field_table::count(const char *name) const try
+{
+	auto it = m_index.find(make_key(name, strlen(name)));
+	return it != m_index.end() ? it->second.size() : 0;
+} catch (const std::bad_alloc &) {
+	return 0;
+}
+
+bool mime_field_table::remove_first(const char *name) try
+{
+	auto it = m_index.find(make_key(name, strlen(name)));
+	if (it == m_index.end())
+		return false;
+	m_fields[it->second.front()].live = false;
+	--m_live;
+	if (it->second.size() == 1)
+		m_index.erase(it);
+	else
+		it->second.erase(it->second.begin());
+	return true;
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
+bool mime_field_table::remove_all(const char *name) try
+{
+	auto it = m_index.find(make_key(name, strlen(name)));
+	if (it == m_index.end())
+		return false;
+	for (auto slot : it->second)
+		m_fields[slot].live = false;
+	m_live -= it->second.size();
+	m_index.erase(it);
+	return true;
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
+void mime_field_table::clear()
+{
+	/* pooled MIME objects keep their buffers, unless unusually large */
+	if (m_arena.capacity() > MIME_FIELD_LEN) {
+		m_arena = std::string();
+		m_fields = std::vector<field>();
+	}
+	m_arena.clear();
+	m_fields.clear();
+	m_index.clear();
+	m_live = 0;
+}
+
 void mime_init(MIME *pmime, LIB_BUFFER *palloc)
 {
 #ifdef _DEBUG_UMTA
@@ -58,7 +180,7 @@ void mime_init(MIME *pmime, LIB_BUFFER *palloc)
 	pmime->first_boundary    = NULL;
 	pmime->last_boundary     = NULL;
 	mem_file_init(&pmime->f_type_params, palloc);
-	mem_file_init(&pmime->f_other_fields, palloc);
+	pmime->other_fields.clear();
 	
 }
 
@@ -89,7 +211,7 @@ void mime_free(MIME *pmime)
         }
 	}
 	mem_file_free(&pmime->f_type_params);
-	mem_file_free(&pmime->f_other_fields);
+	pmime->other_fields.clear();
 	pmime->content_type[0]	 = '\0';
 	pmime->boundary_string[0]= '\0';
 	pmime->boundary_len		 = 0;
@@ -159,12 +281,12 @@ BOOL mime_retrieve(MIME *pmime_parent,
 					pmime->mime_type = SINGLE_MIME;
 				}
 			} else {
-				static_assert(sizeof(mime_field.field_name_len) == sizeof(uint32_t));
-				static_assert(sizeof(mime_field.field_value_len) == sizeof(uint32_t));
-				pmime->f_other_fields.write(&mime_field.field_name_len, sizeof(mime_field.field_name_len));
-				pmime->f_other_fields.write(mime_field.field_name, mime_field.field_name_len);
-				pmime->f_other_fields.write(&mime_field.field_value_len, sizeof(mime_field.field_value_len));
-				pmime->f_other_fields.write(mime_field.field_value, mime_field.field_value_len);
+				if (!pmime->other_fields.append(mime_field.field_name,
+				    mime_field.field_name_len, mime_field.field_value,
+				    mime_field.field_value_len)) {
+					mime_clear(pmime);
+					return FALSE;
+				}
 			}
 			if ('\r' == in_buff[current_offset]) {
 				pmime->head_begin = in_buff;
@@ -290,7 +412,7 @@ void mime_clear(MIME *pmime)
 	pmime->first_boundary    = NULL;
     pmime->last_boundary     = NULL;
 	pmime->f_type_params.clear();
-	pmime->f_other_fields.clear();
+	pmime->other_fields.clear();
 
 }
 
@@ -542,8 +664,6 @@ const char *mime_get_content_type(MIME *pmime)
  */		
 BOOL mime_enum_field(MIME *pmime, MIME_FIELD_ENUM enum_func, void *pparam)
 {
-	int	tag_len, val_len;
-	char tmp_tag[MIME_NAME_LEN];
 	char tmp_value[MIME_FIELD_LEN];
 	
 #ifdef _DEBUG_UMTA
@@ -555,18 +675,14 @@ BOOL mime_enum_field(MIME *pmime, MIME_FIELD_ENUM enum_func, void *pparam)
 	if (FALSE == enum_func("Content-Type", pmime->content_type, pparam)) {
 		return FALSE;
 	}
-	pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-	while (pmime->f_other_fields.read(&tag_len, sizeof(uint32_t)) != MEM_END_OF_FILE) {
-		pmime->f_other_fields.read(tmp_tag, tag_len);
-		tmp_tag[tag_len] = '\0';
-		pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-		pmime->f_other_fields.read(tmp_value, val_len);
-		tmp_value[val_len] = '\0';
-		if (FALSE == enum_func(tmp_tag, tmp_value, pparam)) {
-			return FALSE;
-		}
-	}
-	return TRUE;
+	auto &tbl = pmime->other_fields;
+	return tbl.for_each([&](const mime_field_table::field &f) {
+		/* the callback may modify the value, so hand out a copy */
+		auto len = std::min(static_cast<size_t>(f.value_len), sizeof(tmp_value) - 1);
+		memcpy(tmp_value, tbl.value(f), len);
+		tmp_value[len] = '\0';
+		return enum_func(tbl.name(f), tmp_value, pparam) != FALSE;
+	}) ? TRUE : FALSE;
 }
 
 static BOOL mime_get_content_type_field(MIME *pmime, char *value, int length)
@@ -622,9 +738,6 @@ static BOOL mime_get_content_type_field(MIME *pmime, char *value, int length)
  */		
 BOOL mime_get_field(MIME *pmime, const char *tag, char *value, int length)
 {
-	int tag_len, val_len;
-	char tmp_buff[MIME_NAME_LEN];
-	
 #ifdef _DEBUG_UMTA
 	if (NULL == pmime || NULL == tag || NULL == value) {
 		debug_info("[mime]: NULL pointer found in mime_get_field");
@@ -634,20 +747,14 @@ BOOL mime_get_field(MIME *pmime, const char *tag, char *value, int length)
 	if (0 == strcasecmp(tag, "Content-Type")) {
 		return mime_get_content_type_field(pmime, value, length);
 	}
-	pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-	while (pmime->f_other_fields.read(&tag_len, sizeof(uint32_t)) != MEM_END_OF_FILE) {
-		pmime->f_other_fields.read(tmp_buff, tag_len);
-		tmp_buff[tag_len] = '\0';
-		pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-		if (0 == strcasecmp(tag, tmp_buff)) {
-			length = (length > val_len)?val_len:(length - 1);
-			pmime->f_other_fields.read(value, length);
-			value[length] = '\0';
-			return TRUE;
-		} 
-		pmime->f_other_fields.seek(MEM_FILE_READ_PTR, val_len, MEM_FILE_SEEK_CUR);
-	}
-	return FALSE;
+	auto f = pmime->other_fields.find(tag);
+	if (f == nullptr)
+		return FALSE;
+	int val_len = f->value_len;
+	length = (length > val_len)?val_len:(length - 1);
+	memcpy(value, pmime->other_fields.value(*f), length);
+	value[length] = '\0';
+	return TRUE;
 }
 
 /*
@@ -660,10 +767,6 @@ BOOL mime_get_field(MIME *pmime, const char *tag, char *value, int length)
  */
 int mime_get_field_num(MIME *pmime, const char *tag)
 {
-	int i;
-	int	tag_len, val_len;
-	char tmp_buff[MIME_NAME_LEN];
-
 #ifdef _DEBUG_UMTA
 	if (NULL == pmime || NULL == tag) {
 		debug_info("[mime]: NULL pointer found in mime_get_field_num");
@@ -673,19 +776,7 @@ int mime_get_field_num(MIME *pmime, const char *tag)
 	if (0 == strcasecmp(tag, "Content-Type")) {
 		return 1;
 	}
-	i = 0;
-	pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-	while (pmime->f_other_fields.read(&tag_len, sizeof(uint32_t)) != MEM_END_OF_FILE) {
-		pmime->f_other_fields.read(tmp_buff, tag_len);
-		tmp_buff[tag_len] = '\0';
-		pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-		if (0 == strcasecmp(tag, tmp_buff)) {
-			i ++;
-		}
-		pmime->f_other_fields.seek(MEM_FILE_READ_PTR, val_len, MEM_FILE_SEEK_CUR);
-	}
-	return i;
-		
+	return pmime->other_fields.count(tag);
 }
 
 /*
@@ -703,10 +794,6 @@ int mime_get_field_num(MIME *pmime, const char *tag)
 BOOL mime_search_field(MIME *pmime, const char *tag, int order, char *value,
 	int length)
 {
-	int i;
-	int	tag_len, val_len;
-	char tmp_buff[MIME_FIELD_LEN];
-	
 #ifdef _DEBUG_UMTA
 	if (NULL == pmime || NULL == tag || NULL == value) {
 		debug_info("[mime]: NULL pointer found in mime_search_field");
@@ -724,29 +811,19 @@ BOOL mime_search_field(MIME *pmime, const char *tag, int order, char *value,
 			return FALSE;
 		}
 	}
-	i = -1;
-	pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-	while (pmime->f_other_fields.read(&tag_len, sizeof(uint32_t)) != MEM_END_OF_FILE) {
-		pmime->f_other_fields.read(tmp_buff, tag_len);
-		tmp_buff[tag_len] = '\0';
-		pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-		if (0 == strcasecmp(tag, tmp_buff)) {
-			i ++;
-			if (i == order) {
-				length = (length > val_len)?val_len:(length - 1);
-				pmime->f_other_fields.read(value, length);
-				value[length] = '\0';
-				return TRUE;
-			}
-		} 
-		pmime->f_other_fields.read(tmp_buff, val_len);
-	}
-	return FALSE;
+	auto f = pmime->other_fields.find(tag, order);
+	if (f == nullptr)
+		return FALSE;
+	int val_len = f->value_len;
+	length = (length > val_len)?val_len:(length - 1);
+	memcpy(value, pmime->other_fields.value(*f), length);
+	value[length] = '\0';
+	return TRUE;
 }
 
 /*
  *	set the mime field, if the tag is "content-type", the content type and
- *	content type paramerter list is set, but not f_other_fields! 
+ *	content type paramerter list is set, but not other_fields! 
  *	@param
  *		pmime [in,out]		indicate the MIME object
  *		tag [in]			tag string
@@ -757,11 +834,7 @@ BOOL mime_search_field(MIME *pmime, const char *tag, int order, char *value,
  */
 BOOL mime_set_field(MIME *pmime, const char *tag, const char *value)
 {
-	MEM_FILE file_tmp;
-	int		tag_len, val_len;
 	char	tmp_buff[MIME_FIELD_LEN];
-	BOOL	found_tag = FALSE;
-	int		i, mark;
 	
 #ifdef _DEBUG_UMTA
 	if (NULL == pmime || NULL == tag || NULL == value) {
@@ -779,55 +852,15 @@ BOOL mime_set_field(MIME *pmime, const char *tag, const char *value)
 		}
 		return TRUE;
 	}
-	pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-	mark = -1;
-	while (pmime->f_other_fields.read(&tag_len, sizeof(uint32_t)) != MEM_END_OF_FILE) {
-		mark ++;
-		pmime->f_other_fields.read(tmp_buff, tag_len);
-		tmp_buff[tag_len] = '\0';
-		if (0 == strcasecmp(tag, tmp_buff)) {
-			found_tag = TRUE;
-			break;
-		} 
-		pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-		pmime->f_other_fields.seek(MEM_FILE_READ_PTR, val_len, MEM_FILE_SEEK_CUR);
-	}
-	if (FALSE == found_tag){
-		tag_len = strlen(tag);
-		val_len = strlen(value);
-		pmime->f_other_fields.write(&tag_len, sizeof(uint32_t));
-		pmime->f_other_fields.write(tag, tag_len);
-		pmime->f_other_fields.write(&val_len, sizeof(uint32_t));
-		pmime->f_other_fields.write(value, val_len);
-	} else {
-		mem_file_init(&file_tmp, pmime->f_other_fields.allocator);
-		pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-		i = 0;
-		while (pmime->f_other_fields.read(&tag_len,
-		       sizeof(uint32_t)) != MEM_END_OF_FILE) {
-			pmime->f_other_fields.read(tmp_buff, tag_len);
-			if (i != mark) {
-				file_tmp.write(&tag_len, sizeof(uint32_t));
-				file_tmp.write(tmp_buff, tag_len);
-			}
-			pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-			pmime->f_other_fields.read(tmp_buff, val_len);
-			if (i != mark) {
-				file_tmp.write(&val_len, sizeof(uint32_t));
-				file_tmp.write(tmp_buff, val_len);
-			}
-			i ++;
-		}
-		/* write the new tag-value at the end of mem file */
-		tag_len = strlen(tag);
-		val_len = strlen(value);
-		file_tmp.write(&tag_len, sizeof(uint32_t));
-		file_tmp.write(tag, tag_len);
-		file_tmp.write(&val_len, sizeof(uint32_t));
-		file_tmp.write(value, val_len);
-		file_tmp.copy_to(pmime->f_other_fields);
-		mem_file_free(&file_tmp);
-	}
+	/*
+	 * The first occurrence is replaced by one at the end. Append before
+	 * removing, so that a failed append leaves the old field in place.
+	 */
+	auto b_exist = pmime->other_fields.count(tag) > 0;
+	if (!pmime->other_fields.append(tag, strlen(tag), value, strlen(value)))
+		return FALSE;
+	if (b_exist)
+		pmime->other_fields.remove_first(tag);
 	pmime->head_touched = TRUE;
 	return TRUE;
 }
@@ -845,8 +878,6 @@ BOOL mime_set_field(MIME *pmime, const char *tag, const char *value)
  */
 BOOL mime_append_field(MIME *pmime, const char *tag, const char *value)
 {
-	int	tag_len, val_len;
-	
 #ifdef _DEBUG_UMTA
 	if (NULL == pmime || NULL == tag || NULL == value) {
 		debug_info("[mime]: NULL pointer found in mime_append_field");
@@ -856,12 +887,8 @@ BOOL mime_append_field(MIME *pmime, const char *tag, const char *value)
 	if (0 == strcasecmp(tag, "Content-Type")) {
 		return FALSE;
 	}
-	tag_len = strlen(tag);
-	val_len = strlen(value);
-	pmime->f_other_fields.write(&tag_len, sizeof(uint32_t));
-	pmime->f_other_fields.write(tag, tag_len);
-	pmime->f_other_fields.write(&val_len, sizeof(uint32_t));
-	pmime->f_other_fields.write(value, val_len);
+	if (!pmime->other_fields.append(tag, strlen(tag), value, strlen(value)))
+		return FALSE;
 	pmime->head_touched = TRUE;
 	return TRUE;
 }
@@ -877,37 +904,10 @@ BOOL mime_append_field(MIME *pmime, const char *tag, const char *value)
  */
 BOOL mime_remove_field(MIME *pmime, const char *tag)
 {
-	BOOL found_tag = false;
-	MEM_FILE file_tmp;
-	char tmp_buff[MIME_FIELD_LEN];
-	int tag_len, val_len;
-
 	if (0 == strcasecmp(tag, "Content-Type")) {
 		return FALSE;
 	}
-	mem_file_init(&file_tmp, pmime->f_other_fields.allocator);
-	pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-	while (pmime->f_other_fields.read(&tag_len, sizeof(uint32_t)) != MEM_END_OF_FILE) {
-		pmime->f_other_fields.read(tmp_buff, tag_len);
-		tmp_buff[tag_len] = '\0';
-		if (0 == strcasecmp(tag, tmp_buff)) {
-			found_tag = TRUE;
-			pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-			pmime->f_other_fields.seek(MEM_FILE_READ_PTR, val_len, MEM_FILE_SEEK_CUR);
-		} else {
-			file_tmp.write(&tag_len, sizeof(uint32_t));
-			file_tmp.write(tmp_buff, tag_len);
-			pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-			pmime->f_other_fields.read(tmp_buff, val_len);
-			file_tmp.write(&val_len, sizeof(uint32_t));
-			file_tmp.write(tmp_buff, val_len);
-		}
-	}
-	if (TRUE == found_tag) {
-		file_tmp.copy_to(pmime->f_other_fields);
-	}
-	mem_file_free(&file_tmp);
-	return found_tag;
+	return pmime->other_fields.remove_all(tag) ? TRUE : FALSE;
 }
 
 /*
@@ -1039,6 +1039,17 @@ BOOL mime_set_content_param(MIME *pmime, const char *tag, const char *value)
 	return TRUE;
 }
 
+/* Length of the "name: value\r\n" lines of a touched head */
+static size_t mime_fields_length(const mime_field_table &tbl)
+{
+	size_t len = 0;
+	tbl.for_each([&](const mime_field_table::field &f) {
+		len += f.name_len + 2 + f.value_len + 2;
+		return true;
+	});
+	return len;
+}
+
 /*
  *	write MIME object into stream
  *	@param
@@ -1075,19 +1086,16 @@ BOOL mime_serialize(MIME *pmime, STREAM *pstream)
 			pstream->write("\r\n", 2);
 		}
 	} else {	
-		pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-		while (pmime->f_other_fields.read(&tag_len,
-		       sizeof(uint32_t)) != MEM_END_OF_FILE) {
+		auto &tbl = pmime->other_fields;
+		tbl.for_each([&](const mime_field_table::field &f) {
 			/* xxxxx: yyyyy */
-			pmime->f_other_fields.read(tmp_buff, tag_len);
-			pstream->write(tmp_buff, tag_len);
+			pstream->write(tbl.name(f), f.name_len);
 			pstream->write(": ", 2);
-			pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-			pmime->f_other_fields.read(tmp_buff, val_len);
-			pstream->write(tmp_buff, val_len);
+			pstream->write(tbl.value(f), f.value_len);
 			/* \r\n */
 			pstream->write("\r\n", 2);
-		}
+			return true;
+		});
 
 		/* Content-Type: xxxxx */
 		pstream->write("Content-Type: ", 14);
@@ -1281,24 +1289,24 @@ BOOL mime_read_head(MIME *pmime, char *out_buff, size_t *plength)
 		return TRUE;
 	}
 	offset = 0;
-	pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-	while (pmime->f_other_fields.read(&tag_len, sizeof(uint32_t)) != MEM_END_OF_FILE) {
+	auto &tbl = pmime->other_fields;
+	if (!tbl.for_each([&](const mime_field_table::field &f) {
 		/* xxxxx: yyyyy */
-		pmime->f_other_fields.read(tmp_buff, tag_len);
-		len = tag_len;
-		memcpy(tmp_buff + len, ": ", 2);
-		len += 2;
-		pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-		pmime->f_other_fields.read(tmp_buff + len, val_len);
-		len += val_len;
-		memcpy(tmp_buff + len, "\r\n", 2);
-		len += 2;
-		if (offset + len > *plength) {
-			*plength = 0;
-			return FALSE;
-		}
-		memcpy(tmp_buff + offset, tmp_buff, len);
-		offset += len;
+		len = f.name_len + 2 + f.value_len + 2;
+		if (offset + len > *plength)
+			return false;
+		memcpy(out_buff + offset, tbl.name(f), f.name_len);
+		offset += f.name_len;
+		memcpy(out_buff + offset, ": ", 2);
+		offset += 2;
+		memcpy(out_buff + offset, tbl.value(f), f.value_len);
+		offset += f.value_len;
+		memcpy(out_buff + offset, "\r\n", 2);
+		offset += 2;
+		return true;
+	})) {
+		*plength = 0;
+		return FALSE;
 	}
 	/* Content-Type: xxxxx */
 	memcpy(tmp_buff, "Content-Type: ", 14);
@@ -1339,7 +1347,7 @@ BOOL mime_read_head(MIME *pmime, char *out_buff, size_t *plength)
 		*plength = 0;
 		return FALSE;
 	}
-	memcpy(tmp_buff + offset, tmp_buff, len);
+	memcpy(out_buff + offset, tmp_buff, len);
 	offset += len;
 	*plength = offset;
 	return TRUE;
@@ -1515,31 +1523,160 @@ BOOL mime_read_content(MIME *pmime, char *out_buff, size_t *plength)
 	}
 }
 
-/*
- *	write MIME object into file
- *	@param
- *		pmime [in]		indicate the MIME object
- *		fd				file descriptor
- *	@return
- *		TRUE			OK to copy out the MIME
- *		FALSE			buffer is too short
+namespace {
+
+/**
+ * Output gatherer for mime_to_file/mime_to_ssl. Generated pieces (header
+ * lines, boundaries) are copied into a staging buffer, while larger
+ * untouched ranges of the mail buffer are referenced in place. Everything
+ * goes out with writev(2), or, for TLS, in record-sized SSL_write calls.
  */
-BOOL mime_to_file(MIME *pmime, int fd)
+class mime_writer {
+	public:
+	mime_writer(int fd) : m_fd(fd) {}
+	mime_writer(SSL *ssl) : m_ssl(ssl), m_limit(SSL_RECORD_LEN) {}
+	bool put(const void *, size_t);
+	bool put_ref(const void *, size_t);
+	char *reserve(size_t);
+	bool commit(size_t);
+	bool flush();
+
+	private:
+	/* ranges shorter than this are copied rather than referenced */
+	static constexpr size_t REF_MIN = 2048, SSL_RECORD_LEN = 16384;
+	static constexpr size_t STAGE_LEN = 2 * MIME_FIELD_LEN;
+	static constexpr unsigned int MAX_IOV = 64;
+
+	bool add_iov(const void *, size_t);
+
+	int m_fd = -1;
+	SSL *m_ssl = nullptr;
+	size_t m_limit = MIME_FIELD_LEN, m_used = 0;
+	unsigned int m_niov = 0;
+	bool m_stage_tail = false; /* last iovec ends at m_stage + m_used */
+	std::unique_ptr<char[]> m_stage;
+	struct iovec m_iov[MAX_IOV];
+};
+
+}
+
+bool mime_writer::add_iov(const void *p, size_t z)
 {
-	BOOL has_submime;
-	MIME *pmime_child;
-	size_t len, tmp_len;
-	int	tag_len, val_len;
-	SIMPLE_TREE_NODE *pnode;
-	char tmp_buff[MIME_FIELD_LEN + MIME_NAME_LEN + 4];
-	
-	
-#ifdef _DEBUG_UMTA
-	if (NULL == pmime) {
-		debug_info("[mime]: NULL pointer found in mime_to_file");
-		return FALSE;
+	if (m_niov == MAX_IOV && !flush())
+		return false;
+	m_iov[m_niov].iov_base = const_cast<void *>(p);
+	m_iov[m_niov++].iov_len = z;
+	return true;
+}
+
+/* Staging space for up to @z bytes; finish with commit(). */
+char *mime_writer::reserve(size_t z)
+{
+	if (z > STAGE_LEN)
+		return nullptr;
+	if (m_stage == nullptr) {
+		m_stage.reset(new(std::nothrow) char[STAGE_LEN]);
+		if (m_stage == nullptr)
+			return nullptr;
+	}
+	if ((m_used + z > STAGE_LEN || m_niov == MAX_IOV) && !flush())
+		return nullptr;
+	return &m_stage[m_used];
+}
+
+bool mime_writer::commit(size_t z)
+{
+	if (z == 0)
+		return true;
+	if (m_stage_tail) {
+		m_iov[m_niov-1].iov_len += z;
+	} else {
+		if (!add_iov(&m_stage[m_used], z))
+			return false;
+		m_stage_tail = true;
 	}
-#endif
+	m_used += z;
+	return m_used < m_limit || flush();
+}
+
+bool mime_writer::put(const void *p, size_t z)
+{
+	while (z > 0) {
+		auto seg = std::min(z, m_limit);
+		auto d = reserve(seg);
+		if (d == nullptr)
+			return false;
+		memcpy(d, p, seg);
+		if (!commit(seg))
+			return false;
+		p = static_cast<const char *>(p) + seg;
+		z -= seg;
+	}
+	return true;
+}
+
+/* @p must stay valid until the next flush(). */
+bool mime_writer::put_ref(const void *p, size_t z)
+{
+	if (z < REF_MIN)
+		return put(p, z);
+	m_stage_tail = false;
+	return add_iov(p, z);
+}
+
+bool mime_writer::flush()
+{
+	auto iov = m_iov;
+	auto cnt = m_niov;
+	m_niov = 0;
+	m_used = 0;
+	m_stage_tail = false;
+	if (m_ssl != nullptr) {
+		for (; cnt > 0; ++iov, --cnt) {
+			auto wrlen = SSL_write(m_ssl, iov->iov_base, iov->iov_len);
+			if (wrlen < 0 || static_cast<size_t>(wrlen) != iov->iov_len)
+				return false;
+		}
+		return true;
+	}
+	while (cnt > 0) {
+		auto wrlen = writev(m_fd, iov, cnt);
+		if (wrlen < 0 && errno == EINTR)
+			continue;
+		if (wrlen <= 0)
+			return false;
+		auto done = static_cast<size_t>(wrlen);
+		while (cnt > 0 && done >= iov->iov_len) {
+			done -= iov->iov_len;
+			++iov;
+			--cnt;
+		}
+		if (cnt > 0) {
+			iov->iov_base = static_cast<char *>(iov->iov_base) + done;
+			iov->iov_len -= done;
+		}
+	}
+	return true;
+}
+
+/* Append the "--boundary" delimiter line plus @suffix. */
+static bool mime_emit_boundary(MIME *pmime, mime_writer &w,
+    const char *suffix, size_t slen)
+{
+	auto d = w.reserve(pmime->boundary_len + 2 + slen);
+	if (d == nullptr)
+		return false;
+	memcpy(d, "--", 2);
+	memcpy(d + 2, pmime->boundary_string, pmime->boundary_len);
+	memcpy(d + 2 + pmime->boundary_len, suffix, slen);
+	return w.commit(pmime->boundary_len + 2 + slen);
+}
+
+/* Same output as mime_serialize, gathered into @w. */
+static BOOL mime_emit(MIME *pmime, mime_writer &w)
+{
+	uint32_t tag_len, val_len;
+
 	if (NONE_MIME == pmime->mime_type) {
 #ifdef _DEBUG_UMTA
 		debug_info("[mime]: mime content type is not set");
@@ -1548,167 +1685,110 @@ BOOL mime_to_file(MIME *pmime, int fd)
 	}
 	if (FALSE == pmime->head_touched){
 		/* the original buffer contains \r\n */
-		if (pmime->head_begin + pmime->head_length
-			+ 2 == pmime->content_begin) {
-			auto wrlen = write(fd, pmime->head_begin, pmime->head_length + 2);
-			if (wrlen < 0 || static_cast<size_t>(wrlen) != pmime->head_length + 2)
+		if (pmime->head_begin + pmime->head_length + 2 == pmime->content_begin) {
+			if (!w.put_ref(pmime->head_begin, pmime->head_length + 2))
 				return FALSE;
-		} else {
-			auto wrlen = write(fd, pmime->head_begin, pmime->head_length);
-			if (wrlen < 0 || static_cast<size_t>(wrlen) != pmime->head_length)
-				return FALSE;
-			if (2 != write(fd, "\r\n", 2)) {
-				return FALSE;
-			}
+		} else if (!w.put_ref(pmime->head_begin, pmime->head_length) ||
+		    !w.put("\r\n", 2)) {
+			return FALSE;
 		}
 	} else {	
-		pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-		while (pmime->f_other_fields.read(&tag_len,
-		       sizeof(uint32_t)) != MEM_END_OF_FILE) {
+		auto &tbl = pmime->other_fields;
+		if (!tbl.for_each([&](const mime_field_table::field &f) {
 			/* xxxxx: yyyyy */
-			pmime->f_other_fields.read(tmp_buff, tag_len);
-			len = tag_len;
-			memcpy(tmp_buff + len, ": ", 2);
-			len += 2;
-			pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-			pmime->f_other_fields.read(tmp_buff + len, val_len);
-			len += val_len;
-			memcpy(tmp_buff + len, "\r\n", 2);
-			len += 2;
-			auto wrlen = write(fd, tmp_buff, len);
-			if (wrlen < 0 || static_cast<size_t>(wrlen) != len)
-				return FALSE;
-		}
+			return w.put(tbl.name(f), f.name_len) && w.put(": ", 2) &&
+			       w.put_ref(tbl.value(f), f.value_len) &&
+			       w.put("\r\n", 2);
+		}))
+			return FALSE;
 
 		/* Content-Type: xxxxx */
-		memcpy(tmp_buff, "Content-Type: ", 14);
-		len = 14;
-		val_len = strlen(pmime->content_type);
-		memcpy(tmp_buff + len, pmime->content_type, val_len);
-		len += val_len;
+		if (!w.put("Content-Type: ", 14) ||
+		    !w.put(pmime->content_type, strlen(pmime->content_type)))
+			return FALSE;
 		/* Content-Type: xxxxx;\r\n\tyyyyy=zzzzz */
 		pmime->f_type_params.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
 		while (pmime->f_type_params.read(&tag_len,
 		       sizeof(uint32_t)) != MEM_END_OF_FILE) {
-			/* content-type: xxxxx"; \r\n\t"yyyyy */
-			if (len > MIME_FIELD_LEN + MIME_NAME_LEN - tag_len) {
+			auto d = w.reserve(MIME_NAME_LEN + MIME_FIELD_LEN + 5);
+			if (d == nullptr || tag_len > MIME_NAME_LEN)
 				return FALSE;
-			}
-			memcpy(tmp_buff + len, ";\r\n\t", 4);
-			len += 4;
-			pmime->f_type_params.read(tmp_buff + len, tag_len);
-			len += tag_len;
+			/* content-type: xxxxx"; \r\n\t"yyyyy */
+			memcpy(d, ";\r\n\t", 4);
+			size_t len = 4 + pmime->f_type_params.read(d + 4, tag_len);
 			pmime->f_type_params.read(&val_len, sizeof(uint32_t));
-			if (len > MIME_FIELD_LEN + MIME_NAME_LEN + 3 - val_len) {
+			if (val_len > MIME_FIELD_LEN)
 				return FALSE;
-			}
 			/* content_type: xxxxx; \r\n\tyyyyy=zzz */
 			if (0 != val_len) {
-				memcpy(tmp_buff + len, "=", 1);
-				len += 1;
-				pmime->f_type_params.read(tmp_buff + len, val_len);
-				len += val_len;
+				d[len++] = '=';
+				len += pmime->f_type_params.read(d + len, val_len);
 			}
-		}
-		if (len > MIME_FIELD_LEN + MIME_NAME_LEN) {
-			return FALSE;
+			if (!w.commit(len))
+				return FALSE;
 		}
 		/* \r\n for separate head and content */
-		memcpy(tmp_buff + len, "\r\n\r\n", 4);
-		len += 4;
-		auto wrlen = write(fd, tmp_buff, len);
-		if (wrlen < 0 || static_cast<size_t>(wrlen) != len)
+		if (!w.put("\r\n\r\n", 4))
 			return FALSE;
 	}
 	if (SINGLE_MIME == pmime->mime_type) {
-		if (NULL != pmime->content_begin) {
-			if (0 != pmime->content_length) {
-				auto wrlen = write(fd, pmime->content_begin, pmime->content_length);
-				if (wrlen < 0 || static_cast<size_t>(wrlen) != pmime->content_length)
-					return FALSE;
-			} else {
-				if (!reinterpret_cast<MAIL *>(pmime->content_begin)->to_file(fd))
-					return FALSE;
-			}
-		} else {
+		if (NULL == pmime->content_begin) {
 			/* if there's nothing, just append an empty line */
-			if (2 != write(fd, "\r\n", 2)) {
-				return FALSE;
-			}
-		}
-	} else {
-		if (NULL == pmime->first_boundary) {
-			if (48 != write(fd, "This is a multi-part message "
-						"in MIME format.\r\n\r\n", 48)) {
-				return FALSE;
-			}
-		} else {
-			if (pmime->first_boundary - pmime->content_begin != write(fd,
-				pmime->content_begin, pmime->first_boundary - 
-				pmime->content_begin)) {
-				return FALSE;
-			}
-		}
-		pnode = simple_tree_node_get_child(&pmime->node);
-		has_submime = FALSE;
-        while (NULL != pnode) {
-			has_submime = TRUE;
-			memcpy(tmp_buff, "--", 2);
-			len = 2;
-			memcpy(tmp_buff + len, pmime->boundary_string,
-									pmime->boundary_len);
-			len += pmime->boundary_len;
-			memcpy(tmp_buff + len, "\r\n", 2);
-			len += 2;
-			auto wrlen = write(fd, tmp_buff, len);
-			if (wrlen < 0 || static_cast<size_t>(wrlen) != len)
-				return FALSE;
-			pmime_child = (MIME*)pnode->pdata;
-			if (FALSE == mime_to_file(pmime_child, fd)) {
-				return FALSE;
-			}
-			pnode = simple_tree_node_get_sibling(pnode);
-		}
-		if (FALSE == has_submime) {
-			memcpy(tmp_buff, "--", 2);
-			len = 2;
-			memcpy(tmp_buff + len, pmime->boundary_string,
-									pmime->boundary_len);
-			len += pmime->boundary_len;
-			memcpy(tmp_buff + len, "\r\n\r\n", 4);
-			len += 4;
-			auto wrlen = write(fd, tmp_buff, len);
-			if (wrlen < 0 || static_cast<size_t>(wrlen) != len)
-				return FALSE;
-		}
-		memcpy(tmp_buff, "--", 2);
-		len = 2;
-		memcpy(tmp_buff + len, pmime->boundary_string, pmime->boundary_len);
-		len += pmime->boundary_len;
-		memcpy(tmp_buff + len, "--", 2);
-		len += 2;
-		if (NULL == pmime->last_boundary) {
-			memcpy(tmp_buff + len, "\r\n\r\n", 4);
-			len += 4;
-		} else {
-			tmp_len = pmime->content_length -
-				(pmime->last_boundary - pmime->content_begin); 
-			if (tmp_len > 0 && tmp_len < sizeof(tmp_buff) - len) {
-				memcpy(tmp_buff + len, pmime->last_boundary, tmp_len);
-				len +=  tmp_len;
-			} else if (0 == tmp_len) {
-				memcpy(tmp_buff + len, "\r\n", 2);
-				len += 2;
-			} else {
-				debug_info("[mime]: fatal error in mime_to_file");
-				return FALSE;
-			}
+			return w.put("\r\n", 2) ? TRUE : FALSE;
 		}
-		auto wrlen = write(fd, tmp_buff, len);
-		if (wrlen < 0 || static_cast<size_t>(wrlen) != len)
+		if (0 != pmime->content_length)
+			return w.put_ref(pmime->content_begin,
+			       pmime->content_length) ? TRUE : FALSE;
+		auto pnode = simple_tree_get_root(&reinterpret_cast<MAIL *>(pmime->content_begin)->tree);
+		if (pnode == nullptr)
 			return FALSE;
+		return mime_emit(static_cast<MIME *>(pnode->pdata), w);
 	}
-	return TRUE;
+	if (NULL == pmime->first_boundary) {
+		if (!w.put("This is a multi-part message in MIME format.\r\n\r\n", 48))
+			return FALSE;
+	} else if (!w.put_ref(pmime->content_begin,
+	    pmime->first_boundary - pmime->content_begin)) {
+		return FALSE;
+	}
+	auto pnode = simple_tree_node_get_child(&pmime->node);
+	BOOL has_submime = FALSE;
+	while (NULL != pnode) {
+		has_submime = TRUE;
+		if (!mime_emit_boundary(pmime, w, "\r\n", 2) ||
+		    !mime_emit(static_cast<MIME *>(pnode->pdata), w))
+			return FALSE;
+		pnode = simple_tree_node_get_sibling(pnode);
+	}
+	if (!has_submime && !mime_emit_boundary(pmime, w, "\r\n\r\n", 4))
+		return FALSE;
+	if (!mime_emit_boundary(pmime, w, "--", 2))
+		return FALSE;
+	if (NULL == pmime->last_boundary)
+		return w.put("\r\n\r\n", 4) ? TRUE : FALSE;
+	auto tmp_len = static_cast<ssize_t>(pmime->content_length) -
+	               (pmime->last_boundary - pmime->content_begin);
+	if (tmp_len > 0)
+		return w.put_ref(pmime->last_boundary, tmp_len) ? TRUE : FALSE;
+	if (0 == tmp_len)
+		return w.put("\r\n", 2) ? TRUE : FALSE;
+	debug_info("[mime]: fatal error in mime_emit");
+	return FALSE;
+}
+
+/*
+ *	write MIME object into file
+ *	@param
+ *		pmime [in]		indicate the MIME object
+ *		fd				file descriptor
+ *	@return
+ *		TRUE			OK to copy out the MIME
+ *		FALSE			buffer is too short
+ */
+BOOL mime_to_file(MIME *pmime, int fd)
+{
+	mime_writer w(fd);
+	return mime_emit(pmime, w) && w.flush() ? TRUE : FALSE;
 }
 
 /*
@@ -1722,188 +1802,8 @@ BOOL mime_to_file(MIME *pmime, int fd)
  */
 BOOL mime_to_ssl(MIME *pmime, SSL *ssl)
 {
-	BOOL has_submime;
-	MIME *pmime_child;
-	size_t len, tmp_len;
-	int tag_len, val_len;
-	SIMPLE_TREE_NODE *pnode;
-	char tmp_buff[MIME_FIELD_LEN + MIME_NAME_LEN + 4];
-	
-	
-#ifdef _DEBUG_UMTA
-	if (NULL == pmime || NULL == ssl) {
-		debug_info("[mime]: NULL pointer found in mime_to_ssl");
-		return FALSE;
-	}
-#endif
-	if (NONE_MIME == pmime->mime_type) {
-#ifdef _DEBUG_UMTA
-		debug_info("[mime]: mime content type is not set");
-#endif
-		return FALSE;
-	}
-	if (FALSE == pmime->head_touched){
-		/* the original buffer contains \r\n */
-		if (pmime->head_begin + pmime->head_length
-			+ 2 == pmime->content_begin) {
-			auto wrlen = SSL_write(ssl, pmime->head_begin, pmime->head_length + 2);
-			if (wrlen < 0 || static_cast<size_t>(wrlen))
-				return FALSE;
-		} else {
-			auto wrlen = SSL_write(ssl, pmime->head_begin, pmime->head_length);
-			if (wrlen < 0 || static_cast<size_t>(wrlen) != pmime->head_length)
-				return FALSE;
-			if (2 != SSL_write(ssl, "\r\n", 2)) {
-				return FALSE;
-			}
-		}
-	} else {	
-		pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-		while (pmime->f_other_fields.read(&tag_len, sizeof(uint32_t)) != MEM_END_OF_FILE) {
-			/* xxxxx: yyyyy */
-			pmime->f_other_fields.read(tmp_buff, tag_len);
-			len = tag_len;
-			memcpy(tmp_buff + len, ": ", 2);
-			len += 2;
-			pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-			pmime->f_other_fields.read(tmp_buff + len, val_len);
-			len += val_len;
-			memcpy(tmp_buff + len, "\r\n", 2);
-			len += 2;
-			auto wrlen = SSL_write(ssl, tmp_buff, len);
-			if (wrlen < 0 || static_cast<size_t>(wrlen) != len)
-				return FALSE;
-		}
-
-		/* Content-Type: xxxxx */
-		memcpy(tmp_buff, "Content-Type: ", 14);
-		len = 14;
-		val_len = strlen(pmime->content_type);
-		memcpy(tmp_buff + len, pmime->content_type, val_len);
-		len += val_len;
-		/* Content-Type: xxxxx;\r\n\tyyyyy=zzzzz */
-		pmime->f_type_params.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-		while (pmime->f_type_params.read(&tag_len,
-		       sizeof(uint32_t)) != MEM_END_OF_FILE) {
-			/* content-type: xxxxx"; \r\n\t"yyyyy */
-			if (len > MIME_FIELD_LEN + MIME_NAME_LEN - tag_len) {
-				return FALSE;
-			}
-			memcpy(tmp_buff + len, ";\r\n\t", 4);
-			len += 4;
-			pmime->f_type_params.read(tmp_buff + len, tag_len);
-			len += tag_len;
-			pmime->f_type_params.read(&val_len, sizeof(uint32_t));
-			if (len > MIME_FIELD_LEN + MIME_NAME_LEN + 3 - val_len) {
-				return FALSE;
-			}
-			/* content_type: xxxxx; \r\n\tyyyyy=zzz */
-			if (0 != val_len) {
-				memcpy(tmp_buff + len, "=", 1);
-				len += 1;
-				pmime->f_type_params.read(tmp_buff + len, val_len);
-				len += val_len;
-			}
-		}
-		if (len > MIME_FIELD_LEN + MIME_NAME_LEN) {
-			return FALSE;
-		}
-		/* \r\n for separate head and content */
-		memcpy(tmp_buff + len, "\r\n\r\n", 4);
-		len += 4;
-		auto wrlen = SSL_write(ssl, tmp_buff, len);
-		if (wrlen < 0 || static_cast<size_t>(wrlen) != len)
-			return FALSE;
-	}
-	if (SINGLE_MIME == pmime->mime_type) {
-		if (NULL != pmime->content_begin) {
-			if (0 != pmime->content_length) {
-				auto wrlen = SSL_write(ssl, pmime->content_begin, pmime->content_length);
-				if (wrlen < 0 || static_cast<size_t>(wrlen) != pmime->content_length)
-					return FALSE;
-			} else {
-				if (!reinterpret_cast<MAIL *>(pmime->content_begin)->to_ssl(ssl))
-					return FALSE;
-			}
-		} else {
-			/* if there's nothing, just append an empty line */
-			if (2 != SSL_write(ssl, "\r\n", 2)) {
-				return FALSE;
-			}
-		}
-	} else {
-		if (NULL == pmime->first_boundary) {
-			if (48 != SSL_write(ssl, "This is a multi-part message "
-				"in MIME format.\r\n\r\n", 48)) {
-				return FALSE;
-			}
-		} else {
-			if (pmime->first_boundary - pmime->content_begin != SSL_write(
-				ssl, pmime->content_begin, pmime->first_boundary - 
-				pmime->content_begin)) {
-				return FALSE;
-			}
-		}
-		pnode = simple_tree_node_get_child(&pmime->node);
-		has_submime = FALSE;
-        while (NULL != pnode) {
-			has_submime = TRUE;
-			memcpy(tmp_buff, "--", 2);
-			len = 2;
-			memcpy(tmp_buff + len, pmime->boundary_string,
-									pmime->boundary_len);
-			len += pmime->boundary_len;
-			memcpy(tmp_buff + len, "\r\n", 2);
-			len += 2;
-			auto wrlen = SSL_write(ssl, tmp_buff, len);
-			if (wrlen < 0 || static_cast<size_t>(wrlen) != len)
-				return FALSE;
-			pmime_child = (MIME*)pnode->pdata;
-			if (FALSE == mime_to_ssl(pmime_child, ssl)) {
-				return FALSE;
-			}
-			pnode = simple_tree_node_get_sibling(pnode);
-		}
-		if (FALSE == has_submime) {
-			memcpy(tmp_buff, "--", 2);
-			len = 2;
-			memcpy(tmp_buff + len, pmime->boundary_string,
-									pmime->boundary_len);
-			len += pmime->boundary_len;
-			memcpy(tmp_buff + len, "\r\n\r\n", 4);
-			len += 4;
-			auto wrlen = SSL_write(ssl, tmp_buff, len);
-			if (wrlen < 0 || static_cast<size_t>(wrlen) != len)
-				return FALSE;
-		}
-		memcpy(tmp_buff, "--", 2);
-		len = 2;
-		memcpy(tmp_buff + len, pmime->boundary_string, pmime->boundary_len);
-		len += pmime->boundary_len;
-		memcpy(tmp_buff + len, "--", 2);
-		len += 2;
-		if (NULL == pmime->last_boundary) {
-			memcpy(tmp_buff + len, "\r\n\r\n", 4);
-			len += 4;
-		} else {
-			tmp_len = pmime->content_length -
-				(pmime->last_boundary - pmime->content_begin); 
-			if (tmp_len > 0 && tmp_len < sizeof(tmp_buff) - len) {
-				memcpy(tmp_buff + len, pmime->last_boundary, tmp_len);
-				len +=  tmp_len;
-			} else if (0 == tmp_len) {
-				memcpy(tmp_buff + len, "\r\n", 2);
-				len += 2;
-			} else {
-				debug_info("[mime]: fatal error in mime_to_ssl");
-				return FALSE;
-			}
-		}
-		auto wrlen = SSL_write(ssl, tmp_buff, len);
-		if (wrlen < 0 || static_cast<size_t>(wrlen) != len)
-			return FALSE;
-	}
-	return TRUE;
+	mime_writer w(ssl);
+	return mime_emit(pmime, w) && w.flush() ? TRUE : FALSE;
 }
 
 /*
@@ -1917,8 +1817,6 @@ BOOL mime_to_ssl(MIME *pmime, SSL *ssl)
 BOOL mime_check_dot(MIME *pmime)
 {
 	size_t	tmp_len;
-	int		tag_len, val_len;
-	char	tmp_buff[MIME_FIELD_LEN + MIME_NAME_LEN + 4];
 	MIME	*pmime_child;
 	SIMPLE_TREE_NODE *pnode;
 	
@@ -1941,16 +1839,12 @@ BOOL mime_check_dot(MIME *pmime)
 			return TRUE;
 		}
 	} else {	
-		pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-		while (pmime->f_other_fields.read(&tag_len, sizeof(uint32_t)) != MEM_END_OF_FILE) {
+		auto &tbl = pmime->other_fields;
+		if (!tbl.for_each([&](const mime_field_table::field &f) {
 			/* xxxxx: yyyyy */
-			pmime->f_other_fields.read(tmp_buff, tag_len);
-			if (tag_len >= 2 && '.' == tmp_buff[0] && '.' == tmp_buff[1]) {
-				return TRUE;
-			}
-			pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-			pmime->f_other_fields.seek(MEM_FILE_READ_PTR, val_len, MEM_FILE_SEEK_CUR);
-		}
+			return f.name_len < 2 || strncmp(tbl.name(f), "..", 2) != 0;
+		}))
+			return TRUE;
 		
 	}
 	if (SINGLE_MIME == pmime->mime_type) {
@@ -2027,15 +1921,7 @@ ssize_t mime_get_length(MIME *pmime)
 		/* the original buffer contains \r\n */
 		mime_len += pmime->head_length + 2;
 	} else {	
-		pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-		while (pmime->f_other_fields.read(&tag_len, sizeof(uint32_t)) != MEM_END_OF_FILE) {
-			/* xxxxx: yyyyy */
-			pmime->f_other_fields.seek(MEM_FILE_READ_PTR, tag_len, MEM_FILE_SEEK_CUR);
-			mime_len += tag_len + 2;
-			pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-			pmime->f_other_fields.seek(MEM_FILE_READ_PTR, val_len, MEM_FILE_SEEK_CUR);
-			mime_len += val_len + 2;
-		}
+		mime_len += mime_fields_length(pmime->other_fields);
 
 		/* Content-Type: xxxxx */
 		mime_len += 14;
@@ -2240,15 +2126,7 @@ ssize_t mime_get_mimes_digest(MIME *pmime, const char *id_string,
 		/* the original buffer contains \r\n */
 		*poffset += pmime->head_length + 2;
 	} else {	
-		pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-		while (pmime->f_other_fields.read(&tag_len, sizeof(uint32_t)) != MEM_END_OF_FILE) {
-			/* xxxxx: yyyyy */
-			pmime->f_other_fields.seek(MEM_FILE_READ_PTR, tag_len, MEM_FILE_SEEK_CUR);
-			*poffset += tag_len + 2;
-			pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-			pmime->f_other_fields.seek(MEM_FILE_READ_PTR, val_len, MEM_FILE_SEEK_CUR);
-			*poffset += val_len + 2;
-		}
+		*poffset += mime_fields_length(pmime->other_fields);
 
 		/* Content-Type: xxxxx */
 		*poffset += 14;
@@ -2498,16 +2376,7 @@ ssize_t mime_get_structure_digest(MIME *pmime, const char *id_string,
 		/* the original buffer contains \r\n */
 		*poffset += pmime->head_length + 2;
 	} else {	
-		pmime->f_other_fields.seek(MEM_FILE_READ_PTR, 0, MEM_FILE_SEEK_BEGIN);
-		while (pmime->f_other_fields.read(&tag_len,
-		       sizeof(uint32_t)) != MEM_END_OF_FILE) {
-			/* xxxxx: yyyyy */
-			pmime->f_other_fields.seek(MEM_FILE_READ_PTR, tag_len, MEM_FILE_SEEK_CUR);
-			*poffset += tag_len + 2;
-			pmime->f_other_fields.read(&val_len, sizeof(uint32_t));
-			pmime->f_other_fields.seek(MEM_FILE_READ_PTR, val_len, MEM_FILE_SEEK_CUR);
-			*poffset += val_len + 2;
-		}
+		*poffset += mime_fields_length(pmime->other_fields);
 
 		/* Content-Type: xxxxx */
 		*poffset += 14;
@@ -2789,7 +2658,11 @@ void mime_copy(MIME *pmime_src, MIME *pmime_dst)
 		pmime_dst->content_length = 0;
 	}
 	pmime_src->f_type_params.copy_to(pmime_dst->f_type_params);
-	pmime_src->f_other_fields.copy_to(pmime_dst->f_other_fields);
+	try {
+		pmime_dst->other_fields = pmime_src->other_fields;
+	} catch (const std::bad_alloc &) {
+		pmime_dst->other_fields.clear();
+	}
 	pmime_dst->head_touched = TRUE;
 	pmime_dst->content_touched = TRUE;
 }
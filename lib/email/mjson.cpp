@@ -1725,54 +1725,48 @@ static void mjson_enum_build(MJSON_MIME *pmime, BUILD_PARAM *pbuild)
 		return;
 	}
 	
+	/* 7bit/8bit parts are parsed straight from the mapping */
 	auto length = pmime->get_length(MJSON_MIME_CONTENT);
-	std::unique_ptr<char[], stdlib_delete> pbuff(static_cast<char *>(malloc(strange_roundup(length - 1, 64 * 1024))));
-	if (NULL == pbuff) {
-		close(fd);
-		pbuild->build_result = FALSE;
-		return;
-	}
-	
-	if (lseek(fd, pmime->get_offset(MJSON_MIME_CONTENT), SEEK_SET) < 0)
-		fprintf(stderr, "E-1430: lseek: %s\n", strerror(errno));
-	auto rdlen = ::read(fd, pbuff.get(), length);
-	if (rdlen < 0 || static_cast<size_t>(rdlen) != length) {
-		close(fd);
+	mapped_file pmap;
+	auto ret = pmap.map(fd, pmime->get_offset(MJSON_MIME_CONTENT), length);
+	close(fd);
+	if (ret != 0) {
+		fprintf(stderr, "E-1430: map %s: %s\n", temp_path, strerror(ret));
 		pbuild->build_result = FALSE;
 		return;
 	}
-	close(fd);
 	
+	std::unique_ptr<char[], stdlib_delete> pbuff;
 	if (0 == strcasecmp(pmime->encoding, "base64")) {
-		std::unique_ptr<char[], stdlib_delete> pbuff1(static_cast<char *>(malloc(strange_roundup(length - 1, 64 * 1024))));
-		if (NULL == pbuff1) {
+		pbuff.reset(static_cast<char *>(malloc(strange_roundup(length - 1, 64 * 1024))));
+		if (NULL == pbuff) {
 			pbuild->build_result = FALSE;
 			return;
 		}
-		if (decode64_ex(pbuff.get(), length, pbuff1.get(), length, &length1) != 0) {
+		if (decode64_ex(pmap.data(), length, pbuff.get(), length, &length1) != 0) {
 			pbuild->build_result = FALSE;
 			return;
 		}
-		pbuff = std::move(pbuff1);
 		length = length1;
+		pmap.reset();
 	} else if (0 == strcasecmp(pmime->encoding, "quoted-printable")) {
-		std::unique_ptr<char[], stdlib_delete> pbuff1(static_cast<char *>(malloc(strange_roundup(length - 1, 64 * 1024))));
-		if (NULL == pbuff1) {
+		pbuff.reset(static_cast<char *>(malloc(strange_roundup(length - 1, 64 * 1024))));
+		if (NULL == pbuff) {
 			pbuild->build_result = FALSE;
 			return;
 		}
-		auto qdlen = qp_decode_ex(pbuff1.get(), length, pbuff.get(), length);
+		auto qdlen = qp_decode_ex(pbuff.get(), length, pmap.data(), length);
 		if (qdlen < 0) {
 			pbuild->build_result = false;
 			return;
 		}
 		length = qdlen;
-		pbuff = std::move(pbuff1);
+		pmap.reset();
 	}
 	
 	MJSON temp_mjson(pmime->ppool);
 	MAIL imail(pbuild->ppool);
-	if (!imail.retrieve(pbuff.get(), length)) {
+	if (!imail.retrieve(pbuff != nullptr ? pbuff.get() : pmap.data(), length)) {
 		pbuild->build_result = FALSE;
 		return;
 	} else {
@@ -1806,6 +1800,7 @@ static void mjson_enum_build(MJSON_MIME *pmime, BUILD_PARAM *pbuild)
 					MAX_DIGLEN - digest_len - 1);
 		imail.clear();
 		pbuff.reset();
+		pmap.reset();
 		if (result <= 0) {
 			if (remove(msg_path) < 0 && errno != ENOENT)
 				fprintf(stderr, "W-1373: remove %s: %s\n", msg_path, strerror(errno));
@@ -1710,6 +1710,37 @@ static int exmdb_ext_push_set_message_read_state_request(
 	return pext->p_uint8(ppayload->set_message_read_state.mark_as_read);
 }
 
+static int exmdb_ext_pull_set_messages_read_state_request(
+	EXT_PULL *pext, REQUEST_PAYLOAD *ppayload)
+{
+	uint8_t tmp_byte;
+	
+	TRY(pext->g_uint8(&tmp_byte));
+	if (0 == tmp_byte) {
+		ppayload->set_messages_read_state.username = NULL;
+	} else {
+		TRY(pext->g_str(&ppayload->set_messages_read_state.username));
+	}
+	ppayload->set_messages_read_state.pmessage_ids = cu_alloc<EID_ARRAY>();
+	if (ppayload->set_messages_read_state.pmessage_ids == nullptr)
+		return EXT_ERR_ALLOC;
+	TRY(pext->g_eid_a(ppayload->set_messages_read_state.pmessage_ids));
+	return pext->g_uint8(&ppayload->set_messages_read_state.mark_as_read);
+}
+
+static int exmdb_ext_push_set_messages_read_state_request(
+	EXT_PUSH *pext, const REQUEST_PAYLOAD *ppayload)
+{
+	if (NULL == ppayload->set_messages_read_state.username) {
+		TRY(pext->p_uint8(0));
+	} else {
+		TRY(pext->p_uint8(1));
+		TRY(pext->p_str(ppayload->set_messages_read_state.username));
+	}
+	TRY(pext->p_eid_a(ppayload->set_messages_read_state.pmessage_ids));
+	return pext->p_uint8(ppayload->set_messages_read_state.mark_as_read);
+}
+
 static int exmdb_ext_pull_remove_message_properties_request(
 	EXT_PULL *pext, REQUEST_PAYLOAD *ppayload)
 {
@@ -2059,6 +2090,39 @@ static int exmdb_ext_push_write_message_request(
 	TRY(pext->p_uint64(ppayload->write_message.folder_id));
 	return pext->p_msgctnt(ppayload->write_message.pmsgctnt);
 }
+
+static int exmdb_ext_pull_write_messages_request(
+	EXT_PULL *pext, REQUEST_PAYLOAD *ppayload)
+{
+	TRY(pext->g_str(&ppayload->write_messages.account));
+	TRY(pext->g_uint32(&ppayload->write_messages.cpid));
+	TRY(pext->g_uint64(&ppayload->write_messages.folder_id));
+	TRY(pext->g_uint32(&ppayload->write_messages.count));
+	if (0 == ppayload->write_messages.count) {
+		ppayload->write_messages.pmsgctnt = nullptr;
+		return EXT_ERR_SUCCESS;
+	}
+	ppayload->write_messages.pmsgctnt = cu_alloc<MESSAGE_CONTENT>(ppayload->write_messages.count);
+	if (ppayload->write_messages.pmsgctnt == nullptr) {
+		ppayload->write_messages.count = 0;
+		return EXT_ERR_ALLOC;
+	}
+	for (size_t i = 0; i < ppayload->write_messages.count; ++i)
+		TRY(pext->g_msgctnt(&ppayload->write_messages.pmsgctnt[i]));
+	return EXT_ERR_SUCCESS;
+}
+
+static int exmdb_ext_push_write_messages_request(
+	EXT_PUSH *pext, const REQUEST_PAYLOAD *ppayload)
+{
+	TRY(pext->p_str(ppayload->write_messages.account));
+	TRY(pext->p_uint32(ppayload->write_messages.cpid));
+	TRY(pext->p_uint64(ppayload->write_messages.folder_id));
+	TRY(pext->p_uint32(ppayload->write_messages.count));
+	for (size_t i = 0; i < ppayload->write_messages.count; ++i)
+		TRY(pext->p_msgctnt(&ppayload->write_messages.pmsgctnt[i]));
+	return EXT_ERR_SUCCESS;
+}
 	
 static int exmdb_ext_pull_read_message_request(
 	EXT_PULL *pext, REQUEST_PAYLOAD *ppayload)
@@ -2801,6 +2865,12 @@ int exmdb_ext_pull_request(const BINARY *pbin_in,
 										&ext_pull, &prequest->payload);
 	case exmdb_callid::UNLOAD_STORE:
 		return EXT_ERR_SUCCESS;
+	case exmdb_callid::WRITE_MESSAGES:
+		return exmdb_ext_pull_write_messages_request(
+					&ext_pull, &prequest->payload);
+	case exmdb_callid::SET_MESSAGES_READ_STATE:
+		return exmdb_ext_pull_set_messages_read_state_request(
+					&ext_pull, &prequest->payload);
 	default:
 		return EXT_ERR_BAD_SWITCH;
 	}
@@ -3312,6 +3382,14 @@ int exmdb_ext_push_request(const EXMDB_REQUEST *prequest,
 	case exmdb_callid::UNLOAD_STORE:
 		status = EXT_ERR_SUCCESS;
 		break;
+	case exmdb_callid::WRITE_MESSAGES:
+		status = exmdb_ext_push_write_messages_request(
+					&ext_push, &prequest->payload);
+		break;
+	case exmdb_callid::SET_MESSAGES_READ_STATE:
+		status = exmdb_ext_push_set_messages_read_state_request(
+					&ext_push, &prequest->payload);
+		break;
 	default:
 		return EXT_ERR_BAD_SWITCH;
 	}
@@ -4523,6 +4601,18 @@ static int exmdb_ext_push_write_message_response(
 	return pext->p_uint32(ppayload->write_message.e_result);
 }
 
+static int exmdb_ext_pull_write_messages_response(
+	EXT_PULL *pext, RESPONSE_PAYLOAD *ppayload)
+{
+	return pext->g_uint32(reinterpret_cast<uint32_t *>(&ppayload->write_messages.e_result));
+}
+
+static int exmdb_ext_push_write_messages_response(
+	EXT_PUSH *pext, const RESPONSE_PAYLOAD *ppayload)
+{
+	return pext->p_uint32(ppayload->write_messages.e_result);
+}
+
 static int exmdb_ext_pull_read_message_response(
 	EXT_PULL *pext, RESPONSE_PAYLOAD *ppayload)
 {
@@ -5011,6 +5101,11 @@ int exmdb_ext_pull_response(const BINARY *pbin_in,
 										&ext_pull, &presponse->payload);
 	case exmdb_callid::UNLOAD_STORE:
 		return EXT_ERR_SUCCESS;
+	case exmdb_callid::WRITE_MESSAGES:
+		return exmdb_ext_pull_write_messages_response(
+					&ext_pull, &presponse->payload);
+	case exmdb_callid::SET_MESSAGES_READ_STATE:
+		return EXT_ERR_SUCCESS;
 	default:
 		return EXT_ERR_BAD_SWITCH;
 	}
@@ -5494,6 +5589,13 @@ int exmdb_ext_push_response(const EXMDB_RESPONSE *presponse,
 	case exmdb_callid::UNLOAD_STORE:
 		status = EXT_ERR_SUCCESS;
 		break;
+	case exmdb_callid::WRITE_MESSAGES:
+		status = exmdb_ext_push_write_messages_response(
+					&ext_push, &presponse->payload);
+		break;
+	case exmdb_callid::SET_MESSAGES_READ_STATE:
+		status = EXT_ERR_SUCCESS;
+		break;
 	default:
 		return EXT_ERR_BAD_SWITCH;
 	}
@@ -2,17 +2,25 @@
 // SPDX-FileCopyrightText: 2021 grommunio GmbH
 // This file is part of Gromox.
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <dirent.h>
 #include <memory>
 #include <string>
 #include <string_view>
+#include <unistd.h>
 #include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <gromox/fileio.h>
 
 namespace gromox {
 
+/* below this, mmap/munmap/page faults cost more than one read */
+static constexpr size_t MAP_MIN = 128 * 1024;
+
 std::vector<std::string> gx_split(const std::string_view &sv, char sep)
 {
 	size_t start = 0, pos;
@@ -73,4 +81,65 @@ std::unique_ptr<FILE, file_deleter> fopen_sd(const char *filename, const char *s
 	return nullptr;
 }
 
+int mapped_file::map(int fd, size_t offset, size_t length)
+{
+	reset();
+	struct stat sb;
+	if (fstat(fd, &sb) != 0)
+		return errno;
+	if (!S_ISREG(sb.st_mode))
+		return EINVAL;
+	size_t fsize = sb.st_size;
+	if (offset > fsize)
+		return EINVAL;
+	if (length == SIZE_MAX)
+		length = fsize - offset;
+	else if (length > fsize - offset)
+		return EINVAL;
+	static const size_t pagesize = sysconf(_SC_PAGESIZE);
+	auto skew = offset % pagesize;
+	if (length >= MAP_MIN) {
+		auto base = mmap(nullptr, length + skew, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE, fd, offset - skew);
+		if (base != MAP_FAILED) {
+			m_base = base;
+			m_maplen = length + skew;
+			m_data = static_cast<char *>(base) + skew;
+			m_size = length;
+			return 0;
+		}
+	}
+	/* small range or mmap refused; +1 so that m_data is never NULL */
+	m_data = static_cast<char *>(malloc(length + 1));
+	if (m_data == nullptr)
+		return ENOMEM;
+	m_heap = true;
+	size_t done = 0;
+	while (done < length) {
+		auto ret = pread(fd, m_data + done, length - done, offset + done);
+		if (ret <= 0) {
+			int se = ret == 0 ? EIO : errno;
+			reset();
+			return se;
+		}
+		done += ret;
+	}
+	m_data[length] = '\0';
+	m_size = length;
+	return 0;
+}
+
+void mapped_file::reset()
+{
+	if (m_heap)
+		free(m_data);
+	else if (m_base != nullptr)
+		munmap(m_base, m_maplen);
+	m_base = nullptr;
+	m_maplen = 0;
+	m_data = nullptr;
+	m_size = 0;
+	m_heap = false;
+}
+
 }
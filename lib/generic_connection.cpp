@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <openssl/bio.h>
+#include <openssl/ssl.h>
+#include <gromox/generic_connection.hpp>
+
+/* largest plaintext fragment that fits into one TLS record */
+#define TLS_RECORD_SIZE 16384
+
+ssize_t GENERIC_CONNECTION::writev(const struct iovec *iov, unsigned int count)
+{
+	if (ssl == nullptr) {
+		ssize_t total = 0;
+		unsigned int i = 0;
+		size_t off = 0; /* part of iov[i] already sent */
+		while (i < count) {
+			auto ret = off > 0 ?
+			           ::write(sockd, static_cast<const char *>(iov[i].iov_base) + off, iov[i].iov_len - off) :
+			           ::writev(sockd, &iov[i], std::min(count - i, static_cast<unsigned int>(IOV_MAX)));
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+				return total > 0 ? total : ret;
+			total += ret;
+			off += ret;
+			while (i < count && off >= iov[i].iov_len)
+				off -= iov[i++].iov_len;
+		}
+		return total;
+	}
+	char buf[TLS_RECORD_SIZE];
+	size_t fill = 0;
+	ssize_t total = 0;
+	for (unsigned int i = 0; i < count; ++i) {
+		auto ptr = static_cast<const char *>(iov[i].iov_base);
+		auto len = iov[i].iov_len;
+		while (len > 0) {
+			if (fill == 0 && len >= sizeof(buf)) {
+				/* big fragment, hand it to SSL as-is */
+				auto ret = SSL_write(ssl, ptr, std::min(len, static_cast<size_t>(INT_MAX)));
+				if (ret <= 0)
+					return total > 0 ? total : ret;
+				ptr += ret;
+				len -= ret;
+				total += ret;
+				continue;
+			}
+			auto seg = std::min(len, sizeof(buf) - fill);
+			memcpy(buf + fill, ptr, seg);
+			fill += seg;
+			ptr += seg;
+			len -= seg;
+			if (fill < sizeof(buf))
+				continue;
+			auto ret = SSL_write(ssl, buf, fill);
+			if (ret <= 0)
+				return total > 0 ? total : ret;
+			total += ret;
+			fill = 0;
+		}
+	}
+	if (fill > 0) {
+		auto ret = SSL_write(ssl, buf, fill);
+		if (ret <= 0)
+			return total > 0 ? total : ret;
+		total += ret;
+	}
+	return total;
+}
+
+ssize_t GENERIC_CONNECTION::sendfile(int fd, size_t len)
+{
+	if (ssl == nullptr)
+		return ::sendfile(sockd, fd, nullptr, len);
+#if defined(OPENSSL_VERSION_NUMBER) && OPENSSL_VERSION_NUMBER >= 0x30000000L && \
+    !defined(OPENSSL_NO_KTLS)
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+		auto offset = lseek(fd, 0, SEEK_CUR);
+		if (offset < 0)
+			return -1;
+		auto ret = SSL_sendfile(ssl, fd, offset, len, 0);
+		if (ret > 0 && lseek(fd, offset + ret, SEEK_SET) < 0)
+			return -1;
+		return ret;
+	}
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
@@ -44,7 +44,6 @@ struct RTF_WRITER {
 };
 }
 
-static iconv_t g_conv_id;
 static std::map<std::string, rgb_t> g_color_hash;
 static CPID_TO_CHARSET html_cpid_to_charset;
 
@@ -211,10 +210,6 @@ BOOL html_init_library(CPID_TO_CHARSET cpid_to_charset)
 		g_color_hash.clear();
 		return FALSE;
 	}
-	g_conv_id = iconv_open("UTF-16LE", "UTF-8");
-	if ((iconv_t)-1 == g_conv_id) {
-		return FALSE;
-	}
 	html_cpid_to_charset = cpid_to_charset;
 	return TRUE;
 }
@@ -304,13 +299,17 @@ static uint32_t html_utf8_to_wchar(const char *src, int length)
 {
 	size_t len;
 	size_t in_len;
-	uint32_t wchar;
+	uint32_t wchar = 0;
 	
+	auto conv_id = iconv_cached("UTF-16LE", "UTF-8");
+	if ((iconv_t)-1 == conv_id) {
+		return 0;
+	}
 	auto pin = deconst(src);
 	auto pout = reinterpret_cast<char *>(&wchar);
 	in_len = length;
 	len = sizeof(uint16_t);
-	return iconv(g_conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1) ||
+	return iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1) ||
 	       len != 0 ? 0 : wchar;
 }
 
@@ -1378,15 +1377,17 @@ static void html_string_to_utf8(uint32_t cpid,
 	if (NULL == charset) {
 		charset = "windows-1252";
 	}
-	conv_id = iconv_open("UTF-8//IGNORE",
+	memset(dst, 0, len);
+	conv_id = iconv_cached("UTF-8//IGNORE",
 		replace_iconv_charset(charset));
+	if ((iconv_t)-1 == conv_id) {
+		return;
+	}
 	auto pin = deconst(src);
 	auto pout = dst;
 	in_len = strlen(src);
-	memset(dst, 0, len);
 	iconv(conv_id, &pin, &in_len, &pout, &len);	
 	*pout = '\0';
-	iconv_close(conv_id);
 }
 
 BOOL html_to_rtf(const void *pbuff_in, size_t length, uint32_t cpid,
@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <libHX/ctype_helper.h>
 #include <libHX/string.h>
 #include <gromox/defs.h>
@@ -251,7 +252,6 @@ struct RTF_READER {
 	EXT_PULL ext_pull{};
 	EXT_PUSH ext_push{};
 	int ungot_chars[3] = {-1, -1, -1}, last_returned_ch = 0;
-	iconv_t conv_id{iconv_t(-1)};
 	EXT_PUSH iconv_push{};
 	SIMPLE_TREE element_tree{};
 	ATTACHMENT_LIST *pattachments = nullptr;
@@ -319,13 +319,9 @@ static bool rtf_iconv_open(RTF_READER *preader, const char *fromcode)
 		preader->current_encoding, fromcode)) {
 		return true;
 	}
-	if ((iconv_t)-1 != preader->conv_id) {
-		iconv_close(preader->conv_id);
-		preader->conv_id = (iconv_t)-1;
-	}
-	preader->conv_id = iconv_open("UTF-8//TRANSLIT",
-			replace_iconv_charset(fromcode));
-	if ((iconv_t)-1 == preader->conv_id) {
+	/* only the name is kept; descriptors live in the per-thread cache */
+	if ((iconv_t)-1 == iconv_cached("UTF-8//TRANSLIT",
+	    replace_iconv_charset(fromcode))) {
 		return false;
 	}
 	gx_strlcpy(preader->current_encoding, fromcode, GX_ARRAY_SIZE(preader->current_encoding));
@@ -372,7 +368,7 @@ static bool rtf_flush_iconv_cache(RTF_READER *preader)
 	
 	if (preader->iconv_push.m_offset == 0)
 		return true;
-	if ((iconv_t)-1 == preader->conv_id) {
+	if ('\0' == preader->current_encoding[0]) {
 		if ('\0' == preader->default_encoding[0]) {
 			if (!rtf_iconv_open(preader, "windows-1252"))
 				return false;
@@ -381,6 +377,11 @@ static bool rtf_flush_iconv_cache(RTF_READER *preader)
 				return false;
 		}
 	}
+	auto conv_id = iconv_cached("UTF-8//TRANSLIT",
+	               replace_iconv_charset(preader->current_encoding));
+	if ((iconv_t)-1 == conv_id) {
+		return false;
+	}
 	size_t tmp_len = 4 * preader->iconv_push.m_offset;
 	auto ptmp_buff = static_cast<char *>(malloc(tmp_len));
 	if (NULL == ptmp_buff) {
@@ -390,7 +391,7 @@ static bool rtf_flush_iconv_cache(RTF_READER *preader)
 	size_t in_size = preader->iconv_push.m_offset;
 	out_buff = ptmp_buff;
 	out_size = tmp_len;
-	if (iconv(preader->conv_id, &in_buff, &in_size, &out_buff, &out_size) == static_cast<size_t>(-1)) {
+	if (iconv(conv_id, &in_buff, &in_size, &out_buff, &out_size) == static_cast<size_t>(-1)) {
 		free(ptmp_buff);
 		/* ignore the characters which can not be converted */
 		preader->iconv_push.m_offset = 0;
@@ -609,9 +610,6 @@ RTF_READER::~RTF_READER()
 			proot, rtf_delete_tree_node);
 	}
 	simple_tree_free(&preader->element_tree);
-	if ((iconv_t)-1 != preader->conv_id) {
-		iconv_close(preader->conv_id);
-	}
 }
 
 static bool rtf_express_begin_fontsize(RTF_READER *preader, int size)
@@ -933,7 +931,7 @@ static bool rtf_attrstack_push_express(RTF_READER *preader, int attr, int param)
 		return false;
 	}
 	pattrstack = (ATTRSTACK_NODE*)pnode->pdata;
-	if (pattrstack->tos >= MAX_ATTRS - 1) {
+	if (pattrstack->tos + 1 >= MAX_ATTRS) {
 		debug_info("[rtf]: too many attributes");
 		return false;
 	}
@@ -947,11 +945,10 @@ static bool rtf_attrstack_push_express(RTF_READER *preader, int attr, int param)
 
 static bool rtf_stack_list_new_node(RTF_READER *preader)
 {
-	auto pattrstack = static_cast<ATTRSTACK_NODE *>(malloc(sizeof(ATTRSTACK_NODE)));
+	auto pattrstack = static_cast<ATTRSTACK_NODE *>(calloc(1, sizeof(ATTRSTACK_NODE)));
 	if (NULL == pattrstack) {
 		return false;
 	}
-	memset(pattrstack, 0, sizeof(ATTRSTACK_NODE));
 	pattrstack->node.pdata = pattrstack;
 	pattrstack->tos = -1;
 	double_list_append_as_tail(
@@ -1054,10 +1051,10 @@ static bool rtf_attrstack_find_pop_express(RTF_READER *preader, int attr)
 		if (pattrstack->attr_stack[i] == attr) {
 			memmove(pattrstack->attr_stack + i,
 				pattrstack->attr_stack + i + 1,
-				pattrstack->tos - i);
+				sizeof(*pattrstack->attr_stack) * (pattrstack->tos - i));
 			memmove(pattrstack->attr_params + i,
 				pattrstack->attr_params + i + 1,
-				sizeof(char*)*(pattrstack->tos - i));
+				sizeof(*pattrstack->attr_params) * (pattrstack->tos - i));
 			pattrstack->tos --;
 			break;
 		}
@@ -1085,8 +1082,7 @@ static void rtf_ungetchar(RTF_READER *preader, int ch)
 static int rtf_getchar(RTF_READER *preader, int *pch)
 {
 	int ch;
-	int status;
-	int8_t tmp_char;
+	auto &pull = preader->ext_pull;
 
 	if (preader->ungot_chars[0] >= 0) {
 		ch = preader->ungot_chars[0]; 
@@ -1098,11 +1094,10 @@ static int rtf_getchar(RTF_READER *preader, int *pch)
 		return EXT_ERR_SUCCESS;
 	}
 	do {
-		status = preader->ext_pull.g_int8(&tmp_char);
-		if (EXT_ERR_SUCCESS != status) {
-			return status;
-		}
-		ch = tmp_char;
+		/* open-coded g_int8; this is called for every input byte */
+		if (pull.m_offset >= pull.m_data_size)
+			return EXT_ERR_BUFSIZE;
+		ch = static_cast<int8_t>(pull.m_udata[pull.m_offset++]);
 		if ('\n' == ch) {
 			/* Convert \(newline) into \par here */
 			if ('\\' == preader->last_returned_ch) {
@@ -1123,105 +1118,86 @@ static int rtf_getchar(RTF_READER *preader, int *pch)
 	return EXT_ERR_SUCCESS;
 }
 
-static char* rtf_read_element(RTF_READER *preader) 
+/*
+ * Read the next RTF word (control word, group delimiter or run of text) into
+ * @word. The buffer is reused across calls, so the streaming converter can
+ * walk a document without a heap allocation per token.
+ */
+static bool rtf_read_word(RTF_READER *preader, std::string &word)
 {
 	int ch, ch2;
-	unsigned int ix;
-	bool need_unget = false, have_whitespace = false;
-	bool is_control_word = false, b_numeric_param = false;
-	unsigned int current_max_length;
-	
-	
-	ix = 0;
-	current_max_length = 10;
-	auto input_str = static_cast<char *>(calloc(1, current_max_length));
-	if (NULL == input_str) {
-		debug_info("[rtf]: cannot allocate word storage");
-		return NULL;
-	}
+	bool need_unget = false, is_control_word = false;
+	bool b_numeric_param = false;
 	
+	word.clear();
 	do {
 		if (EXT_ERR_SUCCESS != rtf_getchar(preader, &ch)) {
-			free(input_str);
 			debug_info("[rtf]: fail to get char from reader");
-			return NULL;
+			return false;
 		}
 	} while ('\n' == ch);
 	
 	if (' ' == ch) {
-		/* trm multiple space chars into one */
+		/* trim multiple space chars into one */
 		while (' ' == ch) {
 			if (EXT_ERR_SUCCESS != rtf_getchar(preader, &ch)) {
-				free(input_str);
 				debug_info("[rtf]: fail to get char from reader");
-				return NULL;
+				return false;
 			}
-			have_whitespace = true;
-		}
-		if (have_whitespace) {
-			rtf_ungetchar(preader, ch);
-			input_str[0] = ' '; 
-			input_str[1] = 0;
-			return input_str;
 		}
+		rtf_ungetchar(preader, ch);
+		word = " ";
+		return true;
 	}
 
 	switch (ch) {
 	case '\\':
 		if (EXT_ERR_SUCCESS != rtf_getchar(preader, &ch2)) {
-			free(input_str);
 			debug_info("[rtf]: fail to get char from reader");
-			return NULL;
+			return false;
 		}
 		/* look for two-character command words */
 		switch (ch2) {
 		case '\n':
-			strcpy (input_str, "\\par");
-			return input_str;
+			word = "\\par";
+			return true;
 		case '~':
 		case '{':
 		case '}':
 		case '\\':
 		case '_':
 		case '-':
-			input_str[0] = '\\';
-			input_str[1] = ch2;
-			input_str[2] = '\0';
-			return input_str;
+			word += '\\';
+			word += static_cast<char>(ch2);
+			return true;
 		case '\'':
 			/* preserve \'## expressions (hex char exprs) for later */
-			input_str[0]='\\'; 
-			input_str[1]='\'';
+			word = "\\'";
 			if (EXT_ERR_SUCCESS != rtf_getchar(preader, &ch)) {
-				free(input_str);
 				debug_info("[rtf]: fail to get char from reader");
-				return nullptr;
+				return false;
 			}
-			input_str[2] = ch;
+			word += static_cast<char>(ch);
 			if (EXT_ERR_SUCCESS != rtf_getchar(preader, &ch)) {
-				free(input_str);
 				debug_info("[rtf]: fail to get char from reader");
-				return NULL;
+				return false;
 			}
-			input_str[3] = ch;
-			input_str[4] = '\0';
-			return input_str;
+			word += static_cast<char>(ch);
+			return true;
 		}
 		is_control_word = true;
-		ix = 1;
-		input_str[0] = ch;
+		word += static_cast<char>(ch);
 		ch = ch2;
 		break;
 	case '\t':
 		/* in rtf, a tab char is the same as \tab */
-		strcpy (input_str, "\\tab");
-		return input_str;
+		word = "\\tab";
+		return true;
 	case '{':
 	case '}':
 	case ';':
-		input_str[0]=ch; 
-		input_str[1]=0;
-		return input_str;
+		word += static_cast<char>(ch);
+		return true;
 	}
 
 	while (true) {
@@ -1233,9 +1209,8 @@ static char* rtf_read_element(RTF_READER *preader)
 			if (is_control_word)
 				break;
 			if (EXT_ERR_SUCCESS != rtf_getchar(preader, &ch)) {
-				free(input_str);
 				debug_info("[rtf]: fail to get char from reader");
-				return NULL;
+				return false;
 			}
 			continue; 
 		}
@@ -1262,30 +1237,33 @@ static char* rtf_read_element(RTF_READER *preader)
 				}
 			}
 		}
-		
-		input_str[ix] = ch;
-		ix ++;
-		if (ix == current_max_length) {
-			current_max_length *= 2;
-			auto input_new = static_cast<char *>(realloc(input_str, current_max_length));
-			if (NULL == input_new) {
-				free(input_str);
-				debug_info("[rtf]: out of memory");
-				return NULL;
-			}
-			input_str = input_new;
-		}
+		word += static_cast<char>(ch);
 		if (EXT_ERR_SUCCESS != rtf_getchar(preader, &ch)) {
-			free(input_str);
 			debug_info("[rtf]: fail to get char from reader");
-			return NULL;
+			return false;
 		}
 	}
 	if (need_unget)
 		rtf_ungetchar(preader, ch);
-	input_str[ix] = '\0';
-	if (strncmp(input_str, "\\bin", 4) == 0 && HX_isdigit(input_str[4]))
-		preader->ext_pull.advance(strtol(input_str + 4, nullptr, 0));
+	if (word.compare(0, 4, "\\bin") == 0 && word.size() > 4 &&
+	    HX_isdigit(word[4]))
+		preader->ext_pull.advance(strtol(word.c_str() + 4, nullptr, 0));
+	return true;
+}
+
+static char *rtf_read_element(RTF_READER *preader)
+{
+	std::string word;
+	try {
+		if (!rtf_read_word(preader, word))
+			return nullptr;
+	} catch (const std::bad_alloc &) {
+		debug_info("[rtf]: out of memory");
+		return nullptr;
+	}
+	auto input_str = strdup(word.c_str());
+	if (input_str == nullptr)
+		debug_info("[rtf]: cannot allocate word storage");
 	return input_str;
 }
 
@@ -1314,16 +1292,17 @@ static bool rtf_optimize_element(DOUBLE_LIST *pcollection_list,
 	return false;
 }
 
-static bool rtf_load_element_tree(RTF_READER *preader)
+/*
+ * Load words into @ptree until the group that is open at @plast_group (or,
+ * if that is NULL, the first group read) is closed.
+ */
+static bool rtf_load_element_tree(RTF_READER *preader, SIMPLE_TREE *ptree,
+    GROUP_NODE *plast_group = nullptr, SIMPLE_TREE_NODE *plast_node = nullptr)
 {
 	char *input_word;
 	GROUP_NODE *pgroup;
 	SIMPLE_TREE_NODE *pword;
-	GROUP_NODE *plast_group;
-	SIMPLE_TREE_NODE *plast_node;
 	
-	plast_group = NULL;
-	plast_node = NULL;
 	while ((input_word = rtf_read_element(preader)) != NULL) {
 		if (input_word[0] == '{') {
 			free(input_word);
@@ -1335,15 +1314,15 @@ static bool rtf_load_element_tree(RTF_READER *preader)
 			pgroup->node.pdata = NULL;
 			double_list_init(&pgroup->collection_list);
 			if (NULL == plast_group) {
-				simple_tree_set_root(&preader->element_tree,
+				simple_tree_set_root(ptree,
 					(SIMPLE_TREE_NODE*)pgroup);
 			} else {
 				if (NULL != plast_node) {
-					simple_tree_insert_sibling(&preader->element_tree,
+					simple_tree_insert_sibling(ptree,
 						plast_node, (SIMPLE_TREE_NODE*)pgroup,
 						SIMPLE_TREE_INSERT_AFTER);
 				} else {
-					simple_tree_add_child(&preader->element_tree,
+					simple_tree_add_child(ptree,
 						(SIMPLE_TREE_NODE*)plast_group,
 						(SIMPLE_TREE_NODE*)pgroup, SIMPLE_TREE_ADD_LAST);
 				}
@@ -1381,11 +1360,11 @@ static bool rtf_load_element_tree(RTF_READER *preader)
 			}
 			pword->pdata = input_word;
 			if (NULL == plast_node) {
-				simple_tree_add_child(&preader->element_tree,
+				simple_tree_add_child(ptree,
 					(SIMPLE_TREE_NODE*)plast_group, pword,
 					SIMPLE_TREE_ADD_LAST);
 			} else {
-				simple_tree_insert_sibling(&preader->element_tree,
+				simple_tree_insert_sibling(ptree,
 					plast_node, pword, SIMPLE_TREE_INSERT_AFTER);
 			}
 			plast_node = pword;
@@ -3183,25 +3162,347 @@ static int rtf_convert_group_node(RTF_READER *preader, SIMPLE_TREE_NODE *pnode)
 	return 0;
 }
 
-bool rtf_to_html(const char *pbuff_in, size_t length, const char *charset,
-    char **pbuff_out, size_t *plength, ATTACHMENT_LIST *pattachments)
+namespace {
+
+/* Per-group state of the streaming converter; mirrors rtf_convert_group_node's locals */
+struct STREAM_GROUP {
+	int paragraph_align = ALIGN_LEFT;
+	bool b_paragraph_begun = false, b_hyperlinked = false;
+	bool is_cell_group = false;
+};
+
+}
+
+/*
+ * Look for \fromhtml1 among the first words of the outermost group (the
+ * same window rtf_convert_tree inspects) and rewind the reader afterwards.
+ */
+static bool rtf_detect_fromhtml(RTF_READER *preader)
+{
+	auto saved_pull = preader->ext_pull;
+	int saved_ungot[3];
+	memcpy(saved_ungot, preader->ungot_chars, sizeof(saved_ungot));
+	auto saved_last = preader->last_returned_ch;
+	std::string word;
+	bool b_found = false;
+	
+	if (rtf_read_word(preader, word) && word == "{") {
+		for (int i = 1; i <= 10; ++i) {
+			if (!rtf_read_word(preader, word) ||
+			    word == "{" || word == "}")
+				break;
+			if (word == "\\fromhtml1") {
+				b_found = true;
+				break;
+			}
+		}
+	}
+	preader->ext_pull = saved_pull;
+	memcpy(preader->ungot_chars, saved_ungot, sizeof(saved_ungot));
+	preader->last_returned_ch = saved_last;
+	return b_found;
+}
+
+static bool rtf_stream_group_begin(RTF_READER *preader,
+    std::vector<STREAM_GROUP> &stack)
+{
+	if (stack.size() >= MAX_GROUP_DEPTH) {
+		debug_info("[rtf]: max group depth reached");
+		return false;
+	}
+	if (!rtf_check_for_table(preader) || !rtf_stack_list_new_node(preader))
+		return false;
+	stack.emplace_back();
+	return true;
+}
+
+static bool rtf_stream_group_end(RTF_READER *preader,
+    std::vector<STREAM_GROUP> &stack)
+{
+	auto &group = stack.back();
+	rtf_flush_iconv_cache(preader);
+	if (group.b_hyperlinked)
+		QRF(preader->ext_push.p_bytes(TAG_HYPERLINK_END, sizeof(TAG_HYPERLINK_END) - 1));
+	if (!group.is_cell_group && !rtf_attrstack_pop_express_all(preader))
+		return false;
+	if (group.b_paragraph_begun &&
+	    !rtf_ending_paragraph_align(preader, group.paragraph_align))
+		return false;
+	rtf_stack_list_free_node(preader);
+	stack.pop_back();
+	return true;
+}
+
+/* Consume the remainder of the current group, including its closing brace. */
+static bool rtf_stream_skip_group(RTF_READER *preader)
+{
+	std::string word;
+	size_t depth = 1;
+	
+	while (depth > 0 && rtf_read_word(preader, word)) {
+		if (word == "{")
+			++depth;
+		else if (word == "}")
+			--depth;
+	}
+	return true;
+}
+
+/*
+ * Control words like \fonttbl need to see their siblings. Materialize just
+ * the remainder of the current group as a tree and hand that to @func.
+ */
+static int rtf_stream_call_with_rest(RTF_READER *preader, CMD_PROC_FUNC func,
+    const std::string &word, int align, bool have_param, int num)
+{
+	SIMPLE_TREE tree;
+	
+	simple_tree_init(&tree);
+	auto pgroup = static_cast<GROUP_NODE *>(malloc(sizeof(GROUP_NODE)));
+	if (NULL == pgroup) {
+		return CMD_RESULT_ERROR;
+	}
+	pgroup->node.pdata = NULL;
+	double_list_init(&pgroup->collection_list);
+	simple_tree_set_root(&tree, &pgroup->node);
+	auto cl_0 = make_scope_exit([&]() {
+		simple_tree_destroy_node(&tree, &pgroup->node, rtf_delete_tree_node);
+		simple_tree_free(&tree);
+	});
+	auto pword = static_cast<SIMPLE_TREE_NODE *>(malloc(sizeof(SIMPLE_TREE_NODE)));
+	if (NULL == pword) {
+		return CMD_RESULT_ERROR;
+	}
+	pword->pdata = strdup(word.c_str());
+	if (NULL == pword->pdata) {
+		free(pword);
+		return CMD_RESULT_ERROR;
+	}
+	simple_tree_add_child(&tree, &pgroup->node, pword, SIMPLE_TREE_ADD_LAST);
+	if (!rtf_load_element_tree(preader, &tree, pgroup, pword))
+		return CMD_RESULT_ERROR;
+	auto ret = func(preader, pword, align, have_param, num);
+	return ret == CMD_RESULT_ERROR ? ret : CMD_RESULT_IGNORE_REST;
+}
+
+/*
+ * Handle one non-group word in \fromhtml1 mode. The logic is that of the
+ * word branch in rtf_convert_group_node. Returns CMD_RESULT_IGNORE_REST if
+ * the rest of the group, including its closing brace, has been consumed.
+ */
+static int rtf_stream_word(RTF_READER *preader, STREAM_GROUP &group,
+    std::string &word)
+{
+	int num;
+	int ret_val;
+	bool have_param;
+	CMD_PROC_FUNC func;
+	char name[MAX_CONTROL_LEN];
+	auto string = word.data();
+	
+	if (strcasecmp(string, "\\htmlrtf") == 0 ||
+	    strcasecmp(string, "\\htmlrtf1") == 0)
+		preader->is_within_htmlrtf = true;
+	else if (strcasecmp(string, "\\htmlrtf0") == 0)
+		preader->is_within_htmlrtf = false;
+	if (preader->is_within_htmlrtf)
+		return CMD_RESULT_CONTINUE;
+	if (strncmp(string, "\\'", 2) != 0 && !rtf_flush_iconv_cache(preader))
+		return CMD_RESULT_ERROR;
+	if (*string == ' ' && preader->is_within_header)
+		return CMD_RESULT_CONTINUE;
+	if ('\\' != string[0] || string[1] == '\\' ||
+	    string[1] == '{' || string[1] == '}') {
+		if ('\\' != string[0]) {
+			if (!rtf_starting_body(preader) ||
+			    !rtf_starting_text(preader))
+				return CMD_RESULT_ERROR;
+			if (!group.b_paragraph_begun) {
+				if (!rtf_starting_paragraph_align(preader, group.paragraph_align))
+					return CMD_RESULT_ERROR;
+				group.b_paragraph_begun = true;
+			}
+		}
+		rtf_unescape_string(string);
+		preader->total_chars_in_line += strlen(string);
+		if (!rtf_escape_output(preader, string))
+			return CMD_RESULT_ERROR;
+		return CMD_RESULT_CONTINUE;
+	}
+	string ++;
+	if (0 == strcmp("ql", string)) {
+		group.paragraph_align = ALIGN_LEFT;
+	} else if (0 == strcmp("qr", string)) {
+		group.paragraph_align = ALIGN_RIGHT;
+	} else if (0 == strcmp("qj", string)) {
+		group.paragraph_align = ALIGN_JUSTIFY;
+	} else if (0 == strcmp("qc", string)) {
+		group.paragraph_align = ALIGN_CENTER;
+	} else if (0 == strcmp("pard", string)) {
+		rtf_attrstack_pop_express_all(preader);
+		if (0 != preader->coming_pars_tabular) {
+			preader->coming_pars_tabular --;
+		}
+		if (!rtf_ending_paragraph_align(preader, group.paragraph_align))
+			return CMD_RESULT_ERROR;
+		group.paragraph_align = ALIGN_LEFT;
+		group.b_paragraph_begun = false;
+	} else if (0 == strcmp(string, "cell")) {
+		group.is_cell_group = true;
+		if (!preader->b_printed_cell_begin) {
+			if (preader->ext_push.p_bytes(TAG_TABLE_CELL_BEGIN, sizeof(TAG_TABLE_CELL_BEGIN) - 1) != EXT_ERR_SUCCESS)
+				return CMD_RESULT_ERROR;
+			rtf_attrstack_express_all(preader);
+		}
+		rtf_attrstack_pop_express_all(preader);
+		if (preader->ext_push.p_bytes(TAG_TABLE_CELL_END, sizeof(TAG_TABLE_CELL_END) - 1) != EXT_ERR_SUCCESS)
+			return CMD_RESULT_ERROR;
+		preader->b_printed_cell_begin = false;
+		preader->b_printed_cell_end = true;
+	} else if (0 == strcmp(string, "row")) {
+		if (preader->is_within_table) {
+			if (preader->ext_push.p_bytes(TAG_TABLE_ROW_END, sizeof(TAG_TABLE_ROW_END) - 1) != EXT_ERR_SUCCESS)
+				return CMD_RESULT_ERROR;
+			preader->b_printed_row_begin = false;
+			preader->b_printed_row_end = true;
+		}
+	} else if (string[0] == '\'' && string[1] != '\0' && string[2] != '\0') {
+		if (!rtf_put_iconv_cache(preader, rtf_decode_hex_char(string + 1)))
+			return CMD_RESULT_ERROR;
+	} else {
+		ret_val = rtf_parse_control(string, name, MAX_CONTROL_LEN, &num);
+		if (ret_val < 0) {
+			return CMD_RESULT_ERROR;
+		} else if (ret_val > 0) {
+			have_param = true;
+		} else {
+			have_param = false;
+			/* \b is like \b1 */
+			num = 1;
+		}
+		if (0 == strcmp("par", name) ||
+			0 == strcmp("tab", name) ||
+			0 == strcmp("lquote", name) ||
+			0 == strcmp("rquote", name) ||
+			0 == strcmp("ldblquote", name) ||
+			0 == strcmp("rdblquote", name) ||
+			0 == strcmp("bullet", name) ||
+			0 == strcmp("endash", name) ||
+			0 == strcmp("emdash", name) ||
+			0 == strcmp("colortbl", name) ||
+			0 == strcmp("fonttbl", name) ||
+			0 == strcmp("htmltag", name) ||
+			0 == strcmp("uc", name) ||
+			0 == strcmp("u", name) ||
+			0 == strcmp("f", name) ||
+			0 == strcmp("~", name) ||
+			0 == strcmp("_", name)) {
+			func = rtf_find_cmd_function(name);
+		} else {
+			func = NULL;
+		}
+		if (NULL == func) {
+			return CMD_RESULT_CONTINUE;
+		}
+		if (func == rtf_cmd_fonttbl || func == rtf_cmd_colortbl)
+			return rtf_stream_call_with_rest(preader, func, word,
+			       group.paragraph_align, have_param, num);
+		SIMPLE_TREE_NODE lone{};
+		lone.pdata = word.data();
+		switch (func(preader, &lone, group.paragraph_align,
+		        have_param, num)) {
+		case CMD_RESULT_ERROR:
+			return CMD_RESULT_ERROR;
+		case CMD_RESULT_HYPERLINKED:
+			group.b_hyperlinked = true;
+			break;
+		case CMD_RESULT_IGNORE_REST:
+			rtf_stream_skip_group(preader);
+			return CMD_RESULT_IGNORE_REST;
+		}
+	}
+	return CMD_RESULT_CONTINUE;
+}
+
+/*
+ * Single-pass converter for \fromhtml1 documents. Words are consumed as they
+ * are tokenized; no element tree is built for the document. The output is
+ * identical to what rtf_convert_group_node produces for the same input.
+ *
+ * Only the \fromhtml1 word rules are implemented. The general formatter
+ * additionally needs \pict accumulation per group and lets \field and \*
+ * continue with siblings it has already inspected, so plain RTF still goes
+ * through rtf_convert_tree.
+ */
+static bool rtf_convert_stream(RTF_READER *preader)
+{
+	std::string word;
+	std::vector<STREAM_GROUP> stack;
+	bool b_open = true;
+	
+	if (!rtf_read_word(preader, word) || word != "{")
+		return false;
+	/* the outermost frame is the one holding the root group node */
+	if (!rtf_stream_group_begin(preader, stack))
+		return false;
+	while (true) {
+		if (b_open) {
+			b_open = false;
+			auto &parent = stack.back();
+			if (!parent.b_paragraph_begun) {
+				if (!rtf_starting_paragraph_align(preader, parent.paragraph_align))
+					return false;
+				parent.b_paragraph_begun = true;
+			}
+			if (!rtf_read_word(preader, word))
+				break;
+			if (word == "}") {
+				/* empty group */
+				if (stack.size() == 1)
+					break;
+				continue;
+			}
+			if (!rtf_stream_group_begin(preader, stack))
+				return false;
+		} else if (!rtf_read_word(preader, word)) {
+			break;
+		}
+		if (word == "{") {
+			b_open = true;
+			continue;
+		}
+		if (word != "}") {
+			auto ret = rtf_stream_word(preader, stack.back(), word);
+			if (ret == CMD_RESULT_ERROR)
+				return false;
+			if (ret != CMD_RESULT_IGNORE_REST)
+				continue;
+		}
+		if (!rtf_stream_group_end(preader, stack))
+			return false;
+		if (stack.size() == 1)
+			/* outermost group closed; trailing data is ignored */
+			break;
+	}
+	/* incomplete RTF... pretend it's ok */
+	while (!stack.empty())
+		if (!rtf_stream_group_end(preader, stack))
+			return false;
+	return true;
+}
+
+static bool rtf_convert_tree(RTF_READER *preader, const char *charset)
 {
 	int i;
 	int tmp_len;
-	iconv_t conv_id;
-	char *pout;
-	RTF_READER reader;
 	char tmp_buff[128];
 	SIMPLE_TREE_NODE *proot;
 	SIMPLE_TREE_NODE *pnode;
 	
-	*pbuff_out = nullptr;
-	if (!rtf_init_reader(&reader, pbuff_in, length, pattachments))
-		return false;
-	if (!rtf_load_element_tree(&reader)) {
+	if (!rtf_load_element_tree(preader, &preader->element_tree)) {
 		return false;
 	}
-	proot = simple_tree_get_root(&reader.element_tree);
+	proot = simple_tree_get_root(&preader->element_tree);
 	if (NULL == proot) {
 		return false;
 	}
@@ -3211,25 +3512,35 @@ bool rtf_to_html(const char *pbuff_in, size_t length, const char *charset,
 			break;
 		}
 		if (strcmp(static_cast<char *>(pnode->pdata), "\\fromhtml1") == 0)
-			reader.have_fromhtml = true;
+			preader->have_fromhtml = true;
 		pnode = simple_tree_node_get_sibling(pnode);
 	}
-	if (!reader.have_fromhtml) {
-		QRF(reader.ext_push.p_bytes(TAG_DOCUMENT_BEGIN, sizeof(TAG_DOCUMENT_BEGIN) - 1));
-		QRF(reader.ext_push.p_bytes(TAG_HEADER_BEGIN, sizeof(TAG_HEADER_BEGIN) - 1));
+	if (!preader->have_fromhtml) {
+		QRF(preader->ext_push.p_bytes(TAG_DOCUMENT_BEGIN, sizeof(TAG_DOCUMENT_BEGIN) - 1));
+		QRF(preader->ext_push.p_bytes(TAG_HEADER_BEGIN, sizeof(TAG_HEADER_BEGIN) - 1));
 		tmp_len = snprintf(tmp_buff, arsizeof(tmp_buff), TAG_HTML_CHARSET, charset);
-		QRF(reader.ext_push.p_bytes(tmp_buff, tmp_len));
+		QRF(preader->ext_push.p_bytes(tmp_buff, tmp_len));
 	}
-	auto ret = rtf_convert_group_node(&reader, proot);
+	auto ret = rtf_convert_group_node(preader, proot);
 	if (ret != 0)
 		return false;
-	if (!rtf_end_table(&reader)) {
+	if (!rtf_end_table(preader)) {
 		return false;
 	}
-	if (!reader.have_fromhtml) {
-		QRF(reader.ext_push.p_bytes(TAG_BODY_END, sizeof(TAG_BODY_END) - 1));
-		QRF(reader.ext_push.p_bytes(TAG_DOCUMENT_END, sizeof(TAG_DOCUMENT_END) - 1));
+	if (!preader->have_fromhtml) {
+		QRF(preader->ext_push.p_bytes(TAG_BODY_END, sizeof(TAG_BODY_END) - 1));
+		QRF(preader->ext_push.p_bytes(TAG_DOCUMENT_END, sizeof(TAG_DOCUMENT_END) - 1));
 	}
+	return true;
+}
+
+static bool rtf_output(RTF_READER &reader, const char *charset,
+    char **pbuff_out, size_t *plength)
+{
+	iconv_t conv_id;
+	char *pout;
+	char tmp_buff[128];
+	
 	if (0 == strcasecmp(charset, "UTF-8") ||
 		0 == strcasecmp(charset, "ASCII") ||
 		0 == strcasecmp(charset, "US-ASCII")) {
@@ -3243,7 +3554,7 @@ bool rtf_to_html(const char *pbuff_in, size_t length, const char *charset,
 	}
 	snprintf(tmp_buff, 128, "%s//TRANSLIT",
 		replace_iconv_charset(charset));
-	conv_id = iconv_open(tmp_buff, "UTF-8");
+	conv_id = iconv_cached(tmp_buff, "UTF-8");
 	if ((iconv_t)-1 == conv_id) {
 		return false;
 	}
@@ -3253,20 +3564,55 @@ bool rtf_to_html(const char *pbuff_in, size_t length, const char *charset,
 	size_t out_len = *plength;
 	*pbuff_out = static_cast<char *>(malloc(out_len + 1));
 	if (*pbuff_out == nullptr) {
-		iconv_close(conv_id);
 		return false;
 	}
 	pout = *pbuff_out;
 	size_t in_len = reader.ext_push.m_offset;
 	if (iconv(conv_id, &pin, &in_len, &pout, &out_len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
+		free(*pbuff_out);
+		*pbuff_out = nullptr;
 		return false;
 	}
-	iconv_close(conv_id);
 	*plength -= out_len;
 	return true;
 }
 
+bool rtf_to_html(const char *pbuff_in, size_t length, const char *charset,
+    char **pbuff_out, size_t *plength, ATTACHMENT_LIST *pattachments)
+{
+	RTF_READER reader;
+	
+	*pbuff_out = nullptr;
+	if (!rtf_init_reader(&reader, pbuff_in, length, pattachments))
+		return false;
+	try {
+		if (rtf_detect_fromhtml(&reader)) {
+			/* encapsulated HTML: de-encapsulate in a single pass */
+			reader.have_fromhtml = true;
+			if (!rtf_convert_stream(&reader) || !rtf_end_table(&reader))
+				return false;
+		} else if (!rtf_convert_tree(&reader, charset)) {
+			return false;
+		}
+	} catch (const std::bad_alloc &) {
+		fprintf(stderr, "E-1616: ENOMEM\n");
+		return false;
+	}
+	return rtf_output(reader, charset, pbuff_out, plength);
+}
+
+bool rtf_to_html_tree(const char *pbuff_in, size_t length, const char *charset,
+    char **pbuff_out, size_t *plength, ATTACHMENT_LIST *pattachments)
+{
+	RTF_READER reader;
+	
+	*pbuff_out = nullptr;
+	if (!rtf_init_reader(&reader, pbuff_in, length, pattachments) ||
+	    !rtf_convert_tree(&reader, charset))
+		return false;
+	return rtf_output(reader, charset, pbuff_out, plength);
+}
+
 bool rtf_init_library(CPID_TO_CHARSET cpid_to_charset)
 {
 	static constexpr std::pair<const char *, CMD_PROC_FUNC> cmd_map[] = {
@@ -213,38 +213,25 @@ static int ntlmssp_utf8_to_utf16le(const char *src, void *dst, size_t len)
 	size_t out_len;
 	iconv_t conv_id;
 
-	conv_id = iconv_open("UTF-16LE", "UTF-8");
+	conv_id = iconv_cached("UTF-16LE", "UTF-8");
+	if ((iconv_t)-1 == conv_id) {
+		return -1;
+	}
 	auto pin  = deconst(src);
 	auto pout = static_cast<char *>(dst);
 	in_len = strlen(src);
 	memset(dst, 0, len);
 	out_len = len;
 	if (iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
 		return -1;
-	} else {
-		iconv_close(conv_id);
-		return out_len - len;
 	}
+	return out_len - len;
 }
 
 static bool ntlmssp_utf16le_to_utf8(const void *src, size_t src_len,
 	char *dst, size_t len)
 {
-	char *pin, *pout;
-	iconv_t conv_id;
-
-	conv_id = iconv_open("UTF-8", "UTF-16LE");
-	pin = (char*)src;
-	pout = dst;
-	memset(dst, 0, len);
-	if (iconv(conv_id, &pin, &src_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
-		return false;
-	} else {
-		iconv_close(conv_id);
-		return true;
-	}
+	return utf16le_to_utf8(src, src_len, dst, len);
 }
 
 static bool ntlmssp_md4hash(const char *passwd, void *p16v)
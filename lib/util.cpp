@@ -3,8 +3,14 @@
  *	this file includes some utility functions that will be used by many 
  *	programs
  */
+#include <algorithm>
+#include <cerrno>
 #include <cstdint>
 #include <ctime>
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
 #include <libHX/ctype_helper.h>
 #include <libHX/string.h>
 #include <gromox/defs.h>
@@ -22,6 +28,10 @@
 #if __linux__
 #	include <sys/random.h>
 #endif
+#if defined(__x86_64__) || defined(__i386__)
+#	include <immintrin.h>
+#	define GX_CODEC_X86 1
+#endif
 
 using namespace gromox;
 
@@ -267,6 +277,306 @@ void wchar_to_utf8(uint32_t wchar, char *zstring)
 	}
 }
 
+static unsigned int g_codec_isa = [] {
+#ifdef GX_CODEC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return CODEC_AVX2;
+	if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3"))
+		return CODEC_SSE4;
+#endif
+	return CODEC_SCALAR;
+}();
+
+unsigned int codec_set_isa(unsigned int isa)
+{
+	static const unsigned int best = g_codec_isa;
+	g_codec_isa = std::min(isa, best);
+	return g_codec_isa;
+}
+
+namespace {
+
+/* Descriptors of one thread; failed opens are remembered as (iconv_t)-1 */
+struct iconv_cache {
+	iconv_cache() = default;
+	~iconv_cache() { clear(); }
+	NOMOVE(iconv_cache);
+	void clear() {
+		for (const auto &e : m_map)
+			if (e.second != reinterpret_cast<iconv_t>(-1))
+				iconv_close(e.second);
+		m_map.clear();
+	}
+	std::unordered_map<std::string, iconv_t> m_map;
+};
+
+}
+
+namespace gromox {
+
+iconv_t iconv_cached(const char *to, const char *from) try
+{
+	static constexpr size_t max_entries = 64;
+	thread_local iconv_cache cache;
+	std::string key = to;
+	key += '\0';
+	key += from;
+	auto it = cache.m_map.find(key);
+	if (it == cache.m_map.end()) {
+		if (cache.m_map.size() >= max_entries)
+			cache.clear();
+		it = cache.m_map.emplace(std::move(key), iconv_open(to, from)).first;
+	}
+	if (it->second == reinterpret_cast<iconv_t>(-1))
+		errno = EINVAL;
+	else
+		iconv(it->second, nullptr, nullptr, nullptr, nullptr);
+	return it->second;
+} catch (const std::bad_alloc &) {
+	errno = ENOMEM;
+	return reinterpret_cast<iconv_t>(-1);
+}
+
+#ifdef GX_CODEC_X86
+static __attribute__((target("sse2"))) size_t ascii_run_sse(const char *s, size_t len)
+{
+	size_t i = 0;
+	for (; len - i >= 16; i += 16) {
+		unsigned int m = _mm_movemask_epi8(_mm_loadu_si128(
+		                 reinterpret_cast<const __m128i *>(s + i)));
+		if (m != 0)
+			return i + __builtin_ctz(m);
+	}
+	return i;
+}
+#endif
+
+/* Length of the leading run of 7-bit octets */
+static size_t ascii_run(const char *s, size_t len)
+{
+	size_t i = 0;
+#ifdef GX_CODEC_X86
+	if (g_codec_isa >= CODEC_SSE4)
+		i = ascii_run_sse(s, len);
+#endif
+	while (i < len && !(static_cast<unsigned char>(s[i]) & 0x80))
+		++i;
+	return i;
+}
+
+bool str_isascii(const char *s, size_t len)
+{
+	return ascii_run(s, len) == len;
+}
+
+/*
+ * Charsets whose iconv mapping of 0x00..0x7F is the identity, so 7-bit
+ * text needs no conversion to or from UTF-8. (Not the case for e.g. UTF-7,
+ * ISO-2022-*, HZ or Shift_JIS.)
+ */
+bool charset_ascii_compatible(const char *cs)
+{
+	static const char *const prefixes[] = {
+		"us-ascii", "ascii", "utf-8", "utf8", "iso-8859-", "iso8859-",
+		"iso_8859-", "latin", "windows-125", "cp125", "koi8-", "gb2312",
+		"gbk", "gb18030", "big5", "euc-", "cp936", "cp949", "cp950",
+		"tis-620", "windows-874", "cp874",
+	};
+	for (auto p : prefixes)
+		if (strncasecmp(cs, p, strlen(p)) == 0)
+			return true;
+	return false;
+}
+
+}
+
+#ifdef GX_CODEC_X86
+/* widen 16 ASCII octets per step; returns octets consumed */
+static __attribute__((target("sse2"))) size_t
+ascii_to_utf16le_sse(const char *s, size_t n, char *d, size_t dmax)
+{
+	size_t i = 0;
+	auto zero = _mm_setzero_si128();
+	for (; n - i >= 16 && dmax - 2 * i >= 32; i += 16) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+		if (_mm_movemask_epi8(v) != 0)
+			break;
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(d + 2 * i), _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(d + 2 * i + 16), _mm_unpackhi_epi8(v, zero));
+	}
+	return i;
+}
+
+/* narrow 8 UTF-16LE units below U+0080 per step; returns units consumed */
+static __attribute__((target("sse2"))) size_t
+utf16le_to_ascii_sse(const char *s, size_t units, char *d, size_t dmax)
+{
+	size_t i = 0;
+	auto hi = _mm_set1_epi16(static_cast<short>(0xff80));
+	for (; units - i >= 8 && dmax - i >= 8; i += 8) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 2 * i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, hi),
+		    _mm_setzero_si128())) != 0xffff)
+			break;
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(d + i), _mm_packus_epi16(v, v));
+	}
+	return i;
+}
+#endif
+
+/*
+ * UTF-8 to UTF-16LE with the same strictness as glibc's iconv (no
+ * overlongs, surrogates or code points beyond U+10FFFF). Returns octets
+ * written, or -1 with errno EILSEQ, EINVAL (truncated) or E2BIG.
+ */
+static ssize_t utf8_to_utf16le_n(const char *src, size_t n, char *dst, size_t dmax)
+{
+	auto s = reinterpret_cast<const uint8_t *>(src);
+	auto d = reinterpret_cast<uint8_t *>(dst);
+	size_t i = 0, o = 0;
+	while (i < n) {
+#ifdef GX_CODEC_X86
+		if (g_codec_isa >= CODEC_SSE4 && s[i] < 0x80) {
+			auto k = ascii_to_utf16le_sse(src + i, n - i, dst + o, dmax - o);
+			i += k;
+			o += 2 * k;
+			if (i >= n)
+				break;
+		}
+#endif
+		uint32_t c = s[i];
+		size_t need;
+		uint8_t lo = 0x80, hi = 0xbf;
+		if (c < 0x80) {
+			need = 0;
+		} else if (c >= 0xc2 && c <= 0xdf) {
+			need = 1;
+			c &= 0x1f;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			need = 2;
+			if (c == 0xe0)
+				lo = 0xa0;
+			else if (c == 0xed)
+				hi = 0x9f;
+			c &= 0x0f;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			need = 3;
+			if (c == 0xf0)
+				lo = 0x90;
+			else if (c == 0xf4)
+				hi = 0x8f;
+			c &= 0x07;
+		} else {
+			errno = EILSEQ;
+			return -1;
+		}
+		for (size_t k = 1; k <= need; ++k) {
+			if (i + k >= n) {
+				errno = EINVAL;
+				return -1;
+			}
+			uint8_t t = s[i+k];
+			if (t < lo || t > hi) {
+				errno = EILSEQ;
+				return -1;
+			}
+			lo = 0x80;
+			hi = 0xbf;
+			c = (c << 6) | (t & 0x3f);
+		}
+		i += need + 1;
+		if (c < 0x10000) {
+			if (dmax - o < 2) {
+				errno = E2BIG;
+				return -1;
+			}
+			d[o++] = c;
+			d[o++] = c >> 8;
+			continue;
+		}
+		if (dmax - o < 4) {
+			errno = E2BIG;
+			return -1;
+		}
+		c -= 0x10000;
+		uint16_t h = 0xd800 | (c >> 10), l = 0xdc00 | (c & 0x3ff);
+		d[o++] = h;
+		d[o++] = h >> 8;
+		d[o++] = l;
+		d[o++] = l >> 8;
+	}
+	return o;
+}
+
+/* UTF-16LE to UTF-8; same conventions as utf8_to_utf16le_n */
+static ssize_t utf16le_to_utf8_n(const void *src, size_t n, char *dst, size_t dmax)
+{
+	auto s = static_cast<const uint8_t *>(src);
+	auto d = reinterpret_cast<uint8_t *>(dst);
+	size_t i = 0, o = 0;
+	while (n - i >= 2) {
+#ifdef GX_CODEC_X86
+		if (g_codec_isa >= CODEC_SSE4 && s[i+1] == 0 && s[i] < 0x80) {
+			auto k = utf16le_to_ascii_sse(reinterpret_cast<const char *>(s + i),
+			         (n - i) / 2, dst + o, dmax - o);
+			i += 2 * k;
+			o += k;
+			if (n - i < 2)
+				break;
+		}
+#endif
+		uint32_t c = s[i] | (s[i+1] << 8);
+		i += 2;
+		if (c >= 0xdc00 && c <= 0xdfff) {
+			errno = EILSEQ;
+			return -1;
+		} else if (c >= 0xd800 && c <= 0xdbff) {
+			if (n - i < 2) {
+				errno = EINVAL;
+				return -1;
+			}
+			uint32_t l = s[i] | (s[i+1] << 8);
+			if (l < 0xdc00 || l > 0xdfff) {
+				errno = EILSEQ;
+				return -1;
+			}
+			i += 2;
+			c = 0x10000 + (((c & 0x3ff) << 10) | (l & 0x3ff));
+		}
+		size_t len = c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+		if (dmax - o < len) {
+			errno = E2BIG;
+			return -1;
+		}
+		switch (len) {
+		case 1:
+			d[o++] = c;
+			break;
+		case 2:
+			d[o++] = 0xc0 | (c >> 6);
+			d[o++] = 0x80 | (c & 0x3f);
+			break;
+		case 3:
+			d[o++] = 0xe0 | (c >> 12);
+			d[o++] = 0x80 | ((c >> 6) & 0x3f);
+			d[o++] = 0x80 | (c & 0x3f);
+			break;
+		default:
+			d[o++] = 0xf0 | (c >> 18);
+			d[o++] = 0x80 | ((c >> 12) & 0x3f);
+			d[o++] = 0x80 | ((c >> 6) & 0x3f);
+			d[o++] = 0x80 | (c & 0x3f);
+			break;
+		}
+	}
+	if (i < n) {
+		errno = EINVAL;
+		return -1;
+	}
+	return o;
+}
+
 const char* replace_iconv_charset(const char *charset)
 {
 	if (0 == strcasecmp(charset, "gb2312")) {
@@ -307,10 +617,15 @@ BOOL string_to_utf8(const char *charset,
 		return TRUE;
 	}
 	gx_strlcpy(tmp_charset, replace_iconv_charset(charset), GX_ARRAY_SIZE(tmp_charset));
+	if (charset_ascii_compatible(tmp_charset) &&
+	    str_isascii(in_string, length)) {
+		memcpy(out_string, in_string, length + 1);
+		return TRUE;
+	}
 	if (0 != strcasecmp("utf-7", tmp_charset)) {
 		length ++;
 	}
-	conv_id = iconv_open("UTF-8", tmp_charset);
+	conv_id = iconv_cached("UTF-8", tmp_charset);
 	if ((iconv_t)-1 == conv_id) {
 		return FALSE;
 	}
@@ -318,11 +633,8 @@ BOOL string_to_utf8(const char *charset,
 	pout = out_string;
 	in_len = length;
 	out_len = 2*length;
-	if (iconv(conv_id, &pin, &in_len, &pout, &out_len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
+	if (iconv(conv_id, &pin, &in_len, &pout, &out_len) == static_cast<size_t>(-1))
 		return FALSE;
-	}
-	iconv_close(conv_id);
 	if (0 == strcasecmp("utf-7", tmp_charset)) {
 		out_string[2*length - out_len] = '\0';	
 	}
@@ -351,9 +663,15 @@ BOOL string_from_utf8(const char *charset, const char *in_string,
 		return TRUE;
 	}
 	
+	auto cset = replace_iconv_charset(charset);
+	if (static_cast<size_t>(length) < out_len &&
+	    charset_ascii_compatible(cset) && str_isascii(in_string, length)) {
+		memcpy(out_string, in_string, length + 1);
+		return TRUE;
+	}
 	length ++;
 	
-	conv_id = iconv_open(replace_iconv_charset(charset), "UTF-8");
+	conv_id = iconv_cached(cset, "UTF-8");
 	if ((iconv_t)-1 == conv_id) {
 		return FALSE;
 	}
@@ -361,11 +679,8 @@ BOOL string_from_utf8(const char *charset, const char *in_string,
 	pout = out_string;
 	in_len = length;
 	out_len = 2*length;
-	if (iconv(conv_id, &pin, &in_len, &pout, &out_len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
+	if (iconv(conv_id, &pin, &in_len, &pout, &out_len) == static_cast<size_t>(-1))
 		return FALSE;
-	}
-	iconv_close(conv_id);
 	/*
 	 * U+0000 converts to nothing in UTF-7. But we still need that string
 	 * terminator. Because no \x00 that the caller planned for was emitted
@@ -378,41 +693,14 @@ BOOL string_from_utf8(const char *charset, const char *in_string,
 
 int utf8_to_utf16le(const char *src, void *dst, size_t len)
 {
-	size_t in_len;
-	size_t out_len;
-	iconv_t conv_id;
-
-	conv_id = iconv_open("UTF-16LE", "UTF-8");
-	auto pin  = deconst(src);
-	auto pout = static_cast<char *>(dst);
-	in_len = strlen(src) + 1;
 	memset(dst, 0, len);
-	out_len = len;
-	if (iconv(conv_id, &pin, &in_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
-		return -1;
-	} else {
-		iconv_close(conv_id);
-		return out_len - len;
-	}
+	return utf8_to_utf16le_n(src, strlen(src) + 1, static_cast<char *>(dst), len);
 }
 
 BOOL utf16le_to_utf8(const void *src, size_t src_len, char *dst, size_t len)
 {
-	char *pin, *pout;
-	iconv_t conv_id;
-	
-	conv_id = iconv_open("UTF-8", "UTF-16LE");
-	pin = (char*)src;
-	pout = dst;
 	memset(dst, 0, len);
-	if (iconv(conv_id, &pin, &src_len, &pout, &len) == static_cast<size_t>(-1)) {
-		iconv_close(conv_id);
-		return FALSE;
-	} else {
-		iconv_close(conv_id);
-		return TRUE;
-	}
+	return utf16le_to_utf8_n(src, src_len, dst, len) >= 0 ? TRUE : FALSE;
 }
 
 BOOL get_digest(const char *src, const char *tag, char *buff, size_t buff_len)
@@ -741,18 +1029,27 @@ uint64_t atobyte(const char *string)
 static char crypt_salt[65]=
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789./";
 
-const char *crypt_wrapper(const char *pw)
+/*
+ * The result is stored in thread-local storage and remains valid until the
+ * next call from the same thread.
+ */
+const char *crypt_wrapper(const char *pw) try
 {
+	static thread_local std::unique_ptr<struct crypt_data> cd;
+	if (cd == nullptr)
+		cd = std::make_unique<struct crypt_data>();
 	char salt[21] = "$6$";
 	randstring_k(salt + 3, 16, crypt_salt);
 	salt[19] = '$';
 	salt[20] = '\0';
-	auto ret = crypt(pw, salt);
+	auto ret = crypt_r(pw, salt, cd.get());
 	if (ret != nullptr && ret[0] == '$')
 		return ret;
 	salt[1] = '1';
-	ret = crypt(pw, salt);
+	ret = crypt_r(pw, salt, cd.get());
 	return ret != nullptr ? ret : "*0";
+} catch (const std::bad_alloc &) {
+	return "*0";
 }
 
 
@@ -874,6 +1171,303 @@ static int8_t index_64[128] = {
 	41,42,43,44, 45,46,47,48, 49,50,51,-1, -1,-1,-1,-1
 };
 
+/*
+ * Vector kernels for the bulk of base64/QP work. Each consumes only what
+ * the scalar loops would have treated identically (whole groups of valid
+ * base64, runs of plain QP characters), so output stays byte-for-byte the
+ * same; everything else is left to the scalar code around them.
+ */
+#ifdef GX_CODEC_X86
+/* 12 octets in, 16 characters out (W. Mula's multiply-shift method) */
+static inline __attribute__((always_inline, target("ssse3,sse4.1"))) __m128i
+b64enc_sse4_step(__m128i in)
+{
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+	     4, 5, 3, 4, 1, 2, 0, 1));
+	auto t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+	          _mm_set1_epi32(0x04000040));
+	auto t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+	          _mm_set1_epi32(0x01000010));
+	auto idx = _mm_or_si128(t0, t1);
+	/* 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12 */
+	auto sel = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+	sel = _mm_or_si128(sel, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx),
+	      _mm_set1_epi8(13)));
+	auto shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+	             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+	             '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	return _mm_add_epi8(_mm_shuffle_epi8(shift, sel), idx);
+}
+
+static __attribute__((target("ssse3,sse4.1"))) size_t
+b64enc_sse4(const uint8_t *in, size_t n, char *out)
+{
+	size_t done = 0;
+	for (; n - done >= 16; done += 12, out += 16)
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), b64enc_sse4_step(
+			_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done))));
+	return done;
+}
+
+static __attribute__((target("avx2"))) size_t
+b64enc_avx2(const uint8_t *in, size_t n, char *out)
+{
+	size_t done = 0;
+	for (; n - done >= 28; done += 24, out += 32) {
+		auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done));
+		auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done + 12));
+		auto v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		v = _mm256_shuffle_epi8(v, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+		    4, 5, 3, 4, 1, 2, 0, 1, 10, 11, 9, 10, 7, 8, 6, 7,
+		    4, 5, 3, 4, 1, 2, 0, 1));
+		auto t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+		          _mm256_set1_epi32(0x04000040));
+		auto t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+		          _mm256_set1_epi32(0x01000010));
+		auto idx = _mm256_or_si256(t0, t1);
+		auto sel = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		sel = _mm256_or_si256(sel, _mm256_and_si256(_mm256_cmpgt_epi8(
+		      _mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+		auto shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+		             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		             '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		             'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+		             '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		             '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out),
+			_mm256_add_epi8(_mm256_shuffle_epi8(shift, sel), idx));
+	}
+	for (; n - done >= 16; done += 12, out += 16)
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), b64enc_sse4_step(
+			_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done))));
+	return done;
+}
+
+/*
+ * 16 characters in, 12 octets out; returns false (and writes nothing)
+ * unless all 16 are from the base64 alphabet.
+ */
+static inline __attribute__((always_inline, target("ssse3,sse4.1"))) bool
+b64dec_sse4_step(const char *in, uint8_t *out)
+{
+	auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+	auto hi = _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi8(0x0f));
+	auto lo = _mm_and_si128(v, _mm_set1_epi8(0x0f));
+	auto lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	              0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	auto lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	if (!_mm_testz_si128(_mm_shuffle_epi8(lut_lo, lo), _mm_shuffle_epi8(lut_hi, hi)))
+		return false;
+	auto lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+	                0, 0, 0, 0, 0, 0, 0, 0);
+	auto roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(
+	            _mm_cmpeq_epi8(v, _mm_set1_epi8('/')), hi));
+	v = _mm_add_epi8(v, roll);
+	v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+	v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+	v = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+	    14, 13, 12, -1, -1, -1, -1));
+	alignas(16) uint8_t tmp[16];
+	_mm_store_si128(reinterpret_cast<__m128i *>(tmp), v);
+	memcpy(out, tmp, 12);
+	return true;
+}
+
+static __attribute__((target("ssse3,sse4.1"))) size_t
+b64dec_sse4(const char *in, size_t n, uint8_t *out)
+{
+	size_t done = 0;
+	for (; n - done >= 16 && b64dec_sse4_step(in + done, out); done += 16)
+		out += 12;
+	return done;
+}
+
+static __attribute__((target("avx2"))) size_t
+b64dec_avx2(const char *in, size_t n, uint8_t *out)
+{
+	size_t done = 0;
+	for (; n - done >= 32; done += 32, out += 24) {
+		auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + done));
+		auto hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), _mm256_set1_epi8(0x0f));
+		auto lo = _mm256_and_si256(v, _mm256_set1_epi8(0x0f));
+		auto lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		              0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		              0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		              0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+		auto lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		              0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		              0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+		if (!_mm256_testz_si256(_mm256_shuffle_epi8(lut_lo, lo),
+		    _mm256_shuffle_epi8(lut_hi, hi)))
+			break;
+		auto lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+		                0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 19, 4, -65, -65, -71, -71,
+		                0, 0, 0, 0, 0, 0, 0, 0);
+		auto roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(
+		            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')), hi));
+		v = _mm256_add_epi8(v, roll);
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+		v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+		v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+		    14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8,
+		    14, 13, 12, -1, -1, -1, -1));
+		v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+		alignas(32) uint8_t tmp[32];
+		_mm256_store_si256(reinterpret_cast<__m256i *>(tmp), v);
+		memcpy(out, tmp, 24);
+	}
+	/* VEX-encoded 128-bit tail; no calls into the SSE-only variant */
+	for (; n - done >= 16 && b64dec_sse4_step(in + done, out); done += 16)
+		out += 12;
+	return done;
+}
+
+/*
+ * Length of the leading run of octets that QP passes through unchanged:
+ * 32..126 except '=', and a space only when not followed by CR.
+ */
+static __attribute__((target("sse2"))) size_t
+qp_literal_run_sse(const char *in, size_t n)
+{
+	size_t done = 0;
+	for (; n - done >= 17; done += 16) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done));
+		auto next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done + 1));
+		/* signed compare: octets >= 0x80 are negative and fail too */
+		auto bad = _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(32)),
+		           _mm_or_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(126)),
+		           _mm_cmpeq_epi8(v, _mm_set1_epi8('='))));
+		bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+		      _mm_cmpeq_epi8(next, _mm_set1_epi8('\r'))));
+		unsigned int mask = _mm_movemask_epi8(bad);
+		if (mask != 0)
+			return done + __builtin_ctz(mask);
+	}
+	return done;
+}
+
+/* Length of the leading run not containing '=' (nor '_' if @mime) */
+static __attribute__((target("sse2"))) size_t
+qp_plain_run_sse(const char *in, size_t n, bool mime)
+{
+	size_t done = 0;
+	auto us = _mm_set1_epi8(mime ? '_' : '=');
+	for (; n - done >= 16; done += 16) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done));
+		unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+		                    _mm_cmpeq_epi8(v, _mm_set1_epi8('=')),
+		                    _mm_cmpeq_epi8(v, us)));
+		if (mask != 0)
+			return done + __builtin_ctz(mask);
+	}
+	return done;
+}
+#endif
+
+static void b64enc_scalar(const uint8_t *in, size_t n, char *out)
+{
+	for (; n >= 3; n -= 3, in += 3) {
+		*out++ = basis_64[in[0] >> 2];
+		*out++ = basis_64[((in[0] << 4) & 0x30) | (in[1] >> 4)];
+		*out++ = basis_64[((in[1] << 2) & 0x3c) | (in[2] >> 6)];
+		*out++ = basis_64[in[2] & 0x3f];
+	}
+}
+
+/* Encodes @n octets (a multiple of 3) without padding or line breaks. */
+static void b64enc_block(const uint8_t *in, size_t n, char *out)
+{
+	size_t done = 0;
+#ifdef GX_CODEC_X86
+	if (g_codec_isa >= CODEC_AVX2)
+		done = b64enc_avx2(in, n, out);
+	else if (g_codec_isa >= CODEC_SSE4)
+		done = b64enc_sse4(in, n, out);
+#endif
+	b64enc_scalar(in + done, n - done, out + done / 3 * 4);
+}
+
+static inline bool b64dec_quad(const char *in, uint8_t *out)
+{
+	auto a = reinterpret_cast<const uint8_t *>(in);
+	if ((a[0] | a[1] | a[2] | a[3]) & 0x80)
+		return false;
+	int c1 = index_64[a[0]], c2 = index_64[a[1]];
+	int c3 = index_64[a[2]], c4 = index_64[a[3]];
+	if ((c1 | c2 | c3 | c4) < 0)
+		return false;
+	out[0] = (c1 << 2) | (c2 >> 4);
+	out[1] = (c2 << 4) | (c3 >> 2);
+	out[2] = (c3 << 6) | c4;
+	return true;
+}
+
+/*
+ * Decodes the leading whole quads of pure base64 alphabet (no padding or
+ * junk), stepping over CRLF between quads if @crlf. Returns the characters
+ * consumed; *@outlen receives the octets produced.
+ */
+static size_t b64dec_bulk(const char *in, size_t n, uint8_t *out,
+    size_t *outlen, bool crlf)
+{
+	size_t done = 0, olen = 0;
+	while (true) {
+		size_t k = 0;
+#ifdef GX_CODEC_X86
+		if (g_codec_isa >= CODEC_AVX2)
+			k = b64dec_avx2(in + done, n - done, out + olen);
+		else if (g_codec_isa >= CODEC_SSE4)
+			k = b64dec_sse4(in + done, n - done, out + olen);
+#endif
+		done += k;
+		olen += k / 4 * 3;
+		while (n - done >= 4 && b64dec_quad(in + done, out + olen)) {
+			done += 4;
+			olen += 3;
+		}
+		if (!crlf || n - done < 2 || in[done] != '\r' || in[done+1] != '\n')
+			break;
+		done += 2;
+	}
+	*outlen = olen;
+	return done;
+}
+
+static size_t qp_literal_run(const char *in, size_t n)
+{
+	size_t done = 0;
+#ifdef GX_CODEC_X86
+	if (g_codec_isa >= CODEC_SSE4)
+		done = qp_literal_run_sse(in, n);
+#endif
+	for (; done < n; ++done) {
+		unsigned char ch = in[done];
+		if (ch < 32 || ch > 126 || ch == '=' ||
+		    (ch == ' ' && (done + 1 == n || in[done+1] == '\r')))
+			break;
+	}
+	return done;
+}
+
+static size_t qp_plain_run(const char *in, size_t n, bool mime)
+{
+	if (!mime) {
+		/* libc's memchr is vectorized already */
+		auto p = static_cast<const char *>(memchr(in, '=', n));
+		return p != nullptr ? p - in : n;
+	}
+	size_t done = 0;
+#ifdef GX_CODEC_X86
+	if (g_codec_isa >= CODEC_SSE4)
+		done = qp_plain_run_sse(in, n, mime);
+#endif
+	for (; done < n && in[done] != '=' && in[done] != '_'; ++done)
+		;
+	return done;
+}
+
 
 int encode64(const void *vin, size_t inlen, char *out,
     size_t outmax, size_t *outlen)
@@ -890,15 +1484,11 @@ int encode64(const void *vin, size_t inlen, char *out,
 	  return BUFOVER;
 
 	/* Do the work... */
-	while (inlen >= 3) {
-	  /* user provided max buffer size; make sure we don't go over it */
-		*out++ = basis_64[in[0] >> 2];
-		*out++ = basis_64[((in[0] << 4) & 0x30) | (in[1] >> 4)];
-		*out++ = basis_64[((in[1] << 2) & 0x3c) | (in[2] >> 6)];
-		*out++ = basis_64[in[2] & 0x3f];
-		in += 3;
-		inlen -= 3;
-	}
+	auto bulk = inlen / 3 * 3;
+	b64enc_block(in, bulk, out);
+	in += bulk;
+	out += bulk / 3 * 4;
+	inlen -= bulk;
 	if (inlen > 0) {
 	  /* user provided max buffer size; make sure we don't go over it */
 		*out++ = basis_64[in[0] >> 2];
@@ -928,8 +1518,10 @@ int decode64(const char *in, size_t inlen, void *vout, size_t *outlen)
 	if (in[0] == '+' && in[1] == ' ') in += 2;
 	if (*in == '\r') return FAIL;
 
-	for (lup=0;lup<inlen/4;lup++)
-	{
+	lup = b64dec_bulk(in, inlen / 4 * 4, out, &len, false);
+	in += lup;
+	out += len;
+	for (lup /= 4; lup < inlen / 4; ++lup) {
 		c1 = in[0];
 		if (CHAR64(c1) == -1) return FAIL;
 		c2 = in[1];
@@ -1001,8 +1593,7 @@ int encode64_ex(const void *vin, size_t inlen, char *_out,
 	size_t outsize = (inLen+2)/3*4;		/* 3:4 conversion ratio */
 	size_t inpos  = 0;
 	size_t outPos = 0;
-	int c1, c2, c3;
-	int lineLen = 0;
+	int c1, c2;
 	const char* cp;
 	
 	if (!_in || !_out || !outlen) {
@@ -1012,24 +1603,21 @@ int encode64_ex(const void *vin, size_t inlen, char *_out,
 	if (outmax < outsize) {
 		return -1;
 	}
-	/* Get three characters at a time and encode them. */
-	for (i=0; i < inLen/3; ++i) {
-		c1 = _in[inpos++] & 0xFF;
-		c2 = _in[inpos++] & 0xFF;
-		c3 = _in[inpos++] & 0xFF;
-		out[outPos++] = base64tab[(c1 & 0xFC) >> 2];
-		out[outPos++] = base64tab[((c1 & 0x03) << 4) | ((c2 & 0xF0) >> 4)];
-		out[outPos++] = base64tab[((c2 & 0x0F) << 2) | ((c3 & 0xC0) >> 6)];
-		out[outPos++] = base64tab[c3 & 0x3F];
-		lineLen += 4;
-		if (lineLen >= MAXLINE-3) {
-			const char *cq = DW_EOL;
-			out[outPos++] = *cq++;
-			if (*cq != '\0')
-				out[outPos++] = *cq;
-			lineLen = 0;
-		}
+	/*
+	 * Get three characters at a time and encode them. A line is complete
+	 * once it reaches MAXLINE-3, i.e. after 19 quads from 57 octets.
+	 */
+	static constexpr size_t line_in = (MAXLINE - 3 + 3) / 4 * 3;
+	for (; inLen - inpos >= line_in; inpos += line_in) {
+		b64enc_block(&_in[inpos], line_in, &out[outPos]);
+		outPos += line_in / 3 * 4;
+		for (cp = DW_EOL; *cp != '\0'; ++cp)
+			out[outPos++] = *cp;
 	}
+	i = (inLen - inpos) / 3 * 3;
+	b64enc_block(&_in[inpos], i, &out[outPos]);
+	inpos += i;
+	outPos += i / 3 * 4;
 	/* Encode the remaining one or two characters. */
 	switch (inLen % 3) {
 	case 0:
@@ -1096,6 +1684,11 @@ int decode64_ex(const char *_in, size_t inlen, void *vout,
 		return -1;
 	}
 	while (inpos < inLen) {
+		size_t olen = 0;
+		inpos += b64dec_bulk(&_in[inpos], inLen - inpos, &out[outPos], &olen, true);
+		outPos += olen;
+		if (inpos >= inLen)
+			break;
 		a1 = a2 = a3 = a4 = 0;
 		while (inpos < inLen) {
 			a1 = _in[inpos++] & 0xFF;
@@ -1203,6 +1796,20 @@ ssize_t qp_encode_ex(void *voutput, size_t outlen, const char *input, size_t len
 	outpos = 0;
 	linelen = 0;
 	while (inpos < length) {
+		/*
+		 * Plain printables in mid-line are copied verbatim, stopping
+		 * short of MAXLINE-3 so no soft break can fall inside the run.
+		 */
+		if (linelen > 0 && linelen < MAXLINE - 4) {
+			auto run = qp_literal_run(&input[inpos],
+			           std::min(length - inpos, MAXLINE - 4 - linelen));
+			memcpy(&output[outpos], &input[inpos], run);
+			inpos += run;
+			outpos += run;
+			linelen += run;
+			if (run > 0)
+				continue;
+		}
 		ch = input[inpos++] & 0xFF;
 		/* '.' at beginning of line (confuses some SMTPs) */
 		if (linelen == 0 && ch == '.') {
@@ -1350,6 +1957,12 @@ size_t qp_decode(void *voutput, const char *input, size_t length,
 	bool mime_mode = qp_flags & QP_MIME_HEADER;
 	size_t i, cnt = 0;
 	for (i = 0; i < length; i++) {
+		auto run = qp_plain_run(&input[i], length - i, mime_mode);
+		memcpy(&output[cnt], &input[i], run);
+		cnt += run;
+		i += run;
+		if (i >= length)
+			break;
 		char c = input[i];
 		switch (c) {
 		case '=':
@@ -1396,7 +2009,11 @@ ssize_t qp_decode_ex(void *voutput, size_t out_len, const char *input,
 	int c;
 	size_t i, cnt = 0;
 	for (i = 0; i < length; i++) {
-
+		auto run = qp_plain_run(&input[i], length - i, false);
+		cnt += run;
+		i += run;
+		if (i >= length)
+			break;
 		c = input[i];
 
 		switch (c) {
@@ -12,6 +12,7 @@
 #include <gromox/defs.h>
 #include <gromox/endian.hpp>
 #include <gromox/fileio.h>
+#include <gromox/scope.hpp>
 #include "cache_queue.h"
 #include "exmdb_local.h"
 #include "net_failure.h"
@@ -327,25 +328,21 @@ static void *mdl_thrwork(void *arg)
 				fprintf(stderr, "W-1554: garbage in %s; review and delete\n", temp_path.c_str());
 				continue;
 			}
-			auto pbuff = static_cast<char *>(malloc(((size - 1) / (64 * 1024) + 1) * 64 * 1024));
-			if (NULL == pbuff) {
-				printf("[exmdb_local]: Failed to allocate memory for %s "
-					"in timer queue thread\n", temp_path.c_str());
+			mapped_file pbuff;
+			auto ret = pbuff.map(fd.get(), sizeof(time_t) + 2 * sizeof(uint32_t), size);
+			if (ret != 0) {
+				printf("[exmdb_local]: cannot map %s in timer queue "
+				       "thread: %s\n", temp_path.c_str(), strerror(ret));
 				continue;
 			}
-			auto rdret = read(fd.get(), pbuff, size);
-			if (rdret < 0 || static_cast<size_t>(rdret) != size) {
-				free(pbuff);
-				printf("[exmdb_local]: partial read from %s\n", temp_path.c_str());
-				continue;
-			}
-			if (!pcontext->pmail->retrieve(pbuff, mess_len)) {
-				free(pbuff);
+			/* pmail points into pbuff; let go of it before the unmap */
+			auto cl_mail = make_scope_exit([&]() { pcontext->pmail->clear(); });
+			if (!pcontext->pmail->retrieve(pbuff.data(), mess_len)) {
 				printf("[exmdb_local]: failed to retrieve message %s in "
 				       "cache queue into mail object\n", temp_path.c_str());
 				continue;
 			}
-			ptr = pbuff + mess_len; /* to hell with this bullcrap */
+			ptr = pbuff.data() + mess_len; /* to hell with this bullcrap */
 			size -= mess_len;
 			if (size < sizeof(uint32_t)) {
 				fprintf(stderr, "W-1555: garbage in %s; review and delete\n", temp_path.c_str());
@@ -483,7 +480,6 @@ static void *mdl_thrwork(void *arg)
 					}
 				}
 			}
-			free(pbuff);
 		}
 		time(&scan_end);
 		if (scan_end - scan_begin >= g_scan_interval) {
@@ -2,6 +2,8 @@
 #define DECLARE_SVC_API_STATIC
 #include <csignal>
 #include <cstdint>
+#include <memory>
+#include <new>
 #include <string>
 #include <libHX/string.h>
 #include <gromox/atomic.hpp>
@@ -38,6 +40,15 @@ struct BACK_CONN {
     int sockd;
 };
 
+/*
+ * Receive buffer that persists across read_line calls, since the server
+ * may put several lines (e.g. a BATCH frame) into one segment.
+ */
+struct LINE_BUF {
+	char data[MAX_CMD_LENGTH];
+	int offset;
+};
+
 }
 
 using EVENT_STUB_FUNC = void (*)(char *);
@@ -49,8 +60,8 @@ static DOUBLE_LIST g_back_list;
 static EVENT_STUB_FUNC g_event_stub_func;
 
 static void *evst_thrwork(void *);
-static int read_line(int sockd, char *buff, int length);
-static int connect_event();
+static int read_line(int sockd, LINE_BUF &, char *buff, int length);
+static int connect_event(LINE_BUF &, bool &batch);
 static void install_event_stub(EVENT_STUB_FUNC event_stub_func);
 
 static BOOL svc_event_stub(int reason, void **ppdata)
@@ -163,52 +174,65 @@ static BOOL svc_event_stub(int reason, void **ppdata)
 }
 SVC_ENTRY(svc_event_stub);
 
-static int read_line(int sockd, char *buff, int length)
+static int read_line(int sockd, LINE_BUF &lb, char *buff, int length)
 {
-	int offset;
 	int tv_usec;
 	int read_len;
 	struct pollfd pfd_read;
 
-	offset = 0;
 	while (1) {
+		auto end = static_cast<char *>(memmem(lb.data, lb.offset, "\r\n", 2));
+		if (end != nullptr) {
+			int len = end - lb.data;
+			if (len >= length)
+				return -1;
+			memcpy(buff, lb.data, len);
+			buff[len] = '\0';
+			lb.offset -= len + 2;
+			memmove(lb.data, end + 2, lb.offset);
+			return 0;
+		}
+		if (lb.offset == static_cast<int>(arsizeof(lb.data)))
+			return -1;
 		tv_usec = SOCKET_TIMEOUT * 1000000;
 		pfd_read.fd = sockd;
 		pfd_read.events = POLLIN|POLLPRI;
 		if (1 != poll(&pfd_read, 1, tv_usec)) {
 			return -1;
 		}
-		read_len = read(sockd, buff + offset, length - offset);
+		read_len = read(sockd, lb.data + lb.offset,
+		           arsizeof(lb.data) - lb.offset);
 		if (read_len <= 0) {
 			return -1;
 		}
-		offset += read_len;
-		if (offset >= 2 &&
-			'\r' == buff[offset - 2] && '\n' == buff[offset - 1]) {
-			buff[offset - 2] = '\0';
-			return 0;
-		}
-		if (length == offset) {
-			return -1;
-		}
+		lb.offset += read_len;
 	}
 }
 
 
-static int connect_event()
+static int connect_event(LINE_BUF &lb, bool &batch)
 {
     char temp_buff[1024];
+	lb.offset = 0;
 	int sockd = gx_inet_connect(g_event_ip, g_event_port, 0);
 	if (sockd < 0) {
 		fprintf(stderr, "gx_inet_connect event_stub@[%s]:%hu: %s\n",
 		        g_event_ip, g_event_port, strerror(-sockd));
 		return -1;
 	}
-	if (-1 == read_line(sockd, temp_buff, 1024) ||
+	if (-1 == read_line(sockd, lb, temp_buff, 1024) ||
 		0 != strcasecmp(temp_buff, "OK")) {
         close(sockd);
         return -1;
 	}
+
+	/* Older servers answer FALSE; stay with one line per ack then. */
+	if (write(sockd, "CAPA BATCH\r\n", 12) != 12 ||
+	    read_line(sockd, lb, temp_buff, 1024) != 0) {
+		close(sockd);
+		return -1;
+	}
+	batch = strcasecmp(temp_buff, "TRUE") == 0;
 	
 	auto temp_len = gx_snprintf(temp_buff, arsizeof(temp_buff), "LISTEN %s:%d\r\n",
 				get_host_ID(), getpid());
@@ -217,7 +241,7 @@ static int connect_event()
 		return -1;
 	}
 
-	if (-1 == read_line(sockd, temp_buff, 1024) ||
+	if (-1 == read_line(sockd, lb, temp_buff, 1024) ||
 		0 != strcasecmp(temp_buff, "TRUE")) {
 		close(sockd);
 		return -1;
@@ -229,30 +253,57 @@ static int connect_event()
 static void *evst_thrwork(void *param)
 {
 	BACK_CONN *pback;
-	char buff[MAX_CMD_LENGTH];	
-	
+	bool batch = false;
+	std::unique_ptr<LINE_BUF> lb;
+	std::unique_ptr<char[]> buff;
+
+	try {
+		lb = std::make_unique<LINE_BUF>();
+		buff = std::make_unique<char[]>(MAX_CMD_LENGTH);
+	} catch (const std::bad_alloc &) {
+		fprintf(stderr, "[event_stub]: ENOMEM\n");
+		return nullptr;
+	}
 	pback = (BACK_CONN*)param;
 
 	while (!g_notify_stop) {
-		if (-1 == (pback->sockd = connect_event())) {
+		if (-1 == (pback->sockd = connect_event(*lb, batch))) {
 			sleep(3);
 			continue;
 		}
 
 		while (!g_notify_stop) {
-			if (-1 == read_line(pback->sockd, buff, MAX_CMD_LENGTH)) {
+			if (-1 == read_line(pback->sockd, *lb, buff.get(), MAX_CMD_LENGTH)) {
 				close(pback->sockd);
 				pback->sockd = -1;
 				break;
 			}
 		
-			if (0 == strcasecmp(buff, "PING")) {
+			if (0 == strcasecmp(buff.get(), "PING")) {
 				write(pback->sockd, "TRUE\r\n", 6);
 				continue;
 			}
 
-			if (NULL != g_event_stub_func) {
-				g_event_stub_func(buff);
+			/* "BATCH <n>" is followed by n notification lines, acked once */
+			int count = 1;
+			bool ok = true;
+			if (batch && strncasecmp(buff.get(), "BATCH ", 6) == 0) {
+				count = strtol(buff.get() + 6, nullptr, 0);
+				ok = count > 0 && read_line(pback->sockd, *lb,
+				     buff.get(), MAX_CMD_LENGTH) == 0;
+			}
+			for (int i = 0; ok && i < count; ) {
+				if (NULL != g_event_stub_func) {
+					g_event_stub_func(buff.get());
+				}
+				if (++i < count)
+					ok = read_line(pback->sockd, *lb, buff.get(),
+					     MAX_CMD_LENGTH) == 0;
+			}
+			if (!ok) {
+				close(pback->sockd);
+				pback->sockd = -1;
+				break;
 			}
 			
 			write(pback->sockd, "TRUE\r\n", 6);
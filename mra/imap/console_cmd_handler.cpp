@@ -31,6 +31,8 @@ static char g_imap_parser_help[] =
 	"250 IMAP DAEMON imap control help information:\r\n"
 	"\timap info\r\n"
 	"\t    --print the imap parser info\r\n"
+	"\timap memory\r\n"
+	"\t    --print the memory used by imap contexts\r\n"
 	"\timap set time-out <interval>\r\n"
 	"\t    --set time-out of imap connection\r\n"
 	"\timap set autologout-time <interval>\r\n"
@@ -113,6 +115,30 @@ BOOL cmd_handler_imap_control(int argc, char** argv)
 			necessary_tls == FALSE ? "FALSE" : "TRUE");
 		return TRUE;
 	}
+	if (2 == argc && 0 == strcmp(argv[1], "memory")) {
+		IMAP_MEMINFO mi;
+		char str_ctx[32], str_small[32], str_large[32], str_total[32], str_aver[32];
+		imap_parser_get_meminfo(&mi);
+		size_t fixed = mi.context_num * mi.context_size;
+		size_t bufs = (mi.small_used + mi.small_spare) * mi.small_size +
+		              (mi.large_used + mi.large_spare) * mi.large_size;
+		bytetoa(mi.context_size, str_ctx);
+		bytetoa(mi.small_size, str_small);
+		bytetoa(mi.large_size, str_large);
+		bytetoa(fixed + bufs, str_total);
+		bytetoa(mi.context_num == 0 ? 0 : (fixed + bufs) / mi.context_num, str_aver);
+		console_server_reply_to_client("250 imap memory information:\r\n"
+			"\tcontexts                             %zu\r\n"
+			"\tsize of context                      %s\r\n"
+			"\t%-8s buffers in use/spare         %zu/%zu\r\n"
+			"\t%-8s buffers in use/spare         %zu/%zu\r\n"
+			"\ttotal memory                         %s\r\n"
+			"\taverage memory per context           %s",
+			mi.context_num, str_ctx, str_small, mi.small_used,
+			mi.small_spare, str_large, mi.large_used, mi.large_spare,
+			str_total, str_aver);
+		return TRUE;
+	}
 	if (argc < 4) {
 		console_server_reply_to_client("550 too few arguments");
 		return TRUE;
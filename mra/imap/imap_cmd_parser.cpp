@@ -1032,74 +1032,64 @@ static void imap_cmd_parser_process_fetch_item(IMAP_CONTEXT *pcontext,
 	}
 }
 
-static void imap_cmd_parser_store_flags(const char *cmd, const char *mid,
-	int id, unsigned int uid, int flag_bits, IMAP_CONTEXT *pcontext)
+/*
+ * Apply a STORE to all of pxarray with one midb command per batch, then
+ * queue the untagged FETCH responses so that they leave together with
+ * the tagged reply.
+ */
+static int imap_cmd_parser_store_flags(const char *cmd, XARRAY *pxarray,
+	int flag_bits, BOOL b_uid, IMAP_CONTEXT *pcontext)
 {
 	int errnum;
+	int set_bits = 0, unset_bits = 0;
 	char buff[1024];
 	int string_length;
 	char flags_string[128];
 	
-	string_length = 0;
-	if (0 == strcasecmp(cmd, "FLAGS") ||
-		0 == strcasecmp(cmd, "FLAGS.SILENT")) {
-		system_services_unset_flags(pcontext->maildir,
-			pcontext->selected_folder, mid, FLAG_ANSWERED|
-			FLAG_FLAGGED|FLAG_DELETED|FLAG_SEEN|FLAG_DRAFT, &errnum);
-		system_services_set_flags(pcontext->maildir,
-			pcontext->selected_folder, mid, flag_bits, &errnum);
-		if (0 == strcasecmp(cmd, "FLAGS")) {
-			imap_cmd_parser_convert_flags_string(flag_bits, flags_string);
-			if (0 != uid) {
-				string_length = gx_snprintf(buff, arsizeof(buff),
-					"* %d FETCH (FLAGS %s UID %d)\r\n",
-					id, flags_string, uid);
-			} else {
-				string_length = gx_snprintf(buff, arsizeof(buff),
-					"* %d FETCH (FLAGS %s)\r\n",
-					id, flags_string);
-			}
-		}
-	} else if (0 == strcasecmp(cmd, "+FLAGS") ||
-		0 == strcasecmp(cmd, "+FLAGS.SILENT")) {
-		system_services_set_flags(pcontext->maildir,
-		pcontext->selected_folder, mid, flag_bits, &errnum);
-		if (0 == strcasecmp(cmd, "+FLAGS") && 
-			MIDB_RESULT_OK == system_services_get_flags(pcontext->maildir,
-		    pcontext->selected_folder, mid, &flag_bits, &errnum)) {
-			imap_cmd_parser_convert_flags_string(flag_bits, flags_string);
-			if (0 != uid) {
-				string_length = gx_snprintf(buff, arsizeof(buff),
-					"* %d FETCH (FLAGS %s UID %d)\r\n",
-					id, flags_string, uid);
-			} else {
-				string_length = gx_snprintf(buff, arsizeof(buff),
-					"* %d FETCH (FLAGS %s)\r\n",
-					id, flags_string);
-			}
+	if ('+' == cmd[0]) {
+		set_bits = flag_bits;
+	} else if ('-' == cmd[0]) {
+		unset_bits = flag_bits;
+	} else {
+		unset_bits = FLAG_ANSWERED | FLAG_FLAGGED | FLAG_DELETED |
+		             FLAG_SEEN | FLAG_DRAFT;
+		set_bits = flag_bits;
+	}
+	switch (system_services_store_flags(pcontext->maildir,
+	        pcontext->selected_folder, pxarray, set_bits, unset_bits,
+	        &errnum)) {
+	case MIDB_RESULT_OK:
+		break;
+	case MIDB_NO_SERVER:
+		return 1905;
+	case MIDB_RDWR_ERROR:
+		return 1906;
+	default:
+		return static_cast<uint16_t>(errnum) | DISPATCH_MIDB;
+	}
+	bool b_silent = strchr(cmd, '.') != nullptr;
+	auto num = xarray_get_capacity(pxarray);
+	for (size_t i = 0; i < num; ++i) {
+		auto pitem = static_cast<MITEM *>(xarray_get_item(pxarray, i));
+		if ('\0' == pitem->mid[0]) {
+			continue;
 		}
-	} else if (0 == strcasecmp(cmd, "-FLAGS") ||
-		0 == strcasecmp(cmd, "-FLAGS.SILENT")) {
-		system_services_unset_flags(pcontext->maildir,
-			pcontext->selected_folder, mid, flag_bits, &errnum);
-		if (0 == strcasecmp(cmd, "-FLAGS") &&
-			MIDB_RESULT_OK == system_services_get_flags(pcontext->maildir,
-		    pcontext->selected_folder, mid, &flag_bits, &errnum)) {
-			imap_cmd_parser_convert_flags_string(flag_bits, flags_string);
-			if (0 != uid) {
+		if (!b_silent) {
+			imap_cmd_parser_convert_flags_string(pitem->flag_bits, flags_string);
+			if (b_uid) {
 				string_length = gx_snprintf(buff, arsizeof(buff),
 					"* %d FETCH (FLAGS %s UID %d)\r\n",
-					id, flags_string, uid);
+					pitem->id, flags_string, pitem->uid);
 			} else {
 				string_length = gx_snprintf(buff, arsizeof(buff),
 					"* %d FETCH (FLAGS %s)\r\n",
-					id, flags_string);
+					pitem->id, flags_string);
 			}
+			imap_parser_queue_write(pcontext, buff, string_length);
 		}
+		imap_parser_modify_flags(pcontext, pitem->mid);
 	}
-	if (0 != string_length) {
-		imap_parser_safe_write(pcontext, buff, string_length);
-	}
+	return 0;
 }
 
 static BOOL imap_cmd_parser_convert_imaptime(const char *str_time, time_t *ptime)
@@ -2708,27 +2698,15 @@ static int imap_cmd_parser_append_end2(int argc, char **argv, IMAP_CONTEXT *pcon
 	char *str_internal;
 	char flag_buff[16];
 	char temp_name[1024];
-	struct stat node_stat;
 	char buff[1024];
 	
 	b_answered = FALSE;
 	b_flagged = FALSE;
 	b_seen = FALSE;
 	b_draft = FALSE;
-	if (0 != fstat(pcontext->message_fd, &node_stat)) {
-		close(pcontext->message_fd);
-		if (remove(pcontext->file_path.c_str()) < 0 && errno != ENOENT)
-			fprintf(stderr, "W-1342: remove %s: %s\n",
-				pcontext->file_path.c_str(), strerror(errno));
-		pcontext->message_fd = -1;
-		pcontext->mid.clear();
-		pcontext->file_path.clear();
-		return 1909 | DISPATCH_TAG;
-	}
-	lseek(pcontext->message_fd, 0, SEEK_SET);
-	std::unique_ptr<char[], stdlib_delete> pbuff(static_cast<char *>(malloc(((node_stat.st_size - 1) / (64 * 1024) + 1) * 64 * 1024)));
-	if (pbuff == nullptr || read(pcontext->message_fd, pbuff.get(),
-	    node_stat.st_size) != node_stat.st_size) {
+	mapped_file pbuff;
+	auto ret = pbuff.map(pcontext->message_fd);
+	if (ret != 0 || pbuff.size() < sizeof(tmp_len)) {
 		pbuff.reset();
 		close(pcontext->message_fd);
 		if (remove(pcontext->file_path.c_str()) < 0 && errno != ENOENT)
@@ -2741,9 +2719,10 @@ static int imap_cmd_parser_append_end2(int argc, char **argv, IMAP_CONTEXT *pcon
 	}
 	close(pcontext->message_fd);
 	pcontext->message_fd = -1;
-	memcpy(&tmp_len, pbuff.get(), sizeof(tmp_len));
+	memcpy(&tmp_len, pbuff.data(), sizeof(tmp_len));
 	MAIL imail(imap_parser_get_mpool());
-	if (!imail.retrieve(pbuff.get() + tmp_len, node_stat.st_size - tmp_len)) {
+	if (tmp_len < 0 || static_cast<size_t>(tmp_len) > pbuff.size() ||
+	    !imail.retrieve(pbuff.data() + tmp_len, pbuff.size() - tmp_len)) {
 		imail.clear();
 		pbuff.reset();
 		if (remove(pcontext->file_path.c_str()) < 0 && errno != ENOENT)
@@ -2753,7 +2732,7 @@ static int imap_cmd_parser_append_end2(int argc, char **argv, IMAP_CONTEXT *pcon
 		pcontext->file_path.clear();
 		return 1909;
 	}
-	auto str_name = pbuff.get() + sizeof(uint32_t);
+	auto str_name = pbuff.data() + sizeof(uint32_t);
 	name_len = strlen(str_name);
 	str_flags = str_name + name_len + 1;
 	flags_len = strlen(str_flags);
@@ -3125,7 +3104,11 @@ int imap_cmd_parser_fetch(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	pcontext->write_length = 0;
 	pcontext->write_offset = 0;
 	if (TRUE == b_data) {
-		pcontext->write_buff = pcontext->command_buffer;
+		pcontext->write_buff = imap_parser_wrdat_buffer(pcontext);
+		if (pcontext->write_buff == nullptr) {
+			pcontext->stream.clear();
+			return 1809;
+		}
 		pcontext->sched_stat = SCHED_STAT_WRDAT;
 	} else {
 		pcontext->sched_stat = SCHED_STAT_WRLST;
@@ -3139,8 +3122,7 @@ int imap_cmd_parser_store(int argc, char **argv, IMAP_CONTEXT *pcontext)
 {
 	int errnum;
 	int result;
-	int i, num;
-	MITEM *pitem;
+	int i;
 	XARRAY xarray;
 	int flag_bits;
 	int temp_argc;
@@ -3207,14 +3189,11 @@ int imap_cmd_parser_store(int argc, char **argv, IMAP_CONTEXT *pcontext)
 		return static_cast<uint16_t>(errnum) | DISPATCH_MIDB;
 	}
 	}
-	num = xarray_get_capacity(&xarray);
-	for (i=0; i<num; i++) {
-		pitem = (MITEM*)xarray_get_item(&xarray, i);
-		imap_cmd_parser_store_flags(argv[3], pitem->mid,
-			pitem->id, 0, flag_bits, pcontext);
-		imap_parser_modify_flags(pcontext, pitem->mid);
-	}
+	result = imap_cmd_parser_store_flags(argv[3], &xarray,
+	         flag_bits, FALSE, pcontext);
 	xarray_free(&xarray);
+	if (result != 0)
+		return result;
 	imap_parser_echo_modify(pcontext, NULL);
 	return 1721;
 }
@@ -3489,7 +3468,11 @@ int imap_cmd_parser_uid_fetch(int argc, char **argv, IMAP_CONTEXT *pcontext)
 	pcontext->write_length = 0;
 	pcontext->write_offset = 0;
 	if (TRUE == b_data) {
-		pcontext->write_buff = pcontext->command_buffer;
+		pcontext->write_buff = imap_parser_wrdat_buffer(pcontext);
+		if (pcontext->write_buff == nullptr) {
+			pcontext->stream.clear();
+			return 1809;
+		}
 		pcontext->sched_stat = SCHED_STAT_WRDAT;
 	} else {
 		pcontext->sched_stat = SCHED_STAT_WRLST;
@@ -3502,11 +3485,9 @@ int imap_cmd_parser_uid_fetch(int argc, char **argv, IMAP_CONTEXT *pcontext)
 
 int imap_cmd_parser_uid_store(int argc, char **argv, IMAP_CONTEXT *pcontext)
 {
-	int num;
 	int errnum;
 	int i;
 	int result;
-	MITEM *pitem;
 	XARRAY xarray;
 	int flag_bits;
 	int temp_argc;
@@ -3573,14 +3554,11 @@ int imap_cmd_parser_uid_store(int argc, char **argv, IMAP_CONTEXT *pcontext)
 		return static_cast<uint16_t>(errnum) | DISPATCH_MIDB;
 	}
 	}
-	num = xarray_get_capacity(&xarray);
-	for (i=0; i<num; i++) {
-		pitem = (MITEM*)xarray_get_item(&xarray, i);
-		imap_cmd_parser_store_flags(argv[4], pitem->mid,
-			pitem->id, pitem->uid, flag_bits, pcontext);
-		imap_parser_modify_flags(pcontext, pitem->mid);
-	}
+	result = imap_cmd_parser_store_flags(argv[4], &xarray,
+	         flag_bits, TRUE, pcontext);
 	xarray_free(&xarray);
+	if (result != 0)
+		return result;
 	imap_parser_echo_modify(pcontext, NULL);
 	return 1724;
 }
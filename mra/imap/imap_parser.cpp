@@ -2,10 +2,12 @@
 /* imap parser is a module, which first read data from socket, parses the imap 
  * commands and then do the corresponding action. 
  */ 
+#include <algorithm>
 #include <atomic>
 #include <cerrno>
 #include <climits>
 #include <csignal>
+#include <cstdlib>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -35,6 +37,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <openssl/err.h>
 #include "dir_tree.hpp"
 #if (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x2090000fL) || \
@@ -54,9 +57,29 @@
 
 #define SELECT_INTERVAL			20*60
 
+/* capacity of the small command/read buffer class */
+#define SMALL_BUFFER_SIZE		4096
+
 using namespace std::string_literals;
 using namespace gromox;
 
+namespace {
+
+/*
+ * Free list for one size class of context buffers. Idle connections hold
+ * no buffer at all, short commands live in the small class, and only long
+ * command lines, literals and FETCH data get a MAX_LINE_LENGTH buffer.
+ */
+struct buffer_class {
+	const size_t size;
+	std::mutex lock;
+	std::vector<char *> spare;
+	size_t max_spare = 0;
+	std::atomic<size_t> used{0};
+};
+
+}
+
 static void *imps_thrwork(void *);
 static void *imps_scanwork(void *);
 static void imap_parser_event_proc(char *event);
@@ -99,6 +122,12 @@ static char g_private_key_path[256];
 static char g_certificate_passwd[1024];
 static SSL_CTX *g_ssl_ctx;
 static std::unique_ptr<std::mutex[]> g_ssl_mutex_buf;
+static buffer_class g_small_bufs{SMALL_BUFFER_SIZE}, g_large_bufs{MAX_LINE_LENGTH};
+
+static inline struct iovec imap_iov(const void *base, size_t len)
+{
+	return {const_cast<void *>(base), len};
+}
 
 LIB_BUFFER* imap_parser_get_xpool()
 {
@@ -110,6 +139,142 @@ LIB_BUFFER* imap_parser_get_dpool()
 	return g_alloc_dir;
 }
 
+static char *imap_parser_buf_get(buffer_class &bc)
+{
+	char *buf = nullptr;
+	std::unique_lock hold(bc.lock);
+	if (!bc.spare.empty()) {
+		buf = bc.spare.back();
+		bc.spare.pop_back();
+	}
+	hold.unlock();
+	if (buf == nullptr)
+		buf = static_cast<char *>(malloc(bc.size));
+	if (buf != nullptr)
+		++bc.used;
+	return buf;
+}
+
+static void imap_parser_buf_put(char *buf, size_t size)
+{
+	if (buf == nullptr)
+		return;
+	auto &bc = size == g_small_bufs.size ? g_small_bufs : g_large_bufs;
+	--bc.used;
+	std::unique_lock hold(bc.lock);
+	if (bc.spare.size() < bc.max_spare) {
+		/* capacity was reserved in imap_parser_run, cannot throw */
+		bc.spare.push_back(buf);
+		return;
+	}
+	hold.unlock();
+	free(buf);
+}
+
+static void imap_parser_buf_drain(buffer_class &bc)
+{
+	std::lock_guard hold(bc.lock);
+	for (auto buf : bc.spare)
+		free(buf);
+	bc.spare.clear();
+}
+
+/*
+ * Make sure @buf can hold @need bytes. When a bigger class is needed, the
+ * first @used bytes are carried over into the new buffer.
+ */
+static bool imap_parser_buf_reserve(char *&buf, unsigned int &size,
+    size_t used, size_t need)
+{
+	if (need <= size)
+		return true;
+	if (need > MAX_LINE_LENGTH)
+		return false;
+	auto &bc = need <= SMALL_BUFFER_SIZE ? g_small_bufs : g_large_bufs;
+	auto nbuf = imap_parser_buf_get(bc);
+	if (nbuf == nullptr)
+		return false;
+	if (used > 0)
+		memcpy(nbuf, buf, used);
+	imap_parser_buf_put(buf, size);
+	buf = nbuf;
+	size = bc.size;
+	return true;
+}
+
+static bool imap_parser_reserve_read(IMAP_CONTEXT *pcontext, size_t need)
+{
+	auto old_buffer = pcontext->read_buffer;
+	if (!imap_parser_buf_reserve(pcontext->read_buffer, pcontext->read_size,
+	    pcontext->read_offset, need))
+		return false;
+	if (pcontext->literal_ptr != nullptr)
+		pcontext->literal_ptr = pcontext->read_buffer +
+		                        (pcontext->literal_ptr - old_buffer);
+	return true;
+}
+
+static bool imap_parser_reserve_command(IMAP_CONTEXT *pcontext, size_t need)
+{
+	return imap_parser_buf_reserve(pcontext->command_buffer,
+	       pcontext->command_size, pcontext->command_len, need);
+}
+
+/* command_buffer doubles as the output buffer for FETCH data */
+char *imap_parser_wrdat_buffer(IMAP_CONTEXT *pcontext)
+{
+	return imap_parser_reserve_command(pcontext, MAX_LINE_LENGTH) ?
+	       pcontext->command_buffer : nullptr;
+}
+
+/*
+ * Give buffers without pending data back to the pool, and move a
+ * mostly-empty read buffer down to the small class.
+ */
+static void imap_parser_release_buffers(IMAP_CONTEXT *pcontext)
+{
+	if (pcontext->read_offset == 0 && pcontext->literal_ptr == nullptr) {
+		imap_parser_buf_put(pcontext->read_buffer, pcontext->read_size);
+		pcontext->read_buffer = nullptr;
+		pcontext->read_size = 0;
+	} else if (pcontext->read_size > SMALL_BUFFER_SIZE &&
+	    pcontext->read_offset < SMALL_BUFFER_SIZE) {
+		auto nbuf = imap_parser_buf_get(g_small_bufs);
+		if (nbuf != nullptr) {
+			memcpy(nbuf, pcontext->read_buffer, pcontext->read_offset);
+			if (pcontext->literal_ptr != nullptr)
+				pcontext->literal_ptr = nbuf + (pcontext->literal_ptr -
+				                        pcontext->read_buffer);
+			imap_parser_buf_put(pcontext->read_buffer, pcontext->read_size);
+			pcontext->read_buffer = nbuf;
+			pcontext->read_size = SMALL_BUFFER_SIZE;
+		}
+	}
+	if (pcontext->out_pending.empty())
+		pcontext->out_pending.shrink_to_fit();
+	if (pcontext->command_len == 0 &&
+	    pcontext->write_buff != pcontext->command_buffer) {
+		imap_parser_buf_put(pcontext->command_buffer, pcontext->command_size);
+		pcontext->command_buffer = nullptr;
+		pcontext->command_size = 0;
+	}
+}
+
+void imap_parser_get_meminfo(IMAP_MEMINFO *info)
+{
+	info->context_num  = g_context_num;
+	info->context_size = sizeof(IMAP_CONTEXT);
+	info->small_size   = g_small_bufs.size;
+	info->small_used   = g_small_bufs.used;
+	info->large_size   = g_large_bufs.size;
+	info->large_used   = g_large_bufs.used;
+	std::unique_lock hold(g_small_bufs.lock);
+	info->small_spare = g_small_bufs.spare.size();
+	hold.unlock();
+	hold = std::unique_lock(g_large_bufs.lock);
+	info->large_spare = g_large_bufs.spare.size();
+}
+
 void imap_parser_init(int context_num, int average_num, size_t cache_size,
 	unsigned int timeout, unsigned int autologout_time, int max_auth_times,
 	int block_auth_fail, BOOL support_starttls, BOOL force_starttls,
@@ -173,6 +338,10 @@ int imap_parser_run()
 			printf("[imap_parser]: Failed to init SSL context\n");
 			return -1;
 		}
+#ifdef SSL_OP_ENABLE_KTLS
+		/* lets FETCH bodies go out via SSL_sendfile */
+		SSL_CTX_set_options(g_ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
 		
 		if ('\0' != g_certificate_passwd[0]) {
 			SSL_CTX_set_default_passwd_cb_userdata(g_ssl_ctx,
@@ -268,6 +437,10 @@ int imap_parser_run()
 	}
 	
 	try {
+		g_small_bufs.max_spare = g_context_num;
+		g_large_bufs.max_spare = std::max(g_context_num / 8, static_cast<size_t>(16));
+		g_small_bufs.spare.reserve(g_small_bufs.max_spare);
+		g_large_bufs.spare.reserve(g_large_bufs.max_spare);
 		g_context_list = std::make_unique<IMAP_CONTEXT[]>(g_context_num);
 		g_context_list2.resize(g_context_num);
 		for (size_t i = 0; i < g_context_num; ++i) {
@@ -316,6 +489,8 @@ void imap_parser_stop()
 	
 	g_context_list2.clear();
 	g_context_list.reset();
+	imap_parser_buf_drain(g_small_bufs);
+	imap_parser_buf_drain(g_large_bufs);
 	if (NULL != g_alloc_file) {
 		lib_buffer_free(g_alloc_file);
 		g_alloc_file = NULL;
@@ -424,10 +599,11 @@ static int ps_stat_stls(IMAP_CONTEXT *pcontext)
 			auto imap_reply_str = resource_get_imap_code(1700, 1, &s1len);
 			auto imap_reply_str2 = resource_get_imap_code(1700, 2, &s2len);
 			auto host_ID = resource_get_string("HOST_ID");
-			SSL_write(pcontext->connection.ssl, "* ", 2);
-			SSL_write(pcontext->connection.ssl, imap_reply_str, s1len);
-			SSL_write(pcontext->connection.ssl, host_ID, strlen(host_ID));
-			SSL_write(pcontext->connection.ssl, imap_reply_str2, s2len);
+			struct iovec iov[] = {imap_iov("* ", 2),
+				imap_iov(imap_reply_str, s1len),
+				imap_iov(host_ID, strlen(host_ID)),
+				imap_iov(imap_reply_str2, s2len)};
+			pcontext->connection.writev(iov, arsizeof(iov));
 		}
 		return PROCESS_CONTINUE;
 	}
@@ -443,8 +619,9 @@ static int ps_stat_stls(IMAP_CONTEXT *pcontext)
 		/* IMAP_CODE_2180011: BAD time out */
 		size_t string_length = 0;
 		auto imap_reply_str = resource_get_imap_code(1811, 1, &string_length);
-		write(pcontext->connection.sockd, "* ", 2);
-		write(pcontext->connection.sockd, imap_reply_str, string_length);
+		/* handshake did not complete, reply in plain text */
+		struct iovec iov[] = {imap_iov("* ", 2), imap_iov(imap_reply_str, string_length)};
+		writev(pcontext->connection.sockd, iov, arsizeof(iov));
 		imap_parser_log_info(pcontext, LV_DEBUG, "time out");
 		SLEEP_BEFORE_CLOSE;
 	}
@@ -473,6 +650,7 @@ static int ps_stat_notifying(IMAP_CONTEXT *pcontext)
 			write(pcontext->connection.sockd, temp_buff, len);
 		}
 	}
+	imap_parser_release_buffers(pcontext);
 	std::unique_lock ll_hold(g_list_lock);
 	double_list_append_as_tail(&g_sleeping_list, &pcontext->sleeping_node);
 	pcontext->sched_stat = SCHED_STAT_IDLING;
@@ -481,13 +659,23 @@ static int ps_stat_notifying(IMAP_CONTEXT *pcontext)
 
 static int ps_stat_rdcmd(IMAP_CONTEXT *pcontext)
 {
+	/* start with a small buffer; grow only when it has filled up */
+	if (static_cast<unsigned int>(pcontext->read_offset) >= pcontext->read_size &&
+	    !imap_parser_reserve_read(pcontext, pcontext->read_size == 0 ?
+	    SMALL_BUFFER_SIZE : MAX_LINE_LENGTH)) {
+		imap_parser_log_info(pcontext, LV_WARN, "out of memory");
+		/* IMAP_CODE_2180009: BAD internal error: fail to get stream buffer */
+		size_t string_length = 0;
+		auto imap_reply_str = resource_get_imap_code(1809, 1, &string_length);
+		return ps_end_processing(pcontext, imap_reply_str, string_length);
+	}
 	ssize_t read_len;
 	if (NULL != pcontext->connection.ssl) {
 		read_len = SSL_read(pcontext->connection.ssl, pcontext->read_buffer +
-		           pcontext->read_offset, 64*1024 - pcontext->read_offset);
+		           pcontext->read_offset, pcontext->read_size - pcontext->read_offset);
 	} else {
 		read_len = read(pcontext->connection.sockd, pcontext->read_buffer +
-		           pcontext->read_offset, 64*1024 - pcontext->read_offset);
+		           pcontext->read_offset, pcontext->read_size - pcontext->read_offset);
 	}
 	struct timeval current_time;
 	gettimeofday(&current_time, NULL);
@@ -505,6 +693,7 @@ static int ps_stat_rdcmd(IMAP_CONTEXT *pcontext)
 			return PROCESS_POLLING_RDONLY;
 		}
 		if (pcontext->proto_stat >= PROTO_STAT_AUTH) {
+			imap_parser_release_buffers(pcontext);
 			std::unique_lock ll_hold(g_list_lock);
 			double_list_append_as_tail(&g_sleeping_list, &pcontext->sleeping_node);
 			return PROCESS_SLEEPING;
@@ -535,18 +724,25 @@ static int ps_literal_checking(IMAP_CONTEXT *pcontext)
 		return PROCESS_CONTINUE;
 	}
 	auto temp_len = pcontext->literal_ptr + pcontext->literal_len - pcontext->read_buffer;
-	if (temp_len <= 0 || temp_len >= 64 * 1024 ||
-	    pcontext->command_len + temp_len >= 64 * 1024) {
+	if (temp_len <= 0 || temp_len >= MAX_LINE_LENGTH ||
+	    pcontext->command_len + temp_len >= MAX_LINE_LENGTH) {
 		/* IMAP_CODE_2180017: BAD literal size too large */
 		size_t string_length = 0;
 		auto imap_reply_str = resource_get_imap_code(1817, 1, &string_length);
 		return ps_end_processing(pcontext, imap_reply_str, string_length);
 	}
+	if (!imap_parser_reserve_command(pcontext, pcontext->command_len + temp_len + 1)) {
+		imap_parser_log_info(pcontext, LV_WARN, "out of memory");
+		/* IMAP_CODE_2180009: BAD internal error: fail to get stream buffer */
+		size_t string_length = 0;
+		auto imap_reply_str = resource_get_imap_code(1809, 1, &string_length);
+		return ps_end_processing(pcontext, imap_reply_str, string_length);
+	}
 	memcpy(pcontext->command_buffer + pcontext->command_len, pcontext->read_buffer,
 		temp_len);
 	pcontext->command_len += temp_len;
 	pcontext->read_offset -= temp_len;
-	if (pcontext->read_offset > 0 && pcontext->read_offset < 64*1024) {
+	if (pcontext->read_offset > 0 && pcontext->read_offset < MAX_LINE_LENGTH) {
 		memmove(pcontext->read_buffer, pcontext->literal_ptr + pcontext->literal_len,
 			pcontext->read_offset);
 	} else {
@@ -579,9 +775,9 @@ static int ps_literal_processing(IMAP_CONTEXT *pcontext)
 		memcpy(temp_buff, pcontext->read_buffer + i + 1, temp_len);
 		temp_buff[temp_len] = '\0';
 		pcontext->literal_len = strtol(temp_buff, nullptr, 0);
-		temp_len = 64 * 1024 - (ptr + 3 - pcontext->read_buffer) -
+		temp_len = MAX_LINE_LENGTH - (ptr + 3 - pcontext->read_buffer) -
 		           pcontext->command_len - 2;
-		if (temp_len <= 0 || temp_len >= 64 * 1024) {
+		if (temp_len <= 0 || temp_len >= MAX_LINE_LENGTH) {
 			imap_parser_log_info(pcontext, LV_WARN, "error in command buffer length");
 			/* IMAP_CODE_2180017: BAD literal size too large */
 			size_t string_length = 0;
@@ -591,7 +787,7 @@ static int ps_literal_processing(IMAP_CONTEXT *pcontext)
 		if (pcontext->literal_len < temp_len) {
 			pcontext->read_offset -= 2;
 			temp_len = pcontext->read_offset - (ptr + 1 - pcontext->read_buffer);
-			if (temp_len > 0 && temp_len < 64 * 1024) {
+			if (temp_len > 0 && temp_len < MAX_LINE_LENGTH) {
 				memmove(ptr + 1, ptr + 3, temp_len);
 			}
 			/* IMAP_CODE_2160003: + ready for additional command text */
@@ -604,6 +800,13 @@ static int ps_literal_processing(IMAP_CONTEXT *pcontext)
 			}
 			return X_LITERAL_CHECKING;
 		}
+		if (!imap_parser_reserve_command(pcontext, pcontext->command_len + i + 1)) {
+			imap_parser_log_info(pcontext, LV_WARN, "out of memory");
+			/* IMAP_CODE_2180009: BAD internal error: fail to get stream buffer */
+			size_t string_length = 0;
+			auto imap_reply_str = resource_get_imap_code(1809, 1, &string_length);
+			return ps_end_processing(pcontext, imap_reply_str, string_length);
+		}
 		memcpy(pcontext->command_buffer + pcontext->command_len,
 		       pcontext->read_buffer, i);
 		pcontext->command_len += i;
@@ -639,7 +842,7 @@ static int ps_literal_processing(IMAP_CONTEXT *pcontext)
 				return ps_end_processing(pcontext);
 			case DISPATCH_BREAK:
 				pcontext->read_offset -= ptr + 3 - pcontext->read_buffer;
-				if (pcontext->read_offset > 0 && pcontext->read_offset < 64*1024) {
+				if (pcontext->read_offset > 0 && pcontext->read_offset < MAX_LINE_LENGTH) {
 					memmove(pcontext->read_buffer, ptr + 3, pcontext->read_offset);
 				} else {
 					pcontext->read_offset = 0;
@@ -654,15 +857,10 @@ static int ps_literal_processing(IMAP_CONTEXT *pcontext)
 		/* IMAP_CODE_2180017: BAD literal size too large */
 		size_t string_length = 0;
 		auto imap_reply_str = resource_get_imap_code(1817, 1, &string_length);
-		if (NULL != pcontext->connection.ssl) {
-			SSL_write(pcontext->connection.ssl, "* ", 2);
-			SSL_write(pcontext->connection.ssl, imap_reply_str, string_length);
-		} else {
-			write(pcontext->connection.sockd, "* ", 2);
-			write(pcontext->connection.sockd, imap_reply_str, string_length);
-		}
+		struct iovec iov[] = {imap_iov("* ", 2), imap_iov(imap_reply_str, string_length)};
+		pcontext->connection.writev(iov, arsizeof(iov));
 		pcontext->read_offset -= (ptr + 3 - pcontext->read_buffer);
-		if (pcontext->read_offset > 0 && pcontext->read_offset < 64*1024) {
+		if (pcontext->read_offset > 0 && pcontext->read_offset < MAX_LINE_LENGTH) {
 			memmove(pcontext->read_buffer, ptr + 3, pcontext->read_offset);
 		} else {
 			pcontext->read_offset = 0;
@@ -682,19 +880,26 @@ static int ps_cmd_processing(IMAP_CONTEXT *pcontext)
 		    pcontext->read_buffer[i+1] != '\n') {
 			continue;
 		}
-		if (i >= 64 * 1024 || pcontext->command_len + i >= 64 * 1024) {
+		if (i >= MAX_LINE_LENGTH || pcontext->command_len + i >= MAX_LINE_LENGTH) {
 			imap_parser_log_info(pcontext, LV_WARN, "error in command buffer length");
 			/* IMAP_CODE_2180017: BAD literal size too large */
 			size_t string_length = 0;
 			auto imap_reply_str = resource_get_imap_code(1817, 1, &string_length);
 			return ps_end_processing(pcontext, imap_reply_str, string_length);
 		}
+		if (!imap_parser_reserve_command(pcontext, pcontext->command_len + i + 1)) {
+			imap_parser_log_info(pcontext, LV_WARN, "out of memory");
+			/* IMAP_CODE_2180009: BAD internal error: fail to get stream buffer */
+			size_t string_length = 0;
+			auto imap_reply_str = resource_get_imap_code(1809, 1, &string_length);
+			return ps_end_processing(pcontext, imap_reply_str, string_length);
+		}
 		memcpy(pcontext->command_buffer + pcontext->command_len,
 		       pcontext->read_buffer, i);
 		pcontext->command_len += i;
 		pcontext->command_buffer[pcontext->command_len] = '\0';
 		pcontext->read_offset -= i + 2;
-		if (pcontext->read_offset > 0 && pcontext->read_offset < 64 * 1024) {
+		if (pcontext->read_offset > 0 && pcontext->read_offset < MAX_LINE_LENGTH) {
 			memmove(pcontext->read_buffer, pcontext->read_buffer + i + 2,
 			        pcontext->read_offset);
 		} else {
@@ -735,15 +940,10 @@ static int ps_cmd_processing(IMAP_CONTEXT *pcontext)
 				}
 				size_t string_length = 0;
 				auto imap_reply_str = resource_get_imap_code(1800, 1, &string_length);
-				if (NULL != pcontext->connection.ssl) {
-					SSL_write(pcontext->connection.ssl, pcontext->tag_string, strlen(pcontext->tag_string));
-					SSL_write(pcontext->connection.ssl, " ", 1);
-					SSL_write(pcontext->connection.ssl, imap_reply_str, string_length);
-				} else {
-					write(pcontext->connection.sockd, pcontext->tag_string, strlen(pcontext->tag_string));
-					write(pcontext->connection.sockd, " ", 1);
-					write(pcontext->connection.sockd, imap_reply_str, string_length);
-				}
+				struct iovec iov[] = {
+					imap_iov(pcontext->tag_string, strlen(pcontext->tag_string)),
+					imap_iov(" ", 1), imap_iov(imap_reply_str, string_length)};
+				pcontext->connection.writev(iov, arsizeof(iov));
 			} else {
 				imap_cmd_parser_append_end(argc, argv, pcontext);
 			}
@@ -767,15 +967,10 @@ static int ps_cmd_processing(IMAP_CONTEXT *pcontext)
 				imap_reply_str = resource_get_imap_code(1727, 1,
 				                 &string_length);
 			}
-			if (NULL != pcontext->connection.ssl) {
-				SSL_write(pcontext->connection.ssl, pcontext->tag_string, strlen(pcontext->tag_string));
-				SSL_write(pcontext->connection.ssl, " ", 1);
-				SSL_write(pcontext->connection.ssl, imap_reply_str, string_length);
-			} else {
-				write(pcontext->connection.sockd, pcontext->tag_string, strlen(pcontext->tag_string));
-				write(pcontext->connection.sockd, " ", 1);
-				write(pcontext->connection.sockd, imap_reply_str, string_length);
-			}
+			struct iovec iov[] = {
+				imap_iov(pcontext->tag_string, strlen(pcontext->tag_string)),
+				imap_iov(" ", 1), imap_iov(imap_reply_str, string_length)};
+			pcontext->connection.writev(iov, arsizeof(iov));
 			pcontext->command_len = 0;
 			return X_LITERAL_PROCESSING;
 		}
@@ -783,25 +978,10 @@ static int ps_cmd_processing(IMAP_CONTEXT *pcontext)
 		if (argc < 2 || strlen(argv[0]) >= 32) {
 			size_t string_length = 0;
 			auto imap_reply_str = resource_get_imap_code(1800, 1, &string_length);
-			if (argc <= 0 || strlen(argv[0]) >= 32) {
-				if (pcontext->connection.ssl != nullptr) {
-					SSL_write(pcontext->connection.ssl, "* ", 2);
-					SSL_write(pcontext->connection.ssl, imap_reply_str, string_length);
-				} else {
-					write(pcontext->connection.sockd, "* ", 2);
-					write(pcontext->connection.sockd, imap_reply_str, string_length);
-				}
-			} else {
-				if (pcontext->connection.ssl != nullptr) {
-					SSL_write(pcontext->connection.ssl, argv[0], strlen(argv[0]));
-					SSL_write(pcontext->connection.ssl, " ", 1);
-					SSL_write(pcontext->connection.ssl, imap_reply_str, string_length);
-				} else {
-					write(pcontext->connection.sockd, argv[0], strlen(argv[0]));
-					write(pcontext->connection.sockd, " ", 1);
-					write(pcontext->connection.sockd, imap_reply_str, string_length);
-				}
-			}
+			auto tag = argc <= 0 || strlen(argv[0]) >= 32 ? "*" : argv[0];
+			struct iovec iov[] = {imap_iov(tag, strlen(tag)),
+				imap_iov(" ", 1), imap_iov(imap_reply_str, string_length)};
+			pcontext->connection.writev(iov, arsizeof(iov));
 			pcontext->command_len = 0;
 			return X_LITERAL_CHECKING;
 		}
@@ -818,7 +998,8 @@ static int ps_cmd_processing(IMAP_CONTEXT *pcontext)
 		}
 	}
 
-	if (64 * 1024 == pcontext->read_offset) {
+	/* the read buffer has grown to its limit without a complete line */
+	if (pcontext->read_offset >= MAX_LINE_LENGTH) {
 		pcontext->read_offset = 0;
 		pcontext->literal_ptr = NULL;
 		pcontext->literal_len = 0;
@@ -835,6 +1016,7 @@ static int ps_cmd_processing(IMAP_CONTEXT *pcontext)
 	if (pcontext->sched_stat != SCHED_STAT_IDLING) {
 		return PROCESS_CONTINUE;
 	}
+	imap_parser_release_buffers(pcontext);
 	std::unique_lock ll_hold(g_list_lock);
 	double_list_append_as_tail(&g_sleeping_list, &pcontext->sleeping_node);
 	return PROCESS_SLEEPING;
@@ -880,7 +1062,16 @@ static int ps_stat_appending(IMAP_CONTEXT *pcontext)
 	pcontext->connection.last_timestamp = current_time;
 	if (pcontext->literal_len <= pcontext->current_len + read_len) {
 		ssize_t temp_len = pcontext->current_len + read_len - pcontext->literal_len;
-		memcpy(pcontext->read_buffer, pbuff + read_len - temp_len, temp_len);
+		if (temp_len > 0) {
+			if (!imap_parser_reserve_read(pcontext, temp_len)) {
+				imap_parser_log_info(pcontext, LV_WARN, "out of memory");
+				/* IMAP_CODE_2180009: BAD internal error: fail to get stream buffer */
+				size_t string_length = 0;
+				auto imap_reply_str = resource_get_imap_code(1809, 1, &string_length);
+				return ps_end_processing(pcontext, imap_reply_str, string_length);
+			}
+			memcpy(pcontext->read_buffer, pbuff + read_len - temp_len, temp_len);
+		}
 		pcontext->read_offset = temp_len;
 		pcontext->stream.fwd_write_ptr(read_len - temp_len);
 		pcontext->current_len = pcontext->literal_len;
@@ -910,8 +1101,81 @@ static int ps_stat_appending(IMAP_CONTEXT *pcontext)
 	return X_CMD_PROCESSING;
 }
 
+/*
+ * Send the rest of a message file. Plain connections (and kTLS ones) use
+ * sendfile; otherwise the data is copied through write_buff.
+ */
+static int ps_wrdat_file(IMAP_CONTEXT *pcontext)
+{
+	auto len = pcontext->literal_len - pcontext->current_len;
+	auto sent_len = pcontext->connection.sendfile(pcontext->message_fd, len);
+	if (sent_len < 0 && errno != EOPNOTSUPP) {
+		if (EAGAIN != errno) {
+			imap_parser_log_info(pcontext, LV_DEBUG, "connection lost");
+			return ps_end_processing(pcontext);
+		}
+		struct timeval current_time;
+		gettimeofday(&current_time, NULL);
+		if (CALCULATE_INTERVAL(current_time,
+		    pcontext->connection.last_timestamp) < g_timeout) {
+			return PROCESS_POLLING_WRONLY;
+		}
+		imap_parser_log_info(pcontext, LV_DEBUG, "time out");
+		/* IMAP_CODE_2180011: BAD time out */
+		size_t string_length = 0;
+		auto imap_reply_str = resource_get_imap_code(1811, 1, &string_length);
+		return ps_end_processing(pcontext, imap_reply_str, string_length);
+	} else if (0 == sent_len) {
+		imap_parser_log_info(pcontext, LV_WARN, "failed to read message file");
+		/* IMAP_CODE_2180012: * BAD internal error: fail to read file */
+		size_t string_length = 0;
+		auto imap_reply_str = resource_get_imap_code(1812, 1, &string_length);
+		return ps_end_processing(pcontext, imap_reply_str, string_length);
+	} else if (sent_len > 0) {
+		gettimeofday(&pcontext->connection.last_timestamp, NULL);
+		pcontext->current_len += sent_len;
+		if (pcontext->current_len < pcontext->literal_len) {
+			return PROCESS_CONTINUE;
+		}
+		len = 0;
+	} else {
+		if (len > MAX_LINE_LENGTH) {
+			len = MAX_LINE_LENGTH;
+		}
+		auto read_len = read(pcontext->message_fd, pcontext->write_buff, len);
+		if (read_len != len) {
+			imap_parser_log_info(pcontext, LV_WARN, "failed to read message file");
+			/* IMAP_CODE_2180012: * BAD internal error: fail to read file */
+			size_t string_length = 0;
+			auto imap_reply_str = resource_get_imap_code(1812, 1, &string_length);
+			return ps_end_processing(pcontext, imap_reply_str, string_length);
+		}
+		pcontext->current_len += len;
+	}
+	pcontext->write_length = len;
+	pcontext->write_offset = 0;
+	if (pcontext->literal_len != pcontext->current_len) {
+		return PROCESS_CONTINUE;
+	}
+	close(pcontext->message_fd);
+	pcontext->message_fd = -1;
+	pcontext->literal_len = 0;
+	pcontext->current_len = 0;
+	/* the following response lines share the buffer with the file tail */
+	if (imap_parser_wrdat_retrieve(pcontext) != IMAP_RETRIEVE_ERROR) {
+		return PROCESS_CONTINUE;
+	}
+	/* IMAP_CODE_2180008: internal error, fail to retrieve from stream object */
+	size_t string_length = 0;
+	auto imap_reply_str = resource_get_imap_code(1808, 1, &string_length);
+	return ps_end_processing(pcontext, imap_reply_str, string_length);
+}
+
 static int ps_stat_wrdat(IMAP_CONTEXT *pcontext)
 {
+	if (pcontext->message_fd != -1 && 0 == pcontext->write_length) {
+		return ps_wrdat_file(pcontext);
+	}
 	if (0 == pcontext->write_length) {
 		imap_parser_wrdat_retrieve(pcontext);
 	}
@@ -963,6 +1227,8 @@ static int ps_stat_wrdat(IMAP_CONTEXT *pcontext)
 			pcontext->stream.clear();
 			if (0 == pcontext->write_length) {
 				pcontext->sched_stat = SCHED_STAT_RDCMD;
+				pcontext->write_buff = nullptr;
+				imap_parser_release_buffers(pcontext);
 				return X_LITERAL_CHECKING;
 			}
 			break;
@@ -976,35 +1242,7 @@ static int ps_stat_wrdat(IMAP_CONTEXT *pcontext)
 		}
 		return PROCESS_CONTINUE;
 	}
-	auto len = pcontext->literal_len - pcontext->current_len;
-	if (len > 64 * 1024) {
-		len = 64 * 1024;
-	}
-	auto read_len = read(pcontext->message_fd, pcontext->write_buff, len);
-	if (read_len != len) {
-		imap_parser_log_info(pcontext, LV_WARN, "failed to read message file");
-		/* IMAP_CODE_2180012: * BAD internal error: fail to read file */
-		size_t string_length = 0;
-		auto imap_reply_str = resource_get_imap_code(1812, 1, &string_length);
-		return ps_end_processing(pcontext, imap_reply_str, string_length);
-	}
-	pcontext->current_len += len;
-	pcontext->write_length = len;
-	pcontext->write_offset = 0;
-	if (pcontext->literal_len != pcontext->current_len) {
-		return PROCESS_CONTINUE;
-	}
-	close(pcontext->message_fd);
-	pcontext->message_fd = -1;
-	pcontext->literal_len = 0;
-	pcontext->current_len = 0;
-	if (imap_parser_wrdat_retrieve(pcontext) != IMAP_RETRIEVE_ERROR) {
-		return PROCESS_CONTINUE;
-	}
-	/* IMAP_CODE_2180008: internal error, fail to retrieve from stream object */
-	size_t string_length = 0;
-	auto imap_reply_str = resource_get_imap_code(1808, 1, &string_length);
-	return ps_end_processing(pcontext, imap_reply_str, string_length);
+	return ps_wrdat_file(pcontext);
 }
 
 static int ps_stat_wrlst(IMAP_CONTEXT *pcontext)
@@ -1106,13 +1344,8 @@ static int ps_end_processing(IMAP_CONTEXT *pcontext,
     const char *imap_reply_str, ssize_t string_length)
 {
 	if (NULL != imap_reply_str) {
-		if (NULL != pcontext->connection.ssl) {
-			SSL_write(pcontext->connection.ssl, "* ", 2);
-			SSL_write(pcontext->connection.ssl, imap_reply_str, string_length);
-		} else {
-			write(pcontext->connection.sockd, "* ", 2);
-			write(pcontext->connection.sockd, imap_reply_str, string_length);
-		}
+		struct iovec iov[] = {imap_iov("* ", 2), imap_iov(imap_reply_str, string_length)};
+		pcontext->connection.writev(iov, arsizeof(iov));
 	}
 	if (NULL != pcontext->connection.ssl) {
 		SSL_shutdown(pcontext->connection.ssl);
@@ -1401,11 +1634,7 @@ void imap_parser_echo_modify(IMAP_CONTEXT *pcontext, STREAM *pstream)
 									   "* %d EXISTS\r\n",
 									   recent, exists);
 		if (NULL == pstream) {
-			if (NULL != pcontext->connection.ssl) {
-				SSL_write(pcontext->connection.ssl, buff, tmp_len);
-			} else {
-				write(pcontext->connection.sockd, buff, tmp_len);
-			}
+			imap_parser_queue_write(pcontext, buff, tmp_len);
 		} else {
 			pstream->write(buff, tmp_len);
 		}
@@ -1472,10 +1701,8 @@ void imap_parser_echo_modify(IMAP_CONTEXT *pcontext, STREAM *pstream)
 		tmp_len += gx_snprintf(buff + tmp_len, arsizeof(buff) - tmp_len, "))\r\n");
 		if (pstream != nullptr)
 			pstream->write(buff, tmp_len);
-		else if (pcontext->connection.ssl != nullptr)
-			SSL_write(pcontext->connection.ssl, buff, tmp_len);
 		else
-			write(pcontext->connection.sockd, buff, tmp_len);
+			imap_parser_queue_write(pcontext, buff, tmp_len);
 	}
 	mem_file_free(&temp_file);
 }
@@ -1640,8 +1867,12 @@ static int imap_parser_dispatch_cmd2(int argc, char **argv, IMAP_CONTEXT *pconte
 
 static int imap_parser_dispatch_cmd(int argc, char **argv, IMAP_CONTEXT *ctx)
 {
-	return imap_cmd_parser_dval(argc, argv, ctx,
-	       imap_parser_dispatch_cmd2(argc, argv, ctx));
+	auto ret = imap_cmd_parser_dval(argc, argv, ctx,
+	           imap_parser_dispatch_cmd2(argc, argv, ctx));
+	/* untagged lines queued by a command that did not write a reply */
+	if (!ctx->out_pending.empty())
+		imap_parser_safe_write(ctx, nullptr, 0);
+	return ret;
 }
 
 IMAP_CONTEXT::IMAP_CONTEXT() :
@@ -1674,10 +1905,10 @@ static void imap_parser_context_clear(IMAP_CONTEXT *pcontext)
 	pcontext->b_readonly = FALSE;
 	pcontext->tag_string[0] = '\0';
 	pcontext->command_len = 0;
-	pcontext->command_buffer[0] = '\0';
 	pcontext->read_offset = 0;
-	pcontext->read_buffer[0] = '\0';
 	pcontext->literal_ptr = NULL;
+	pcontext->out_pending.clear();
+	imap_parser_release_buffers(pcontext);
 	pcontext->literal_len = 0;
 	pcontext->current_len = 0;
 	pcontext->stream.clear();
@@ -1691,6 +1922,8 @@ IMAP_CONTEXT::~IMAP_CONTEXT()
 {
 	auto pcontext = this;
 	mem_file_free(&pcontext->f_flags);
+	imap_parser_buf_put(pcontext->read_buffer, pcontext->read_size);
+	imap_parser_buf_put(pcontext->command_buffer, pcontext->command_size);
 	if (NULL != pcontext->connection.ssl) {
 		SSL_shutdown(pcontext->connection.ssl);
 		SSL_free(pcontext->connection.ssl);
@@ -1948,6 +2181,19 @@ int imap_parser_get_sequence_ID()
 	return nu;
 }
 
+/*
+ * Hold back untagged responses (EXISTS/FETCH bursts) so that they go out
+ * together with the next reply instead of one record/syscall per line.
+ */
+void imap_parser_queue_write(IMAP_CONTEXT *pcontext, const void *pbuff, size_t count)
+{
+	try {
+		pcontext->out_pending.append(static_cast<const char *>(pbuff), count);
+	} catch (const std::bad_alloc &) {
+		imap_parser_safe_write(pcontext, pbuff, count);
+	}
+}
+
 void imap_parser_safe_write(IMAP_CONTEXT *pcontext, const void *pbuff, size_t count)
 {
 	int opt;
@@ -1958,11 +2204,12 @@ void imap_parser_safe_write(IMAP_CONTEXT *pcontext, const void *pbuff, size_t co
 	if (fcntl(pcontext->connection.sockd, F_SETFL, opt) < 0)
 		fprintf(stderr, "W-1365: fcntl: %s\n", strerror(errno));
 	/* end of set mode */
-	if (NULL != pcontext->connection.ssl) {
-		SSL_write(pcontext->connection.ssl, pbuff, count);
-	} else {
-		write(pcontext->connection.sockd, pbuff, count);
-	}
+	struct iovec iov[] = {
+		imap_iov(pcontext->out_pending.data(), pcontext->out_pending.size()),
+		imap_iov(pbuff, count),
+	};
+	pcontext->connection.writev(iov, arsizeof(iov));
+	pcontext->out_pending.clear();
 	/* set the socket back to non-block mode */
 	opt |= O_NONBLOCK;
 	if (fcntl(pcontext->connection.sockd, F_SETFL, opt) < 0)
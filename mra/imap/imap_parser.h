@@ -9,7 +9,7 @@
 #include <gromox/stream.hpp>
 #include <gromox/mem_file.hpp>
 #include <gromox/mime_pool.hpp>
-#define MAX_LINE_LENGTH			64*1024
+#define MAX_LINE_LENGTH			(64 * 1024)
 #define FLAG_RECENT				0x1
 #define FLAG_ANSWERED			0x2
 #define FLAG_FLAGGED			0x4
@@ -91,17 +91,30 @@ struct IMAP_CONTEXT final : public SCHEDULE_CONTEXT {
 	BOOL b_modify = false;
 	MEM_FILE f_flags{};
 	char tag_string[32]{};
+	/*
+	 * Command and read buffers are taken from a shared, size-classed
+	 * pool on demand (see imap_parser_reserve_*); *_size is the capacity.
+	 */
 	int command_len = 0;
-	char command_buffer[64*1024]{};
+	unsigned int command_size = 0;
+	char *command_buffer = nullptr;
 	int read_offset = 0;
-	char read_buffer[64*1024]{};
+	unsigned int read_size = 0;
+	char *read_buffer = nullptr;
 	char *literal_ptr = nullptr;
 	int literal_len = 0, current_len = 0;
 	STREAM stream; /* stream for writing to imap client */
+	std::string out_pending; /* untagged responses not yet sent */
 	int auth_times = 0;
 	char username[UADDR_SIZE]{}, maildir[256]{}, lang[32]{};
 };
 
+struct IMAP_MEMINFO {
+	size_t context_num, context_size;
+	size_t small_size, small_used, small_spare;
+	size_t large_size, large_used, large_spare;
+};
+
 void imap_parser_init(int context_num, int average_num, size_t cache_size,
 	unsigned int timeout, unsigned int autologout_time, int max_auth_times,
 	int block_auth_fail, BOOL support_starttls, BOOL force_starttls,
@@ -122,6 +135,7 @@ void imap_parser_modify_flags(IMAP_CONTEXT *pcontext, const char *mid_string);
 void imap_parser_add_select(IMAP_CONTEXT *pcontext);
 void imap_parser_remove_select(IMAP_CONTEXT *pcontext);
 void imap_parser_safe_write(IMAP_CONTEXT *pcontext, const void *pbuff, size_t count);
+extern void imap_parser_queue_write(IMAP_CONTEXT *, const void *, size_t);
 extern LIB_BUFFER *imap_parser_get_allocator();
 extern std::shared_ptr<MIME_POOL> imap_parser_get_mpool();
 /* get allocator for mjson mime */
@@ -129,4 +143,6 @@ extern LIB_BUFFER *imap_parser_get_jpool();
 extern LIB_BUFFER *imap_parser_get_xpool();
 extern LIB_BUFFER *imap_parser_get_dpool();
 extern int imap_parser_get_sequence_ID();
+extern char *imap_parser_wrdat_buffer(IMAP_CONTEXT *);
+extern void imap_parser_get_meminfo(IMAP_MEMINFO *);
 extern void imap_parser_log_info(IMAP_CONTEXT *pcontext, int level, const char *format, ...);
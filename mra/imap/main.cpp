@@ -164,19 +164,24 @@ int main(int argc, const char **argv) try
 	printf("[system]: threads pool initial threads number is %d\n",
 		thread_init_num);
 
-	unsigned int context_aver_mem = g_config_file->get_ll("context_average_mem") / (64 * 1024);
-	bytetoa(context_aver_mem*64*1024, temp_buff);
+	/* message stream memory, counted in stream blocks */
+	unsigned int context_aver_mem = g_config_file->get_ll("context_average_mem") / STREAM_BLOCK_SIZE;
+	bytetoa(context_aver_mem * STREAM_BLOCK_SIZE, temp_buff);
 	printf("[imap]: context average memory is %s\n", temp_buff);
  
-	unsigned int context_max_mem = g_config_file->get_ll("context_max_mem") / (64 * 1024);
+	unsigned int context_max_mem = g_config_file->get_ll("context_max_mem") / STREAM_BLOCK_SIZE;
 	if (context_max_mem < context_aver_mem) {
 		context_max_mem = context_aver_mem;
-		bytetoa(context_max_mem*64*1024, temp_buff);
+		bytetoa(context_max_mem * STREAM_BLOCK_SIZE, temp_buff);
 		resource_set_string("CONTEXT_MAX_MEM", temp_buff);
 	} 
-	context_max_mem *= 64*1024;
+	context_max_mem *= STREAM_BLOCK_SIZE;
 	bytetoa(context_max_mem, temp_buff);
 	printf("[imap]: context maximum memory is %s\n", temp_buff);
+	bytetoa(static_cast<uint64_t>(context_num) * context_aver_mem * STREAM_BLOCK_SIZE, temp_buff);
+	printf("[imap]: preallocating %s of stream blocks; command and read "
+	       "buffers (up to %u bytes each) are allocated on demand\n",
+	       temp_buff, MAX_LINE_LENGTH);
  
 	unsigned int context_aver_mitem = g_config_file->get_ll("context_average_mitem");
 	printf("[imap]: context average mitem number is %d\n", context_aver_mitem);
@@ -35,6 +35,7 @@ E(free_result)
 E(set_flags)
 E(unset_flags)
 E(get_flags)
+E(store_flags)
 E(copy_mail)
 E(search)
 E(search_uid)
@@ -87,6 +88,7 @@ int system_services_run()
 	E(system_services_set_flags, "set_mail_flags");
 	E(system_services_unset_flags, "unset_mail_flags");
 	E(system_services_get_flags, "get_mail_flags");
+	E(system_services_store_flags, "store_mail_flags");
 	E(system_services_copy_mail, "copy_mail");
 	E(system_services_search, "imap_search");
 	E(system_services_search_uid, "imap_search_uid");
@@ -133,6 +135,7 @@ void system_services_stop()
 	service_release("set_mail_flags", "system");
 	service_release("unset_mail_flags", "system");
 	service_release("get_mail_flags", "system");
+	service_release("store_mail_flags", "system");
 	service_release("copy_mail", "system");
 	service_release("imap_search", "system");
 	service_release("imap_search_uid", "system");
@@ -40,6 +40,7 @@ extern void (*system_services_free_result)(XARRAY*);
 extern int (*system_services_set_flags)(const char*, const char*, const char*, int, int*);
 extern int (*system_services_unset_flags)(const char*, const char*, const char*, int, int*);
 extern int (*system_services_get_flags)(const char*, const char*, const char*, int*, int*);
+extern int (*system_services_store_flags)(const char *, const char *, XARRAY *, int, int, int *);
 extern int (*system_services_copy_mail)(const char*, const char*, const char*,
 	const char*, char*, int*);
 extern int (*system_services_search)(const char*, const char*, const char*, int, char**, char*, int*, int*);
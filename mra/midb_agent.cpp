@@ -121,6 +121,7 @@ static int fetch_detail_uid(const char *path, const char *folder, DOUBLE_LIST *,
 static int set_mail_flags(const char *path, const char *folder, const char *mid_string, int flag_bits, int *perrno);
 static int unset_mail_flags(const char *path, const char *folder, const char *mid_string, int flag_bits, int *perrno);
 static int get_mail_flags(const char *path, const char *folder, const char *mid_string, int *pflag_bits, int *perrno);
+static int store_mail_flags(const char *path, const char *folder, XARRAY *, int set_bits, int unset_bits, int *perrno);
 static int copy_mail(const char *path, const char *src_folder, const char *mid_string, const char *dst_folder, char *dst_mid, int *perrno);
 static int imap_search(const char *path, const char *folder, const char *charset, int argc, char **argv, char *ret_buff, int *plen, int *perrno);
 static int imap_search_uid(const char *path, const char *folder, const char *charset, int argc, char **argv, char *ret_buff, int *plen, int *perrno);
@@ -278,6 +279,7 @@ static BOOL svc_midb_agent(int reason, void **ppdata)
 		    !E(fetch_simple_uid) || !E(fetch_detail_uid) ||
 		    !E(free_result) || !E(set_mail_flags) ||
 		    !E(unset_mail_flags) || !E(get_mail_flags) ||
+		    !E(store_mail_flags) ||
 		    !E(copy_mail) || !E(imap_search) || !E(imap_search_uid) ||
 		    !E(check_full)) {
 			printf("[midb_agent]: failed to register services\n");
@@ -627,12 +629,10 @@ static int delete_mail(const char *path, const char *folder, SINGLE_LIST *plist)
 	for (pnode=single_list_get_head(plist); NULL!=pnode;
 		pnode=single_list_get_after(plist, pnode)) {
 		pmsg = (MSG_UNIT*)pnode->pdata;
-		buff[length] = ' ';
-		length ++;
 		temp_len = strlen(pmsg->file_name);
-		memcpy(buff + length, pmsg->file_name, temp_len);
-		length += temp_len;
-		if (length > 128*1024) {
+		/* send the batch if " file_name" and the final CRLF would not fit */
+		if (length > cmd_len && static_cast<size_t>(length) +
+		    1 + temp_len + 2 > arsizeof(buff)) {
 			buff[length] = '\r';
 			length ++;
 			buff[length] = '\n';
@@ -650,6 +650,10 @@ static int delete_mail(const char *path, const char *folder, SINGLE_LIST *plist)
 				goto DELETE_ERROR;
 			}
 		}
+		buff[length] = ' ';
+		length ++;
+		memcpy(buff + length, pmsg->file_name, temp_len);
+		length += temp_len;
 	}
 
 	if (length > cmd_len) {
@@ -1452,12 +1456,10 @@ static int remove_mail(const char *path, const char *folder,
 	for (pnode=single_list_get_head(plist); NULL!=pnode;
 		pnode=single_list_get_after(plist, pnode)) {
 		pitem = (MITEM*)pnode->pdata;
-		buff[length] = ' ';
-		length ++;
 		temp_len = strlen(pitem->mid);
-		memcpy(buff + length, pitem->mid, temp_len);
-		length += temp_len;
-		if (length > 128*1024) {
+		/* send the batch if " mid" and the final CRLF would not fit */
+		if (length > cmd_len && static_cast<size_t>(length) +
+		    1 + temp_len + 2 > arsizeof(buff)) {
 			buff[length] = '\r';
 			length ++;
 			buff[length] = '\n';
@@ -1476,6 +1478,10 @@ static int remove_mail(const char *path, const char *folder,
 				goto RDWR_ERROR;
 			}
 		}
+		buff[length] = ' ';
+		length ++;
+		memcpy(buff + length, pitem->mid, temp_len);
+		length += temp_len;
 	}
 
 	if (length > cmd_len) {
@@ -3048,6 +3054,119 @@ static int get_mail_flags(const char *path, const char *folder,
 
 }
 	
+static int flags_to_letters(int flag_bits, char *out)
+{
+	int length = 0;
+	out[length++] = '(';
+	if (flag_bits & FLAG_ANSWERED)
+		out[length++] = 'A';
+	if (flag_bits & FLAG_DRAFT)
+		out[length++] = 'U';
+	if (flag_bits & FLAG_FLAGGED)
+		out[length++] = 'F';
+	if (flag_bits & FLAG_DELETED)
+		out[length++] = 'D';
+	if (flag_bits & FLAG_SEEN)
+		out[length++] = 'S';
+	if (flag_bits & FLAG_RECENT)
+		out[length++] = 'R';
+	out[length++] = ')';
+	out[length] = '\0';
+	return length;
+}
+
+static int letters_to_flags(const char *s, size_t len)
+{
+	int flag_bits = 0;
+	for (size_t i = 0; i < len; ++i) {
+		switch (s[i]) {
+		case 'A': flag_bits |= FLAG_ANSWERED; break;
+		case 'U': flag_bits |= FLAG_DRAFT; break;
+		case 'F': flag_bits |= FLAG_FLAGGED; break;
+		case 'D': flag_bits |= FLAG_DELETED; break;
+		case 'S': flag_bits |= FLAG_SEEN; break;
+		case 'R': flag_bits |= FLAG_RECENT; break;
+		}
+	}
+	return flag_bits;
+}
+
+/*
+ * Clear unset_bits, then raise set_bits, on all MITEMs of pxarray with as
+ * few P-BFLG round trips as the line limits allow. On success, flag_bits
+ * of each item holds the resulting flags; items that midb no longer has
+ * in the folder get an empty mid.
+ */
+static int store_mail_flags(const char *path, const char *folder,
+    XARRAY *pxarray, int set_bits, int unset_bits, int *perrno)
+{
+	static constexpr size_t max_batch = 4096;
+	char buff[128*1025];
+	char set_string[16], unset_string[16];
+	size_t num = xarray_get_capacity(pxarray);
+
+	if (0 == num) {
+		return MIDB_RESULT_OK;
+	}
+	auto pback = get_connection(path);
+	if (NULL == pback) {
+		return MIDB_NO_SERVER;
+	}
+	flags_to_letters(set_bits, set_string);
+	flags_to_letters(unset_bits, unset_string);
+	for (size_t start = 0; start < num; ) {
+		int length = gx_snprintf(buff, arsizeof(buff), "P-BFLG %s %s %s %s",
+		             path, folder, set_string, unset_string);
+		size_t end = start;
+		for (; end < num && end - start < max_batch; ++end) {
+			auto pitem = static_cast<MITEM *>(xarray_get_item(pxarray, end));
+			auto temp_len = strlen(pitem->mid);
+			/* leave room for " mid" and the final CRLF */
+			if (end > start && length + 1 + temp_len + 2 > arsizeof(buff))
+				break;
+			buff[length++] = ' ';
+			memcpy(&buff[length], pitem->mid, temp_len);
+			length += temp_len;
+		}
+		buff[length++] = '\r';
+		buff[length++] = '\n';
+		if (rw_command(pback->sockd, buff, length, arsizeof(buff)) < 0)
+			goto RDWR_ERROR;
+		if (0 == strncmp(buff, "FALSE ", 6)) {
+			std::unique_lock sv_hold(g_server_lock);
+			double_list_append_as_tail(&pback->psvr->conn_list, &pback->node);
+			*perrno = strtol(buff + 6, nullptr, 0);
+			return MIDB_RESULT_ERROR;
+		} else if (0 != strncmp(buff, "TRUE", 4)) {
+			goto RDWR_ERROR;
+		}
+		auto ptoken = buff + 4;
+		for (; start < end; ++start) {
+			auto pitem = static_cast<MITEM *>(xarray_get_item(pxarray, start));
+			if (*ptoken != ' ')
+				goto RDWR_ERROR;
+			++ptoken;
+			auto tok_len = strcspn(ptoken, " ");
+			if (1 == tok_len && '-' == *ptoken)
+				pitem->mid[0] = '\0';
+			else
+				pitem->flag_bits = letters_to_flags(ptoken, tok_len);
+			ptoken += tok_len;
+		}
+	}
+	{
+		std::unique_lock sv_hold(g_server_lock);
+		double_list_append_as_tail(&pback->psvr->conn_list, &pback->node);
+	}
+	return MIDB_RESULT_OK;
+ RDWR_ERROR:
+	close(pback->sockd);
+	pback->sockd = -1;
+	std::unique_lock sv_hold(g_server_lock);
+	double_list_append_as_tail(&g_lost_list, &pback->node);
+	return MIDB_RDWR_ERROR;
+}
+	
 static int copy_mail(const char *path, const char *src_folder,
     const char *mid_string, const char *dst_folder, char *dst_mid, int *perrno)
 {
@@ -0,0 +1,879 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+/*
+ * Equivalence and speed of the base64/QP codecs and the UTF-8/UTF-16LE
+ * transcoders across instruction set levels. The reference is the
+ * byte-at-a-time code they replaced, or iconv:
+ *
+ * 	codectest [-s seed] [-n rounds]	fuzz against the reference
+ * 	codectest -b			throughput per level
+ */
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <iconv.h>
+#include <unistd.h>
+#include <libHX/ctype_helper.h>
+#include <gromox/util.hpp>
+
+using clk = std::chrono::steady_clock;
+
+namespace ref {
+
+#define OK	(0)
+#define FAIL	(-1)
+#define BUFOVER (-2)
+
+
+#define CHAR64(c)  (((c) < 0 || (c) > 127) ? -1 : index_64[(c)])
+
+static char basis_64[] =
+   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/???????????????????????????????????????????????????????????????????????????????????????????????????????????????????????????????????????????";
+
+static int8_t index_64[128] = {
+	-1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1,
+	-1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,-1,
+	-1,-1,-1,-1, -1,-1,-1,-1, -1,-1,-1,62, -1,-1,-1,63,
+	52,53,54,55, 56,57,58,59, 60,61,-1,-1, -1,-1,-1,-1,
+	-1, 0, 1, 2,  3, 4, 5, 6,  7, 8, 9,10, 11,12,13,14,
+	15,16,17,18, 19,20,21,22, 23,24,25,-1, -1,-1,-1,-1,
+	-1,26,27,28, 29,30,31,32, 33,34,35,36, 37,38,39,40,
+	41,42,43,44, 45,46,47,48, 49,50,51,-1, -1,-1,-1,-1
+};
+
+
+static int encode64(const void *vin, size_t inlen, char *out,
+    size_t outmax, size_t *outlen)
+{
+	auto in = static_cast<const unsigned char *>(vin);
+	unsigned char oval;
+	size_t olen;
+
+	/* Will it fit? */
+	olen = (inlen + 2) / 3 * 4;
+	if (outlen)
+	  *outlen = olen;
+	if (outmax < olen)
+	  return BUFOVER;
+
+	/* Do the work... */
+	while (inlen >= 3) {
+	  /* user provided max buffer size; make sure we don't go over it */
+		*out++ = basis_64[in[0] >> 2];
+		*out++ = basis_64[((in[0] << 4) & 0x30) | (in[1] >> 4)];
+		*out++ = basis_64[((in[1] << 2) & 0x3c) | (in[2] >> 6)];
+		*out++ = basis_64[in[2] & 0x3f];
+		in += 3;
+		inlen -= 3;
+	}
+	if (inlen > 0) {
+	  /* user provided max buffer size; make sure we don't go over it */
+		*out++ = basis_64[in[0] >> 2];
+		oval = (in[0] << 4) & 0x30;
+		if (inlen > 1) oval |= in[1] >> 4;
+		*out++ = basis_64[oval];
+		*out++ = (inlen < 2) ? '=' : basis_64[(in[1] << 2) & 0x3c];
+		*out++ = '=';
+	}
+
+	if (olen < outmax)
+	  *out = '\0';
+	
+	return OK;
+}
+
+static int decode64(const char *in, size_t inlen, void *vout, size_t *outlen)
+{
+	auto out = static_cast<uint8_t *>(vout);
+	size_t len = 0,lup;
+	int c1, c2, c3, c4;
+
+	/* check parameters */
+	if (out==NULL) return FAIL;
+
+	/* xxx these necessary? */
+	if (in[0] == '+' && in[1] == ' ') in += 2;
+	if (*in == '\r') return FAIL;
+
+	for (lup=0;lup<inlen/4;lup++)
+	{
+		c1 = in[0];
+		if (CHAR64(c1) == -1) return FAIL;
+		c2 = in[1];
+		if (CHAR64(c2) == -1) return FAIL;
+		c3 = in[2];
+		if (c3 != '=' && CHAR64(c3) == -1) return FAIL; 
+		c4 = in[3];
+		if (c4 != '=' && CHAR64(c4) == -1) return FAIL;
+		in += 4;
+		*out++ = (CHAR64(c1) << 2) | (CHAR64(c2) >> 4);
+		++len;
+		if (c3 != '=') {
+			*out++ = ((CHAR64(c2) << 4) & 0xf0) | (CHAR64(c3) >> 2);
+			++len;
+			if (c4 != '=') {
+				*out++ = ((CHAR64(c3) << 6) & 0xc0) | CHAR64(c4);
+				++len;
+			}
+		}
+	}
+
+	*out=0; /* terminate string */
+	*outlen=len;
+	return OK;
+}
+
+
+#define DW_EOL "\r\n"
+#define MAXLINE	76
+static char base64tab[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	"abcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static char base64idx[128] = {
+	'\377','\377','\377','\377','\377','\377','\377','\377',
+	'\377','\377','\377','\377','\377','\377','\377','\377',
+	'\377','\377','\377','\377','\377','\377','\377','\377',
+	'\377','\377','\377','\377','\377','\377','\377','\377',
+	'\377','\377','\377','\377','\377','\377','\377','\377',
+	'\377','\377','\377',	 62,'\377','\377','\377',	 63,
+		52,	   53,	  54,	 55,	56,	   57,	  58,	 59,
+		60,	   61,'\377','\377','\377','\377','\377','\377',
+	'\377',		0,	   1,	  2,	 3,		4,	   5,	  6,
+		 7,		8,	   9,	 10,	11,	   12,	  13,	 14,
+		15,	   16,	  17,	 18,	19,	   20,	  21,	 22,
+		23,	   24,	  25,'\377','\377','\377','\377','\377',
+	'\377',	   26,	  27,	 28,	29,	   30,	  31,	 32,
+		33,	   34,	  35,	 36,	37,	   38,	  39,	 40,
+		41,	   42,	  43,	 44,	45,	   46,	  47,	 48,
+		49,	   50,	  51,'\377','\377','\377','\377','\377'
+};
+
+static char hextab[] = "0123456789ABCDEF";
+
+
+#define isbase64(a) (  ('A' <= (a) && (a) <= 'Z') \
+					|| ('a' <= (a) && (a) <= 'z') \
+					|| ('0' <= (a) && (a) <= '9') \
+					||	(a) == '+' || (a) == '/'  )
+
+
+
+static int encode64_ex(const void *vin, size_t inlen, char *_out,
+	size_t outmax, size_t *outlen)
+{
+	auto _in = static_cast<const uint8_t *>(vin);
+	size_t inLen = inlen;
+	size_t i;
+	char* out = _out;
+	size_t outsize = (inLen+2)/3*4;		/* 3:4 conversion ratio */
+	size_t inpos  = 0;
+	size_t outPos = 0;
+	int c1, c2, c3;
+	int lineLen = 0;
+	const char* cp;
+	
+	if (!_in || !_out || !outlen) {
+		return -1;
+	}
+	outsize += strlen(DW_EOL)*outsize/MAXLINE + 2;	/* Space for newlines and NUL */
+	if (outmax < outsize) {
+		return -1;
+	}
+	/* Get three characters at a time and encode them. */
+	for (i=0; i < inLen/3; ++i) {
+		c1 = _in[inpos++] & 0xFF;
+		c2 = _in[inpos++] & 0xFF;
+		c3 = _in[inpos++] & 0xFF;
+		out[outPos++] = base64tab[(c1 & 0xFC) >> 2];
+		out[outPos++] = base64tab[((c1 & 0x03) << 4) | ((c2 & 0xF0) >> 4)];
+		out[outPos++] = base64tab[((c2 & 0x0F) << 2) | ((c3 & 0xC0) >> 6)];
+		out[outPos++] = base64tab[c3 & 0x3F];
+		lineLen += 4;
+		if (lineLen >= MAXLINE-3) {
+			const char *cq = DW_EOL;
+			out[outPos++] = *cq++;
+			if (*cq != '\0')
+				out[outPos++] = *cq;
+			lineLen = 0;
+		}
+	}
+	/* Encode the remaining one or two characters. */
+	switch (inLen % 3) {
+	case 0:
+		cp = DW_EOL;
+		out[outPos++] = *cp++;
+		if (*cp) {
+			out[outPos++] = *cp;
+		}
+		break;
+	case 1:
+		c1 = _in[inpos] & 0xFF;
+		out[outPos++] = base64tab[(c1 & 0xFC) >> 2];
+		out[outPos++] = base64tab[((c1 & 0x03) << 4)];
+		out[outPos++] = '=';
+		out[outPos++] = '=';
+		cp = DW_EOL;
+		out[outPos++] = *cp++;
+		if (*cp) {
+			out[outPos++] = *cp;
+		}
+		break;
+	case 2:
+		c1 = _in[inpos++] & 0xFF;
+		c2 = _in[inpos] & 0xFF;
+		out[outPos++] = base64tab[(c1 & 0xFC) >> 2];
+		out[outPos++] = base64tab[((c1 & 0x03) << 4) | ((c2 & 0xF0) >> 4)];
+		out[outPos++] = base64tab[((c2 & 0x0F) << 2)];
+		out[outPos++] = '=';
+		cp = DW_EOL;
+		out[outPos++] = *cp++;
+		if (*cp) {
+			out[outPos++] = *cp;
+		}
+		break;
+	}
+	out[outPos] = 0;
+	*outlen = outPos;
+	return 0;
+}
+
+
+static int decode64_ex(const char *_in, size_t inlen, void *vout,
+	size_t outmax, size_t *outlen)
+{
+	auto out = static_cast<uint8_t *>(vout);
+	size_t inLen = inlen;
+	size_t outsize = ( ( inLen + 3 ) / 4 ) * 3;
+	/* Get four input chars at a time and decode them. Ignore white space
+	 * chars (CR, LF, SP, HT). If '=' is encountered, terminate input. If
+	 * a char other than white space, base64 char, or '=' is encountered,
+	 * flag an input error, but otherwise ignore the char.
+	 */
+	int is_err = 0;
+	int is_endSeen = 0;
+	int b1, b2, b3;
+	int a1, a2, a3, a4;
+	size_t inpos = 0;
+	size_t outPos = 0;
+	
+	if (_in == nullptr || vout == nullptr || outlen == nullptr)
+		return -1;
+	if (outmax < outsize) {
+		*outlen = 0;
+		return -1;
+	}
+	while (inpos < inLen) {
+		a1 = a2 = a3 = a4 = 0;
+		while (inpos < inLen) {
+			a1 = _in[inpos++] & 0xFF;
+			if (isbase64(a1)) {
+				break;
+			}
+			else if (a1 == '=') {
+				is_endSeen = 1;
+				break;
+			}
+			else if (a1 != '\r' && a1 != '\n' && a1 != ' ' && a1 != '\t') {
+				is_err = 1;
+			}
+		}
+		while (inpos < inLen) {
+			a2 = _in[inpos++] & 0xFF;
+			if (isbase64(a2)) {
+				break;
+			}
+			else if (a2 == '=') {
+				is_endSeen = 1;
+				break;
+			}
+			else if (a2 != '\r' && a2 != '\n' && a2 != ' ' && a2 != '\t') {
+				is_err = 1;
+			}
+		}
+		while (inpos < inLen) {
+			a3 = _in[inpos++] & 0xFF;
+			if (isbase64(a3)) {
+				break;
+			}
+			else if (a3 == '=') {
+				is_endSeen = 1;
+				break;
+			}
+			else if (a3 != '\r' && a3 != '\n' && a3 != ' ' && a3 != '\t') {
+				is_err = 1;
+			}
+		}
+		while (inpos < inLen) {
+			a4 = _in[inpos++] & 0xFF;
+			if (isbase64(a4)) {
+				break;
+			}
+			else if (a4 == '=') {
+				is_endSeen = 1;
+				break;
+			}
+			else if (a4 != '\r' && a4 != '\n' && a4 != ' ' && a4 != '\t') {
+				is_err = 1;
+			}
+		}
+		if (isbase64(a1) && isbase64(a2) && isbase64(a3) && isbase64(a4)) {
+			a1 = base64idx[a1] & 0xFF;
+			a2 = base64idx[a2] & 0xFF;
+			a3 = base64idx[a3] & 0xFF;
+			a4 = base64idx[a4] & 0xFF;
+			b1 = ((a1 << 2) & 0xFC) | ((a2 >> 4) & 0x03);
+			b2 = ((a2 << 4) & 0xF0) | ((a3 >> 2) & 0x0F);
+			b3 = ((a3 << 6) & 0xC0) | ( a4		 & 0x3F);
+			out[outPos++] = (char)b1;
+			out[outPos++] = (char)b2;
+			out[outPos++] = (char)b3;
+		}
+		else if (isbase64(a1) && isbase64(a2) && isbase64(a3) && a4 == '=') {
+			a1 = base64idx[a1] & 0xFF;
+			a2 = base64idx[a2] & 0xFF;
+			a3 = base64idx[a3] & 0xFF;
+			b1 = ((a1 << 2) & 0xFC) | ((a2 >> 4) & 0x03);
+			b2 = ((a2 << 4) & 0xF0) | ((a3 >> 2) & 0x0F);
+			out[outPos++] = (char)b1;
+			out[outPos++] = (char)b2;
+			break;
+		}
+		else if (isbase64(a1) && isbase64(a2) && a3 == '=' && a4 == '=') {
+			a1 = base64idx[a1] & 0xFF;
+			a2 = base64idx[a2] & 0xFF;
+			b1 = ((a1 << 2) & 0xFC) | ((a2 >> 4) & 0x03);
+			out[outPos++] = (char)b1;
+			break;
+		}
+		else {
+			break;
+		}
+		if (is_endSeen) {
+			break;
+		}
+	} /* end while loop */
+	out[outPos] = 0;
+	*outlen = outPos;
+	return (is_err) ? -1 : 0;
+}
+
+static ssize_t qp_encode_ex(void *voutput, size_t outlen, const char *input, size_t length)
+{
+	auto output = static_cast<uint8_t *>(voutput);
+	size_t inpos, outpos, linelen;
+	int ch;
+
+	if (!input || !output) {
+		return -1;
+	}
+	inpos  = 0;
+	outpos = 0;
+	linelen = 0;
+	while (inpos < length) {
+		ch = input[inpos++] & 0xFF;
+		/* '.' at beginning of line (confuses some SMTPs) */
+		if (linelen == 0 && ch == '.') {
+			output[outpos++] = '=';
+			output[outpos++] = hextab[(ch >> 4) & 0x0F];
+			output[outpos++] = hextab[ch & 0x0F];
+			linelen += 3;
+		}
+		/* "From " at beginning of line (gets mangled in mbox folders) */
+		else if (linelen == 0 && inpos+3 < length && ch == 'F'
+				 && input[inpos	 ] == 'r' && input[inpos+1] == 'o'
+				 && input[inpos+2] == 'm' && input[inpos+3] == ' ') {
+			output[outpos++] = '=';
+			output[outpos++] = hextab[(ch >> 4) & 0x0F];
+			output[outpos++] = hextab[ch & 0x0F];
+			linelen += 3;
+		}
+		/* Normal printable char */
+		else if ((62 <= ch && ch <= 126) || (33 <= ch && ch <= 60)) {
+			output[outpos++] = (char) ch;
+			++linelen;
+		}
+		/* Space */
+		else if (ch == ' ') {
+			/* Space at end of line or end of input must be encoded */
+			if (inpos >= length			  /* End of input? */
+				|| (inpos < length-1	  /* End of line? */
+					&& input[inpos	] == '\r' 
+					&& input[inpos+1] == '\n') ) {
+
+				output[outpos++] = '=';
+				output[outpos++] = '2';
+				output[outpos++] = '0';
+				linelen += 3;
+			}
+			else {
+				output[outpos++] = ' ';
+				++linelen;
+			}
+		}
+		/* Hard line break */
+		else if (inpos < length && ch == '\r' && input[inpos] == '\n') {
+			++inpos;
+			output[outpos++] = '\r';
+			output[outpos++] = '\n';
+			linelen = 0;
+		}
+		/* Non-printable char */
+		else if (ch & 0x80		  /* 8-bit char */
+				 || !(ch & 0xE0)  /* control char */
+				 || ch == 0x7F	  /* DEL */
+				 || ch == '=') {  /* special case */
+			output[outpos++] = '=';
+			output[outpos++] = hextab[(ch >> 4) & 0x0F];
+			output[outpos++] = hextab[ch & 0x0F];
+			linelen += 3;
+		}
+		/* Soft line break */
+		if (linelen >= MAXLINE-3 && !(inpos < length-1 && 
+			input[inpos] == '\r' && input[inpos+1] == '\n')) {
+
+			output[outpos++] = '=';
+			output[outpos++] = '\r';
+			output[outpos++] = '\n';
+			linelen = 0;
+		}
+	}
+	output[outpos] = 0;
+	return outpos;
+}
+
+
+/* 'robust' QP decode accepts =3e as encouraged by the standard, although
+ *	it is illegal to encode this way
+ */
+static const unsigned char hex_tab[256] = 
+{
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00, 0x01,
+	0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+	0x0F, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x0A, 0x0B, 0x0C,
+	0x0D, 0x0E, 0x0F, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+};
+
+static size_t qp_decode(void *voutput, const char *input, size_t length,
+    unsigned int qp_flags)
+{
+	auto output = static_cast<uint8_t *>(voutput);
+	bool mime_mode = qp_flags & QP_MIME_HEADER;
+	size_t i, cnt = 0;
+	for (i = 0; i < length; i++) {
+		char c = input[i];
+		switch (c) {
+		case '=':
+			/* quoted char, process it */
+			if (i < length - 2 && HX_isxdigit(input[i+1]) &&
+			    HX_isxdigit(input[i+2])) { /* OK, this is =HEX */
+				output[cnt++] = (hex_tab[input[i+1] & 0xff] << 4) | 
+					hex_tab[input[i+2] & 0xff];
+				i +=2;
+				break;
+			}
+			/* indicates 'soft-line break', implying ignore 
+			   it & the following CR 
+			*/
+			if (i < length - 2 && input[i+1] == '\r' && 
+				input[i+2] == '\n') {
+					i +=2;
+					break;
+			}
+			/* just ignore it, it doesn't seem to be correctly quoting
+			   anything (report an error/add a fussy mode?) 
+			*/
+			break;
+		case '_':
+			if (mime_mode) {
+				output[cnt++] = ' ';
+				break;
+			}
+			[[fallthrough]];
+		default:
+			/* pass other characters through unmolested */
+			output[cnt++] = c;
+			break;
+		}
+	}
+	output[cnt] = '\0';
+	return cnt;
+}
+
+static ssize_t qp_decode_ex(void *voutput, size_t out_len, const char *input,
+    size_t length)
+{
+	auto output = static_cast<uint8_t *>(voutput);
+	int c;
+	size_t i, cnt = 0;
+	for (i = 0; i < length; i++) {
+
+		c = input[i];
+
+		switch (c) {
+		case '=':
+			/* quoted char, process it */
+			if (i < length - 2 && HX_isxdigit(input[i+1]) &&
+			    HX_isxdigit(input[i+2])) { /* OK, this is =HEX */
+				cnt++;
+				i +=2;
+				break;
+			}
+			/* indicates 'soft-line break', implying ignore 
+			   it & the following CR 
+			*/
+			if (i < length - 2 && input[i+1] == '\r' && 
+				input[i+2] == '\n') {
+					i +=2;
+					break;
+			}
+			/* just ignore it, it doesn't seem to be correctly quoting
+			   anything (report an error/add a fussy mode?) 
+			*/
+			break;
+		default:
+			/* pass other characters through unmolested */
+			cnt++;
+			break;
+		}
+	}
+	if (cnt >= out_len) {
+		return -1;
+	}
+	return qp_decode(output, input, length, 0);
+}
+
+
+}
+
+static std::mt19937 g_rng;
+static const char *g_isa_name[] = {"scalar", "sse4", "avx2"};
+
+static size_t rnd(size_t max)
+{
+	return std::uniform_int_distribution<size_t>(0, max)(g_rng);
+}
+
+static std::string rand_binary(size_t len)
+{
+	std::string s(len, '\0');
+	for (auto &c : s)
+		c = rnd(255);
+	return s;
+}
+
+/* mostly printable text with CRLFs, spaces, dots, "From " and 8-bit */
+static std::string rand_text(size_t len)
+{
+	static const char *const frag[] = {"\r\n", " ", " \r\n", ".", "From ", "=", "\t", "_"};
+	std::string s;
+	while (s.size() < len) {
+		auto k = rnd(20);
+		if (k < 14)
+			s += static_cast<char>(33 + rnd(93));
+		else if (k < 19)
+			s += frag[rnd(gromox::arsizeof(frag) - 1)];
+		else
+			s += static_cast<char>(rnd(255));
+	}
+	return s;
+}
+
+/* words, spaces, CRLF-terminated lines and the odd 8-bit letter */
+static std::string rand_prose(size_t len)
+{
+	std::string s;
+	size_t col = 0;
+	while (s.size() < len) {
+		auto k = rnd(99);
+		if (col > 60 + rnd(20)) {
+			s += "\r\n";
+			col = 0;
+			continue;
+		} else if (k < 15) {
+			s += ' ';
+		} else if (k < 17) {
+			s += static_cast<char>(0xc3);
+			s += static_cast<char>(0xa4 + rnd(20));
+			++col;
+		} else {
+			s += static_cast<char>('a' + rnd(25));
+		}
+		++col;
+	}
+	return s;
+}
+
+/* sprinkle whitespace, junk and padding into base64 text */
+static std::string mangle(std::string s)
+{
+	static const char junk[] = " \t\r\n=!*-\x80";
+	auto n = rnd(4);
+	for (size_t i = 0; i < n && !s.empty(); ++i) {
+		auto pos = rnd(s.size() - 1);
+		switch (rnd(2)) {
+		case 0: s.insert(pos, 1, junk[rnd(sizeof(junk) - 2)]); break;
+		case 1: s[pos] = junk[rnd(sizeof(junk) - 2)]; break;
+		default: s.resize(pos); break;
+		}
+	}
+	return s;
+}
+
+static std::string hexdump_head(const std::string &s)
+{
+	std::string out;
+	char buf[4];
+	for (size_t i = 0; i < s.size() && i < 32; ++i) {
+		snprintf(buf, sizeof(buf), "%02x", static_cast<unsigned char>(s[i]));
+		out += buf;
+	}
+	return out;
+}
+
+#define CHECK(cond, what, input) do { \
+		if (!(cond)) { \
+			printf("[%s] %s mismatch, input %zu bytes: %s...\n", \
+			       g_isa_name[isa], (what), (input).size(), \
+			       hexdump_head(input).c_str()); \
+			return false; \
+		} \
+	} while (false)
+
+static bool cmp_decode64(unsigned int isa, const std::string &in)
+{
+	std::string a(in.size() + 16, 'x'), b(in.size() + 16, 'x');
+	size_t la = 0, lb = 0;
+	int ra = decode64_ex(in.c_str(), in.size(), a.data(), a.size(), &la);
+	int rb = ref::decode64_ex(in.c_str(), in.size(), b.data(), b.size(), &lb);
+	CHECK(ra == rb && la == lb && a == b, "decode64_ex", in);
+	std::string c(in.size() + 16, 'x'), d(in.size() + 16, 'x');
+	ra = decode64(in.c_str(), in.size(), c.data(), &la);
+	rb = ref::decode64(in.c_str(), in.size(), d.data(), &lb);
+	CHECK(ra == rb && (ra != 0 || (la == lb && c == d)), "decode64", in);
+	return true;
+}
+
+static bool cmp_base64(unsigned int isa, const std::string &in)
+{
+	auto max = in.size() * 2 + 16;
+	std::string a(max, 'x'), b(max, 'x');
+	size_t la = 0, lb = 0;
+	int ra = encode64_ex(in.data(), in.size(), a.data(), max, &la);
+	int rb = ref::encode64_ex(in.data(), in.size(), b.data(), max, &lb);
+	CHECK(ra == rb && la == lb && a == b, "encode64_ex", in);
+	if (!cmp_decode64(isa, a.substr(0, la)) ||
+	    !cmp_decode64(isa, mangle(a.substr(0, la))))
+		return false;
+	std::string c(max, 'x'), d(max, 'x');
+	ra = encode64(in.data(), in.size(), c.data(), max, &la);
+	rb = ref::encode64(in.data(), in.size(), d.data(), max, &lb);
+	CHECK(ra == rb && la == lb && c == d, "encode64", in);
+	return cmp_decode64(isa, c.substr(0, la)) &&
+	       cmp_decode64(isa, mangle(c.substr(0, la)));
+}
+
+static bool cmp_qpdecode(unsigned int isa, const std::string &in)
+{
+	for (unsigned int flags : {0U, static_cast<unsigned int>(QP_MIME_HEADER)}) {
+		std::string a(in.size() + 16, 'x'), b(in.size() + 16, 'x');
+		auto la = qp_decode(a.data(), in.c_str(), in.size(), flags);
+		auto lb = ref::qp_decode(b.data(), in.c_str(), in.size(), flags);
+		CHECK(la == lb && a == b, flags ? "qp_decode/mime" : "qp_decode", in);
+	}
+	std::string a(in.size() + 16, 'x'), b(in.size() + 16, 'x');
+	auto la = qp_decode_ex(a.data(), a.size(), in.c_str(), in.size());
+	auto lb = ref::qp_decode_ex(b.data(), b.size(), in.c_str(), in.size());
+	CHECK(la == lb && a == b, "qp_decode_ex", in);
+	return true;
+}
+
+static bool cmp_qp(unsigned int isa, const std::string &in)
+{
+	auto max = in.size() * 4 + 16;
+	std::string a(max, 'x'), b(max, 'x');
+	auto la = qp_encode_ex(a.data(), max, in.c_str(), in.size());
+	auto lb = ref::qp_encode_ex(b.data(), max, in.c_str(), in.size());
+	CHECK(la == lb && a == b, "qp_encode_ex", in);
+	return la < 0 || (cmp_qpdecode(isa, a.substr(0, la)) &&
+	       cmp_qpdecode(isa, in));
+}
+
+/* UTF-8 with mostly ASCII, some multi-byte and the odd invalid sequence */
+static std::string rand_utf8(size_t len, bool clean)
+{
+	std::string s;
+	while (s.size() < len) {
+		auto k = rnd(99);
+		uint32_t c = k < 80 ? 1 + rnd(0x7e) : k < 90 ? 0x80 + rnd(0x77f) :
+		             k < 97 ? 0x800 + rnd(0xf7ff) : 0x10000 + rnd(0xfffff);
+		if (c >= 0xd800 && c <= 0xdfff)
+			c = 0xfffd;
+		char buf[8];
+		wchar_to_utf8(c, buf);
+		s += buf;
+	}
+	if (!clean && !s.empty())
+		s[rnd(s.size() - 1)] = 0x80 + rnd(0x7e);
+	return s;
+}
+
+static ssize_t iconv_ref(const char *to, const char *from, const char *in,
+    size_t inlen, char *out, size_t outlen)
+{
+	auto cd = iconv_open(to, from);
+	auto pin = const_cast<char *>(in);
+	auto pout = out, obegin = out;
+	auto ret = iconv(cd, &pin, &inlen, &pout, &outlen);
+	iconv_close(cd);
+	return ret == static_cast<size_t>(-1) ? -1 : pout - obegin;
+}
+
+static bool cmp_utf16(unsigned int isa, const std::string &in)
+{
+	auto max = in.size() * 2 + 2;
+	std::string a(max, 'x'), b(max, '\0');
+	auto la = utf8_to_utf16le(in.c_str(), a.data(), a.size());
+	auto lb = iconv_ref("UTF-16LE", "UTF-8", in.c_str(), in.size() + 1, b.data(), b.size());
+	CHECK(la == lb && (la < 0 || a == b), "utf8_to_utf16le", in);
+	if (la < 0)
+		return true;
+	/* and back, also with a truncated or damaged tail */
+	auto u16 = a.substr(0, la);
+	if (rnd(3) == 0 && !u16.empty())
+		u16.resize(u16.size() - 1 - rnd(std::min(u16.size() - 1, static_cast<size_t>(3))));
+	else if (rnd(3) == 0 && u16.size() >= 2)
+		u16[u16.size() - 1 - rnd(1)] = 0xd8 + rnd(7);
+	max = u16.size() * 2 + 2;
+	std::string c(max, 'x'), d(max, '\0');
+	auto rc = utf16le_to_utf8(u16.data(), u16.size(), c.data(), c.size());
+	auto rd = iconv_ref("UTF-8", "UTF-16LE", u16.data(), u16.size(), d.data(), d.size());
+	CHECK(!!rc == (rd >= 0) && (rd < 0 || c == d), "utf16le_to_utf8", u16);
+	return true;
+}
+
+static int fuzz(unsigned int rounds)
+{
+	auto top = codec_set_isa(CODEC_AVX2);
+	for (unsigned int isa = CODEC_SCALAR; isa <= top; ++isa) {
+		codec_set_isa(isa);
+		for (unsigned int r = 0; r < rounds; ++r) {
+			/* favour lengths around line and vector boundaries */
+			auto len = rnd(3) == 0 ? 57 * rnd(8) + rnd(64) - 32 : rnd(4000);
+			if (len > 100000)
+				len = 0;
+			if (!cmp_base64(isa, rand_binary(len)) ||
+			    !cmp_qp(isa, rand_text(len)) ||
+			    !cmp_qp(isa, rand_prose(len)) ||
+			    !cmp_utf16(isa, rand_utf8(len, rnd(4) != 0)))
+				return EXIT_FAILURE;
+		}
+		printf("%s: %u rounds OK\n", g_isa_name[isa], rounds);
+	}
+	codec_set_isa(top);
+	return EXIT_SUCCESS;
+}
+
+template<typename F> static double mbps(size_t bytes, F &&f)
+{
+	unsigned int iter = 0;
+	auto start = clk::now();
+	std::chrono::duration<double> el;
+	do {
+		f();
+		++iter;
+		el = clk::now() - start;
+	} while (el.count() < 0.3);
+	return bytes * iter / el.count() / 1e6;
+}
+
+static int bench()
+{
+	static constexpr size_t len = 4 << 20;
+	auto bin = rand_binary(len), text = rand_prose(len);
+	std::string b64(len * 2, '\0'), qp(len * 4, '\0'), out(len * 4, '\0');
+	size_t b64len = 0;
+	encode64_ex(bin.data(), len, b64.data(), b64.size(), &b64len);
+	auto qplen = qp_encode_ex(qp.data(), qp.size(), text.c_str(), len);
+	size_t ol;
+	printf("%-8s %12s %12s %12s %12s (MB/s of raw data)\n", "", "b64 enc",
+	       "b64 dec", "qp enc", "qp dec");
+	printf("%-8s %12.0f %12.0f %12.0f %12.0f\n", "ref",
+	       mbps(len, [&]() { ref::encode64_ex(bin.data(), len, out.data(), out.size(), &ol); }),
+	       mbps(len, [&]() { ref::decode64_ex(b64.data(), b64len, out.data(), out.size(), &ol); }),
+	       mbps(len, [&]() { ref::qp_encode_ex(out.data(), out.size(), text.c_str(), len); }),
+	       mbps(len, [&]() { ref::qp_decode(out.data(), qp.c_str(), qplen, 0); }));
+	auto top = codec_set_isa(CODEC_AVX2);
+	for (unsigned int isa = CODEC_SCALAR; isa <= top; ++isa) {
+		codec_set_isa(isa);
+		printf("%-8s %12.0f %12.0f %12.0f %12.0f\n", g_isa_name[isa],
+		       mbps(len, [&]() { encode64_ex(bin.data(), len, out.data(), out.size(), &ol); }),
+		       mbps(len, [&]() { decode64_ex(b64.data(), b64len, out.data(), out.size(), &ol); }),
+		       mbps(len, [&]() { qp_encode_ex(out.data(), out.size(), text.c_str(), len); }),
+		       mbps(len, [&]() { qp_decode(out.data(), qp.c_str(), qplen); }));
+	}
+	codec_set_isa(top);
+
+	/* mostly-ASCII text, the common case for names and subjects */
+	auto u8 = rand_prose(len);
+	for (auto &ch : u8)
+		if (static_cast<unsigned char>(ch) >= 0x80)
+			ch = 'e';
+	std::string u16(len * 2 + 2, '\0');
+	auto u16len = utf8_to_utf16le(u8.c_str(), u16.data(), u16.size());
+	printf("\n%-8s %12s %12s (MB/s of UTF-8)\n", "", "to utf16le", "from utf16le");
+	printf("%-8s %12.0f %12.0f\n", "iconv",
+	       mbps(len, [&]() { iconv_ref("UTF-16LE", "UTF-8", u8.c_str(), len + 1, out.data(), out.size()); }),
+	       mbps(len, [&]() { iconv_ref("UTF-8", "UTF-16LE", u16.data(), u16len, out.data(), out.size()); }));
+	for (unsigned int isa = CODEC_SCALAR; isa <= top; ++isa) {
+		codec_set_isa(isa);
+		printf("%-8s %12.0f %12.0f\n", g_isa_name[isa],
+		       mbps(len, [&]() { utf8_to_utf16le(u8.c_str(), out.data(), out.size()); }),
+		       mbps(len, [&]() { utf16le_to_utf8(u16.data(), u16len, out.data(), out.size()); }));
+	}
+	codec_set_isa(top);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int seed = 1, rounds = 2000;
+	bool do_bench = false;
+	int c;
+	while ((c = getopt(argc, argv, "bn:s:")) != -1) {
+		switch (c) {
+		case 'b': do_bench = true; break;
+		case 'n': rounds = strtoul(optarg, nullptr, 0); break;
+		case 's': seed = strtoul(optarg, nullptr, 0); break;
+		default:
+			fprintf(stderr, "Usage: %s [-b] [-n rounds] [-s seed]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	g_rng.seed(seed);
+	return do_bench ? bench() : fuzz(rounds);
+}
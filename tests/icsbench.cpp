@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later WITH linking exception
+// This file is part of Gromox.
+/*
+ * Benchmark for the given-IDSET lookups of ICS content sync:
+ *
+ * 	icsbench [-n ids] [-g gap_percent] [-s seed]
+ *
+ * A synthetic folder of n message IDs is generated, from which gap_percent
+ * are missing at random (giving many short ranges in the IDSET). The
+ * former IDSET_CACHE (a :memory: SQLite table holding every ID of the
+ * short ranges, plus a list of the long ones) is compared with the
+ * range vector of exch/exmdb_provider/idset_cache.h, for setup and for
+ * one ascending pass over all IDs, as done while scanning the messages
+ * table. Both must agree on every lookup.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include <sqlite3.h>
+#include "../exch/exmdb_provider/idset_cache.h"
+
+using clk = std::chrono::steady_clock;
+using range_list = std::vector<std::pair<uint64_t, uint64_t>>;
+
+#define IDSET_CACHE_MIN_RANGE 10
+
+namespace {
+
+struct OLD_CACHE {
+	~OLD_CACHE();
+	bool init(const range_list &);
+	bool hint(uint64_t);
+
+	sqlite3 *psqlite = nullptr;
+	sqlite3_stmt *pstmt = nullptr;
+	range_list long_ranges;
+};
+
+}
+
+OLD_CACHE::~OLD_CACHE()
+{
+	sqlite3_finalize(pstmt);
+	sqlite3_close(psqlite);
+}
+
+bool OLD_CACHE::init(const range_list &ranges)
+{
+	if (sqlite3_open_v2(":memory:", &psqlite, SQLITE_OPEN_READWRITE |
+	    SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK ||
+	    sqlite3_exec(psqlite, "CREATE TABLE id_vals (id_val INTEGER PRIMARY KEY)",
+	    nullptr, nullptr, nullptr) != SQLITE_OK)
+		return false;
+	sqlite3_stmt *ins = nullptr;
+	if (sqlite3_prepare_v2(psqlite, "INSERT INTO id_vals VALUES (?)",
+	    -1, &ins, nullptr) != SQLITE_OK)
+		return false;
+	for (const auto &r : ranges) {
+		if (r.second - r.first >= IDSET_CACHE_MIN_RANGE) {
+			long_ranges.push_back(r);
+			continue;
+		}
+		for (auto v = r.first; v <= r.second; ++v) {
+			sqlite3_reset(ins);
+			sqlite3_bind_int64(ins, 1, v);
+			if (sqlite3_step(ins) != SQLITE_DONE) {
+				sqlite3_finalize(ins);
+				return false;
+			}
+		}
+	}
+	sqlite3_finalize(ins);
+	return sqlite3_prepare_v2(psqlite, "SELECT id_val FROM id_vals WHERE id_val=?",
+	       -1, &pstmt, nullptr) == SQLITE_OK;
+}
+
+bool OLD_CACHE::hint(uint64_t v)
+{
+	sqlite3_reset(pstmt);
+	sqlite3_bind_int64(pstmt, 1, v);
+	if (sqlite3_step(pstmt) == SQLITE_ROW)
+		return true;
+	for (const auto &r : long_ranges)
+		if (v >= r.first && v <= r.second)
+			return true;
+	return false;
+}
+
+static double msec_since(clk::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(clk::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nids = 200000, gap = 5, seed = 1;
+	int c;
+	while ((c = getopt(argc, argv, "g:n:s:")) != -1) {
+		switch (c) {
+		case 'g': gap = strtoul(optarg, nullptr, 0); break;
+		case 'n': nids = strtoul(optarg, nullptr, 0); break;
+		case 's': seed = strtoul(optarg, nullptr, 0); break;
+		default:
+			fprintf(stderr, "Usage: %s [-n ids] [-g gap_percent] [-s seed]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (nids == 0 || gap > 100) {
+		fprintf(stderr, "Usage: %s [-n ids] [-g gap_percent] [-s seed]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	std::mt19937 rng(seed);
+	std::uniform_int_distribution<unsigned int> pct(0, 99);
+	range_list ranges;
+	uint64_t base = 0x10000;
+	for (uint64_t v = base; v < base + nids; ++v) {
+		if (pct(rng) < gap)
+			continue;
+		if (!ranges.empty() && ranges.back().second + 1 == v)
+			ranges.back().second = v;
+		else
+			ranges.emplace_back(v, v);
+	}
+
+	auto start = clk::now();
+	OLD_CACHE old_cache;
+	if (!old_cache.init(ranges)) {
+		fprintf(stderr, "sqlite setup failed\n");
+		return EXIT_FAILURE;
+	}
+	auto t_old_init = msec_since(start);
+	start = clk::now();
+	IDSET_CACHE cache;
+	for (const auto &r : ranges)
+		cache.add(r.first, r.second);
+	cache.finalize();
+	auto t_new_init = msec_since(start);
+
+	std::vector<bool> res_old(nids), res_new(nids);
+	start = clk::now();
+	for (unsigned int i = 0; i < nids; ++i)
+		res_old[i] = old_cache.hint(base + i);
+	auto t_old_scan = msec_since(start);
+	start = clk::now();
+	for (unsigned int i = 0; i < nids; ++i)
+		res_new[i] = cache.hint(base + i);
+	auto t_new_scan = msec_since(start);
+	/* random order, as when the changes are sorted by delivery time */
+	std::vector<uint64_t> shuffled(nids);
+	for (unsigned int i = 0; i < nids; ++i)
+		shuffled[i] = base + i;
+	std::shuffle(shuffled.begin(), shuffled.end(), rng);
+	bool ok = res_old == res_new;
+	start = clk::now();
+	for (auto v : shuffled)
+		ok &= cache.hint(v) == res_new[v - base];
+	auto t_new_rand = msec_since(start);
+
+	printf("%u IDs, %zu ranges (%zu long):\n"
+	       "  setup:            sqlite %.1f ms, range vector %.2f ms\n"
+	       "  ascending lookup: sqlite %.1f ms, range vector %.2f ms\n"
+	       "  random lookup:    range vector %.2f ms\n",
+	       nids, ranges.size(), old_cache.long_ranges.size(),
+	       t_old_init, t_new_init, t_old_scan, t_new_scan, t_new_rand);
+	if (!ok) {
+		printf("LOOKUP MISMATCH\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
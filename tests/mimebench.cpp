@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later WITH linking exception
+// This file is part of Gromox.
+/*
+ * Serialization benchmark over a corpus of RFC 5322 messages:
+ *
+ * 	mimebench [-n iterations] file...
+ *
+ * Each message is written with MAIL::to_file (gathered writev output) and
+ * with MAIL::serialize+STREAM::dump, once as parsed and once with a header
+ * modified (which regenerates the top-level head) into a temporary file.
+ * Outputs are compared. Loading is measured too: read(2) into the heap
+ * versus gromox::mapped_file, each followed by MAIL::retrieve, reporting
+ * latency and the anonymous memory held while the MAIL is alive.
+ */
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gromox/defs.h>
+#include <gromox/fileio.h>
+#include <gromox/lib_buffer.hpp>
+#include <gromox/mail.hpp>
+#include <gromox/mime_pool.hpp>
+#include <gromox/stream.hpp>
+
+using namespace gromox;
+using clk = std::chrono::steady_clock;
+
+static LIB_BUFFER *g_stream_alloc;
+
+static bool slurp_fd(int fd, std::string &out)
+{
+	out.clear();
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return false;
+	char buf[65536];
+	ssize_t ret;
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		out.append(buf, ret);
+	return ret == 0;
+}
+
+static bool via_stream(MAIL &mail, int fd)
+{
+	STREAM stream(g_stream_alloc);
+	return mail.serialize(&stream) && stream.dump(fd) == STREAM_DUMP_OK;
+}
+
+static bool via_file(MAIL &mail, int fd)
+{
+	return mail.to_file(fd);
+}
+
+static double bench(MAIL &mail, bool (*fn)(MAIL &, int), int out_fd,
+    unsigned int iter)
+{
+	auto start = clk::now();
+	for (unsigned int i = 0; i < iter; ++i)
+		if (ftruncate(out_fd, 0) != 0 || lseek(out_fd, 0, SEEK_SET) != 0 ||
+		    !fn(mail, out_fd))
+			return -1;
+	return std::chrono::duration<double, std::micro>(clk::now() - start).count() / iter;
+}
+
+static long rss_anon_kb()
+{
+	std::unique_ptr<FILE, file_deleter> fp(fopen("/proc/self/status", "r"));
+	if (fp == nullptr)
+		return -1;
+	char line[256];
+	while (fgets(line, sizeof(line), fp.get()) != nullptr)
+		if (strncmp(line, "RssAnon:", 8) == 0)
+			return strtol(line + 8, nullptr, 10);
+	return -1;
+}
+
+static bool load_read(const char *file, const std::shared_ptr<MIME_POOL> &pool,
+    long *rss)
+{
+	wrapfd fd(open(file, O_RDONLY));
+	struct stat sb;
+	if (fd.get() < 0 || fstat(fd.get(), &sb) != 0)
+		return false;
+	std::unique_ptr<char[]> buf(new(std::nothrow) char[sb.st_size]);
+	if (buf == nullptr || read(fd.get(), buf.get(), sb.st_size) != sb.st_size)
+		return false;
+	MAIL mail(pool);
+	if (!mail.retrieve(buf.get(), sb.st_size))
+		return false;
+	if (rss != nullptr)
+		*rss = rss_anon_kb();
+	return true;
+}
+
+static bool load_map(const char *file, const std::shared_ptr<MIME_POOL> &pool,
+    long *rss)
+{
+	wrapfd fd(open(file, O_RDONLY));
+	mapped_file mf;
+	if (fd.get() < 0 || mf.map(fd.get()) != 0)
+		return false;
+	MAIL mail(pool);
+	if (!mail.retrieve(mf.data(), mf.size()))
+		return false;
+	if (rss != nullptr)
+		*rss = rss_anon_kb();
+	return true;
+}
+
+static void bench_load(const char *file, unsigned int iter,
+    const std::shared_ptr<MIME_POOL> &pool)
+{
+	using load_fn = bool (*)(const char *, const std::shared_ptr<MIME_POOL> &, long *);
+	double usec[2];
+	long rss[2];
+	load_fn fn[2] = {load_read, load_map};
+	for (unsigned int k = 0; k < 2; ++k) {
+		auto base = rss_anon_kb();
+		if (!fn[k](file, pool, &rss[k])) {
+			fprintf(stderr, "%s: load failed\n", file);
+			return;
+		}
+		rss[k] -= base;
+		auto start = clk::now();
+		for (unsigned int i = 0; i < iter; ++i)
+			fn[k](file, pool, nullptr);
+		usec[k] = std::chrono::duration<double, std::micro>(clk::now() - start).count() / iter;
+	}
+	printf("%s: load+parse read %.1f us (+%ld KB anon), "
+	       "mapped %.1f us (+%ld KB anon)\n",
+	       file, usec[0], rss[0], usec[1], rss[1]);
+}
+
+static int run_one(const char *file, unsigned int iter, int out_fd,
+    const std::shared_ptr<MIME_POOL> &pool)
+{
+	std::string data;
+	wrapfd in(open(file, O_RDONLY));
+	if (in.get() < 0 || !slurp_fd(in.get(), data)) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return -1;
+	}
+	MAIL mail(pool);
+	if (!mail.retrieve(data.data(), data.size())) {
+		fprintf(stderr, "%s: could not parse\n", file);
+		return -1;
+	}
+	bench_load(file, iter, pool);
+	int ret = 0;
+	for (unsigned int pass = 0; pass < 2; ++pass) {
+		if (pass == 1 && !mail.set_header("X-Mimebench", "1")) {
+			fprintf(stderr, "%s: set_header failed\n", file);
+			return -1;
+		}
+		wrapfd fa(open("/tmp", O_TMPFILE | O_RDWR, 0600));
+		wrapfd fb(open("/tmp", O_TMPFILE | O_RDWR, 0600));
+		std::string a, b;
+		if (fa.get() < 0 || fb.get() < 0 ||
+		    !via_file(mail, fa.get()) || !via_stream(mail, fb.get()) ||
+		    !slurp_fd(fa.get(), a) || !slurp_fd(fb.get(), b)) {
+			fprintf(stderr, "%s: serialization failed\n", file);
+			return -1;
+		}
+		if (a != b) {
+			printf("%s%s: OUTPUT DIFFERS (%zu vs %zu bytes)\n", file,
+			       pass ? " [touched]" : "", a.size(), b.size());
+			ret = 1;
+			continue;
+		}
+		auto t_file = bench(mail, via_file, out_fd, iter);
+		auto t_stream = bench(mail, via_stream, out_fd, iter);
+		printf("%s%s: %zu bytes, to_file %.1f us (%.0f MB/s), "
+		       "serialize+dump %.1f us\n", file, pass ? " [touched]" : "",
+		       a.size(), t_file, a.size() / t_file, t_stream);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int iter = 100;
+	int c;
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		if (c == 'n') {
+			iter = strtoul(optarg, nullptr, 0);
+		} else {
+			fprintf(stderr, "Usage: %s [-n iterations] file...\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc || iter == 0) {
+		fprintf(stderr, "Usage: %s [-n iterations] file...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	auto pool = MIME_POOL::create(1024, 8);
+	g_stream_alloc = lib_buffer_init(STREAM_ALLOC_SIZE, 4096, false);
+	wrapfd out_fd(open("/tmp", O_TMPFILE | O_RDWR, 0600));
+	if (pool == nullptr || g_stream_alloc == nullptr || out_fd.get() < 0) {
+		fprintf(stderr, "init failed\n");
+		return EXIT_FAILURE;
+	}
+	int ret = EXIT_SUCCESS;
+	for (int i = optind; i < argc; ++i)
+		if (run_one(argv[i], iter, out_fd.get(), pool) != 0)
+			ret = EXIT_FAILURE;
+	lib_buffer_free(g_stream_alloc);
+	return ret;
+}
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later WITH linking exception
+// This file is part of Gromox.
+/*
+ * Reassembly benchmark for fragmented DCERPC requests:
+ *
+ * 	pdubench [-n iterations] [-s total_size] [-f fragment_size]
+ *
+ * A synthetic request stub is cut into fragments and put back together
+ * once with the former strategy (grow to the next 16K multiple, then
+ * malloc+memcpy+free on every fragment) and once with
+ * pdu_processor_append_stub, both without and with an alloc_hint.
+ * The reassembled stubs are compared with the original.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include "../exch/http/pdu_processor.h"
+
+using clk = std::chrono::steady_clock;
+
+static constexpr size_t MAX_REQUEST_MEM = SIZE_MAX;
+
+static bool append_roundup(DATA_BLOB *dst, uint32_t *palloc_size,
+    const void *src, uint32_t len, size_t hint, size_t)
+{
+	size_t alloc_size = std::max(static_cast<size_t>(dst->length) + len, hint);
+	if (*palloc_size < alloc_size) {
+		alloc_size = (alloc_size + 16383) / 16384 * 16384;
+		auto pdata = malloc(alloc_size);
+		if (pdata == nullptr)
+			return false;
+		if (dst->length > 0)
+			memcpy(pdata, dst->data, dst->length);
+		free(dst->data);
+		dst->vdata = pdata;
+		*palloc_size = alloc_size;
+	}
+	memcpy(dst->data + dst->length, src, len);
+	dst->length += len;
+	return true;
+}
+
+using append_fn = bool (*)(DATA_BLOB *, uint32_t *, const void *, uint32_t, size_t, size_t);
+
+static double run(append_fn fn, const std::vector<uint8_t> &stub,
+    uint32_t frag, bool use_hint, unsigned int iter, bool *ok)
+{
+	auto start = clk::now();
+	for (unsigned int i = 0; i < iter; ++i) {
+		DATA_BLOB blob{};
+		uint32_t alloc_size = 0;
+		size_t hint = use_hint ? stub.size() : 0;
+		for (size_t ofs = 0; ofs < stub.size(); ofs += frag) {
+			uint32_t len = std::min(static_cast<size_t>(frag), stub.size() - ofs);
+			if (!fn(&blob, &alloc_size, &stub[ofs], len, hint, MAX_REQUEST_MEM)) {
+				*ok = false;
+				break;
+			}
+		}
+		if (i == 0 && (blob.length != stub.size() ||
+		    memcmp(blob.data, stub.data(), stub.size()) != 0))
+			*ok = false;
+		free(blob.data);
+	}
+	return std::chrono::duration<double, std::milli>(clk::now() - start).count() / iter;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int iter = 20;
+	size_t total = 8 << 20;
+	uint32_t frag = 5840;
+	int c;
+	while ((c = getopt(argc, argv, "f:n:s:")) != -1) {
+		switch (c) {
+		case 'f': frag = strtoul(optarg, nullptr, 0); break;
+		case 'n': iter = strtoul(optarg, nullptr, 0); break;
+		case 's': total = strtoull(optarg, nullptr, 0); break;
+		default:
+			fprintf(stderr, "Usage: %s [-n iterations] [-s total_size] [-f fragment_size]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (iter == 0 || frag == 0 || total == 0 || total > UINT32_MAX) {
+		fprintf(stderr, "Usage: %s [-n iterations] [-s total_size] [-f fragment_size]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	std::vector<uint8_t> stub(total);
+	for (size_t i = 0; i < total; ++i)
+		stub[i] = i * 2654435761U >> 24;
+	bool ok = true;
+	auto t_old = run(append_roundup, stub, frag, false, iter, &ok);
+	auto t_new = run(pdu_processor_append_stub, stub, frag, false, iter, &ok);
+	auto t_old_hint = run(append_roundup, stub, frag, true, iter, &ok);
+	auto t_new_hint = run(pdu_processor_append_stub, stub, frag, true, iter, &ok);
+	printf("%zu bytes in %u-byte fragments:\n"
+	       "  no alloc_hint: 16K roundup %.2f ms, geometric %.2f ms\n"
+	       "  alloc_hint:    16K roundup %.2f ms, geometric %.2f ms\n",
+	       total, frag, t_old, t_new, t_old_hint, t_new_hint);
+	if (!ok) {
+		printf("REASSEMBLY MISMATCH\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later WITH linking exception
+// This file is part of Gromox.
+/*
+ * Handle churn benchmark for exch/emsmdb/rop_processor.cpp:
+ *
+ * 	ropbench [-t threads] [-n logons] [-h handles] [-m mailboxes]
+ *
+ * rop_processor.cpp is linked in as is. Every thread plays one emsmdb
+ * session with its own LOGMAP: it repeatedly logs on to one of the
+ * mailboxes (rop_processor_create_logon_item), opens handles below the
+ * logon (add_object_handle), looks each of them up (get_object), releases
+ * every other one, and logs off by releasing the logon handle. The ping
+ * scan thread runs meanwhile. Afterwards, all logon objects must have
+ * been freed.
+ *
+ * The rest of exchange_emsmdb is replaced by the stand-ins at the end of
+ * this file. Since they only depend on rop_processor's external interface,
+ * the same program can be built against an older rop_processor.cpp for
+ * comparison.
+ */
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <libHX/string.h>
+#include <gromox/int_hash.hpp>
+#include <gromox/proc_common.h>
+#include <gromox/util.hpp>
+#include "../exch/emsmdb/attachment_object.h"
+#include "../exch/emsmdb/common_util.h"
+#include "../exch/emsmdb/emsmdb_interface.h"
+#include "../exch/emsmdb/exmdb_client.h"
+#include "../exch/emsmdb/fastdownctx_object.h"
+#include "../exch/emsmdb/fastupctx_object.h"
+#include "../exch/emsmdb/ftstream_parser.h"
+#include "../exch/emsmdb/ftstream_producer.h"
+#include "../exch/emsmdb/ics_state.h"
+#include "../exch/emsmdb/icsdownctx_object.h"
+#include "../exch/emsmdb/icsupctx_object.h"
+#include "../exch/emsmdb/message_object.h"
+#include "../exch/emsmdb/notify_response.h"
+#include "../exch/emsmdb/rop_dispatch.h"
+#include "../exch/emsmdb/rop_ext.h"
+#include "../exch/emsmdb/rop_ids.h"
+#include "../exch/emsmdb/rop_processor.h"
+#include "../exch/emsmdb/stream_object.h"
+#include "../exch/emsmdb/subscription_object.h"
+#include "../exch/emsmdb/table_object.h"
+
+using namespace gromox;
+using clk = std::chrono::steady_clock;
+
+static unsigned int g_threads = 8, g_logons = 2000, g_handles = 20;
+static unsigned int g_mailboxes = 64;
+static std::atomic<int> g_live_logons{0};
+static std::atomic<unsigned int> g_pings{0}, g_failures{0};
+static thread_local uint32_t t_last_handle;
+
+static bool churn_logon(LOGMAP *plogmap, uint8_t logon_id, const char *dir,
+    std::vector<int> &handles)
+{
+	static char dummy;
+	auto plogon = logon_object::create(0, 0, LOGON_MODE_OWNER, 0, "", dir, {});
+	if (plogon == nullptr)
+		return false;
+	auto lh = rop_processor_create_logon_item(plogmap, logon_id, plogon.get());
+	if (lh < 0)
+		return false;
+	plogon.release();
+	handles.clear();
+	handles.push_back(lh);
+	for (unsigned int k = 1; k <= g_handles; ++k) {
+		/* folders below the logon, messages below the folders */
+		auto parent = k % 4 == 1 ? lh : handles.back();
+		auto h = rop_processor_add_object_handle(plogmap, logon_id,
+		         parent, OBJECT_TYPE_NONE, &dummy);
+		if (h < 0)
+			return false;
+		handles.push_back(h);
+	}
+	for (auto h : handles) {
+		int type = -1;
+		if (rop_processor_get_object(plogmap, logon_id, h, &type) == nullptr)
+			return false;
+	}
+	for (size_t k = 2; k < handles.size(); k += 2)
+		rop_processor_release_object_handle(plogmap, logon_id, handles[k]);
+	rop_processor_release_object_handle(plogmap, logon_id, lh);
+	return rop_processor_get_logon_object(plogmap, logon_id) == nullptr;
+}
+
+static void churn(unsigned int seq)
+{
+	std::vector<int> handles;
+	char dir[64];
+	auto plogmap = rop_processor_create_logmap();
+	if (plogmap == nullptr) {
+		++g_failures;
+		return;
+	}
+	t_last_handle = 0;
+	for (unsigned int i = 0; i < g_logons; ++i) {
+		snprintf(dir, arsizeof(dir), "/var/lib/gromox/user/%u",
+		         (seq * g_logons + i) % g_mailboxes);
+		if (!churn_logon(plogmap, i % 256, dir, handles))
+			++g_failures;
+	}
+	rop_processor_release_logmap(plogmap);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+	while ((c = getopt(argc, argv, "h:m:n:t:")) != -1) {
+		switch (c) {
+		case 'h': g_handles = strtoul(optarg, nullptr, 0); break;
+		case 'm': g_mailboxes = strtoul(optarg, nullptr, 0); break;
+		case 'n': g_logons = strtoul(optarg, nullptr, 0); break;
+		case 't': g_threads = strtoul(optarg, nullptr, 0); break;
+		default:
+			fprintf(stderr, "Usage: %s [-t threads] [-n logons] [-h handles] [-m mailboxes]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	/* rop_processor refuses more than 500 handles per logon */
+	if (g_threads == 0 || g_mailboxes == 0 || g_handles >= 500) {
+		fprintf(stderr, "Usage: %s [-t threads] [-n logons] [-h handles] [-m mailboxes]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	struct sigaction sact{};
+	sigemptyset(&sact.sa_mask);
+	sact.sa_handler = [](int) {};
+	sigaction(SIGALRM, &sact, nullptr);
+	rop_processor_init(g_handles + 1, 1);
+	if (rop_processor_run() != 0)
+		return EXIT_FAILURE;
+	std::vector<std::thread> thr;
+	auto t0 = clk::now();
+	for (unsigned int i = 0; i < g_threads; ++i)
+		thr.emplace_back(churn, i);
+	for (auto &t : thr)
+		t.join();
+	std::chrono::duration<double, std::milli> ms = clk::now() - t0;
+	rop_processor_stop();
+	auto logons = static_cast<double>(g_threads) * g_logons;
+	printf("%u threads x %u logons x %u handles: %.1f ms, %.0f logons/s, "
+	       "%.0f handles/s, %u ping(s)\n", g_threads, g_logons, g_handles,
+	       ms.count(), logons * 1000 / ms.count(),
+	       logons * (g_handles + 1) * 1000 / ms.count(), g_pings.load());
+	if (g_failures != 0 || g_live_logons != 0) {
+		fprintf(stderr, "%u failed logons, %d logon objects not freed\n",
+		        g_failures.load(), g_live_logons.load());
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Stand-ins for the parts of exchange_emsmdb that rop_processor.cpp links
+ * against. Only the logon object, handle numbering and the ping are
+ * reached by the benchmark.
+ */
+logon_object::logon_object()
+{
+	++g_live_logons;
+}
+
+logon_object::~logon_object()
+{
+	--g_live_logons;
+}
+
+std::unique_ptr<logon_object> logon_object::create(uint8_t logon_flags,
+    uint32_t open_flags, int logon_mode, int account_id, const char *account,
+    const char *dir, GUID mailbox_guid)
+{
+	std::unique_ptr<logon_object> plogon;
+	try {
+		plogon.reset(new logon_object);
+	} catch (const std::bad_alloc &) {
+		return nullptr;
+	}
+	plogon->logon_flags = logon_flags;
+	plogon->open_flags = open_flags;
+	plogon->logon_mode = logon_mode;
+	plogon->account_id = account_id;
+	gx_strlcpy(plogon->account, account, arsizeof(plogon->account));
+	gx_strlcpy(plogon->dir, dir, arsizeof(plogon->dir));
+	plogon->mailbox_guid = mailbox_guid;
+	return plogon;
+}
+
+BOOL emsmdb_interface_alloc_handle_number(uint32_t *pnum)
+{
+	/* per emsmdb handle, i.e. per thread here */
+	*pnum = t_last_handle++;
+	return TRUE;
+}
+
+static BOOL ping_store(const char *dir)
+{
+	++g_pings;
+	return TRUE;
+}
+
+static int context_num()
+{
+	return g_threads;
+}
+
+decltype(exmdb_client_ping_store) exmdb_client_ping_store = ping_store;
+decltype(get_context_num) get_context_num = context_num;
+unsigned int g_rop_debug;
+
+FOLDER_CONTENT::~FOLDER_CONTENT() {}
+ICS_STATE::~ICS_STATE() {}
+fxstream_parser::~fxstream_parser() {}
+fxstream_producer::~fxstream_producer() {}
+attachment_object::~attachment_object() {}
+fastdownctx_object::~fastdownctx_object() {}
+fastupctx_object::~fastupctx_object() {}
+icsdownctx_object::~icsdownctx_object() {}
+icsupctx_object::~icsupctx_object() {}
+message_object::~message_object() {}
+stream_object::~stream_object() {}
+subscription_object::~subscription_object() {}
+table_object::~table_object() {}
+BOOL table_object::read_row(uint64_t, uint32_t, TPROPVAL_ARRAY *) { return false; }
+EMSMDB_INFO *emsmdb_interface_get_emsmdb_info() { return nullptr; }
+DOUBLE_LIST *emsmdb_interface_get_notify_list() { return nullptr; }
+void emsmdb_interface_put_notify_list() {}
+BOOL emsmdb_interface_get_cxr(uint16_t *) { return false; }
+BOOL emsmdb_interface_set_rop_left(uint16_t) { return false; }
+BOOL emsmdb_interface_set_rop_num(int) { return false; }
+void *common_util_alloc(size_t) { return nullptr; }
+BOOL common_util_propvals_to_row(const TPROPVAL_ARRAY *, const PROPTAG_ARRAY *, PROPERTY_ROW *) { return false; }
+void notify_response_free(NOTIFY_RESPONSE *) {}
+int rop_dispatch(ROP_REQUEST *, ROP_RESPONSE **, uint32_t *, uint8_t) { return ecError; }
+int rop_ext_pull_rop_buffer(EXT_PULL *, ROP_BUFFER *) { return EXT_ERR_FORMAT; }
+int rop_ext_make_rpc_ext(const void *, uint32_t, const ROP_BUFFER *, void *, uint32_t *) { return EXT_ERR_FORMAT; }
+void rop_ext_set_rhe_flag_last(uint8_t *, uint32_t) {}
+int rop_ext_push_rop_response(EXT_PUSH *, uint8_t, ROP_RESPONSE *) { return EXT_ERR_FORMAT; }
+int rop_ext_push_notify_response(EXT_PUSH *, const NOTIFY_RESPONSE *) { return EXT_ERR_FORMAT; }
+int rop_ext_push_pending_response(EXT_PUSH *, const PENDING_RESPONSE *) { return EXT_ERR_FORMAT; }
+const char *rop_idtoname(unsigned int) { return ""; }
@@ -1,36 +1,32 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 #include <algorithm>
 #include <cerrno>
-#include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
-#include <list>
+#include <deque>
 #include <memory>
-#include <mutex>
 #include <unordered_map>
-#include <stdexcept>
+#include <unordered_set>
 #include <string>
 #include <utility>
 #include <vector>
 #include <libHX/option.h>
 #include <libHX/string.h>
 #include <gromox/atomic.hpp>
+#include <gromox/fileio.h>
 #include <gromox/paths.h>
 #include <gromox/socket.h>
 #include <gromox/util.hpp>
 #include <gromox/scope.hpp>
-#include <gromox/mem_file.hpp>
 #include <gromox/list_file.hpp>
 #include <gromox/config_file.hpp>
-#include <gromox/double_list.hpp>
-#include <gromox/single_list.hpp>
 #include <ctime>
 #include <cstdio>
+#include <fcntl.h>
 #include <unistd.h>
 #include <csignal>
-#include <pthread.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -43,70 +39,75 @@
 
 #define SCAN_INTERVAL			10*60
 
-#define FIFO_AVERAGE_LENGTH		128
-
 #define MAX_CMD_LENGTH			64*1024
 
-#define HASH_CAPABILITY			10000
+/* per-listener backlog; further events for that listener are dropped */
+#define MAX_QUEUE_LENGTH		4096
+
+/* events per BATCH frame for listeners that negotiated CAPA BATCH */
+#define MAX_BATCH_EVENTS		64
+
+/* unsent replies to a sender that does not read them */
+#define MAX_WBUF_LENGTH			1024*1024
 
 using namespace gromox;
 
 namespace {
 
-#define EXTRA_FIFOITEM_SIZE sizeof(SINGLE_LIST)
-struct FIFO {
-	FIFO() = default;
-	FIFO(LIB_BUFFER *, size_t data_size, size_t max_size);
-	BOOL enqueue(void *);
-	void *get_front();
-	void dequeue();
-
-	LIB_BUFFER *mbuf_pool = nullptr;
-	SINGLE_LIST mlist{};
-	size_t data_size = 0, cur_size = 0, max_size = 0;
-};
+struct HOST_NODE;
 
-struct ENQUEUE_NODE {
-	~ENQUEUE_NODE() { if (sockd >= 0) close(sockd); }
+/**
+ * One client socket. Connections start out in Enqueue Mode (commands and
+ * notifications from event_proxy); LISTEN turns them into listeners which
+ * only receive frames and send back acknowledgements.
+ *
+ * @inflight:	number of events in the frame awaiting "TRUE"
+ * @last_time:	last time the peer was heard from (or an ack came in)
+ * @sent_time:	when the outstanding frame or PING was written
+ */
+struct ev_conn {
+	~ev_conn() { if (sockd >= 0) close(sockd); }
 
-	char res_id[128]{};
 	int sockd = -1;
-	int offset = 0;
-	char buffer[MAX_CMD_LENGTH]{};
-	char line[MAX_CMD_LENGTH]{};
-};
-
-struct DEQUEUE_NODE {
-	~DEQUEUE_NODE();
-
+	bool listener = false, batch = false, closing = false;
+	bool ping_inflight = false, want_out = false;
 	char res_id[128]{};
-	int sockd = -1;
-	FIFO fifo{};
-	std::mutex lock, cond_mutex;
-	std::condition_variable waken_cond;
+	std::string rbuf, wbuf;
+	HOST_NODE *host = nullptr;
+	std::deque<std::string> queue;
+	size_t inflight = 0;
+	time_t last_time = 0, sent_time = 0;
 };
 
+/**
+ * @hash:	selected "user:folder" keys and their last SELECT time
+ * @list:	listener connections of this host
+ * @rr:		round-robin position into @list
+ */
 struct HOST_NODE {
-	DOUBLE_LIST_NODE node{};
-	char res_id[128]{};
+	std::string res_id;
 	time_t last_time = 0;
 	std::unordered_map<std::string, time_t> hash;
-	std::vector<std::shared_ptr<DEQUEUE_NODE>> list;
+	std::vector<ev_conn *> list;
+	size_t rr = 0;
+};
+
+struct ev_stats {
+	uint64_t events_in = 0, events_queued = 0, events_delivered = 0;
+	uint64_t frames = 0, dropped = 0, max_depth = 0, conns_refused = 0;
 };
 
 }
 
 static gromox::atomic_bool g_notify_stop;
-static unsigned int g_threads_num;
-static LIB_BUFFER *g_fifo_alloc;
-static LIB_BUFFER *g_file_alloc;
+static unsigned int g_max_conns;
+static int g_epfd = -1;
 static std::vector<std::string> g_acl_list;
-static std::list<ENQUEUE_NODE> g_enqueue_list, g_enqueue_list1;
-static std::vector<std::shared_ptr<DEQUEUE_NODE>> g_dequeue_list1;
-static std::list<HOST_NODE> g_host_list;
-static std::mutex g_enqueue_lock, g_dequeue_lock, g_host_lock;
-static std::mutex g_enqueue_cond_mutex, g_dequeue_cond_mutex;
-static std::condition_variable g_enqueue_waken_cond, g_dequeue_waken_cond;
+static std::unordered_map<int, std::unique_ptr<ev_conn>> g_conns;
+static std::unordered_map<std::string, HOST_NODE> g_host_map;
+/* "user:folder" -> hosts which selected it, to avoid scanning all hosts */
+static std::unordered_map<std::string, std::unordered_set<HOST_NODE *>> g_select_index;
+static ev_stats g_stats;
 static char *opt_config_file;
 static unsigned int opt_show_version;
 
@@ -117,81 +118,11 @@ static struct HXoption g_options_table[] = {
 	HXOPT_TABLEEND,
 };
 
-static void *ev_acceptwork(void *);
-static void *ev_enqwork(void *);
-static void *ev_deqwork(void *);
-static void *ev_scanwork(void *);
-static BOOL read_response(int sockd);
-
-static BOOL read_mark(ENQUEUE_NODE *penqueue);
-
+static void ev_loop(int listen_fd);
 static void term_handler(int signo);
 
-/**
- * A FIFO implemented using a singly-linked list. The core is maintained
- * outside the FIFO, but the FIFO will give back a node-sized memory every time
- * you call deque, unless the FIFO is empty.
- */
-FIFO::FIFO(LIB_BUFFER *pbuf_pool, size_t ds, size_t ms) :
-	mbuf_pool(pbuf_pool), data_size(ds), max_size(ms)
-{
-	if (pbuf_pool == nullptr)
-		throw std::invalid_argument("FIFO with no LIB_BUFFER");
-	single_list_init(&mlist);
-}
-
-/* Returns TRUE on success, or FALSE if the FIFO is full. */
-BOOL FIFO::enqueue(void *pdata)
-{
-#ifdef _DEBUG_UMTA
-	if (pdata == nullptr)
-		debug_info("[fifo]: fifo_enqueue, param nullptr");
-#endif
-	if (cur_size >= max_size)
-		return false;
-	auto node = lib_buffer_get<SINGLE_LIST_NODE>(mbuf_pool);
-	node->pdata = reinterpret_cast<char *>(node) + sizeof(SINGLE_LIST_NODE);
-	memcpy(node->pdata, pdata, data_size);
-	single_list_append_as_tail(&mlist, node);
-	++cur_size;
-	return TRUE;
-}
-
-/**
- * Dequeues the top item from the specified FIFO, and gives back the data size
- * of memory to the outside allocator
- */
-void FIFO::dequeue()
-{
-	if (cur_size <= 0)
-		return;
-	auto node = single_list_pop_front(&mlist);
-	lib_buffer_put(mbuf_pool, node);
-	--cur_size;
-}
-
-/**
- * Returns a pointer to the data at the front of the specified FIFO, or nullptr
- * if the FIFO is empty.
- */
-void *FIFO::get_front()
-{
-	if (cur_size <= 0)
-		return nullptr;
-	auto node = single_list_get_head(&mlist);
-	return node != nullptr ? node->pdata : nullptr;
-}
-
-DEQUEUE_NODE::~DEQUEUE_NODE()
-{
-	if (sockd >= 0)
-		close(sockd);
-}
-
 int main(int argc, const char **argv) try
 {
-	pthread_attr_t thr_attr;
-
 	setvbuf(stdout, nullptr, _IOLBF, 0);
 	if (HX_getopt(g_options_table, &argc, &argv,
 	    HXOPT_USAGEONERR | HXOPT_KEEP_ARGV) != HXOPT_ERR_SUCCESS)
@@ -214,7 +145,7 @@ int main(int argc, const char **argv) try
 		{"config_file_path", PKGSYSCONFDIR "/event:" PKGSYSCONFDIR},
 		{"event_listen_ip", "::1"},
 		{"event_listen_port", "33333"},
-		{"event_threads_num", "50", CFG_SIZE, "1", "1000"},
+		{"event_max_connections", "1000", CFG_SIZE, "4"},
 		{},
 	};
 	config_file_apply(*pconfig, cfg_default_values);
@@ -224,8 +155,10 @@ int main(int argc, const char **argv) try
 	printf("[system]: listen address is [%s]:%hu\n",
 	       *listen_ip == '\0' ? "*" : listen_ip, listen_port);
 
-	g_threads_num = pconfig->get_ll("event_threads_num");
-	printf("[system]: threads number is 2*%d\n", g_threads_num);
+	g_max_conns = pconfig->get_ll("event_max_connections");
+	printf("[system]: maximum number of connections is %u\n", g_max_conns);
+	if (pconfig->get_value("event_threads_num") != nullptr)
+		printf("[system]: event_threads_num is obsolete and ignored\n");
 
 	auto sockd = gx_inet_listen(listen_ip, listen_port);
 	if (sockd < 0) {
@@ -237,64 +170,6 @@ int main(int argc, const char **argv) try
 	auto ret = switch_user_exec(*pconfig, argv);
 	if (ret < 0)
 		return 7;
-	
-	g_threads_num ++;
-	g_fifo_alloc = lib_buffer_init(sizeof(MEM_FILE) + EXTRA_FIFOITEM_SIZE,
-	               g_threads_num * FIFO_AVERAGE_LENGTH, TRUE);
-	if (NULL == g_fifo_alloc) {
-		printf("[system]: Failed to init queue allocator\n");
-		return 3;
-	}
-	auto cl_0 = make_scope_exit([&]() { lib_buffer_free(g_fifo_alloc); });
-	g_file_alloc = lib_buffer_init(FILE_ALLOC_SIZE,
-					g_threads_num*FIFO_AVERAGE_LENGTH, TRUE);
-	if (NULL == g_file_alloc) {
-		printf("[system]: Failed to init file allocator\n");
-		return 4;
-	}
-	auto cl_1 = make_scope_exit([&]() { lib_buffer_free(g_file_alloc); });
-	g_dequeue_list1.reserve(g_threads_num);
-	pthread_attr_init(&thr_attr);
-	auto cl_3 = make_scope_exit([&]() { pthread_attr_destroy(&thr_attr); });
-	pthread_attr_setstacksize(&thr_attr, 1024*1024);
-	
-	std::vector<pthread_t> tidlist;
-	tidlist.reserve(g_threads_num * 2);
-	auto cl_4 = make_scope_exit([&]() {
-		g_enqueue_waken_cond.notify_all();
-		g_dequeue_waken_cond.notify_all();
-		for (auto tid : tidlist) {
-			pthread_kill(tid, SIGALRM);
-			pthread_join(tid, nullptr);
-		}
-	});
-	size_t i;
-	for (i=0; i<g_threads_num; i++) {
-		pthread_t tid;
-		ret = pthread_create(&tid, &thr_attr, ev_enqwork, nullptr);
-		if (ret != 0) {
-			printf("[system]: failed to create enqueue pool thread: %s\n", strerror(ret));
-			break;
-		}
-		tidlist.push_back(tid);
-		char buf[32];
-		snprintf(buf, sizeof(buf), "enqueue/%zu", i);
-		pthread_setname_np(tid, buf);
-
-		ret = pthread_create(&tid, &thr_attr, ev_deqwork, nullptr);
-		if (ret != 0) {
-			printf("[system]: failed to create dequeue pool thread: %s\n", strerror(ret));
-			break;
-		}
-		tidlist.push_back(tid);
-		snprintf(buf, sizeof(buf), "dequeue/%zu", i);
-		pthread_setname_np(tid, buf);
-	}
-	
-	if (i != g_threads_num) {
-		g_notify_stop = true;
-		return 9;
-	}
 
 	ret = list_file_read_fixedstrings("event_acl.txt",
 	           pconfig->get_value("config_file_path"), g_acl_list);
@@ -303,104 +178,374 @@ int main(int argc, const char **argv) try
 		g_acl_list = {"::1"};
 	} else if (ret < 0) {
 		printf("[system]: list_file_initd event_acl.txt: %s\n", strerror(-ret));
-		g_notify_stop = true;
 		return 10;
 	}
 
-	pthread_t acc_thr{}, scan_thr{};
-	ret = pthread_create(&acc_thr, nullptr, ev_acceptwork,
-	      reinterpret_cast<void *>(static_cast<intptr_t>(sockd)));
-	if (ret != 0) {
-		printf("[system]: failed to create accept thread: %s\n", strerror(ret));
-		g_notify_stop = true;
+	g_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (g_epfd < 0) {
+		printf("[system]: epoll_create: %s\n", strerror(errno));
 		return 11;
 	}
-	auto cl_5 = make_scope_exit([&]() {
-		pthread_kill(acc_thr, SIGALRM); /* kick accept() */
-		pthread_join(acc_thr, nullptr);
+	auto cl_3 = make_scope_exit([&]() {
+		g_conns.clear();
+		close(g_epfd);
 	});
-	pthread_setname_np(acc_thr, "accept");
-	ret = pthread_create(&scan_thr, nullptr, ev_scanwork, nullptr);
-	if (ret != 0) {
-		printf("[system]: failed to create scanning thread: %s\n", strerror(ret));
-		g_notify_stop = true;
+	int flags = fcntl(sockd, F_GETFL);
+	fcntl(sockd, F_SETFL, flags | O_NONBLOCK);
+	struct epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.fd = sockd;
+	if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, sockd, &ev) != 0) {
+		printf("[system]: epoll_ctl: %s\n", strerror(errno));
 		return 11;
 	}
-	auto cl_6 = make_scope_exit([&]() {
-		pthread_kill(scan_thr, SIGALRM); /* kick sleep() */
-		pthread_join(scan_thr, nullptr);
-	});
-	pthread_setname_np(scan_thr, "scan");
 
-	sact.sa_handler = [](int) {};
-	sact.sa_flags   = 0;
-	sigaction(SIGALRM, &sact, nullptr);
 	sact.sa_handler = term_handler;
 	sact.sa_flags   = SA_RESETHAND;
 	sigaction(SIGINT, &sact, nullptr);
 	sigaction(SIGTERM, &sact, nullptr);
 	printf("[system]: EVENT is now running\n");
-	while (!g_notify_stop) {
-		sleep(1);
-	}
+	ev_loop(sockd);
 	return 0;
 } catch (const cfg_error &) {
 	return EXIT_FAILURE;
 }
 
-static void *ev_scanwork(void *param)
+static void ev_update_events(ev_conn *c)
 {
-	int i = 0;
-	time_t cur_time;
-	
-	while (!g_notify_stop) {
-		if (i < SCAN_INTERVAL) {
-			sleep(1);
-			i ++;
+	bool want = !c->wbuf.empty();
+	if (want == c->want_out)
+		return;
+	struct epoll_event ev{};
+	ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+	ev.data.fd = c->sockd;
+	epoll_ctl(g_epfd, EPOLL_CTL_MOD, c->sockd, &ev);
+	c->want_out = want;
+}
+
+/*
+ * Write out as much of wbuf as the socket takes. On error, the unsent rest
+ * is discarded, so that a connection marked for closing goes right away.
+ */
+static bool ev_flush(ev_conn *c)
+{
+	while (!c->wbuf.empty()) {
+		auto ret = write(c->sockd, c->wbuf.data(), c->wbuf.size());
+		if (ret < 0 && errno == EINTR)
 			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret <= 0) {
+			c->wbuf.clear();
+			return false;
 		}
-		i = 0;
-		std::unique_lock hl_hold(g_host_lock);
-		time(&cur_time);
-		auto ptail = g_host_list.size() > 0 ? &g_host_list.back() : nullptr;
-		while (g_host_list.size() > 0) {
-			std::list<HOST_NODE> tmp_list;
-			auto phost = &g_host_list.front();
-			tmp_list.splice(tmp_list.end(), g_host_list, g_host_list.begin());
-			if (phost->list.size() == 0 &&
-				cur_time - phost->last_time > HOST_INTERVAL) {
-			} else {
-				for (auto it = phost->hash.begin(); it != phost->hash.end(); ) {
-					if (cur_time - it->second > SELECT_INTERVAL)
-						it = phost->hash.erase(it);
-					else
-						++it;
-				}
-				g_host_list.splice(g_host_list.end(), tmp_list);
+		c->wbuf.erase(0, ret);
+	}
+	ev_update_events(c);
+	return true;
+}
+
+/* Queue output; on failure the connection is marked for closing. */
+static bool ev_send(ev_conn *c, const char *s, size_t len)
+{
+	if (c->wbuf.size() + len > MAX_WBUF_LENGTH) {
+		c->wbuf.clear();
+		c->closing = true;
+		return false;
+	}
+	c->wbuf.append(s, len);
+	if (ev_flush(c))
+		return true;
+	c->closing = true;
+	return false;
+}
+
+static inline bool ev_send(ev_conn *c, const char *s)
+{
+	return ev_send(c, s, strlen(s));
+}
+
+static void host_unselect(HOST_NODE *phost, const std::string &key)
+{
+	auto it = g_select_index.find(key);
+	if (it == g_select_index.end())
+		return;
+	it->second.erase(phost);
+	if (it->second.empty())
+		g_select_index.erase(it);
+}
+
+static bool ev_pump(ev_conn *);
+
+/*
+ * Hand the events still queued on a departing listener to the other live
+ * listeners of its host. The unacknowledged frame is not resent, since the
+ * peer may have acted on it already.
+ */
+static void ev_requeue(ev_conn *c)
+{
+	auto phost = c->host;
+	std::vector<ev_conn *> touched;
+	for (size_t tries = 0; !c->queue.empty() && tries < phost->list.size(); ) {
+		auto l = phost->list[phost->rr++ % phost->list.size()];
+		if (l->closing || l->queue.size() >= MAX_QUEUE_LENGTH) {
+			++tries;
+			continue;
+		}
+		tries = 0;
+		l->queue.emplace_back(std::move(c->queue.front()));
+		c->queue.pop_front();
+		g_stats.max_depth = std::max(g_stats.max_depth,
+		                    static_cast<uint64_t>(l->queue.size()));
+		if (std::find(touched.begin(), touched.end(), l) == touched.end())
+			touched.push_back(l);
+	}
+	for (auto l : touched)
+		ev_pump(l);
+}
+
+static void ev_close(int fd)
+{
+	auto it = g_conns.find(fd);
+	if (it == g_conns.end())
+		return;
+	auto c = it->second.get();
+	if (c->host != nullptr) {
+		auto &l = c->host->list;
+		l.erase(std::remove(l.begin(), l.end(), c), l.end());
+		time(&c->host->last_time);
+		ev_requeue(c);
+	}
+	g_stats.dropped += c->queue.size() + c->inflight;
+	epoll_ctl(g_epfd, EPOLL_CTL_DEL, fd, nullptr);
+	g_conns.erase(it);
+}
+
+/* Write the next frame to a listener if it is not waiting for an ack. */
+static bool ev_pump(ev_conn *c)
+{
+	if (c->inflight > 0 || c->ping_inflight || c->queue.empty())
+		return true;
+	std::string frame;
+	size_t n = 1;
+	if (c->batch && c->queue.size() > 1) {
+		n = std::min(c->queue.size(), static_cast<size_t>(MAX_BATCH_EVENTS));
+		frame = "BATCH " + std::to_string(n) + "\r\n";
+	}
+	for (size_t i = 0; i < n; ++i) {
+		frame += c->queue.front();
+		frame += "\r\n";
+		c->queue.pop_front();
+	}
+	c->inflight = n;
+	time(&c->sent_time);
+	++g_stats.frames;
+	return ev_send(c, frame.data(), frame.size());
+}
+
+static void ev_listener_input(ev_conn *c, const char *line)
+{
+	if (strcasecmp(line, "TRUE") != 0) {
+		c->closing = true;
+		return;
+	}
+	time(&c->last_time);
+	if (c->host != nullptr)
+		c->host->last_time = c->last_time;
+	if (c->ping_inflight) {
+		c->ping_inflight = false;
+	} else if (c->inflight > 0) {
+		g_stats.events_delivered += c->inflight;
+		c->inflight = 0;
+	}
+	ev_pump(c);
+}
+
+/* Build "user:folder" (user part lowercased) from two adjacent fields. */
+static bool ev_make_key(const char *user, size_t ulen, const char *folder,
+    size_t flen, std::string &key)
+{
+	if (ulen > 127 || flen > 63)
+		return false;
+	key.assign(user, ulen);
+	HX_strlower(key.data());
+	key += ':';
+	key.append(folder, flen);
+	return true;
+}
+
+static void ev_cmd_listen(ev_conn *c, const char *res_id)
+{
+	auto &h = g_host_map[res_id];
+	if (h.res_id.empty())
+		h.res_id = res_id;
+	time(&h.last_time);
+	h.list.push_back(c);
+	c->host = &h;
+	c->listener = true;
+	gx_strlcpy(c->res_id, res_id, arsizeof(c->res_id));
+	c->last_time = h.last_time;
+	ev_send(c, "TRUE\r\n", 6);
+}
+
+static void ev_cmd_select(ev_conn *c, const char *args, bool b_select)
+{
+	auto pspace = strchr(args, ' ');
+	std::string key;
+	if (pspace == nullptr || !ev_make_key(args, pspace - args,
+	    pspace + 1, strlen(pspace + 1), key)) {
+		ev_send(c, "FALSE\r\n", 7);
+		return;
+	}
+	auto hit = g_host_map.find(c->res_id);
+	if (!b_select) {
+		if (hit != g_host_map.end()) {
+			hit->second.hash.erase(key);
+			host_unselect(&hit->second, key);
+		}
+		ev_send(c, "TRUE\r\n", 6);
+		return;
+	}
+	if (hit == g_host_map.end()) {
+		ev_send(c, "FALSE\r\n", 7);
+		return;
+	}
+	auto phost = &hit->second;
+	phost->hash[key] = time(nullptr);
+	g_select_index[key].insert(phost);
+	ev_send(c, "TRUE\r\n", 6);
+}
+
+static void ev_notify(ev_conn *c, const char *line)
+{
+	auto pspace = strchr(line, ' ');
+	if (pspace == nullptr) {
+		ev_send(c, "FALSE\r\n", 7);
+		return;
+	}
+	auto pspace1 = strchr(pspace + 1, ' ');
+	if (pspace1 == nullptr) {
+		ev_send(c, "FALSE\r\n", 7);
+		return;
+	}
+	auto pspace2 = strchr(pspace1 + 1, ' ');
+	if (pspace2 == nullptr)
+		pspace2 = pspace1 + strlen(pspace1);
+	std::string key;
+	if (pspace1 - pspace > 128 || pspace2 - pspace1 > 64 ||
+	    !ev_make_key(pspace + 1, pspace1 - pspace - 1, pspace1 + 1,
+	    pspace2 - pspace1 - 1, key)) {
+		ev_send(c, "FALSE\r\n", 7);
+		return;
+	}
+	++g_stats.events_in;
+	auto sel = g_select_index.find(key);
+	if (sel != g_select_index.end()) {
+		for (auto phost : sel->second) {
+			if (phost->res_id == c->res_id || phost->list.empty())
+				continue;
+			/* round-robin over the host's listeners */
+			auto l = phost->list[phost->rr++ % phost->list.size()];
+			if (l->queue.size() >= MAX_QUEUE_LENGTH) {
+				++g_stats.dropped;
+				continue;
 			}
-			if (phost == ptail)
-				break;
+			l->queue.emplace_back(line);
+			++g_stats.events_queued;
+			g_stats.max_depth = std::max(g_stats.max_depth,
+			                    static_cast<uint64_t>(l->queue.size()));
+			ev_pump(l);
 		}
-		hl_hold.unlock();
 	}
-	return NULL;
+	ev_send(c, "TRUE\r\n", 6);
 }
 
-static void *ev_acceptwork(void *param)
+static void ev_command(ev_conn *c, const char *line)
 {
-	socklen_t addrlen;
-	int sockd, sockd2;
-	char client_hostip[40];
-	struct sockaddr_storage peer_name;
-	ENQUEUE_NODE *penqueue;
+	time(&c->last_time);
+	if (0 == strncasecmp(line, "ID ", 3)) {
+		gx_strlcpy(c->res_id, line + 3, arsizeof(c->res_id));
+		ev_send(c, "TRUE\r\n", 6);
+	} else if (0 == strncasecmp(line, "LISTEN ", 7)) {
+		ev_cmd_listen(c, line + 7);
+	} else if (0 == strncasecmp(line, "SELECT ", 7)) {
+		ev_cmd_select(c, line + 7, true);
+	} else if (0 == strncasecmp(line, "UNSELECT ", 9)) {
+		ev_cmd_select(c, line + 9, false);
+	} else if (0 == strcasecmp(line, "CAPA BATCH")) {
+		c->batch = true;
+		ev_send(c, "TRUE\r\n", 6);
+	} else if (0 == strcasecmp(line, "QUIT")) {
+		ev_send(c, "BYE\r\n", 5);
+		c->closing = true;
+	} else if (0 == strcasecmp(line, "PING")) {
+		ev_send(c, "TRUE\r\n", 6);
+	} else if (0 == strcasecmp(line, "STATS")) {
+		char buf[512];
+		snprintf(buf, arsizeof(buf), "TRUE connections=%zu hosts=%zu "
+		         "selections=%zu events_in=%llu queued=%llu delivered=%llu "
+		         "frames=%llu dropped=%llu max_depth=%llu refused=%llu\r\n",
+		         g_conns.size(), g_host_map.size(), g_select_index.size(),
+		         static_cast<unsigned long long>(g_stats.events_in),
+		         static_cast<unsigned long long>(g_stats.events_queued),
+		         static_cast<unsigned long long>(g_stats.events_delivered),
+		         static_cast<unsigned long long>(g_stats.frames),
+		         static_cast<unsigned long long>(g_stats.dropped),
+		         static_cast<unsigned long long>(g_stats.max_depth),
+		         static_cast<unsigned long long>(g_stats.conns_refused));
+		ev_send(c, buf);
+	} else {
+		ev_notify(c, line);
+	}
+}
 
-	sockd = (int)(long)param;
-	while (!g_notify_stop) {
-		/* wait for an incoming connection */
-        addrlen = sizeof(peer_name);
-        sockd2 = accept(sockd, (struct sockaddr*)&peer_name, &addrlen);
-		if (sockd2 < 0)
+static void ev_read(ev_conn *c)
+{
+	char buf[16384];
+	while (true) {
+		auto ret = read(c->sockd, buf, sizeof(buf));
+		if (ret < 0 && errno == EINTR)
 			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret < 0)
+			c->wbuf.clear();
+		if (ret <= 0) {
+			c->closing = true;
+			return;
+		}
+		c->rbuf.append(buf, ret);
+		if (static_cast<size_t>(ret) < sizeof(buf))
+			break;
+	}
+	size_t start = 0;
+	while (!c->closing) {
+		auto pos = c->rbuf.find("\r\n", start);
+		if (pos == c->rbuf.npos)
+			break;
+		c->rbuf[pos] = '\0';
+		auto line = &c->rbuf[start];
+		start = pos + 2;
+		if (c->listener)
+			ev_listener_input(c, line);
+		else
+			ev_command(c, line);
+	}
+	c->rbuf.erase(0, start);
+	if (c->rbuf.size() >= MAX_CMD_LENGTH)
+		c->closing = true;
+}
+
+static void ev_accept(int listen_fd)
+{
+	while (true) {
+		struct sockaddr_storage peer_name;
+		socklen_t addrlen = sizeof(peer_name);
+		int sockd2 = accept4(listen_fd, reinterpret_cast<sockaddr *>(&peer_name),
+		             &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sockd2 < 0)
+			return;
+		char client_hostip[40];
 		int ret = getnameinfo(reinterpret_cast<sockaddr *>(&peer_name),
 		          addrlen, client_hostip, sizeof(client_hostip),
 		          nullptr, 0, NI_NUMERICHOST | NI_NUMERICSERV);
@@ -415,400 +560,147 @@ static void *ev_acceptwork(void *param)
 			close(sockd2);
 			continue;
 		}
-
-		std::unique_lock eq_hold(g_enqueue_lock);
-		if (g_enqueue_list.size() + 1 + g_enqueue_list1.size() >= g_threads_num) {
-			eq_hold.unlock();
+		if (g_conns.size() >= g_max_conns) {
+			++g_stats.conns_refused;
 			write(sockd2, "Maximum Connection Reached!\r\n", 29);
 			close(sockd2);
 			continue;
 		}
+		std::unique_ptr<ev_conn> c;
 		try {
-			g_enqueue_list1.emplace_back();
-			penqueue = &g_enqueue_list1.back();
+			c = std::make_unique<ev_conn>();
 		} catch (const std::bad_alloc &) {
-			eq_hold.unlock();
 			write(sockd2, "ENOMEM\r\n", 8);
 			close(sockd2);
 			continue;
 		}
-
-		penqueue->sockd = sockd2;
-		eq_hold.unlock();
-		write(sockd2, "OK\r\n", 4);
-		g_enqueue_waken_cond.notify_one();
+		c->sockd = sockd2;
+		time(&c->last_time);
+		struct epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.fd = sockd2;
+		if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, sockd2, &ev) != 0)
+			continue;
+		auto pc = c.get();
+		g_conns.emplace(sockd2, std::move(c));
+		if (!ev_send(pc, "OK\r\n", 4))
+			ev_close(sockd2);
 	}
-	return nullptr;
 }
 
-static void *ev_enqwork(void *param)
+/* Once per second: ack timeouts, keepalive PINGs, idle senders. */
+static void ev_timers(time_t cur_time)
 {
-	int temp_len;
-	char *pspace;
-	char *pspace1;
-	char *pspace2;
-	BOOL b_result;
-	time_t cur_time;
-	MEM_FILE temp_file;
-	char temp_string[256];
-	
- NEXT_LOOP:
-	if (g_notify_stop)
-		return nullptr;
-	std::unique_lock cm_hold(g_enqueue_cond_mutex);
-	g_enqueue_waken_cond.wait(cm_hold);
-	cm_hold.unlock();
-	if (g_notify_stop)
-		return nullptr;
-	std::unique_lock eq_hold(g_enqueue_lock);
-	if (g_enqueue_list1.size() == 0)
-		goto NEXT_LOOP;
-	auto eq_node = g_enqueue_list1.begin();
-	auto penqueue = &*eq_node;
-	g_enqueue_list.splice(g_enqueue_list.end(), g_enqueue_list1, eq_node);
-	eq_hold.unlock();
-	
-	while (true) {
-		if (FALSE == read_mark(penqueue)) {
-			eq_hold.lock();
-			g_enqueue_list.erase(eq_node);
-			goto NEXT_LOOP;
-		}
-		
-		if (0 == strncasecmp(penqueue->line, "ID ", 3)) {
-			strncpy(penqueue->res_id, penqueue->line + 3, 128);
-			write(penqueue->sockd, "TRUE\r\n", 6);
+	std::vector<int> dead;
+	for (auto &[fd, cp] : g_conns) {
+		auto c = cp.get();
+		if (c->closing) {
+			/* give a pending BYE some time to drain */
+			if (c->listener || c->wbuf.empty() ||
+			    cur_time - c->last_time >= SOCKET_TIMEOUT)
+				dead.push_back(fd);
 			continue;
-		} else if (0 == strncasecmp(penqueue->line, "LISTEN ", 7)) {
-			HOST_NODE *phost = nullptr;
-			std::shared_ptr<DEQUEUE_NODE> pdequeue;
-			try {
-				pdequeue = std::make_shared<DEQUEUE_NODE>();
-			} catch (const std::bad_alloc &) {
-				write(penqueue->sockd, "FALSE\r\n", 7);
-				continue;
-			}
-			strncpy(pdequeue->res_id, penqueue->line + 7, 128);
-			pdequeue->fifo = FIFO(g_fifo_alloc, sizeof(MEM_FILE), FIFO_AVERAGE_LENGTH);
-			std::unique_lock hl_hold(g_host_lock);
-			auto host_it = std::find_if(g_host_list.begin(), g_host_list.end(),
-			               [&](const HOST_NODE &h) { return strcmp(h.res_id, penqueue->line + 7) == 0; });
-			if (host_it == g_host_list.end()) {
-				try {
-					g_host_list.emplace_back();
-					phost = &g_host_list.back();
-				} catch (const std::bad_alloc &) {
-					hl_hold.unlock();
-					write(penqueue->sockd, "FALSE\r\n", 7);
-					continue;
-				}
-				gx_strlcpy(phost->res_id, penqueue->line + 7, arsizeof(phost->res_id));
-			} else {
-				phost = &*host_it;
-			}
-			time(&phost->last_time);
-			try {
-				phost->list.push_back(pdequeue);
-			} catch (const std::bad_alloc &) {
-				write(pdequeue->sockd, "FALSE\r\n", 7);
-				continue;
-			}
-			try {
-				std::lock_guard dq_hold(g_dequeue_lock);
-				g_dequeue_list1.push_back(pdequeue);
-			} catch (const std::bad_alloc &) {
-				phost->list.pop_back();
-				write(pdequeue->sockd, "FALSE\r\n", 7);
-				continue;
-			}
-			pdequeue->sockd = penqueue->sockd;
-			penqueue->sockd = -1;
-			hl_hold.unlock();
-			write(pdequeue->sockd, "TRUE\r\n", 6);
-			g_dequeue_waken_cond.notify_one();
-			eq_hold.lock();
-			g_enqueue_list.erase(eq_node);
-			goto NEXT_LOOP;
-		} else if (0 == strncasecmp(penqueue->line, "SELECT ", 7)) {
-			pspace = strchr(penqueue->line + 7, ' ');
-			temp_len = pspace - (penqueue->line + 7);
-			if (NULL == pspace ||  temp_len > 127 || strlen(pspace + 1) > 63) {
-				write(penqueue->sockd, "FALSE\r\n", 7);
-				continue;
-			}
-			memcpy(temp_string, penqueue->line + 7, temp_len);
-			temp_string[temp_len] = ':';
-			temp_len ++;
-			temp_string[temp_len] = '\0';
-			HX_strlower(temp_string);
-			strcat(temp_string, pspace + 1);
-			
-			b_result = FALSE;
-			std::unique_lock hl_hold(g_host_lock);
-			for (auto &hnode : g_host_list) {
-				auto phost = &hnode;
-				if (0 == strcmp(penqueue->res_id, phost->res_id)) {
-					time(&cur_time);
-					auto time_it = phost->hash.find(temp_string);
-					if (time_it != phost->hash.end()) {
-						time_it->second = cur_time;
-					} else try {
-						phost->hash.emplace(temp_string, cur_time);
-					} catch (const std::bad_alloc &) {
-					}
-					b_result = TRUE;
-					break;
-				}
-			}
-			hl_hold.unlock();
-			if (b_result)
-				write(penqueue->sockd, "TRUE\r\n", 6);
-			else
-				write(penqueue->sockd, "FALSE\r\n", 7);
-			continue;
-		} else if (0 == strncasecmp(penqueue->line, "UNSELECT ", 9)) {
-			pspace = strchr(penqueue->line + 9, ' ');
-			temp_len = pspace - (penqueue->line + 9);
-			if (NULL == pspace ||  temp_len > 127 || strlen(pspace + 1) > 63) {
-				write(penqueue->sockd, "FALSE\r\n", 7);
-				continue;
-			}
-			memcpy(temp_string, penqueue->line + 9, temp_len);
-			temp_string[temp_len] = ':';
-			temp_len ++;
-			temp_string[temp_len] = '\0';
-			HX_strlower(temp_string);
-			strcat(temp_string, pspace + 1);
-			
-			std::unique_lock hl_hold(g_host_lock);
-			auto phost = std::find_if(g_host_list.begin(), g_host_list.end(),
-			             [&](const HOST_NODE &h) { return strcmp(penqueue->res_id, h.res_id) == 0; });
-			if (phost != g_host_list.end())
-				phost->hash.erase(temp_string);
-			hl_hold.unlock();
-			write(penqueue->sockd, "TRUE\r\n", 6);
-			continue;
-		} else if (0 == strcasecmp(penqueue->line, "QUIT")) {
-			write(penqueue->sockd, "BYE\r\n", 5);
-			eq_hold.lock();
-			g_enqueue_list.erase(eq_node);
-			goto NEXT_LOOP;
-		} else if (0 == strcasecmp(penqueue->line, "PING")) {
-			write(penqueue->sockd, "TRUE\r\n", 6);	
+		}
+		if (!c->listener) {
+			if (cur_time - c->last_time >= SOCKET_TIMEOUT)
+				dead.push_back(fd);
 			continue;
-		} else {
-			pspace = strchr(penqueue->line, ' ');
-			if (NULL == pspace) {
-				write(penqueue->sockd, "FALSE\r\n", 7);
-				continue;
-			}
-			pspace1 = strchr(pspace + 1, ' ');
-			if (NULL == pspace1) {
-				write(penqueue->sockd, "FALSE\r\n", 7);
-				continue;
-			}
-			pspace2 = strchr(pspace1 + 1, ' ');
-			if (pspace2 == nullptr)
-				pspace2 = penqueue->line + strlen(penqueue->line);
-			if (pspace1 - pspace > 128 || pspace2 - pspace1 > 64) {
-				write(penqueue->sockd, "FALSE\r\n", 7);
-				continue;
-			}
-			temp_len = pspace1 - (pspace + 1);
-			memcpy(temp_string, pspace + 1, temp_len);
-			temp_string[temp_len] = ':';
-			temp_len ++;
-			temp_string[temp_len] = '\0';
-			HX_strlower(temp_string);
-			memcpy(temp_string + temp_len, pspace1 + 1, pspace2 - pspace1 - 1);
-			temp_string[temp_len + (pspace2 - pspace1 - 1)] = '\0';
-
-			std::unique_lock hl_hold(g_host_lock);
-			for (auto &hnode : g_host_list) {
-				auto phost = &hnode;
-				if (0 == strcmp(penqueue->res_id, phost->res_id) ||
-				    phost->hash.find(temp_string) == phost->hash.cend())
-					continue;
-				
-				if (phost->list.size() > 0) {
-					auto pdequeue = phost->list.front();
-					phost->list.erase(phost->list.begin());
-					mem_file_init(&temp_file, g_file_alloc);
-					temp_file.write(penqueue->line, strlen(penqueue->line));
-					std::unique_lock dl_hold(pdequeue->lock);
-					b_result = pdequeue->fifo.enqueue(&temp_file);
-					dl_hold.unlock();
-					if (!b_result)
-						mem_file_free(&temp_file);
-					else
-						pdequeue->waken_cond.notify_one();
-					phost->list.push_back(pdequeue);
-				}
-			}
-			hl_hold.unlock();
-			write(penqueue->sockd, "TRUE\r\n", 6);
+		}
+		if (c->inflight > 0 || c->ping_inflight) {
+			if (cur_time - c->sent_time >= SOCKET_TIMEOUT)
+				dead.push_back(fd);
 			continue;
 		}
+		if (cur_time - c->last_time >= SOCKET_TIMEOUT - 3) {
+			c->ping_inflight = true;
+			c->sent_time = cur_time;
+			if (!ev_send(c, "PING\r\n", 6))
+				dead.push_back(fd);
+		}
 	}
-	return NULL;
+	for (auto fd : dead)
+		ev_close(fd);
 }
 
-static void *ev_deqwork(void *param)
+static void ev_scan(time_t cur_time)
 {
-	time_t cur_time;
-	time_t last_time;
-	MEM_FILE temp_file;
-	char buff[MAX_CMD_LENGTH];
-	
- NEXT_LOOP:
-	std::unique_lock dc_hold(g_dequeue_cond_mutex);
-	g_dequeue_waken_cond.wait(dc_hold);
-	dc_hold.unlock();
-	if (g_notify_stop)
-		return nullptr;
-	std::unique_lock dq_hold(g_dequeue_lock);
-	if (g_dequeue_list1.size() == 0)
-		goto NEXT_LOOP;
-	auto pdequeue = g_dequeue_list1.front();
-	g_dequeue_list1.erase(g_dequeue_list1.begin());
-	dq_hold.unlock();
-	
-	time(&last_time);
-	std::unique_lock hl_hold(g_host_lock);
-	auto phost = std::find_if(g_host_list.begin(), g_host_list.end(),
-	             [&](const HOST_NODE &h) { return strcmp(h.res_id, pdequeue->res_id) == 0; });
-	if (phost == g_host_list.end())
-		goto NEXT_LOOP;
-	hl_hold.unlock();
-	
-	while (!g_notify_stop) {
-		dc_hold.lock();
-		pdequeue->waken_cond.wait_for(dc_hold, std::chrono::seconds(1));
-		dc_hold.unlock();
-		if (g_notify_stop)
-			break;
-		dq_hold.lock();
-		auto pfile = static_cast<MEM_FILE *>(pdequeue->fifo.get_front());
-		if (NULL != pfile) {
-			temp_file = *pfile;
-			pdequeue->fifo.dequeue();
-		}
-		dq_hold.unlock();
-		time(&cur_time);
-		
-		if (NULL == pfile) {	
-			if (cur_time - last_time >= SOCKET_TIMEOUT - 3) {
-				if (6 != write(pdequeue->sockd, "PING\r\n", 6) ||
-					FALSE == read_response(pdequeue->sockd)) {
-					hl_hold.lock();
-					auto it = std::find(phost->list.begin(), phost->list.end(), pdequeue);
-					if (it != phost->list.end())
-						phost->list.erase(it);
-					hl_hold.unlock();
-					close(pdequeue->sockd);
-					pdequeue->sockd = -1;
-					while ((pfile = static_cast<MEM_FILE *>(pdequeue->fifo.get_front())) != nullptr) {
-						mem_file_free(pfile);
-						pdequeue->fifo.dequeue();
-					}
-					goto NEXT_LOOP;
-				}
-				last_time = cur_time;
-				hl_hold.lock();
-				phost->last_time = cur_time;
-				hl_hold.unlock();
-			}
+	for (auto it = g_host_map.begin(); it != g_host_map.end(); ) {
+		auto phost = &it->second;
+		if (phost->list.size() == 0 &&
+		    cur_time - phost->last_time > HOST_INTERVAL) {
+			for (const auto &e : phost->hash)
+				host_unselect(phost, e.first);
+			it = g_host_map.erase(it);
 			continue;
 		}
-		
-		int len = temp_file.read(buff, arsizeof(buff) - 2);
-		buff[len] = '\r';
-		len ++;
-		buff[len] = '\n';
-		len ++;
-		mem_file_free(&temp_file);
-		if (len != write(pdequeue->sockd, buff, len) ||
-			FALSE == read_response(pdequeue->sockd)) {
-			hl_hold.lock();
-			auto it = std::find(phost->list.begin(), phost->list.end(), pdequeue);
-			if (it != phost->list.end())
-				phost->list.erase(it);
-			hl_hold.unlock();
-			close(pdequeue->sockd);
-			pdequeue->sockd = -1;
-			while ((pfile = static_cast<MEM_FILE *>(pdequeue->fifo.get_front())) != nullptr) {
-				mem_file_free(pfile);
-				pdequeue->fifo.dequeue();
+		for (auto hi = phost->hash.begin(); hi != phost->hash.end(); ) {
+			if (cur_time - hi->second > SELECT_INTERVAL) {
+				host_unselect(phost, hi->first);
+				hi = phost->hash.erase(hi);
+			} else {
+				++hi;
 			}
-			goto NEXT_LOOP;
 		}
-		
-		last_time = cur_time;
-		hl_hold.lock();
-		phost->last_time = cur_time;
-		hl_hold.unlock();
-	}	
-	return NULL;
-}
-
-static BOOL read_response(int sockd)
-{
-	fd_set myset;
-	int offset;
-	int read_len;
-	char buff[1024];
-	struct timeval tv;
-
-	offset = 0;
-	while (true) {
-		tv.tv_usec = 0;
-		tv.tv_sec = SOCKET_TIMEOUT;
-		FD_ZERO(&myset);
-		FD_SET(sockd, &myset);
-		if (select(sockd + 1, &myset, nullptr, nullptr, &tv) <= 0)
-			return FALSE;
-		read_len = read(sockd, buff + offset, 1024 - offset);
-		if (read_len <= 0)
-			return FALSE;
-		offset += read_len;
-		if (offset == 6)
-			return strncasecmp(buff, "TRUE\r\n", 6) == 0 ? TRUE : false;
-		if (offset > 6)
-			return FALSE;
+		++it;
 	}
+	printf("[system]: %zu connections, %zu hosts; events: %llu in, "
+	       "%llu delivered in %llu frames, %llu dropped, max backlog %llu\n",
+	       g_conns.size(), g_host_map.size(),
+	       static_cast<unsigned long long>(g_stats.events_in),
+	       static_cast<unsigned long long>(g_stats.events_delivered),
+	       static_cast<unsigned long long>(g_stats.frames),
+	       static_cast<unsigned long long>(g_stats.dropped),
+	       static_cast<unsigned long long>(g_stats.max_depth));
 }
 
-static BOOL read_mark(ENQUEUE_NODE *penqueue)
+/**
+ * All connections are served by this single epoll loop. The broker only
+ * does hash lookups and buffer copies per event, so one thread keeps up
+ * with many worker processes, and the host/selection tables need no locks.
+ */
+static void ev_loop(int listen_fd)
 {
-	fd_set myset;
-	int i, read_len;
-	struct timeval tv;
+	struct epoll_event events[256];
+	time_t last_tick = time(nullptr), last_scan = last_tick;
 
-	while (true) {
-		tv.tv_usec = 0;
-		tv.tv_sec = SOCKET_TIMEOUT;
-		FD_ZERO(&myset);
-		FD_SET(penqueue->sockd, &myset);
-		if (select(penqueue->sockd + 1, &myset, nullptr, nullptr, &tv) <= 0)
-			return FALSE;
-		read_len = read(penqueue->sockd, penqueue->buffer +
-		penqueue->offset, MAX_CMD_LENGTH - penqueue->offset);
-		if (read_len <= 0)
-			return FALSE;
-		penqueue->offset += read_len;
-		for (i=0; i<penqueue->offset-1; i++) {
-			if ('\r' == penqueue->buffer[i] &&
-				'\n' == penqueue->buffer[i + 1]) {
-				memcpy(penqueue->line, penqueue->buffer, i);
-				penqueue->line[i] = '\0';
-				penqueue->offset -= i + 2;
-				memmove(penqueue->buffer, penqueue->buffer + i + 2,
-					penqueue->offset);
-				return TRUE;
+	while (!g_notify_stop) {
+		int num = epoll_wait(g_epfd, events, arsizeof(events), 1000);
+		if (num < 0 && errno != EINTR) {
+			printf("[system]: epoll_wait: %s\n", strerror(errno));
+			break;
+		}
+		for (int i = 0; i < num; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == listen_fd) {
+				ev_accept(listen_fd);
+				continue;
+			}
+			auto it = g_conns.find(fd);
+			if (it == g_conns.end())
+				continue;
+			auto c = it->second.get();
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				c->wbuf.clear();
+				c->closing = true;
 			}
+			/* keep draining a closing connection, e.g. a partial BYE */
+			if ((events[i].events & EPOLLOUT) && !ev_flush(c))
+				c->closing = true;
+			if (!c->closing && (events[i].events & EPOLLIN))
+				ev_read(c);
+			/* QUIT: close once BYE has been written out */
+			if (c->closing && (c->listener || c->wbuf.empty()))
+				ev_close(fd);
+		}
+		auto cur_time = time(nullptr);
+		if (cur_time != last_tick) {
+			last_tick = cur_time;
+			ev_timers(cur_time);
+		}
+		if (cur_time - last_scan >= SCAN_INTERVAL) {
+			last_scan = cur_time;
+			ev_scan(cur_time);
 		}
-		if (penqueue->offset == MAX_CMD_LENGTH)
-			return FALSE;
 	}
 }
 
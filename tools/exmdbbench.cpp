@@ -0,0 +1,898 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later WITH linking exception
+// This file is part of Gromox.
+/*
+ * Offline load generator for exmdb_provider.
+ *
+ * A number of private stores is created in a scratch directory with the
+ * same code as gromox-mkprivate. libgxs_exmdb_provider.so is then loaded
+ * in-process through the regular service plugin loader and listens on
+ * [::1]. The user directory lookups it normally obtains from mysql_adaptor
+ * are answered by stubs here, so no database server is needed. Client
+ * threads drive a weighted mix of operations against random stores through
+ * the exmdb_client_remote RPC stubs, i.e. with the same request
+ * serialization and socket protocol as midb, zcore or emsmdb in a
+ * multi-host setup. Every RPC is timed, and throughput plus latency
+ * percentiles are printed per call type at the end.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <unistd.h>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <libHX/io.h>
+#include <libHX/option.h>
+#include <libHX/string.h>
+#include <gromox/alloc_context.hpp>
+#include <gromox/config_file.hpp>
+#include <gromox/defs.h>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/ext_buffer.hpp>
+#include <gromox/fileio.h>
+#include <gromox/idset.hpp>
+#include <gromox/mail.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/mime_pool.hpp>
+#include <gromox/paths.h>
+#include <gromox/pcl.hpp>
+#include <gromox/proptags.hpp>
+#include <gromox/rop_util.hpp>
+#include <gromox/scope.hpp>
+#include <gromox/socket.h>
+#include <gromox/textmaps.hpp>
+#include "../exch/http/service.h"
+#include "../exch/mysql_adaptor/mysql_adaptor.h"
+#include "mkshared.hpp"
+
+#define SERVICE_ID_LANG_TO_CHARSET							1
+#define SERVICE_ID_CPID_TO_CHARSET							2
+#define SERVICE_ID_GET_USER_DISPLAYNAME						3
+#define SERVICE_ID_CHECK_MLIST_INCLUDE						4
+#define SERVICE_ID_GET_USER_LANG							5
+#define SERVICE_ID_GET_TIMEZONE								6
+#define SERVICE_ID_GET_MAILDIR								7
+#define SERVICE_ID_GET_ID_FFROM_USERNAME					8
+#define SERVICE_ID_GET_USERNAME_FROM_ID						9
+#define SERVICE_ID_GET_USER_IDS								10
+#define SERVICE_ID_GET_DOMAIN_IDS							11
+#define SERVICE_ID_GET_ID_FROM_MAILDIR						12
+#define SERVICE_ID_GET_ID_FROM_HOMEDIR						13
+#define SERVICE_ID_SEND_MAIL								14
+#define SERVICE_ID_GET_MIME_POOL							15
+#define SERVICE_ID_LOG_INFO									16
+#define SERVICE_ID_GET_HANDLE								17
+
+/* rows fetched per query_table, like one screenful in a client */
+#define TABLE_ROWS 50
+
+using namespace gromox;
+using clk = std::chrono::steady_clock;
+
+namespace {
+
+enum bench_op { BO_TABLE, BO_PROPS, BO_WRITE, BO_MOVE, BO_SYNC, BO_MAX };
+enum bench_result { BR_OK, BR_FAIL, BR_SKIP };
+
+struct bench_store {
+	std::string dir, username;
+	unsigned int user_id = 0;
+	std::mutex lock;
+	std::vector<uint64_t> mids; /* messages in the inbox */
+};
+
+struct bench_thread {
+	/* RPC latencies in microseconds, indexed by exmdb call id */
+	std::vector<std::vector<uint32_t>> usec{256};
+	std::vector<size_t> rpc_fail = std::vector<size_t>(256);
+	size_t ops[BO_MAX]{}, op_fail[BO_MAX]{}, op_skip[BO_MAX]{};
+};
+
+struct bin_delete {
+	void operator()(BINARY *x) const { rop_util_free_binary(x); }
+	void operator()(IDSET *x) const { idset_free(x); }
+};
+
+}
+
+std::shared_ptr<CONFIG_FILE> g_config_file;
+static unsigned int g_nstores = 4, g_nmsgs = 200, g_nthreads = 8;
+static unsigned int g_duration = 10, g_body_size = 2048, g_seed = 1;
+static unsigned int g_port, g_keep;
+static char *g_mix_spec, *g_plugin_dir, *g_datadir, *g_base_cfg, *g_workdir;
+static unsigned int g_mix[BO_MAX] = {30, 40, 15, 10, 5};
+static constexpr const char *g_op_names[] = {"table", "props", "write", "move", "sync"};
+static std::string g_userdir, g_body;
+static std::vector<std::unique_ptr<bench_store>> g_stores;
+static std::shared_ptr<MIME_POOL> g_mime_pool;
+static std::atomic<unsigned int> g_conn_serial;
+static thread_local int t_sockd = -1;
+static thread_local ALLOC_CONTEXT *t_arena;
+static thread_local bench_thread *t_stats;
+
+static constexpr HXoption g_options_table[] = {
+	{nullptr, 'C', HXTYPE_STRING, &g_base_cfg, nullptr, nullptr, 0, "exmdb_provider.cfg to take settings from", "FILE"},
+	{nullptr, 'M', HXTYPE_UINT, &g_nmsgs, nullptr, nullptr, 0, "Messages per store before the run (default: 200)", "N"},
+	{nullptr, 'P', HXTYPE_STRING, &g_plugin_dir, nullptr, nullptr, 0, "Directory with libgxs_exmdb_provider.so", "DIR"},
+	{nullptr, 'S', HXTYPE_UINT, &g_seed, nullptr, nullptr, 0, "Random seed (default: 1)", "N"},
+	{nullptr, 'T', HXTYPE_UINT, &g_duration, nullptr, nullptr, 0, "Run time in seconds (default: 10)", "SECS"},
+	{nullptr, 'b', HXTYPE_UINT, &g_body_size, nullptr, nullptr, 0, "Body size of written messages (default: 2048)", "BYTES"},
+	{nullptr, 'd', HXTYPE_STRING, &g_datadir, nullptr, nullptr, 0, "Data directory", "DIR"},
+	{nullptr, 'k', HXTYPE_NONE, &g_keep, nullptr, nullptr, 0, "Keep the scratch directory"},
+	{nullptr, 'm', HXTYPE_STRING, &g_mix_spec, nullptr, nullptr, 0, "Operation mix (default: table=30,props=40,write=15,move=10,sync=5)", "SPEC"},
+	{nullptr, 'n', HXTYPE_UINT, &g_nstores, nullptr, nullptr, 0, "Number of stores (default: 4)", "N"},
+	{nullptr, 'p', HXTYPE_UINT, &g_port, nullptr, nullptr, 0, "Listen port (default: any free one)", "PORT"},
+	{nullptr, 't', HXTYPE_UINT, &g_nthreads, nullptr, nullptr, 0, "Client threads (default: 8)", "N"},
+	{nullptr, 'w', HXTYPE_STRING, &g_workdir, nullptr, nullptr, 0, "Where to create the scratch directory (default: /tmp)", "DIR"},
+	HXOPT_AUTOHELP,
+	HXOPT_TABLEEND,
+};
+
+/*
+ * Stand-ins for the mysql_adaptor functions used by exmdb_provider. User
+ * bench<N>@localhost has ID N and the maildir <userdir>/<N>.
+ */
+static unsigned int bs_user_id(const char *username)
+{
+	unsigned int id = 0;
+	char at = '\0';
+	if (sscanf(username, "bench%u%c", &id, &at) != 2 || at != '@' ||
+	    strcasecmp(strchr(username, '@'), "@localhost") != 0 ||
+	    id == 0 || id > g_stores.size())
+		return 0;
+	return id;
+}
+
+static bool bs_get_maildir(const char *username, char *maildir, size_t size)
+{
+	auto id = bs_user_id(username);
+	if (id == 0)
+		return false;
+	gx_strlcpy(maildir, g_stores[id-1]->dir.c_str(), size);
+	return true;
+}
+
+static BOOL bs_get_id_from_username(const char *username, int *user_id)
+{
+	auto id = bs_user_id(username);
+	if (id == 0)
+		return false;
+	*user_id = id;
+	return TRUE;
+}
+
+static BOOL bs_get_id_from_maildir(const char *maildir, int *user_id)
+{
+	for (const auto &st : g_stores) {
+		if (st->dir != maildir)
+			continue;
+		*user_id = st->user_id;
+		return TRUE;
+	}
+	return false;
+}
+
+static BOOL bs_get_username_from_id(int user_id, char *username, size_t size)
+{
+	if (user_id <= 0 || static_cast<size_t>(user_id) > g_stores.size())
+		return false;
+	gx_strlcpy(username, g_stores[user_id-1]->username.c_str(), size);
+	return TRUE;
+}
+
+static BOOL bs_get_user_ids(const char *username, int *user_id,
+    int *domain_id, enum display_type *dtypx)
+{
+	auto id = bs_user_id(username);
+	if (id == 0)
+		return false;
+	*user_id = id;
+	*domain_id = 1;
+	if (dtypx != nullptr)
+		*dtypx = DT_MAILUSER;
+	return TRUE;
+}
+
+static bool bs_get_user_displayname(const char *username, char *dispname, size_t size)
+{
+	gx_strlcpy(dispname, username, size);
+	return true;
+}
+
+static bool bs_get_user_lang(const char *username, char *lang, size_t size)
+{
+	gx_strlcpy(lang, "en", size);
+	return true;
+}
+
+static bool bs_get_timezone(const char *username, char *tz, size_t size)
+{
+	if (size > 0)
+		*tz = '\0';
+	return true;
+}
+
+static BOOL bs_check_mlist_include(const char *mlist_name, const char *account)
+{
+	return false;
+}
+
+static BOOL bs_get_domain_ids(const char *domainname, int *domain_id, int *org_id)
+{
+	if (strcasecmp(domainname, "localhost") != 0)
+		return false;
+	*domain_id = 1;
+	*org_id = 0;
+	return TRUE;
+}
+
+static BOOL bs_get_id_from_homedir(const char *homedir, int *domain_id)
+{
+	return false; /* no public stores */
+}
+
+static BOOL bs_lang_to_charset(const char *lang, char *cset)
+{
+	if (lang == nullptr)
+		return false;
+	auto r = lang_to_charset(lang);
+	if (r == nullptr)
+		return false;
+	gx_strlcpy(cset, r, 32);
+	return TRUE;
+}
+
+static BOOL bs_send_mail(MAIL *, const char *, DOUBLE_LIST *)
+{
+	return false;
+}
+
+static std::shared_ptr<MIME_POOL> bs_get_mime_pool()
+{
+	return g_mime_pool;
+}
+
+static void bs_log_info(unsigned int level, const char *fmt, ...)
+{
+	if (level > LV_WARN)
+		return;
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+static const GUID *bs_get_handle()
+{
+	return nullptr;
+}
+
+static void bench_pass_services(void (*pass)(int, void *))
+{
+#define E(id, type, f) pass((id), reinterpret_cast<void *>(static_cast<type>(f)))
+#define M(id, s, f) E((id), decltype(&mysql_adaptor_ ## s), (f))
+	E(SERVICE_ID_LANG_TO_CHARSET, BOOL (*)(const char *, char *), bs_lang_to_charset);
+	E(SERVICE_ID_CPID_TO_CHARSET, const char *(*)(uint32_t), cpid_to_cset);
+	M(SERVICE_ID_GET_USER_DISPLAYNAME, get_user_displayname, bs_get_user_displayname);
+	M(SERVICE_ID_CHECK_MLIST_INCLUDE, check_mlist_include, bs_check_mlist_include);
+	M(SERVICE_ID_GET_USER_LANG, get_user_lang, bs_get_user_lang);
+	M(SERVICE_ID_GET_TIMEZONE, get_timezone, bs_get_timezone);
+	M(SERVICE_ID_GET_MAILDIR, get_maildir, bs_get_maildir);
+	M(SERVICE_ID_GET_ID_FFROM_USERNAME, get_id_from_username, bs_get_id_from_username);
+	M(SERVICE_ID_GET_USERNAME_FROM_ID, get_username_from_id, bs_get_username_from_id);
+	M(SERVICE_ID_GET_USER_IDS, get_user_ids, bs_get_user_ids);
+	M(SERVICE_ID_GET_DOMAIN_IDS, get_domain_ids, bs_get_domain_ids);
+	M(SERVICE_ID_GET_ID_FROM_MAILDIR, get_id_from_maildir, bs_get_id_from_maildir);
+	M(SERVICE_ID_GET_ID_FROM_HOMEDIR, get_id_from_homedir, bs_get_id_from_homedir);
+	E(SERVICE_ID_SEND_MAIL, BOOL (*)(MAIL *, const char *, DOUBLE_LIST *), bs_send_mail);
+	E(SERVICE_ID_GET_MIME_POOL, std::shared_ptr<MIME_POOL> (*)(), bs_get_mime_pool);
+	E(SERVICE_ID_LOG_INFO, void (*)(unsigned int, const char *, ...), bs_log_info);
+	E(SERVICE_ID_GET_HANDLE, const GUID *(*)(), bs_get_handle);
+#undef M
+#undef E
+}
+
+/*
+ * exmdb_provider allocates from ndr_stack_alloc when it runs outside one
+ * of its own RPC threads. That is the case for exmdb_rpc_alloc on the
+ * client threads, since the plugin and this program share libgromox_exrpc
+ * and the plugin installs its allocator there.
+ */
+static void *bench_ndr_alloc(int, size_t size)
+{
+	return t_arena != nullptr ? alloc_context_alloc(t_arena, size) : nullptr;
+}
+
+static int bench_connect()
+{
+	wrapfd fd(gx_inet_connect("::1", g_port, 0));
+	if (fd.get() < 0) {
+		fprintf(stderr, "exmdbbench: connect [::1]:%u: %s\n",
+		        g_port, strerror(-fd.get()));
+		return -1;
+	}
+	char rid[64];
+	snprintf(rid, arsizeof(rid), "exmdbbench:%ld:%u",
+	         static_cast<long>(getpid()), ++g_conn_serial);
+	auto prefix = g_userdir + "/";
+	EXMDB_REQUEST rq;
+	rq.call_id = exmdb_callid::CONNECT;
+	rq.payload.connect.prefix    = deconst(prefix.c_str());
+	rq.payload.connect.remote_id = rid;
+	rq.payload.connect.b_private = TRUE;
+	BINARY tb{};
+	if (exmdb_ext_push_request(&rq, &tb) != EXT_ERR_SUCCESS ||
+	    !exmdb_client_write_socket(fd.get(), &tb)) {
+		free(tb.pb);
+		fprintf(stderr, "exmdbbench: protocol failure during connect\n");
+		return -1;
+	}
+	free(tb.pb);
+	if (!exmdb_client_read_socket(fd.get(), &tb)) {
+		fprintf(stderr, "exmdbbench: protocol failure during connect\n");
+		return -1;
+	}
+	auto code = tb.cb > 0 ? tb.pb[0] : exmdb_response::DISPATCH_ERROR;
+	auto len = tb.cb;
+	free(tb.pb);
+	if (code != exmdb_response::SUCCESS || len != 5) {
+		fprintf(stderr, "exmdbbench: connect: %s\n", exmdb_rpc_strerror(code));
+		return -1;
+	}
+	return fd.release();
+}
+
+static BOOL bench_rpc_exec1(const EXMDB_REQUEST *prequest, EXMDB_RESPONSE *presponse)
+{
+	if (t_sockd < 0 && (t_sockd = bench_connect()) < 0)
+		return false;
+	BINARY tb;
+	if (exmdb_ext_push_request(prequest, &tb) != EXT_ERR_SUCCESS)
+		return false;
+	if (!exmdb_client_write_socket(t_sockd, &tb)) {
+		free(tb.pb);
+		close(t_sockd);
+		t_sockd = -1;
+		return false;
+	}
+	free(tb.pb);
+	if (!exmdb_client_read_socket(t_sockd, &tb)) {
+		close(t_sockd);
+		t_sockd = -1;
+		return false;
+	}
+	auto cl_0 = make_scope_exit([&]() { free(tb.pb); });
+	if (tb.cb < 5 || tb.pb[0] != exmdb_response::SUCCESS)
+		return false;
+	presponse->call_id = prequest->call_id;
+	BINARY tb2 = tb;
+	tb2.cb -= 5;
+	tb2.pb += 5;
+	return exmdb_ext_pull_response(&tb2, presponse) == EXT_ERR_SUCCESS ? TRUE : false;
+}
+
+static BOOL bench_rpc_exec(const char *dir, const EXMDB_REQUEST *prequest,
+    EXMDB_RESPONSE *presponse)
+{
+	auto start = clk::now();
+	auto ok = bench_rpc_exec1(prequest, presponse);
+	if (!ok) {
+		++t_stats->rpc_fail[prequest->call_id];
+		return false;
+	}
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(clk::now() - start).count();
+	t_stats->usec[prequest->call_id].push_back(std::min<int64_t>(us, UINT32_MAX));
+	return TRUE;
+}
+
+static const char *bench_rpc_name(unsigned int id)
+{
+	switch (id) {
+	case exmdb_callid::ALLOCATE_CN: return "allocate_cn";
+	case exmdb_callid::ALLOCATE_MESSAGE_ID: return "allocate_message_id";
+	case exmdb_callid::GET_CONTENT_SYNC: return "get_content_sync";
+	case exmdb_callid::GET_MESSAGE_PROPERTIES: return "get_message_properties";
+	case exmdb_callid::LOAD_CONTENT_TABLE: return "load_content_table";
+	case exmdb_callid::MOVECOPY_MESSAGES: return "movecopy_messages";
+	case exmdb_callid::QUERY_TABLE: return "query_table";
+	case exmdb_callid::UNLOAD_TABLE: return "unload_table";
+	case exmdb_callid::WRITE_MESSAGE: return "write_message";
+	}
+	return nullptr;
+}
+
+static bench_result op_table(bench_store &st)
+{
+	static constexpr uint32_t tags[] = {
+		PidTagMid, PR_SUBJECT, PROP_TAG_MESSAGEDELIVERYTIME,
+		PR_MESSAGE_SIZE, PR_MESSAGE_FLAGS,
+	};
+	SORT_ORDER sort{PROP_TYPE(PROP_TAG_MESSAGEDELIVERYTIME),
+		PROP_ID(PROP_TAG_MESSAGEDELIVERYTIME), TABLE_SORT_DESCEND};
+	SORTORDER_SET sorts{1, 0, 0, &sort};
+	PROPTAG_ARRAY proptags{arsizeof(tags), deconst(tags)};
+	uint32_t table_id = 0, row_count = 0;
+	TARRAY_SET rows{};
+	auto dir = st.dir.c_str();
+	if (!exmdb_client_remote::load_content_table(dir, 65001,
+	    rop_util_make_eid_ex(1, PRIVATE_FID_INBOX), nullptr, 0, nullptr,
+	    &sorts, &table_id, &row_count))
+		return BR_FAIL;
+	auto ok = exmdb_client_remote::query_table(dir, nullptr, 65001,
+	          table_id, &proptags, 0, TABLE_ROWS, &rows);
+	if (!exmdb_client_remote::unload_table(dir, table_id))
+		ok = false;
+	return ok ? BR_OK : BR_FAIL;
+}
+
+static bench_result op_props(bench_store &st, std::mt19937 &rng)
+{
+	static constexpr uint32_t tags[] = {
+		PR_SUBJECT, PR_BODY, PR_MESSAGE_CLASS, PR_MESSAGE_SIZE,
+		PR_MESSAGE_FLAGS, PR_LAST_MODIFICATION_TIME, PR_CHANGE_KEY,
+	};
+	uint64_t mid;
+	{
+		std::lock_guard hold(st.lock);
+		if (st.mids.empty())
+			return BR_SKIP;
+		mid = st.mids[rng() % st.mids.size()];
+	}
+	PROPTAG_ARRAY proptags{arsizeof(tags), deconst(tags)};
+	TPROPVAL_ARRAY props{};
+	return exmdb_client_remote::get_message_properties(st.dir.c_str(),
+	       nullptr, 65001, mid, &proptags, &props) ? BR_OK : BR_FAIL;
+}
+
+static bench_result op_write(bench_store &st, std::mt19937 &rng)
+{
+	auto dir = st.dir.c_str();
+	auto fid = rop_util_make_eid_ex(1, PRIVATE_FID_INBOX);
+	uint64_t mid = 0, change_num = 0;
+	if (!exmdb_client_remote::allocate_message_id(dir, fid, &mid) ||
+	    !exmdb_client_remote::allocate_cn(dir, &change_num))
+		return BR_FAIL;
+
+	XID zxid{rop_util_make_user_guid(st.user_id), change_num};
+	char xidbuf[22];
+	EXT_PUSH ep;
+	if (!ep.init(xidbuf, arsizeof(xidbuf), 0) ||
+	    ep.p_xid(zxid) != EXT_ERR_SUCCESS)
+		return BR_FAIL;
+	BINARY change_key;
+	change_key.pv = xidbuf;
+	change_key.cb = ep.m_offset;
+	PCL pcl;
+	if (!pcl.append(zxid))
+		return BR_FAIL;
+	std::unique_ptr<BINARY, bin_delete> pclbin(pcl.serialize());
+	if (pclbin == nullptr)
+		return BR_FAIL;
+	char subject[64];
+	snprintf(subject, arsizeof(subject), "exmdbbench %08x", static_cast<unsigned int>(rng()));
+	auto now = rop_util_current_nttime();
+	TAGGED_PROPVAL pv[] = {
+		{PidTagMid, &mid},
+		{PidTagChangeNumber, &change_num},
+		{PR_CHANGE_KEY, &change_key},
+		{PR_PREDECESSOR_CHANGE_LIST, pclbin.get()},
+		{PR_MESSAGE_CLASS, deconst("IPM.Note")},
+		{PR_SUBJECT, subject},
+		{PROP_TAG_MESSAGEDELIVERYTIME, &now},
+		{PR_LAST_MODIFICATION_TIME, &now},
+		{PR_BODY, deconst(g_body.c_str())},
+	};
+	MESSAGE_CONTENT ctnt{};
+	ctnt.proplist.count = g_body.empty() ? arsizeof(pv) - 1 : arsizeof(pv);
+	ctnt.proplist.ppropval = pv;
+	gxerr_t e_result = GXERR_SUCCESS;
+	if (!exmdb_client_remote::write_message(dir, st.username.c_str(),
+	    65001, fid, &ctnt, &e_result) || e_result != GXERR_SUCCESS)
+		return BR_FAIL;
+	std::lock_guard hold(st.lock);
+	st.mids.push_back(mid);
+	return BR_OK;
+}
+
+static bench_result op_move(bench_store &st, std::mt19937 &rng)
+{
+	uint64_t mid;
+	{
+		std::lock_guard hold(st.lock);
+		if (st.mids.empty())
+			return BR_SKIP;
+		auto i = rng() % st.mids.size();
+		mid = st.mids[i];
+		st.mids[i] = st.mids.back();
+		st.mids.pop_back();
+	}
+	EID_ARRAY ids{1, &mid};
+	BOOL b_partial = false;
+	return exmdb_client_remote::movecopy_messages(st.dir.c_str(),
+	       st.user_id, 65001, false, st.username.c_str(),
+	       rop_util_make_eid_ex(1, PRIVATE_FID_INBOX),
+	       rop_util_make_eid_ex(1, PRIVATE_FID_DELETED_ITEMS),
+	       false, &ids, &b_partial) ? BR_OK : BR_FAIL;
+}
+
+/* Initial ICS content download of the inbox, with empty state */
+static bench_result op_sync(bench_store &st)
+{
+	std::unique_ptr<IDSET, bin_delete> given(idset_init(TRUE, REPL_TYPE_GUID));
+	std::unique_ptr<IDSET, bin_delete> seen(idset_init(TRUE, REPL_TYPE_GUID));
+	if (given == nullptr || seen == nullptr)
+		return BR_FAIL;
+	uint32_t fai_count = 0, normal_count = 0;
+	uint64_t fai_total = 0, normal_total = 0, last_cn = 0, last_readcn = 0;
+	EID_ARRAY updated{}, chg{}, given_mids{}, deleted{}, nolonger{}, read{}, unread{};
+	return exmdb_client_remote::get_content_sync(st.dir.c_str(),
+	       rop_util_make_eid_ex(1, PRIVATE_FID_INBOX), nullptr,
+	       given.get(), seen.get(), nullptr, nullptr, 65001, nullptr, TRUE,
+	       &fai_count, &fai_total, &normal_count, &normal_total, &updated,
+	       &chg, &last_cn, &given_mids, &deleted, &nolonger, &read, &unread,
+	       &last_readcn) ? BR_OK : BR_FAIL;
+}
+
+static bench_result bench_run_op(unsigned int op, bench_store &st, std::mt19937 &rng)
+{
+	switch (op) {
+	case BO_TABLE: return op_table(st);
+	case BO_PROPS: return op_props(st, rng);
+	case BO_WRITE: return op_write(st, rng);
+	case BO_MOVE: return op_move(st, rng);
+	case BO_SYNC: return op_sync(st);
+	}
+	return BR_SKIP;
+}
+
+static void bench_account(bench_thread &bt, unsigned int op, bench_result r)
+{
+	if (r == BR_SKIP)
+		++bt.op_skip[op];
+	else if (r == BR_FAIL)
+		++bt.op_fail[op];
+	else
+		++bt.ops[op];
+}
+
+static void bench_worker(unsigned int tid, clk::time_point deadline, bench_thread &bt)
+{
+	ALLOC_CONTEXT arena;
+	alloc_context_init(&arena);
+	t_arena = &arena;
+	t_stats = &bt;
+	std::mt19937 rng(g_seed + tid);
+	unsigned int total = 0;
+	for (auto w : g_mix)
+		total += w;
+	while (clk::now() < deadline) {
+		unsigned int pick = rng() % total, op = 0;
+		while (pick >= g_mix[op])
+			pick -= g_mix[op++];
+		auto &st = *g_stores[rng() % g_stores.size()];
+		bench_account(bt, op, bench_run_op(op, st, rng));
+		alloc_context_free(&arena);
+		alloc_context_init(&arena);
+	}
+	alloc_context_free(&arena);
+	t_arena = nullptr;
+	t_stats = nullptr;
+	if (t_sockd >= 0) {
+		close(t_sockd);
+		t_sockd = -1;
+	}
+}
+
+/* Fill the inboxes; thread @tid does every g_nthreads'th store. */
+static void bench_populate(unsigned int tid, bench_thread &bt)
+{
+	ALLOC_CONTEXT arena;
+	alloc_context_init(&arena);
+	t_arena = &arena;
+	t_stats = &bt;
+	std::mt19937 rng(g_seed + tid);
+	for (size_t i = tid; i < g_stores.size(); i += g_nthreads) {
+		for (unsigned int j = 0; j < g_nmsgs; ++j) {
+			bench_account(bt, BO_WRITE, op_write(*g_stores[i], rng));
+			alloc_context_free(&arena);
+			alloc_context_init(&arena);
+		}
+	}
+	alloc_context_free(&arena);
+	t_arena = nullptr;
+	t_stats = nullptr;
+	if (t_sockd >= 0) {
+		close(t_sockd);
+		t_sockd = -1;
+	}
+}
+
+static bool bench_parse_mix(const char *spec)
+{
+	unsigned int mix[BO_MAX]{}, total = 0;
+	std::string s = spec;
+	for (auto &&kv : gx_split(s, ',')) {
+		auto eq = kv.find('=');
+		if (eq == kv.npos)
+			return false;
+		auto name = kv.substr(0, eq);
+		auto it = std::find_if(std::begin(g_op_names), std::end(g_op_names),
+		          [&](const char *n) { return name == n; });
+		if (it == std::end(g_op_names))
+			return false;
+		char *end = nullptr;
+		auto w = strtoul(kv.c_str() + eq + 1, &end, 0);
+		if (end == nullptr || *end != '\0' || w > 1000000)
+			return false;
+		mix[it - std::begin(g_op_names)] = w;
+		total += w;
+	}
+	if (total == 0)
+		return false;
+	memcpy(g_mix, mix, sizeof(g_mix));
+	return true;
+}
+
+static unsigned int bench_pick_port()
+{
+	wrapfd fd(socket(AF_INET6, SOCK_STREAM, 0));
+	if (fd.get() < 0)
+		return 0;
+	struct sockaddr_in6 sa{};
+	sa.sin6_family = AF_INET6;
+	sa.sin6_addr = in6addr_loopback;
+	socklen_t sl = sizeof(sa);
+	if (bind(fd.get(), reinterpret_cast<struct sockaddr *>(&sa), sizeof(sa)) != 0 ||
+	    getsockname(fd.get(), reinterpret_cast<struct sockaddr *>(&sa), &sl) != 0)
+		return 0;
+	return ntohs(sa.sin6_port);
+}
+
+static bool bench_write_config(const std::string &cfgdir)
+{
+	auto path = cfgdir + "/exmdb_provider.cfg";
+	std::unique_ptr<FILE, file_deleter> fp(fopen(path.c_str(), "w"));
+	if (fp == nullptr) {
+		fprintf(stderr, "exmdbbench: %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	if (g_base_cfg != nullptr) {
+		auto base = config_file_init(g_base_cfg);
+		if (base == nullptr) {
+			fprintf(stderr, "exmdbbench: %s: %s\n", g_base_cfg, strerror(errno));
+			return false;
+		}
+		for (size_t i = 0; i < base->num_entries; ++i) {
+			auto &e = base->config_table[i];
+			if (strcasecmp(e.keyname, "listen_ip") != 0 &&
+			    strcasecmp(e.keyname, "listen_port") != 0)
+				fprintf(fp.get(), "%s = %s\n", e.keyname, e.value);
+		}
+	}
+	fprintf(fp.get(), "listen_ip = ::1\nlisten_port = %u\n", g_port);
+	fp.reset();
+	path = cfgdir + "/exmdb_list.txt";
+	fp.reset(fopen(path.c_str(), "w"));
+	if (fp == nullptr) {
+		fprintf(stderr, "exmdbbench: %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	fprintf(fp.get(), "%s/ private ::1 %u\n", g_userdir.c_str(), g_port);
+	fp.reset();
+	path = cfgdir + "/exmdb_acl.txt";
+	fp.reset(fopen(path.c_str(), "w"));
+	if (fp == nullptr) {
+		fprintf(stderr, "exmdbbench: %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	fprintf(fp.get(), "::1\n");
+	return true;
+}
+
+static bool bench_create_stores(const char *datadir)
+{
+	textmaps_init(datadir);
+	for (unsigned int i = 1; i <= g_nstores; ++i) {
+		auto st = std::make_unique<bench_store>();
+		st->user_id  = i;
+		st->dir      = g_userdir + "/" + std::to_string(i);
+		st->username = "bench" + std::to_string(i) + "@localhost";
+		for (auto sub : {"", "/cid", "/eml", "/ext", "/tmp"}) {
+			auto d = st->dir + sub;
+			if (mkdir(d.c_str(), 0777) != 0 && errno != EEXIST) {
+				fprintf(stderr, "exmdbbench: mkdir %s: %s\n", d.c_str(), strerror(errno));
+				return false;
+			}
+		}
+		if (mkprivate_create_db(st->dir.c_str(), "en", i, datadir) != 0) {
+			fprintf(stderr, "exmdbbench: could not create store %s\n", st->dir.c_str());
+			return false;
+		}
+		g_stores.push_back(std::move(st));
+	}
+	return true;
+}
+
+static uint32_t bench_pct(const std::vector<uint32_t> &v, double p)
+{
+	auto i = static_cast<size_t>(p * v.size());
+	return v[std::min(i, v.size() - 1)];
+}
+
+static void bench_report(std::vector<bench_thread> &bt, double secs)
+{
+	size_t ops = 0, fail = 0, skip = 0;
+	printf("%-10s %10s %10s %8s %8s\n", "operation", "count", "ops/s", "failed", "skipped");
+	for (unsigned int op = 0; op < BO_MAX; ++op) {
+		size_t n = 0, f = 0, s = 0;
+		for (const auto &t : bt) {
+			n += t.ops[op];
+			f += t.op_fail[op];
+			s += t.op_skip[op];
+		}
+		if (n + f + s == 0)
+			continue;
+		printf("%-10s %10zu %10.1f %8zu %8zu\n", g_op_names[op], n, n / secs, f, s);
+		ops += n;
+		fail += f;
+		skip += s;
+	}
+	printf("%-10s %10zu %10.1f %8zu %8zu\n\n", "total", ops, ops / secs, fail, skip);
+
+	printf("%-24s %9s %9s %8s %8s %8s %8s %6s\n", "rpc", "calls", "calls/s",
+	       "p50(us)", "p99", "p999", "max", "failed");
+	for (unsigned int id = 0; id < 256; ++id) {
+		std::vector<uint32_t> v;
+		size_t f = 0;
+		for (auto &t : bt) {
+			v.insert(v.end(), t.usec[id].begin(), t.usec[id].end());
+			f += t.rpc_fail[id];
+		}
+		if (v.empty() && f == 0)
+			continue;
+		std::sort(v.begin(), v.end());
+		auto name = bench_rpc_name(id);
+		char buf[16];
+		if (name == nullptr) {
+			snprintf(buf, arsizeof(buf), "rpc#%u", id);
+			name = buf;
+		}
+		if (v.empty()) {
+			printf("%-24s %9zu %9s %8s %8s %8s %8s %6zu\n", name,
+			       v.size(), "-", "-", "-", "-", "-", f);
+			continue;
+		}
+		printf("%-24s %9zu %9.1f %8u %8u %8u %8u %6zu\n", name, v.size(),
+		       v.size() / secs, bench_pct(v, 0.5), bench_pct(v, 0.99),
+		       bench_pct(v, 0.999), v.back(), f);
+	}
+}
+
+int main(int argc, const char **argv)
+{
+	setvbuf(stdout, nullptr, _IOLBF, 0);
+	if (HX_getopt(g_options_table, &argc, &argv, HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
+		return EXIT_FAILURE;
+	if (g_mix_spec != nullptr && !bench_parse_mix(g_mix_spec)) {
+		fprintf(stderr, "exmdbbench: invalid operation mix \"%s\"\n", g_mix_spec);
+		return EXIT_FAILURE;
+	}
+	if (g_nstores == 0 || g_nthreads == 0) {
+		fprintf(stderr, "exmdbbench: need at least one store and one thread\n");
+		return EXIT_FAILURE;
+	}
+	if (g_port == 0 && (g_port = bench_pick_port()) == 0) {
+		fprintf(stderr, "exmdbbench: no free port on [::1]\n");
+		return EXIT_FAILURE;
+	}
+	g_body.assign(g_body_size, 'x');
+	for (size_t i = 71; i < g_body.size(); i += 72)
+		g_body[i] = '\n';
+	const char *datadir = g_datadir != nullptr ? g_datadir : PKGDATADIR;
+
+	auto root = std::string(g_workdir != nullptr ? g_workdir : "/tmp") + "/exmdbbench.XXXXXX";
+	if (mkdtemp(root.data()) == nullptr) {
+		fprintf(stderr, "exmdbbench: mkdtemp %s: %s\n", root.c_str(), strerror(errno));
+		return EXIT_FAILURE;
+	}
+	auto cl_0 = make_scope_exit([&]() {
+		if (g_keep)
+			printf("exmdbbench: scratch directory kept at %s\n", root.c_str());
+		else
+			HX_rrmdir(root.c_str());
+	});
+	auto cfgdir = root + "/config";
+	g_userdir = root + "/user";
+	if (mkdir(cfgdir.c_str(), 0777) != 0 || mkdir(g_userdir.c_str(), 0777) != 0) {
+		fprintf(stderr, "exmdbbench: mkdir: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	auto t_start = clk::now();
+	if (!bench_create_stores(datadir) || !bench_write_config(cfgdir))
+		return EXIT_FAILURE;
+	std::chrono::duration<double> t_diff = clk::now() - t_start;
+	printf("exmdbbench: created %u stores in %.1f s\n", g_nstores, t_diff.count());
+
+	g_config_file = config_file_initd("exmdb_provider.cfg", cfgdir.c_str());
+	if (g_config_file == nullptr) {
+		fprintf(stderr, "exmdbbench: config_file_initd: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	g_mime_pool = MIME_POOL::create(g_nthreads * 4, 16);
+	static constexpr const char *plugins[] = {"libgxs_exmdb_provider.so", nullptr};
+	service_init({g_plugin_dir != nullptr ? g_plugin_dir : PKGLIBDIR,
+		cfgdir.c_str(), datadir, root.c_str(), plugins, false,
+		g_nthreads, "exmdbbench"});
+	auto cl_1 = make_scope_exit(service_stop);
+	if (!service_register_service("ndr_stack_alloc",
+	    reinterpret_cast<void *>(bench_ndr_alloc), typeid(*bench_ndr_alloc))) {
+		fprintf(stderr, "exmdbbench: service_register ndr_stack_alloc failed\n");
+		return EXIT_FAILURE;
+	}
+	if (service_run_early() != 0 || service_run() != 0) {
+		fprintf(stderr, "exmdbbench: could not start exmdb_provider\n");
+		return EXIT_FAILURE;
+	}
+	void (*pass_service)(int, void *);
+	pass_service = reinterpret_cast<decltype(pass_service)>(service_query("pass_service",
+	               "exmdbbench", typeid(*pass_service)));
+	if (pass_service == nullptr) {
+		fprintf(stderr, "exmdbbench: exmdb_provider did not offer \"pass_service\"\n");
+		return EXIT_FAILURE;
+	}
+	bench_pass_services(pass_service);
+	service_release("pass_service", "exmdbbench");
+	/*
+	 * The plugin pointed exmdb_rpc_exec at its own proxy client. All
+	 * stores are local to it, so it never needs that; take it over for
+	 * the client threads. exmdb_rpc_alloc stays as the plugin set it.
+	 */
+	exmdb_rpc_exec = bench_rpc_exec;
+
+	std::vector<bench_thread> pop_stats(g_nthreads);
+	std::vector<std::thread> thr;
+	t_start = clk::now();
+	for (unsigned int i = 0; i < g_nthreads; ++i)
+		thr.emplace_back(bench_populate, i, std::ref(pop_stats[i]));
+	for (auto &t : thr)
+		t.join();
+	thr.clear();
+	t_diff = clk::now() - t_start;
+	size_t written = 0, wfail = 0;
+	for (const auto &t : pop_stats) {
+		written += t.ops[BO_WRITE];
+		wfail += t.op_fail[BO_WRITE];
+	}
+	printf("exmdbbench: wrote %zu messages (%zu failed) in %.1f s\n",
+	       written, wfail, t_diff.count());
+	if (written == 0 && g_nmsgs > 0) {
+		fprintf(stderr, "exmdbbench: populating the stores failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("exmdbbench: %u threads, %u stores, %u s\n", g_nthreads, g_nstores, g_duration);
+	std::vector<bench_thread> run_stats(g_nthreads);
+	t_start = clk::now();
+	auto deadline = t_start + std::chrono::seconds(g_duration);
+	for (unsigned int i = 0; i < g_nthreads; ++i)
+		thr.emplace_back(bench_worker, i, deadline, std::ref(run_stats[i]));
+	for (auto &t : thr)
+		t.join();
+	t_diff = clk::now() - t_start;
+	bench_report(run_stats, std::max(t_diff.count(), 1e-3));
+	return EXIT_SUCCESS;
+}
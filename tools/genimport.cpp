@@ -10,6 +10,7 @@
 #include <cstring>
 #include <ctime>
 #include <memory>
+#include <mutex>
 #include <mysql.h>
 #include <string>
 #include <unistd.h>
@@ -38,6 +39,7 @@ namespace exmdb_client = exmdb_client_remote;
 
 static std::string g_dstuser;
 static int g_socket = -1;
+static std::mutex g_socket_lock; /* one request in flight on g_socket */
 static unsigned int g_user_id;
 static std::string g_storedir_s;
 const char *g_storedir;
@@ -425,6 +427,7 @@ static BOOL exm_dorpc(const char *dir, const EXMDB_REQUEST *prequest, EXMDB_RESP
 	BINARY tb;
 	if (exmdb_ext_push_request(prequest, &tb) != EXT_ERR_SUCCESS)
 		return false;
+	std::lock_guard hold(g_socket_lock);
 	if (!exmdb_client_write_socket(g_socket, &tb)) {
 		free(tb.pb);
 		return false;
@@ -581,6 +584,14 @@ int exm_create_folder(uint64_t parent_fld, TPROPVAL_ARRAY *props, bool o_excl,
 	return 0;
 }
 
+/*
+ * Change tracking of the source store. exm_create_msg replaces these with
+ * freshly allocated values; exm_create_msgs drops them so that the server
+ * allocates them, resulting in the same set of properties either way.
+ */
+static constexpr uint32_t exm_change_tags[] =
+	{PidTagMid, PidTagChangeNumber, PR_CHANGE_KEY, PR_PREDECESSOR_CHANGE_LIST};
+
 int exm_create_msg(uint64_t parent_fld, MESSAGE_CONTENT *ctnt)
 {
 	uint64_t msg_id = 0, change_num = 0;
@@ -641,6 +652,41 @@ int exm_create_msg(uint64_t parent_fld, MESSAGE_CONTENT *ctnt)
 	return 0;
 }
 
+/**
+ * Write @count messages to @parent_fld with one WRITE_MESSAGES RPC. The
+ * server allocates message IDs, change numbers, change keys and PCLs and
+ * commits the whole batch in one transaction, so on failure none of the
+ * messages were created.
+ */
+int exm_create_msgs(uint64_t parent_fld, size_t count, MESSAGE_CONTENT *ctnt)
+{
+	if (count == 0)
+		return 0;
+	if (count > UINT32_MAX)
+		return -E2BIG;
+	auto last_time = rop_util_current_nttime();
+	for (size_t i = 0; i < count; ++i) {
+		auto props = &ctnt[i].proplist;
+		for (auto tag : exm_change_tags)
+			props->erase(tag);
+		if (props->has(PR_LAST_MODIFICATION_TIME))
+			continue;
+		auto ret = props->set(PR_LAST_MODIFICATION_TIME, &last_time);
+		if (ret != 0)
+			return ret;
+	}
+	gxerr_t e_result = GXERR_SUCCESS;
+	if (!exmdb_client::write_messages(g_storedir, g_dstuser.c_str(), 65001,
+	    parent_fld, count, ctnt, &e_result)) {
+		fprintf(stderr, "exm: write_messages RPC failed\n");
+		return -EIO;
+	} else if (e_result != 0) {
+		fprintf(stderr, "exm: write_messages: gxerr %d\n", e_result);
+		return -EIO;
+	}
+	return 0;
+}
+
 static std::string sql_escape(MYSQL *sqh, const char *in)
 {
 	std::string out;
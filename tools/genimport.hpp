@@ -90,5 +90,6 @@ extern uint16_t gi_resolve_namedprop(const PROPERTY_XNAME &);
 extern int exm_set_change_keys(TPROPVAL_ARRAY *props, uint64_t cn);
 extern int exm_create_folder(uint64_t parent_fld, TPROPVAL_ARRAY *props, bool o_excl, uint64_t *new_fld_id);
 extern int exm_create_msg(uint64_t parent_fld, MESSAGE_CONTENT *);
+extern int exm_create_msgs(uint64_t parent_fld, size_t count, MESSAGE_CONTENT *);
 extern void gi_setup_early(const char *dstmbox);
 extern int gi_setup();
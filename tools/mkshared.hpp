@@ -8,3 +8,4 @@ extern bool add_folderprop_iv(sqlite3_stmt *, uint32_t art_num, bool add_next);
 extern bool add_folderprop_sv(sqlite3_stmt *, const char *dispname, const char *contcls);
 extern bool add_folderprop_tv(sqlite3_stmt *);
 extern bool add_changenum(sqlite3_stmt *, enum cnguid_type, uint64_t user_id, uint64_t change_num);
+extern int mkprivate_create_db(const char *dir, const char *lang, int user_id, const char *datadir);
@@ -1,13 +1,21 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // SPDX-FileCopyrightText: 2021 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <unistd.h>
 #include <utility>
+#include <vector>
 #include <libHX/option.h>
 #include <gromox/endian.hpp>
 #include <gromox/ext_buffer.hpp>
@@ -25,6 +33,51 @@ struct ob_desc {
 	parent_desc parent;
 };
 
+/* One MT packet as read from stdin */
+struct mt_frame {
+	std::unique_ptr<char[]> buf;
+	size_t size = 0;
+};
+
+/* One decoded and propid-adjusted object, handed to the uploader */
+struct mt_item {
+	ob_desc obd;
+	tpropval_array_ptr props;
+	message_content_ptr msg;
+	size_t wire_size = 0;
+};
+
+/* Messages destined for the same folder, written with one RPC */
+struct mt_batch {
+	mt_batch() = default;
+	~mt_batch() { clear(); }
+	NOMOVE(mt_batch);
+	void clear();
+
+	uint64_t fid_to = 0;
+	size_t bytes = 0;
+	std::vector<MESSAGE_CONTENT> msgs;
+};
+
+/**
+ * Bounded FIFO between the pipeline stages. close() is used both for
+ * end-of-stream (pop drains what is left) and for aborting (push fails).
+ */
+template<typename T> class mt_queue {
+	public:
+	mt_queue(size_t limit) : m_limit(limit) {}
+	bool push(T &&);
+	bool pop(T &);
+	void close();
+
+	private:
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::deque<T> m_items;
+	size_t m_limit = 0;
+	bool m_closed = false;
+};
+
 }
 
 using gi_thru_map = std::unordered_map<uint16_t, uint16_t>;
@@ -34,8 +87,11 @@ static gi_folder_map_t g_folder_map;
 static gi_name_map g_src_name_map;
 static gi_thru_map g_thru_name_map;
 static uint8_t g_splice;
-static unsigned int g_oexcl = 1;
+static unsigned int g_oexcl = 1, g_batch_count = 32;
+static size_t g_stat_folders, g_stat_msgs, g_stat_skipped, g_stat_bytes;
+static constexpr size_t MT_BATCH_BYTES = 16U << 20, MT_QUEUE_DEPTH = 64;
 static constexpr HXoption g_options_table[] = {
+	{nullptr, 'B', HXTYPE_UINT, &g_batch_count, nullptr, nullptr, 0, "Maximum number of messages per bulk write (default: 32)", "N"},
 	{nullptr, 'p', HXTYPE_NONE, &g_show_props, nullptr, nullptr, 0, "Show properties in detail (if -t)"},
 	{nullptr, 't', HXTYPE_NONE, &g_show_tree, nullptr, nullptr, 0, "Show tree-based analysis of the archive"},
 	{nullptr, 'u', HXTYPE_STRING, &g_username, nullptr, nullptr, 0, "Username of store to import to", "EMAILADDR"},
@@ -234,17 +290,46 @@ static void exm_folder_adjust(TPROPVAL_ARRAY &props)
 	exm_adjust_namedprops(props);
 }
 
-static int exm_folder(const ob_desc &obd, TPROPVAL_ARRAY &props)
+template<typename T> bool mt_queue<T>::push(T &&item)
 {
-	if (g_show_tree) {
-		printf("exm: Folder %lxh (parent=%llxh)\n",
-			static_cast<unsigned long>(obd.nid),
-			static_cast<unsigned long long>(obd.parent.folder_id));
-		if (g_show_props)
-			gi_dump_tpropval_a(0, props);
-	}
-	exm_folder_adjust(props);
+	std::unique_lock hold(m_lock);
+	m_cond.wait(hold, [&]() { return m_closed || m_items.size() < m_limit; });
+	if (m_closed)
+		return false;
+	m_items.push_back(std::move(item));
+	m_cond.notify_all();
+	return true;
+}
+
+template<typename T> bool mt_queue<T>::pop(T &item)
+{
+	std::unique_lock hold(m_lock);
+	m_cond.wait(hold, [&]() { return m_closed || !m_items.empty(); });
+	if (m_items.empty())
+		return false;
+	item = std::move(m_items.front());
+	m_items.pop_front();
+	m_cond.notify_all();
+	return true;
+}
+
+template<typename T> void mt_queue<T>::close()
+{
+	std::unique_lock hold(m_lock);
+	m_closed = true;
+	m_cond.notify_all();
+}
+
+void mt_batch::clear()
+{
+	for (auto &m : msgs)
+		message_content_free_internal(&m);
+	msgs.clear();
+	bytes = 0;
+}
 
+static int exm_folder(const ob_desc &obd, TPROPVAL_ARRAY &props)
+{
 	auto current_it  = g_folder_map.find(obd.nid);
 	auto parent_it   = g_folder_map.find(obd.parent.folder_id);
 	uint64_t new_fid = 0;
@@ -303,35 +388,66 @@ static int exm_folder(const ob_desc &obd, TPROPVAL_ARRAY &props)
 	return 0;
 }
 
-static int exm_message(const ob_desc &obd, MESSAGE_CONTENT &ctnt)
+static void exm_flush(mt_batch &batch)
+{
+	if (batch.msgs.empty())
+		return;
+	auto count = batch.msgs.size();
+	auto ret = exm_create_msgs(batch.fid_to, count, batch.msgs.data());
+	if (ret >= 0) {
+		g_stat_msgs += count;
+		batch.clear();
+		return;
+	}
+	/*
+	 * The batch was rolled back as a whole. Retry one by one so that only
+	 * the offending message(s) get lost, like in the unbatched case.
+	 */
+	if (count > 1)
+		fprintf(stderr, "exm: bulk write of %zu messages failed (%s), retrying individually\n",
+		        count, strerror(-ret));
+	for (auto &m : batch.msgs) {
+		if (count > 1 && exm_create_msg(batch.fid_to, &m) >= 0)
+			++g_stat_msgs;
+		else
+			++g_stat_skipped;
+	}
+	batch.clear();
+}
+
+static void exm_message(mt_batch &batch, mt_item &item)
 {
-	if (g_show_tree)
-		printf("exm: Message %lxh (parent=%llxh)\n",
-			static_cast<unsigned long>(obd.nid),
-			static_cast<unsigned long long>(obd.parent.folder_id));
-	if (g_show_tree && g_show_props)
-		gi_dump_msgctnt(0, ctnt);
-	auto folder_it = g_folder_map.find(obd.parent.folder_id);
+	auto folder_it = g_folder_map.find(item.obd.parent.folder_id);
 	if (folder_it == g_folder_map.end()) {
 		fprintf(stderr, "PF-1123: unknown parent folder %llxh\n",
-		        static_cast<unsigned long long>(obd.parent.folder_id));
-		return 0;
+		        static_cast<unsigned long long>(item.obd.parent.folder_id));
+		++g_stat_skipped;
+		return;
 	}
-	exm_adjust_propids(ctnt);
-	if (g_show_tree && g_show_props) {
-		tree(0);
-		tlog("adjusted properties:\n");
-		gi_dump_msgctnt(0, ctnt);
+	if (batch.fid_to != folder_it->second.fid_to) {
+		exm_flush(batch);
+		batch.fid_to = folder_it->second.fid_to;
 	}
-	return exm_create_msg(folder_it->second.fid_to, &ctnt);
+	/* Take over the contents, leaving only the shell to be freed */
+	batch.msgs.push_back(*item.msg);
+	free(item.msg.release());
+	batch.bytes += item.wire_size;
+	if (batch.msgs.size() >= g_batch_count || batch.bytes >= MT_BATCH_BYTES)
+		exm_flush(batch);
 }
 
-static int exm_packet(const void *buf, size_t bufsize)
+/**
+ * Pipeline stage 2: decode a packet and map its named properties. This is the
+ * only stage touching g_src_name_map/g_thru_name_map.
+ */
+static mt_item exm_decode(const mt_frame &frame)
 {
 	EXT_PULL ep;
-	ep.init(buf, bufsize, zalloc, EXT_FLAG_WCOUNT);
-	ob_desc obd;
+	ep.init(frame.buf.get(), frame.size, zalloc, EXT_FLAG_WCOUNT);
+	mt_item item;
+	auto &obd = item.obd;
 	uint32_t type = 0;
+	item.wire_size = frame.size;
 	if (ep.g_uint32(&type) != EXT_ERR_SUCCESS ||
 	    ep.g_uint32(&obd.nid) != EXT_ERR_SUCCESS)
 		throw YError("PG-1121");
@@ -341,24 +457,140 @@ static int exm_packet(const void *buf, size_t bufsize)
 		throw YError("PG-1116");
 	obd.parent.type = static_cast<enum mapi_object_type>(type);
 	if (obd.mapitype == MAPI_FOLDER) {
-		TPROPVAL_ARRAY props{};
-		auto cl_0 = make_scope_exit([&]() { tpropval_array_free_internal(&props); });
-		if (ep.g_tpropval_a(&props) != EXT_ERR_SUCCESS)
+		item.props.reset(static_cast<TPROPVAL_ARRAY *>(zalloc(sizeof(TPROPVAL_ARRAY))));
+		if (item.props == nullptr)
+			throw std::bad_alloc();
+		if (ep.g_tpropval_a(item.props.get()) != EXT_ERR_SUCCESS)
 			throw YError("PG-1118");
-		auto ret = exm_folder(obd, props);
-		if (ret < 0)
-			throw YError("PG-1122: %s", strerror(-ret));
-		return 0;
+		if (g_show_tree) {
+			printf("exm: Folder %lxh (parent=%llxh)\n",
+				static_cast<unsigned long>(obd.nid),
+				static_cast<unsigned long long>(obd.parent.folder_id));
+			if (g_show_props)
+				gi_dump_tpropval_a(0, *item.props);
+		}
+		exm_folder_adjust(*item.props);
+		return item;
 	} else if (obd.mapitype == MAPI_MESSAGE) {
-		MESSAGE_CONTENT ctnt{};
-		auto cl_0 = make_scope_exit([&]() { message_content_free_internal(&ctnt); });
-		if (ep.g_msgctnt(&ctnt) != EXT_ERR_SUCCESS)
+		item.msg.reset(static_cast<MESSAGE_CONTENT *>(zalloc(sizeof(MESSAGE_CONTENT))));
+		if (item.msg == nullptr)
+			throw std::bad_alloc();
+		if (ep.g_msgctnt(item.msg.get()) != EXT_ERR_SUCCESS)
 			throw YError("PG-1119");
-		return exm_message(obd, ctnt);
+		if (g_show_tree)
+			printf("exm: Message %lxh (parent=%llxh)\n",
+				static_cast<unsigned long>(obd.nid),
+				static_cast<unsigned long long>(obd.parent.folder_id));
+		if (g_show_tree && g_show_props)
+			gi_dump_msgctnt(0, *item.msg);
+		exm_adjust_propids(*item.msg);
+		if (g_show_tree && g_show_props) {
+			tree(0);
+			tlog("adjusted properties:\n");
+			gi_dump_msgctnt(0, *item.msg);
+		}
+		return item;
 	}
 	throw YError("PG-1117: unknown obd.mapitype %u", obd.mapitype);
 }
 
+/**
+ * Pipeline stage 3: create folders and write messages. This is the only stage
+ * touching g_folder_map.
+ */
+static void exm_upload(mt_queue<mt_item> &queue)
+{
+	mt_batch batch;
+	mt_item item;
+	while (queue.pop(item)) {
+		g_stat_bytes += item.wire_size;
+		if (item.obd.mapitype == MAPI_MESSAGE) {
+			exm_message(batch, item);
+			continue;
+		}
+		/* Subsequent messages may refer to this folder; keep order. */
+		exm_flush(batch);
+		auto ret = exm_folder(item.obd, *item.props);
+		if (ret < 0)
+			throw YError("PG-1122: %s", strerror(-ret));
+		++g_stat_folders;
+	}
+	exm_flush(batch);
+}
+
+static bool exm_read_frame(mt_frame &frame)
+{
+	uint64_t xsize = 0;
+	errno = 0;
+	auto ret = fullread(STDIN_FILENO, &xsize, sizeof(xsize));
+	if (ret == 0)
+		return false;
+	if (ret < 0 || static_cast<size_t>(ret) != sizeof(xsize))
+		throw YError("PG-1005: %s", strerror(errno));
+	xsize = le64_to_cpu(xsize);
+	frame.buf = std::make_unique<char[]>(xsize);
+	frame.size = xsize;
+	errno = 0;
+	ret = fullread(STDIN_FILENO, frame.buf.get(), xsize);
+	if (ret == 0)
+		throw YError("PG-1013: EOF on input");
+	else if (ret < 0 || static_cast<size_t>(ret) != xsize)
+		throw YError("PG-1006: %s", strerror(errno));
+	return true;
+}
+
+/**
+ * Reading stdin, decoding and uploading run in separate threads, so that the
+ * exmdb server is kept busy while the next batch is being prepared.
+ */
+static void exm_pipeline()
+{
+	mt_queue<mt_frame> frame_q(MT_QUEUE_DEPTH);
+	mt_queue<mt_item> item_q(MT_QUEUE_DEPTH);
+	std::exception_ptr dec_err, upl_err;
+
+	std::thread decoder([&]() {
+		try {
+			mt_frame frame;
+			while (frame_q.pop(frame))
+				if (!item_q.push(exm_decode(frame)))
+					break;
+		} catch (...) {
+			dec_err = std::current_exception();
+			frame_q.close();
+		}
+		item_q.close();
+	});
+	std::thread uploader([&]() {
+		try {
+			exm_upload(item_q);
+		} catch (...) {
+			upl_err = std::current_exception();
+		}
+		item_q.close();
+		frame_q.close();
+	});
+	try {
+		mt_frame frame;
+		while (exm_read_frame(frame))
+			if (!frame_q.push(std::move(frame)))
+				break;
+	} catch (...) {
+		frame_q.close();
+		item_q.close();
+		decoder.join();
+		uploader.join();
+		throw;
+	}
+	frame_q.close();
+	decoder.join();
+	uploader.join();
+	if (dec_err != nullptr)
+		std::rethrow_exception(dec_err);
+	if (upl_err != nullptr)
+		std::rethrow_exception(upl_err);
+}
+
 static void gi_dump_thru_map(const gi_thru_map &map)
 {
 	if (!g_show_props)
@@ -377,29 +609,21 @@ int main(int argc, const char **argv) try
 		fprintf(stderr, "Usage: gromox-mt2exm -u username\n");
 		return EXIT_FAILURE;
 	}
+	if (g_batch_count == 0)
+		g_batch_count = 1;
 
 	gi_setup_early(g_username);
 	exm_read_base_maps();
 	if (gi_setup() != EXIT_SUCCESS)
 		return EXIT_FAILURE;
-	while (true) {
-		uint64_t xsize = 0;
-		errno = 0;
-		auto ret = fullread(STDIN_FILENO, &xsize, sizeof(xsize));
-		if (ret == 0)
-			break;
-		if (ret < 0 || static_cast<size_t>(ret) != sizeof(xsize))
-			throw YError("PG-1005: %s", strerror(errno));
-		xsize = le64_to_cpu(xsize);
-		auto buf = std::make_unique<char[]>(xsize);
-		errno = 0;
-		ret = fullread(STDIN_FILENO, buf.get(), xsize);
-		if (ret == 0)
-			throw YError("PG-1013: EOF on input");
-		else if (ret < 0 || static_cast<size_t>(ret) != xsize)
-			throw YError("PG-1006: %s", strerror(errno));
-		exm_packet(buf.get(), xsize);
-	}
+	auto t_start = std::chrono::steady_clock::now();
+	exm_pipeline();
+	std::chrono::duration<double> t_diff = std::chrono::steady_clock::now() - t_start;
+	auto secs = std::max(t_diff.count(), 1e-3);
+	auto mbytes = g_stat_bytes / 1048576.0;
+	fprintf(stderr, "mt2exm: %zu folders, %zu messages (%zu skipped), %.1f MB in %.1f s: %.1f msgs/s, %.2f MB/s\n",
+	        g_stat_folders, g_stat_msgs, g_stat_skipped, mbytes, secs,
+	        g_stat_msgs / secs, mbytes / secs);
 	gi_dump_thru_map(g_thru_name_map);
 	return EXIT_SUCCESS;
 } catch (const std::exception &e) {
@@ -3,7 +3,9 @@
 #	include "config.h"
 #endif
 #include <cerrno>
+#include <chrono>
 #include <memory>
+#include <string>
 #include <libHX/option.h>
 #include <gromox/paths.h>
 #include <gromox/rtf.hpp>
@@ -12,6 +14,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <unistd.h>
 
 namespace {
@@ -24,9 +27,11 @@ struct srcitem {
 }
 
 static std::unique_ptr<LIST_FILE> g_list_file;
-static unsigned int opt_show_version;
+static unsigned int opt_show_version, opt_bench, opt_rounds = 10;
 
 static struct HXoption g_options_table[] = {
+	{"bench", 'b', HXTYPE_NONE, &opt_bench, nullptr, nullptr, 0, "Benchmark the converters on the files given as arguments"},
+	{"rounds", 'n', HXTYPE_UINT, &opt_rounds, nullptr, nullptr, 0, "Number of conversions per file in benchmark mode (default: 10)", "N"},
 	{"version", 0, HXTYPE_NONE, &opt_show_version, nullptr, nullptr, 0, "Output version information and exit"},
 	HXOPT_AUTOHELP,
 	HXOPT_TABLEEND,
@@ -42,6 +47,102 @@ static const char* cpid_to_charset_to(uint32_t cpid)
 	return "us-ascii";
 }
 
+static bool read_file(const char *path, std::string &out)
+{
+	auto fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	char buf[65536];
+	ssize_t len;
+	out.clear();
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		out.append(buf, len);
+	close(fd);
+	return len == 0;
+}
+
+using rtf_conv_func = bool (*)(const char *, size_t, const char *, char **, size_t *, ATTACHMENT_LIST *);
+
+static double time_conv(rtf_conv_func conv, const std::string &rtf,
+    std::string &html, bool &ok)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < opt_rounds; ++i) {
+		auto atx = attachment_list_init();
+		char *out = nullptr;
+		size_t outlen = 0;
+		ok = conv(rtf.c_str(), rtf.size(), "utf-8", &out, &outlen, atx);
+		if (ok && i == 0)
+			html.assign(out, outlen);
+		free(out);
+		attachment_list_free(atx);
+	}
+	std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+	return d.count() / opt_rounds;
+}
+
+/*
+ * Convert every corpus file with both the single-pass converter (rtf_to_html)
+ * and the element-tree converter (rtf_to_html_tree), report per-file and
+ * aggregate throughput, and flag files where the outputs differ.
+ */
+static int bench_main(int argc, const char **argv)
+{
+	size_t total_bytes = 0, ndiff = 0, nfail = 0;
+	double total_stream = 0, total_tree = 0;
+	std::string raw, rtf, html_s, html_t;
+
+	if (opt_rounds == 0)
+		opt_rounds = 1;
+	printf("%-40s %10s %10s %10s %s\n", "file", "bytes", "fast ms", "tree ms", "result");
+	for (int i = 1; i < argc; ++i) {
+		if (!read_file(argv[i], raw)) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			++nfail;
+			continue;
+		}
+		BINARY bin;
+		bin.pv = raw.data();
+		bin.cb = raw.size();
+		ssize_t unc_size = rtfcp_uncompressed_size(&bin);
+		if (unc_size < 0) {
+			/* not compressed; take it as plain RTF */
+			rtf = raw;
+		} else {
+			rtf.resize(unc_size);
+			size_t rtf_len = unc_size;
+			if (!rtfcp_uncompress(&bin, rtf.data(), &rtf_len)) {
+				fprintf(stderr, "%s: fail to uncompress rtf\n", argv[i]);
+				++nfail;
+				continue;
+			}
+			rtf.resize(rtf_len);
+		}
+		bool ok_s = false, ok_t = false;
+		auto t_s = time_conv(rtf_to_html, rtf, html_s, ok_s);
+		auto t_t = time_conv(rtf_to_html_tree, rtf, html_t, ok_t);
+		const char *result = "same";
+		if (!ok_s || !ok_t) {
+			result = ok_s == ok_t ? "failed" : "DIFF(status)";
+			++nfail;
+		} else if (html_s != html_t) {
+			result = "DIFF";
+			++ndiff;
+		}
+		printf("%-40s %10zu %10.3f %10.3f %s\n", argv[i], rtf.size(),
+		       t_s * 1000, t_t * 1000, result);
+		total_bytes += rtf.size();
+		total_stream += t_s;
+		total_tree += t_t;
+	}
+	if (total_stream > 0 && total_tree > 0)
+		printf("total: %zu bytes, fast %.1f MB/s, tree %.1f MB/s, speedup %.2fx\n",
+		       total_bytes, total_bytes / total_stream / 1048576,
+		       total_bytes / total_tree / 1048576, total_tree / total_stream);
+	printf("%zu files differ, %zu failed\n", ndiff, nfail);
+	return ndiff == 0 && nfail == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, const char **argv)
 {
 	int offset;
@@ -58,6 +159,19 @@ int main(int argc, const char **argv)
 		printf("version: %s\n", PACKAGE_VERSION);
 		return 0;
 	}
+	if (opt_bench) {
+		g_list_file = list_file_initd("cpid.txt", PKGDATADIR, "%d%s:64");
+		if (NULL == g_list_file) {
+			fprintf(stderr, "list_file_init %s: %s\n",
+				PKGDATADIR "/cpid.txt", strerror(errno));
+			return 3;
+		}
+		if (!rtf_init_library(cpid_to_charset_to)) {
+			fprintf(stderr, "Failed to init RTF library\n");
+			return 4;
+		}
+		return bench_main(argc, argv);
+	}
 	offset = 0;
 	buff_len = 64*1024;
 	auto pbuff = static_cast<char *>(malloc(buff_len));
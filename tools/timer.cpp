@@ -1,15 +1,19 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 #include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <condition_variable>
-#include <list>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <libHX/option.h>
 #include <libHX/string.h>
 #include <gromox/atomic.hpp>
+#include <gromox/fileio.h>
 #include <gromox/paths.h>
 #include <gromox/scope.hpp>
 #include <gromox/socket.h>
@@ -19,10 +23,12 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <unistd.h>
 #include <csignal>
 #include <pthread.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -38,19 +44,23 @@
 
 #define DEF_MODE			S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH
 
+/*
+ * The journal is rewritten from memory once it holds this many records
+ * and more than twice as many as there are pending timers.
+ */
+#define JOURNAL_COMPACT_MIN	4096
+
 using namespace gromox;
 
 namespace {
 
-struct CONNECTION_NODE {
-	CONNECTION_NODE() = default;
-	CONNECTION_NODE(CONNECTION_NODE &&);
-	~CONNECTION_NODE();
-	void operator=(CONNECTION_NODE &&) = delete;
+struct tm_conn {
+	~tm_conn() { if (sockd >= 0) close(sockd); }
+
 	int sockd = -1;
-	int offset = 0;
-	char buffer[1024]{};
-	char line[1024]{};
+	bool closing = false, want_out = false;
+	std::string rbuf, wbuf;
+	time_t last_time = 0;
 };
 
 struct TIMER {
@@ -59,23 +69,23 @@ struct TIMER {
 	std::string command;
 };
 
-struct srcitem {
-	int tid;
-	long exectime;
-	char command[512];
-} __attribute__((packed));
-
 }
 
 static gromox::atomic_bool g_notify_stop;
-static size_t g_threads_num;
+static unsigned int g_max_conns;
 static int g_last_tid;
-static int g_list_fd = -1;
+static int g_list_fd = -1, g_epfd = -1;
+static size_t g_journal_records;
 static std::string g_list_path;
 static std::vector<std::string> g_acl_list;
-static std::list<CONNECTION_NODE> g_connection_list, g_connection_list1;
-static std::list<TIMER> g_exec_list;
-static std::mutex g_tid_lock, g_list_lock, g_connection_lock, g_cond_mutex;
+static std::unordered_map<int, std::unique_ptr<tm_conn>> g_conns;
+/*
+ * Pending timers by ID, and the execution order as (time, ID) pairs.
+ * Both are protected by g_list_lock, which also serializes journal writes.
+ */
+static std::unordered_map<int, TIMER> g_timers;
+static std::set<std::pair<time_t, int>> g_schedule;
+static std::mutex g_list_lock;
 static std::condition_variable g_waken_cond;
 static char *opt_config_file;
 static unsigned int opt_show_version;
@@ -87,102 +97,186 @@ static struct HXoption g_options_table[] = {
 	HXOPT_TABLEEND,
 };
 
-static void *tmr_acceptwork(void *);
-static void *tmr_thrwork(void *);
-static void execute_timer(TIMER *ptimer);
+static void *tmr_execwork(void *);
+static void tm_loop(int listen_fd);
+static const char *execute_timer(const TIMER *ptimer);
 
 static int parse_line(char *pbuff, const char* cmdline, char** argv);
 
 static void encode_line(const char *in, char *out);
 
-static BOOL read_mark(CONNECTION_NODE *pconnection);
-
 static void term_handler(int signo);
 static int increase_tid();
 
-CONNECTION_NODE::CONNECTION_NODE(CONNECTION_NODE &&o) :
-	sockd(o.sockd), offset(o.offset)
+/*
+ * Caller holds g_list_lock (or is the only thread yet). A record that
+ * could only be written in part is cut off again, so that the next one
+ * does not get glued to it.
+ */
+static bool journal_append(const char *line, size_t len)
+{
+	auto start = lseek(g_list_fd, 0, SEEK_END);
+	for (size_t ofs = 0; ofs < len; ) {
+		auto ret = write(g_list_fd, line + ofs, len - ofs);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			fprintf(stderr, "E-1405: write %s: %s\n", g_list_path.c_str(),
+			        ret < 0 ? strerror(errno) : "short write");
+			if (ofs > 0 && start >= 0 && ftruncate(g_list_fd, start) != 0)
+				fprintf(stderr, "E-1630: truncate %s: %s\n",
+				        g_list_path.c_str(), strerror(errno));
+			return false;
+		}
+		ofs += ret;
+	}
+	++g_journal_records;
+	return true;
+}
+
+static bool journal_add(const TIMER &t)
 {
-	o.sockd = -1;
-	memcpy(buffer, o.buffer, sizeof(buffer));
-	memcpy(line, o.line, sizeof(line));
+	char temp_line[2*COMMAND_LENGTH+64];
+	auto temp_len = sprintf(temp_line, "%d\t%ld\t", t.t_id,
+	                static_cast<long>(t.exec_time));
+	encode_line(t.command.c_str(), temp_line + temp_len);
+	temp_len += strlen(temp_line + temp_len);
+	temp_line[temp_len++] = '\n';
+	return journal_append(temp_line, temp_len);
 }
 
-CONNECTION_NODE::~CONNECTION_NODE()
+static bool journal_done(int t_id, const char *result)
 {
-	if (sockd >= 0)
-		close(sockd);
+	char temp_line[64];
+	auto temp_len = snprintf(temp_line, arsizeof(temp_line), "%d\t0\t%s\n",
+	                t_id, result);
+	return journal_append(temp_line, temp_len);
 }
 
-static void save_timers(time_t &last_cltime, const time_t &cur_time)
+/*
+ * Parse one journal line ("<tid> <exectime> <command>", with exectime 0
+ * marking completion or cancellation). The escaping is that of list_file.
+ */
+static bool journal_parse(const char *ptr, int &tid, long &exectime,
+    std::string &command)
 {
-	close(g_list_fd);
-	auto pfile = list_file_initd(g_list_path.c_str(), "/", "%d%l%s:512");
-	if (pfile == nullptr) {
-		g_list_fd = open(g_list_path.c_str(), O_APPEND | O_WRONLY);
-		return;
+	char *end;
+	tid = strtol(ptr, &end, 0);
+	if (end == ptr)
+		return false;
+	ptr = end;
+	exectime = strtol(ptr, &end, 0);
+	if (end == ptr)
+		return false;
+	ptr = end;
+	while (*ptr == ' ' || *ptr == '\t')
+		++ptr;
+	command.clear();
+	while (*ptr != '\0' && *ptr != '\t' && *ptr != ' ' && *ptr != '\r' &&
+	    *ptr != '\n' && *ptr != '#') {
+		if (*ptr == '\\') {
+			++ptr;
+			if (*ptr != '#' && *ptr != ' ' && *ptr != '\t' && *ptr != '\\')
+				return false;
+		}
+		command += *ptr++;
 	}
-	auto item_num = pfile->get_size();
-	auto pitem = static_cast<srcitem *>(pfile->get_list());
-	for (size_t i = 0; i < item_num; ++i) {
-		if (pitem[i].exectime != 0)
+	return !command.empty();
+}
+
+/*
+ * Replay the journal in one pass. Records of finished/cancelled timers
+ * just remove the entry by ID, so recovery is O(n log n) in the journal
+ * size rather than quadratic.
+ */
+static int journal_load()
+{
+	std::unique_ptr<FILE, file_deleter> fp(fopen(g_list_path.c_str(), "r"));
+	if (fp == nullptr)
+		return errno == ENOENT ? 0 : -errno;
+	char *line = nullptr;
+	size_t linesize = 0;
+	auto cl_0 = make_scope_exit([&]() { free(line); });
+	std::string command;
+	while (getline(&line, &linesize, fp.get()) >= 0) {
+		if (*line == '\r' || *line == '\n' || *line == '#')
 			continue;
-		for (size_t j = 0; j < item_num; ++j) {
-			if (i == j)
-				continue;
-			if (pitem[i].tid == pitem[j].tid) {
-				pitem[j].exectime = 0;
-				break;
+		int tid;
+		long exectime;
+		if (!journal_parse(line, tid, exectime, command))
+			continue;
+		++g_journal_records;
+		if (tid > g_last_tid)
+			g_last_tid = tid;
+		if (exectime == 0) {
+			auto it = g_timers.find(tid);
+			if (it != g_timers.end()) {
+				g_schedule.erase({it->second.exec_time, tid});
+				g_timers.erase(it);
 			}
+			continue;
 		}
+		auto [it, added] = g_timers.emplace(tid, TIMER{tid, exectime, command});
+		if (added)
+			g_schedule.emplace(exectime, tid);
 	}
+	return 0;
+}
+
+/*
+ * Rewrite the journal with only the pending timers. Caller holds
+ * g_list_lock. On failure, the old journal stays in use.
+ */
+static void journal_compact()
+{
 	auto temp_path = g_list_path + ".tmp";
-	auto temp_fd = open(temp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, DEF_MODE);
-	if (temp_fd >= 0) {
-		for (size_t i = 0; i < item_num; ++i) {
-			if (pitem[i].exectime == 0)
-				continue;
-			char temp_line[2048];
-			auto temp_len = gx_snprintf(temp_line, arsizeof(temp_line), "%d\t%ld\t",
-				   pitem[i].tid, pitem[i].exectime);
-			encode_line(pitem[i].command, temp_line + temp_len);
-			temp_len = strlen(temp_line);
-			temp_line[temp_len] = '\n';
-			++temp_len;
-			write(temp_fd, temp_line, temp_len);
-		}
-		close(temp_fd);
-		if (remove(g_list_path.c_str()) < 0 && errno != ENOENT)
-			fprintf(stderr, "W-1403: remove %s: %s\n",
-			        g_list_path.c_str(), strerror(errno));
-		if (rename(temp_path.c_str(), g_list_path.c_str()) < 0)
-			fprintf(stderr, "E-1404: rename %s %s: %s\n",
-			        temp_path.c_str(), g_list_path.c_str(), strerror(errno));
+	std::unique_ptr<FILE, file_deleter> fp(fopen(temp_path.c_str(), "w"));
+	if (fp == nullptr) {
+		fprintf(stderr, "E-1406: fopen %s: %s\n", temp_path.c_str(), strerror(errno));
+		return;
+	}
+	fchmod(fileno(fp.get()), DEF_MODE);
+	for (const auto &e : g_schedule) {
+		auto &t = g_timers.at(e.second);
+		char temp_line[2*COMMAND_LENGTH];
+		encode_line(t.command.c_str(), temp_line);
+		fprintf(fp.get(), "%d\t%ld\t%s\n", t.t_id,
+		        static_cast<long>(t.exec_time), temp_line);
+	}
+	if (fflush(fp.get()) != 0 || fsync(fileno(fp.get())) != 0) {
+		fprintf(stderr, "E-1407: write %s: %s\n", temp_path.c_str(), strerror(errno));
+		fp.reset();
+		unlink(temp_path.c_str());
+		return;
 	}
-	last_cltime = cur_time;
-	g_list_fd = open(g_list_path.c_str(), O_APPEND | O_WRONLY);
+	fp.reset();
+	if (rename(temp_path.c_str(), g_list_path.c_str()) < 0) {
+		fprintf(stderr, "E-1404: rename %s %s: %s\n",
+		        temp_path.c_str(), g_list_path.c_str(), strerror(errno));
+		unlink(temp_path.c_str());
+		return;
+	}
+	auto fd = open(g_list_path.c_str(), O_APPEND | O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "E-1408: open %s: %s\n", g_list_path.c_str(), strerror(errno));
+		return;
+	}
+	printf("[system]: journal compacted from %zu to %zu records\n",
+	       g_journal_records, g_timers.size());
+	close(g_list_fd);
+	g_list_fd = fd;
+	g_journal_records = g_timers.size();
 }
 
-static TIMER *put_timer(TIMER &&ptimer)
+static inline bool journal_needs_compact()
 {
-	for (auto pos = g_exec_list.begin(); pos != g_exec_list.end(); ++pos) {
-		if (pos->exec_time <= ptimer.exec_time)
-			continue;
-		std::list<TIMER> stash;
-		stash.push_back(std::move(ptimer));
-		g_exec_list.splice(pos, stash, stash.begin());
-		return &*pos;
-	}
-	g_exec_list.push_back(std::move(ptimer));
-	return &g_exec_list.back();
+	return g_journal_records >= JOURNAL_COMPACT_MIN &&
+	       g_journal_records > 2 * g_timers.size();
 }
 
 int main(int argc, const char **argv) try
 {
-	time_t cur_time;
-	time_t last_cltime;
-	pthread_t thr_accept_id{};
-	std::vector<pthread_t> thr_ids;
+	pthread_t thr_exec_id{};
 
 	setvbuf(stdout, nullptr, _IOLBF, 0);
 	if (HX_getopt(g_options_table, &argc, &argv,
@@ -206,8 +300,8 @@ int main(int argc, const char **argv) try
 		{"config_file_path", PKGSYSCONFDIR "/timer:" PKGSYSCONFDIR},
 		{"timer_listen_ip", "::1"},
 		{"timer_listen_port", "6666"},
+		{"timer_max_connections", "1000", CFG_SIZE, "4"},
 		{"timer_state_path", PKGSTATEDIR "/timer.txt"},
-		{"timer_threads_num", "50", CFG_SIZE, "5", "50"},
 		{},
 	};
 	config_file_apply(*pconfig, cfg_default_values);
@@ -218,9 +312,10 @@ int main(int argc, const char **argv) try
 	printf("[system]: listen address is [%s]:%hu\n",
 	       *listen_ip == '\0' ? "*" : listen_ip, listen_port);
 
-	g_threads_num = pconfig->get_ll("timer_threads_num");
-	printf("[system]: processing threads number is %zu\n", g_threads_num);
-	g_threads_num ++;
+	g_max_conns = pconfig->get_ll("timer_max_connections");
+	printf("[system]: maximum number of connections is %u\n", g_max_conns);
+	if (pconfig->get_value("timer_threads_num") != nullptr)
+		printf("[system]: timer_threads_num is obsolete and ignored\n");
 
 	auto sockd = gx_inet_listen(listen_ip, listen_port);
 	if (sockd < 0) {
@@ -233,45 +328,13 @@ int main(int argc, const char **argv) try
 	if (ret < 0)
 		return 4;
 
-	auto pfile = list_file_initd(g_list_path.c_str(), "/", "%d%l%s:512");
-	if (NULL == pfile) {
+	ret = journal_load();
+	if (ret < 0) {
 		printf("[system]: Failed to read timers from %s: %s\n",
-		       g_list_path.c_str(), strerror(errno));
+		       g_list_path.c_str(), strerror(-ret));
 		return 3;
 	}
-
-	auto item_num = pfile->get_size();
-	auto pitem = static_cast<srcitem *>(pfile->get_list());
-	for (size_t i = 0; i < item_num; ++i) {
-		if (pitem[i].exectime != 0)
-			continue;
-		for (size_t j = 0; j < item_num; ++j) {
-			if (i == j)
-				continue;
-			if (pitem[i].tid == pitem[j].tid) {
-				pitem[j].exectime = 0;
-				break;
-			}
-		}
-	}
-
-	time(&cur_time);
-
-	for (size_t i = 0; i < item_num; ++i) {
-		if (pitem[i].tid > g_last_tid)
-			g_last_tid = pitem[i].tid;
-		if (pitem[i].exectime == 0)
-			continue;
-		try {
-			TIMER tmr;
-			tmr.t_id = pitem[i].tid;
-			tmr.exec_time = pitem[i].exectime;
-			tmr.command = pitem[i].command;
-			put_timer(std::move(tmr));
-		} catch (std::bad_alloc &) {
-		}
-	}
-	pfile.reset();
+	printf("[system]: %zu pending timers\n", g_timers.size());
 
 	g_list_fd = open(g_list_path.c_str(), O_CREAT | O_APPEND | O_WRONLY, S_IRUSR | S_IWUSR);
 	if (g_list_fd < 0) {
@@ -279,33 +342,8 @@ int main(int argc, const char **argv) try
 		return 7;
 	}
 	auto cl_1 = make_scope_exit([&]() { close(g_list_fd); });
-
-	thr_ids.reserve(g_threads_num);
-	for (size_t i = 0; i < g_threads_num; ++i) {
-		pthread_t tid;
-		ret = pthread_create(&tid, nullptr, tmr_thrwork, nullptr);
-		if (ret != 0) {
-			printf("[system]: failed to create pool thread: %s\n", strerror(ret));
-			break;
-		}
-		thr_ids.push_back(tid);
-		char buf[32];
-		snprintf(buf, sizeof(buf), "worker/%zu", i);
-		pthread_setname_np(thr_ids[i], buf);
-	}
-	auto cl_2 = make_scope_exit([&]() {
-		/* thread might be waiting at the condvar */
-		g_waken_cond.notify_all();
-		for (auto tid : thr_ids) {
-			/* thread might be waiting in read_mark/select */
-			pthread_kill(tid, SIGALRM);
-			pthread_join(tid, nullptr);
-		}
-	});
-	if (thr_ids.size() != g_threads_num) {
-		g_notify_stop = true;
-		return 8;
-	}
+	if (g_journal_records > g_timers.size())
+		journal_compact();
 
 	ret = list_file_read_fixedstrings("timer_acl.txt",
 	           pconfig->get_value("config_file_path"), g_acl_list);
@@ -314,276 +352,374 @@ int main(int argc, const char **argv) try
 		g_acl_list = {"::1"};
 	} else if (ret < 0) {
 		printf("[system]: list_file_initd timer_acl.txt: %s\n", strerror(-ret));
-		g_notify_stop = true;
 		return 9;
 	}
-	
-	ret = pthread_create(&thr_accept_id, nullptr, tmr_acceptwork,
-	      reinterpret_cast<void *>(static_cast<intptr_t>(sockd)));
+
+	g_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (g_epfd < 0) {
+		printf("[system]: epoll_create: %s\n", strerror(errno));
+		return 11;
+	}
+	auto cl_2 = make_scope_exit([&]() {
+		g_conns.clear();
+		close(g_epfd);
+	});
+	int flags = fcntl(sockd, F_GETFL);
+	fcntl(sockd, F_SETFL, flags | O_NONBLOCK);
+	struct epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.fd = sockd;
+	if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, sockd, &ev) != 0) {
+		printf("[system]: epoll_ctl: %s\n", strerror(errno));
+		return 11;
+	}
+
+	ret = pthread_create(&thr_exec_id, nullptr, tmr_execwork, nullptr);
 	if (ret != 0) {
-		printf("[system]: failed to create accept thread: %s\n", strerror(ret));
-		g_notify_stop = true;
+		printf("[system]: failed to create executor thread: %s\n", strerror(ret));
 		return 10;
 	}
 	auto cl_3 = make_scope_exit([&]() {
-		pthread_kill(thr_accept_id, SIGALRM); /* kick accept() */
-		pthread_join(thr_accept_id, nullptr);
+		g_notify_stop = true;
+		std::unique_lock li_hold(g_list_lock);
+		g_waken_cond.notify_all();
+		li_hold.unlock();
+		pthread_join(thr_exec_id, nullptr);
 	});
-	
-	pthread_setname_np(thr_accept_id, "accept");
-	time(&last_cltime);
-	sact.sa_handler = [](int) {};
-	sact.sa_flags   = 0;
-	sigaction(SIGALRM, &sact, nullptr);
+	pthread_setname_np(thr_exec_id, "exec");
+
 	sact.sa_handler = term_handler;
-	sact.sa_flags   = SA_RESTART;
+	sact.sa_flags   = SA_RESETHAND;
 	sigaction(SIGINT, &sact, nullptr);
 	sigaction(SIGTERM, &sact, nullptr);
 	printf("[system]: TIMER is now running\n");
+	tm_loop(sockd);
+	return 0;
+} catch (const cfg_error &) {
+	return EXIT_FAILURE;
+}
 
+/**
+ * Runs due timers one after another, like before, but without holding
+ * g_list_lock while the command executes, so ADD/CANCEL are not stalled.
+ */
+static void *tmr_execwork(void *param)
+{
+	std::unique_lock li_hold(g_list_lock);
 	while (!g_notify_stop) {
-		std::unique_lock li_hold(g_list_lock);
-		time(&cur_time);
-		for (auto ptimer = g_exec_list.begin(); ptimer != g_exec_list.end(); ) {
-			if (ptimer->exec_time > cur_time)
-				break;
-			std::list<TIMER> stash;
-			stash.splice(stash.end(), g_exec_list, ptimer++);
-			execute_timer(&stash.front());
+		auto cur_time = time(nullptr);
+		if (g_schedule.empty() || g_schedule.begin()->first > cur_time) {
+			if (journal_needs_compact())
+				journal_compact();
+			auto wake = std::chrono::system_clock::now() + std::chrono::seconds(60);
+			if (!g_schedule.empty())
+				wake = std::min(wake, std::chrono::system_clock::from_time_t(g_schedule.begin()->first));
+			g_waken_cond.wait_until(li_hold, wake);
+			continue;
 		}
+		auto it = g_timers.find(g_schedule.begin()->second);
+		g_schedule.erase(g_schedule.begin());
+		auto tmr = std::move(it->second);
+		g_timers.erase(it);
+		li_hold.unlock();
+		auto result = execute_timer(&tmr);
+		li_hold.lock();
+		journal_done(tmr.t_id, result);
+	}
+	return nullptr;
+}
 
-		if (cur_time - last_cltime > 7 * 86400)
-			save_timers(last_cltime, cur_time);
+static void tm_update_events(tm_conn *c)
+{
+	bool want = !c->wbuf.empty();
+	if (want == c->want_out)
+		return;
+	struct epoll_event ev{};
+	ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+	ev.data.fd = c->sockd;
+	epoll_ctl(g_epfd, EPOLL_CTL_MOD, c->sockd, &ev);
+	c->want_out = want;
+}
+
+/*
+ * Write out as much of wbuf as the socket takes. On error, the unsent rest
+ * is discarded, so that a connection marked for closing goes right away.
+ */
+static bool tm_flush(tm_conn *c)
+{
+	while (!c->wbuf.empty()) {
+		auto ret = write(c->sockd, c->wbuf.data(), c->wbuf.size());
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret <= 0) {
+			c->wbuf.clear();
+			return false;
+		}
+		c->wbuf.erase(0, ret);
+	}
+	tm_update_events(c);
+	return true;
+}
+
+/* Queue output; on failure the connection is marked for closing. */
+static void tm_send(tm_conn *c, const char *s, size_t len)
+{
+	c->wbuf.append(s, len);
+	if (!tm_flush(c))
+		c->closing = true;
+}
+
+static void tm_close(int fd)
+{
+	epoll_ctl(g_epfd, EPOLL_CTL_DEL, fd, nullptr);
+	g_conns.erase(fd);
+}
+
+static void tm_cmd_cancel(tm_conn *c, const char *arg)
+{
+	int t_id = strtol(arg, nullptr, 0);
+	if (t_id <= 0) {
+		tm_send(c, "FALSE 1\r\n", 9);
+		return;
+	}
+	std::unique_lock li_hold(g_list_lock);
+	auto it = g_timers.find(t_id);
+	if (it == g_timers.end()) {
 		li_hold.unlock();
-		sleep(1);
+		tm_send(c, "FALSE 2\r\n", 9);
+		return;
+	}
+	g_schedule.erase({it->second.exec_time, t_id});
+	g_timers.erase(it);
+	journal_done(t_id, "CANCEL");
+	li_hold.unlock();
+	tm_send(c, "TRUE\r\n", 6);
+}
 
+static void tm_cmd_add(tm_conn *c, char *arg)
+{
+	auto pspace = strchr(arg, ' ');
+	if (NULL == pspace) {
+		tm_send(c, "FALSE 1\r\n", 9);
+		return;
 	}
-	return 0;
-} catch (const cfg_error &) {
-	return EXIT_FAILURE;
+	*pspace = '\0';
+	pspace ++;
+
+	int exec_interval = strtol(arg, nullptr, 0);
+	if (exec_interval <= 0 || strlen(pspace) >= COMMAND_LENGTH) {
+		tm_send(c, "FALSE 2\r\n", 9);
+		return;
+	}
+
+	int t_id = increase_tid();
+	bool logged = false;
+	try {
+		TIMER tmr{t_id, exec_interval + time(nullptr), pspace};
+		std::lock_guard li_hold(g_list_lock);
+		auto [it, added] = g_timers.emplace(t_id, std::move(tmr));
+		try {
+			g_schedule.emplace(it->second.exec_time, it->first);
+		} catch (const std::bad_alloc &) {
+			g_timers.erase(it);
+			throw;
+		}
+		/* a timer that would not survive a restart is not accepted */
+		logged = journal_add(it->second);
+		if (!logged) {
+			g_schedule.erase({it->second.exec_time, it->first});
+			g_timers.erase(it);
+		} else if (g_schedule.begin()->second == it->first) {
+			g_waken_cond.notify_one();
+		}
+	} catch (const std::bad_alloc &) {
+	}
+	if (!logged) {
+		tm_send(c, "FALSE 3\r\n", 9);
+		return;
+	}
+	char temp_line[32];
+	auto temp_len = sprintf(temp_line, "TRUE %d\r\n", t_id);
+	tm_send(c, temp_line, temp_len);
 }
 
-static void *tmr_acceptwork(void *param)
+static void tm_command(tm_conn *c, char *line)
 {
-	int sockd, sockd2;
-	socklen_t addrlen;
-	char client_hostip[40];
-	struct sockaddr_storage peer_name;
+	if (0 == strncasecmp(line, "CANCEL ", 7)) {
+		tm_cmd_cancel(c, line + 7);
+	} else if (0 == strncasecmp(line, "ADD ", 4)) {
+		tm_cmd_add(c, line + 4);
+	} else if (0 == strcasecmp(line, "QUIT")) {
+		tm_send(c, "BYE\r\n", 5);
+		c->closing = true;
+	} else if (0 == strcasecmp(line, "PING")) {
+		tm_send(c, "TRUE\r\n", 6);
+	} else {
+		tm_send(c, "FALSE\r\n", 7);
+	}
+}
 
-	sockd = (int)(long)param;
-	while (!g_notify_stop) {
-		/* wait for an incoming connection */
-        addrlen = sizeof(peer_name);
-        sockd2 = accept(sockd, (struct sockaddr*)&peer_name, &addrlen);
-		if (sockd2 < 0)
+static void tm_read(tm_conn *c)
+{
+	char buf[4096];
+	while (true) {
+		auto ret = read(c->sockd, buf, sizeof(buf));
+		if (ret < 0 && errno == EINTR)
 			continue;
-		CONNECTION_NODE conn;
-		conn.sockd = sockd2;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret < 0)
+			c->wbuf.clear();
+		if (ret <= 0) {
+			c->closing = true;
+			return;
+		}
+		c->rbuf.append(buf, ret);
+		if (static_cast<size_t>(ret) < sizeof(buf))
+			break;
+	}
+	time(&c->last_time);
+	size_t start = 0;
+	while (!c->closing) {
+		auto pos = c->rbuf.find("\r\n", start);
+		if (pos == c->rbuf.npos)
+			break;
+		c->rbuf[pos] = '\0';
+		auto line = &c->rbuf[start];
+		start = pos + 2;
+		tm_command(c, line);
+	}
+	c->rbuf.erase(0, start);
+	if (c->rbuf.size() >= 1024)
+		c->closing = true;
+}
+
+static void tm_accept(int listen_fd)
+{
+	while (true) {
+		struct sockaddr_storage peer_name;
+		socklen_t addrlen = sizeof(peer_name);
+		int sockd2 = accept4(listen_fd, reinterpret_cast<sockaddr *>(&peer_name),
+		             &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sockd2 < 0)
+			return;
+		char client_hostip[40];
 		int ret = getnameinfo(reinterpret_cast<sockaddr *>(&peer_name),
 		          addrlen, client_hostip, sizeof(client_hostip),
 		          nullptr, 0, NI_NUMERICHOST | NI_NUMERICSERV);
 		if (ret != 0) {
 			printf("getnameinfo: %s\n", gai_strerror(ret));
+			close(sockd2);
 			continue;
 		}
 		if (std::find(g_acl_list.cbegin(), g_acl_list.cend(),
 		    client_hostip) == g_acl_list.cend()) {
 			write(sockd2, "Access Deny\r\n", 13);
+			close(sockd2);
 			continue;
 		}
-
-		std::unique_lock co_hold(g_connection_lock);
-		if (g_connection_list.size() + 1 + g_connection_list1.size() >= g_threads_num) {
-			co_hold.unlock();
+		if (g_conns.size() >= g_max_conns) {
 			write(sockd2, "Maximum Connection Reached!\r\n", 29);
+			close(sockd2);
 			continue;
 		}
-
+		std::unique_ptr<tm_conn> c;
 		try {
-			g_connection_list1.push_back(std::move(conn));
+			c = std::make_unique<tm_conn>();
 		} catch (const std::bad_alloc &) {
 			write(sockd2, "Not enough memory\r\n", 19);
+			close(sockd2);
 			continue;
 		}
-		co_hold.unlock();
-		write(sockd2, "OK\r\n", 4);
-		g_waken_cond.notify_one();
-	}
-	return nullptr;
-}
-
-static void execute_timer(TIMER *ptimer)
-{
-	int len;
-	int status;
-	pid_t pid;
-	char result[1024];
-	char temp_buff[2048];
-	char* argv[MAXARGS];
-
-	int argc = parse_line(temp_buff, ptimer->command.c_str(), argv);
-	if (argc > 0) {
-		pid = fork();
-		if (0 == pid) {
-			chdir("../tools");
-			execve(argv[0], argv, NULL);
-			_exit(-1);
-		} else if (pid > 0) {
-			if (waitpid(pid, &status, 0) > 0) {
-				strcpy(result, WIFEXITED(status) && !WEXITSTATUS(status) ? "DONE" : "EXEC-FAILURE");
-			} else {
-				strcpy(result, "FAIL-TO-WAIT");
-			}
-		} else {
-			strcpy(result, "FAIL-TO-FORK");
-		}
-	} else {
-		strcpy(result, "FORMAT-ERROR");
+		c->sockd = sockd2;
+		time(&c->last_time);
+		struct epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.fd = sockd2;
+		if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, sockd2, &ev) != 0)
+			continue;
+		auto pc = c.get();
+		g_conns.emplace(sockd2, std::move(c));
+		tm_send(pc, "OK\r\n", 4);
+		if (pc->closing)
+			tm_close(sockd2);
 	}
-
-	len = sprintf(temp_buff, "%d\t0\t%s\n", ptimer->t_id, result);
-
-	write(g_list_fd, temp_buff, len);
 }
 
-static void *tmr_thrwork(void *param)
+/**
+ * All client connections are served by this epoll loop; commands only
+ * touch the in-memory index and append to the journal.
+ */
+static void tm_loop(int listen_fd)
 {
-	int temp_len;
-	char *pspace, temp_line[1024];
-	
- NEXT_LOOP:
-	if (g_notify_stop)
-		return nullptr;
-	std::unique_lock cm_hold(g_cond_mutex);
-	g_waken_cond.wait(cm_hold);
-	cm_hold.unlock();
-	if (g_notify_stop)
-		return nullptr;
-	std::unique_lock co_hold(g_connection_lock);
-	if (g_connection_list1.size() == 0)
-		goto NEXT_LOOP;
-	g_connection_list.splice(g_connection_list.end(), g_connection_list1, g_connection_list1.begin());
-	auto pconnection = std::prev(g_connection_list.end());
-	co_hold.unlock();
+	struct epoll_event events[256];
+	time_t last_tick = time(nullptr);
 
-	while (true) {
-		if (!read_mark(&*pconnection)) {
-			co_hold.lock();
-			g_connection_list.erase(pconnection);
-			co_hold.unlock();
-			goto NEXT_LOOP;
+	while (!g_notify_stop) {
+		int num = epoll_wait(g_epfd, events, arsizeof(events), 1000);
+		if (num < 0 && errno != EINTR) {
+			printf("[system]: epoll_wait: %s\n", strerror(errno));
+			break;
 		}
-
-		if (0 == strncasecmp(pconnection->line, "CANCEL ", 7)) {
-			int t_id = strtol(pconnection->line + 7, nullptr, 0);
-			if (t_id <= 0) {
-				write(pconnection->sockd, "FALSE 1\r\n", 9);	
-				continue;
-			}
-			bool removed_timer = false;
-			std::unique_lock li_hold(g_list_lock);
-			for (auto pos = g_exec_list.begin(); pos != g_exec_list.end(); ++pos) {
-				auto ptimer = &*pos;
-				if (t_id == ptimer->t_id) {
-					temp_len = sprintf(temp_line, "%d\t0\tCANCEL\n",
-								ptimer->t_id);
-					g_exec_list.erase(pos);
-					removed_timer = true;
-					write(g_list_fd, temp_line, temp_len);
-					break;
-				}
-			}
-			li_hold.unlock();
-			if (removed_timer)
-				write(pconnection->sockd, "TRUE\r\n", 6);
-			else
-				write(pconnection->sockd, "FALSE 2\r\n", 9);
-		} else if (0 == strncasecmp(pconnection->line, "ADD ", 4)) {
-			pspace = strchr(pconnection->line + 4, ' ');
-			if (NULL == pspace) {
-				write(pconnection->sockd, "FALSE 1\r\n", 9);
-				continue;
-			}
-			*pspace = '\0';
-			pspace ++;
-
-			int exec_interval = strtol(pconnection->line + 4, nullptr, 0);
-			if (exec_interval <= 0 || strlen(pspace) >= COMMAND_LENGTH) {
-				write(pconnection->sockd, "FALSE 2\r\n", 9);
+		for (int i = 0; i < num; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == listen_fd) {
+				tm_accept(listen_fd);
 				continue;
 			}
-
-			TIMER tmr;
-			tmr.t_id = increase_tid();
-			tmr.exec_time = exec_interval + time(nullptr);
-			try {
-				tmr.command = pspace;
-			} catch (const std::bad_alloc &) {
-				write(pconnection->sockd, "FALSE 3\r\n", 9);
+			auto it = g_conns.find(fd);
+			if (it == g_conns.end())
 				continue;
+			auto c = it->second.get();
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				c->wbuf.clear();
+				c->closing = true;
 			}
-
-			std::unique_lock li_hold(g_list_lock);
-			auto ptimer = put_timer(std::move(tmr));
-
-			temp_len = sprintf(temp_line, "%d\t%ld\t", ptimer->t_id,
-						ptimer->exec_time);
-			encode_line(ptimer->command.c_str(), temp_line + temp_len);
-			temp_len = strlen(temp_line);
-			temp_line[temp_len] = '\n';
-			temp_len ++;
-			write(g_list_fd, temp_line, temp_len);
-			li_hold.unlock();
-			temp_len = sprintf(temp_line, "TRUE %d\r\n", ptimer->t_id);
-			write(pconnection->sockd, temp_line, temp_len);
-		} else if (0 == strcasecmp(pconnection->line, "QUIT")) {
-			write(pconnection->sockd, "BYE\r\n", 5);
-			close(pconnection->sockd);
-			co_hold.lock();
-			g_connection_list.erase(pconnection);
-			co_hold.unlock();
-			goto NEXT_LOOP;
-		} else if (0 == strcasecmp(pconnection->line, "PING")) {
-			write(pconnection->sockd, "TRUE\r\n", 6);	
-		} else {
-			write(pconnection->sockd, "FALSE\r\n", 7);
+			/* keep draining a closing connection, e.g. a partial BYE */
+			if ((events[i].events & EPOLLOUT) && !tm_flush(c))
+				c->closing = true;
+			if (!c->closing && (events[i].events & EPOLLIN))
+				tm_read(c);
+			/* QUIT: close once BYE has been written out */
+			if (c->closing && c->wbuf.empty())
+				tm_close(fd);
 		}
+		auto cur_time = time(nullptr);
+		if (cur_time == last_tick)
+			continue;
+		last_tick = cur_time;
+		std::vector<int> dead;
+		for (const auto &[fd, c] : g_conns)
+			if (cur_time - c->last_time >= SOCKET_TIMEOUT)
+				dead.push_back(fd);
+		for (auto fd : dead)
+			tm_close(fd);
 	}
-	return NULL;
 }
 
-static BOOL read_mark(CONNECTION_NODE *pconnection)
+static const char *execute_timer(const TIMER *ptimer)
 {
-	fd_set myset;
-	int i, read_len;
-	struct timeval tv;
+	int status;
+	pid_t pid;
+	char temp_buff[2048];
+	char* argv[MAXARGS];
 
-	while (true) {
-		tv.tv_usec = 0;
-		tv.tv_sec = SOCKET_TIMEOUT;
-		FD_ZERO(&myset);
-		FD_SET(pconnection->sockd, &myset);
-		if (select(pconnection->sockd + 1, &myset, nullptr, nullptr, &tv) <= 0)
-			return FALSE;
-		read_len = read(pconnection->sockd, pconnection->buffer +
-		pconnection->offset, 1024 - pconnection->offset);
-		if (read_len <= 0)
-			return FALSE;
-		pconnection->offset += read_len;
-		for (i=0; i<pconnection->offset-1; i++) {
-			if ('\r' == pconnection->buffer[i] &&
-				'\n' == pconnection->buffer[i + 1]) {
-				memcpy(pconnection->line, pconnection->buffer, i);
-				pconnection->line[i] = '\0';
-				pconnection->offset -= i + 2;
-				memmove(pconnection->buffer, pconnection->buffer + i + 2,
-					pconnection->offset);
-				return TRUE;
-			}
-		}
-		if (pconnection->offset == 1024)
-			return FALSE;
+	int argc = parse_line(temp_buff, ptimer->command.c_str(), argv);
+	if (argc <= 0)
+		return "FORMAT-ERROR";
+	pid = fork();
+	if (0 == pid) {
+		chdir("../tools");
+		execve(argv[0], argv, NULL);
+		_exit(-1);
+	} else if (pid < 0) {
+		return "FAIL-TO-FORK";
 	}
+	if (waitpid(pid, &status, 0) <= 0)
+		return "FAIL-TO-WAIT";
+	return WIFEXITED(status) && !WEXITSTATUS(status) ? "DONE" : "EXEC-FAILURE";
 }
 
 static void term_handler(int signo)
@@ -673,11 +809,6 @@ static void encode_line(const char *in, char *out)
 
 static int increase_tid()
 {
-	int val;
-
-	std::lock_guard lk(g_tid_lock);
-	g_last_tid ++;
-	val = g_last_tid;
-	return val;
+	return ++g_last_tid;
 }
 